@@ -0,0 +1,554 @@
+#include "arith.h"
+#include "var.h"
+#include "lexer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+** 算術式の評価
+** $(( ... )) / (( ... )) / let で使う、64bit整数のC言語の演算子の式を評価する
+** 式の木は作らずに、再帰下降で構文を読みながらその場で値を計算する
+**
+** 優先順位(低い順)
+**   ,  =  *= /= %= += -= <<= >>= &= ^= |=  ?:  ||  &&  |  ^  &  == !=  < <= > >=  << >>  + -  * / %  **
+**   単項 + - ! ~ ++ --  後置 ++ --  ( )  数値(10進 / 0x16進 / 0始まりの8進)  変数名
+**
+** && || ?: で評価しない側は skip を立てて読み進め、変数の代入やゼロ除算のエラーを起こさない
+*/
+typedef struct Arith
+{
+	const char* p; /* 次に読む位置 */
+	const char* error; /* エラーの内容。エラーが無ければNULL */
+	int skip; /* 0 より大きければ、値を計算せずに構文だけ読む */
+	bool constant; /* 変数を参照したら失敗する(構文解析時の畳み込み用) */
+} Arith;
+
+/*
+** ArithValue:
+** 式の値。変数名そのものであれば、代入やインクリメントのためにその名前も持つ
+*/
+typedef struct ArithValue
+{
+	int64_t value;
+	const char* name; /* 変数名の先頭。変数でなければNULL */
+	size_t namelen;
+} ArithValue;
+
+static ArithValue arith_comma(Arith* a);
+static ArithValue arith_assign(Arith* a);
+
+/* 符号付き整数のオーバーフローは未定義動作なので、符号なしで計算して折り返す */
+#define WRAP(op, x, y) ((int64_t)((uint64_t)(x) op (uint64_t)(y)))
+
+static void skip_space(Arith* a)
+{
+	while (isspace((unsigned char)*a->p))
+		a->p++;
+}
+
+/* 次が演算子 op であれば読み進めて true を返す。op の後ろに続いてはいけない文字を not で指定する */
+static bool accept(Arith* a, const char* op, const char* not)
+{
+	skip_space(a);
+	if (*a->p != *op) /* ほとんどの呼び出しは1文字目で外れる */
+		return false;
+	size_t len = strlen(op);
+	if (strncmp(a->p, op, len) != 0)
+		return false;
+	if (not != NULL && a->p[len] != 0 && strchr(not, a->p[len]) != NULL)
+		return false;
+	a->p += len;
+	return true;
+}
+
+static void fail(Arith* a, const char* message)
+{
+	if (a->error == NULL)
+		a->error = message;
+}
+
+static ArithValue number(int64_t value)
+{
+	ArithValue v = { value, NULL, 0 };
+	return v;
+}
+
+/* 変数の値を読む。未定義や空の変数は 0 */
+static int64_t var_value(Arith* a, const char* name, size_t len)
+{
+	if (a->skip || a->constant)
+		return 0;
+
+	char* key = strndup(name, len);
+	const char* s = var_get(key);
+	free(key);
+	if (s == NULL || *s == 0)
+		return 0;
+
+	char* end;
+	long long value = strtoll(s, &end, 0);
+	while (isspace((unsigned char)*end))
+		end++;
+	if (*end != 0)
+		fail(a, "variable is not a number");
+	return value;
+}
+
+/* 変数に値を代入する */
+static void set_value(Arith* a, ArithValue* target, int64_t value)
+{
+	if (a->skip || a->constant)
+		return;
+	if (target->name == NULL) {
+		fail(a, "assignment to non-variable");
+		return;
+	}
+
+	char* key = strndup(target->name, target->namelen);
+	char num[32];
+	snprintf(num, sizeof(num), "%lld", (long long)value);
+	var_set(key, num);
+	free(key);
+}
+
+/* 数値・変数名・かっこ */
+static ArithValue arith_primary(Arith* a)
+{
+	skip_space(a);
+
+	if (*a->p == '(') {
+		a->p++;
+		ArithValue v = arith_comma(a);
+		if (!accept(a, ")", NULL))
+			fail(a, "missing ')'");
+		v.name = NULL;
+		return v;
+	}
+
+	if (isdigit((unsigned char)*a->p)) {
+		char* end;
+		long long value = strtoll(a->p, &end, 0);
+		if (isalnum((unsigned char)*end) || *end == '_')
+			fail(a, "invalid number");
+		a->p = end;
+		return number(value);
+	}
+
+	if (isalpha((unsigned char)*a->p) || *a->p == '_') {
+		ArithValue v;
+		v.name = a->p;
+		while (isalnum((unsigned char)*a->p) || *a->p == '_')
+			a->p++;
+		v.namelen = a->p - v.name;
+		if (a->constant)
+			fail(a, "not constant");
+		v.value = var_value(a, v.name, v.namelen);
+		return v;
+	}
+
+	fail(a, *a->p ? "syntax error" : "missing operand");
+	return number(0);
+}
+
+/* 後置 ++ -- */
+static ArithValue arith_postfix(Arith* a)
+{
+	ArithValue v = arith_primary(a);
+	if (accept(a, "++", NULL)) {
+		set_value(a, &v, WRAP(+, v.value, 1));
+		v.name = NULL;
+	}
+	else if (accept(a, "--", NULL)) {
+		set_value(a, &v, WRAP(-, v.value, 1));
+		v.name = NULL;
+	}
+	return v;
+}
+
+/* 単項 + - ! ~ と前置 ++ -- */
+static ArithValue arith_unary(Arith* a)
+{
+	ArithValue v;
+	if (accept(a, "++", NULL)) {
+		v = arith_unary(a);
+		set_value(a, &v, v.value = WRAP(+, v.value, 1));
+	}
+	else if (accept(a, "--", NULL)) {
+		v = arith_unary(a);
+		set_value(a, &v, v.value = WRAP(-, v.value, 1));
+	}
+	else if (accept(a, "+", NULL))
+		return number(arith_unary(a).value);
+	else if (accept(a, "-", NULL))
+		return number(WRAP(-, 0, arith_unary(a).value));
+	else if (accept(a, "!", "="))
+		return number(!arith_unary(a).value);
+	else if (accept(a, "~", NULL))
+		return number(~arith_unary(a).value);
+	else
+		return arith_postfix(a);
+
+	v.name = NULL;
+	return v;
+}
+
+/* 二項演算子をひとつ計算する */
+static int64_t binary(Arith* a, char op, int64_t x, int64_t y)
+{
+	switch (op)
+	{
+	case '*': return WRAP(*, x, y);
+	case '+': return WRAP(+, x, y);
+	case '-': return WRAP(-, x, y);
+	case '<': return (int64_t)((uint64_t)x << (y & 63));
+	case '>': return x >> (y & 63);
+	case '&': return x & y;
+	case '^': return x ^ y;
+	case '|': return x | y;
+	case '/':
+	case '%':
+		if (y == 0) {
+			if (!a->skip)
+				fail(a, "division by zero");
+			return 0;
+		}
+		if (x == INT64_MIN && y == -1) /* 結果が表せない */
+			return op == '/' ? INT64_MIN : 0;
+		return op == '/' ? x / y : x % y;
+	}
+	return 0;
+}
+
+/* べき乗 ** (右結合) */
+static ArithValue arith_pow(Arith* a)
+{
+	ArithValue v = arith_unary(a);
+	if (!accept(a, "**", NULL))
+		return v;
+
+	int64_t exp = arith_pow(a).value;
+	int64_t result = 1;
+	if (exp < 0) {
+		if (!a->skip)
+			fail(a, "exponent less than 0");
+		return number(0);
+	}
+	for (int64_t base = v.value; exp > 0; exp >>= 1) {
+		if (exp & 1)
+			result = WRAP(*, result, base);
+		base = WRAP(*, base, base);
+	}
+	return number(result);
+}
+
+static ArithValue arith_mul(Arith* a)
+{
+	ArithValue v = arith_pow(a);
+	for (;;) {
+		char op;
+		if (accept(a, "*", "=*"))
+			op = '*';
+		else if (accept(a, "/", "="))
+			op = '/';
+		else if (accept(a, "%", "="))
+			op = '%';
+		else
+			return v;
+		v = number(binary(a, op, v.value, arith_pow(a).value));
+	}
+}
+
+static ArithValue arith_add(Arith* a)
+{
+	ArithValue v = arith_mul(a);
+	for (;;) {
+		if (accept(a, "+", "=+"))
+			v = number(WRAP(+, v.value, arith_mul(a).value));
+		else if (accept(a, "-", "=-"))
+			v = number(WRAP(-, v.value, arith_mul(a).value));
+		else
+			return v;
+	}
+}
+
+static ArithValue arith_shift(Arith* a)
+{
+	ArithValue v = arith_add(a);
+	for (;;) {
+		if (accept(a, "<<", "="))
+			v = number(binary(a, '<', v.value, arith_add(a).value));
+		else if (accept(a, ">>", "="))
+			v = number(binary(a, '>', v.value, arith_add(a).value));
+		else
+			return v;
+	}
+}
+
+static ArithValue arith_relational(Arith* a)
+{
+	ArithValue v = arith_shift(a);
+	for (;;) {
+		if (accept(a, "<=", NULL))
+			v = number(v.value <= arith_shift(a).value);
+		else if (accept(a, ">=", NULL))
+			v = number(v.value >= arith_shift(a).value);
+		else if (accept(a, "<", "<"))
+			v = number(v.value < arith_shift(a).value);
+		else if (accept(a, ">", ">"))
+			v = number(v.value > arith_shift(a).value);
+		else
+			return v;
+	}
+}
+
+static ArithValue arith_equality(Arith* a)
+{
+	ArithValue v = arith_relational(a);
+	for (;;) {
+		if (accept(a, "==", NULL))
+			v = number(v.value == arith_relational(a).value);
+		else if (accept(a, "!=", NULL))
+			v = number(v.value != arith_relational(a).value);
+		else
+			return v;
+	}
+}
+
+static ArithValue arith_bitand(Arith* a)
+{
+	ArithValue v = arith_equality(a);
+	while (accept(a, "&", "&="))
+		v = number(v.value & arith_equality(a).value);
+	return v;
+}
+
+static ArithValue arith_bitxor(Arith* a)
+{
+	ArithValue v = arith_bitand(a);
+	while (accept(a, "^", "="))
+		v = number(v.value ^ arith_bitand(a).value);
+	return v;
+}
+
+static ArithValue arith_bitor(Arith* a)
+{
+	ArithValue v = arith_bitxor(a);
+	while (accept(a, "|", "|="))
+		v = number(v.value | arith_bitxor(a).value);
+	return v;
+}
+
+/* && は左辺が偽なら右辺を評価しない */
+static ArithValue arith_and(Arith* a)
+{
+	ArithValue v = arith_bitor(a);
+	while (accept(a, "&&", NULL)) {
+		bool left = v.value != 0;
+		if (!left)
+			a->skip++;
+		int64_t right = arith_bitor(a).value;
+		if (!left)
+			a->skip--;
+		v = number(left && right != 0);
+	}
+	return v;
+}
+
+/* || は左辺が真なら右辺を評価しない */
+static ArithValue arith_or(Arith* a)
+{
+	ArithValue v = arith_and(a);
+	while (accept(a, "||", NULL)) {
+		bool left = v.value != 0;
+		if (left)
+			a->skip++;
+		int64_t right = arith_and(a).value;
+		if (left)
+			a->skip--;
+		v = number(left || right != 0);
+	}
+	return v;
+}
+
+/* 条件 ? 真の式 : 偽の式 。選ばれなかった方は評価しない */
+static ArithValue arith_ternary(Arith* a)
+{
+	ArithValue v = arith_or(a);
+	if (!accept(a, "?", NULL))
+		return v;
+
+	bool cond = v.value != 0;
+	if (!cond)
+		a->skip++;
+	ArithValue t = arith_comma(a);
+	if (!cond)
+		a->skip--;
+
+	if (!accept(a, ":", NULL)) {
+		fail(a, "missing ':'");
+		return number(0);
+	}
+
+	if (cond)
+		a->skip++;
+	ArithValue f = arith_ternary(a);
+	if (cond)
+		a->skip--;
+
+	return number(cond ? t.value : f.value);
+}
+
+/* 代入演算子は右結合 */
+static ArithValue arith_assign(Arith* a)
+{
+	static const char* ops[] = { "=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|=", NULL };
+	static const char opchar[] = { 0, '*', '/', '%', '+', '-', '<', '>', '&', '^', '|' };
+
+	ArithValue v = arith_ternary(a);
+	int i;
+	for (i = 0; ops[i] != NULL; i++) {
+		if (!accept(a, ops[i], i == 0 ? "=" : NULL))
+			continue;
+
+		int64_t right = arith_assign(a).value;
+		if (i > 0)
+			right = binary(a, opchar[i], v.value, right);
+		set_value(a, &v, right);
+		return number(right);
+	}
+	return v;
+}
+
+static ArithValue arith_comma(Arith* a)
+{
+	ArithValue v = arith_assign(a);
+	while (accept(a, ",", NULL))
+		v = arith_assign(a);
+	return v;
+}
+
+/* 式全体を評価する。式の後ろに余計な文字が残っていればエラー */
+static bool arith_run(Arith* a, int64_t* result)
+{
+	skip_space(a);
+	if (*a->p == 0) { /* 空の式は 0 */
+		*result = 0;
+		return true;
+	}
+
+	*result = arith_comma(a).value;
+	skip_space(a);
+	if (*a->p != 0)
+		fail(a, "syntax error");
+	return a->error == NULL;
+}
+
+/*
+** arith_eval():
+** 算術式を評価して result に入れる。変数の参照・代入を行う
+** エラーの場合はメッセージを表示して false を返す
+*/
+bool arith_eval(const char* expr, int64_t* result)
+{
+	Arith a = { expr, NULL, 0, false };
+	if (arith_run(&a, result))
+		return true;
+
+	printf("arithmetic: %s: %s\n", a.error, expr);
+	*result = 0;
+	return false;
+}
+
+/*
+** arith_fold():
+** 変数を参照しない定数式であれば、評価して true を返す(構文解析時の畳み込み用)
+** 定数式でない場合やエラーの場合は、何も表示せずに false を返す(エラーは実行時に報告する)
+*/
+bool arith_fold(const char* expr, int64_t* result)
+{
+	Arith a = { expr, NULL, 0, true };
+	return arith_run(&a, result);
+}
+
+/*
+** arith_find_end():
+** "$((" の直後を受け取り、対応する "))" の位置を返す。見つからなければNULL
+** 式の中のかっこの対応を数える
+*/
+const char* arith_find_end(const char* p)
+{
+	int depth = 0;
+	for (; *p; p++) {
+		if (*p == '(')
+			depth++;
+		else if (*p == ')') {
+			if (depth == 0)
+				return p[1] == ')' ? p : NULL;
+			depth--;
+		}
+	}
+	return NULL;
+}
+
+/* 次の "$((" 。クオートされていた '$' ( CHAR_QUOTED の印の次)は式の始まりではない */
+static const char* find_arith(const char* start, const char* word)
+{
+	const char* p = strstr(word, "$((");
+	while (p != NULL && p > start && p[-1] == CHAR_QUOTED)
+		p = strstr(p + 1, "$((");
+	return p;
+}
+
+/*
+** arith_fold_word():
+** 単語の中の $(( 定数式 )) を、計算結果の数値に置き換えた文字列を返す(呼び出し元でfreeする)
+** 置き換えるものが無ければNULL
+*/
+char* arith_fold_word(const char* word)
+{
+	const char* start = word;
+	const char* p = find_arith(start, word);
+	if (p == NULL)
+		return NULL;
+
+	size_t cap = strlen(word) + 1;
+	char* folded = malloc(cap);
+	size_t len = 0;
+	bool changed = false;
+	char num[32];
+
+	while (p != NULL) {
+		const char* end = arith_find_end(p + 3);
+		if (end == NULL)
+			break;
+
+		char* expr = strndup(p + 3, end - (p + 3));
+		int64_t value;
+		bool constant = strchr(expr, '$') == NULL && arith_fold(expr, &value);
+		free(expr);
+
+		/* 式の手前まで、または畳み込めない式はそのまま写す */
+		size_t keep = (constant ? p : end + 2) - word;
+		size_t numlen = constant ? (size_t)snprintf(num, sizeof(num), "%lld", (long long)value) : 0;
+		if (len + keep + numlen + strlen(end + 2) + 1 > cap) {
+			cap = len + keep + numlen + strlen(end + 2) + 1;
+			folded = realloc(folded, cap);
+		}
+		memcpy(folded + len, word, keep);
+		len += keep;
+		memcpy(folded + len, num, numlen);
+		len += numlen;
+		changed = changed || constant;
+		word = end + 2;
+		p = find_arith(start, word);
+	}
+
+	strcpy(folded + len, word);
+	if (!changed) {
+		free(folded);
+		return NULL;
+	}
+	return folded;
+}
@@ -0,0 +1,12 @@
+#ifndef ARITH_H
+#define ARITH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool arith_eval(const char* expr, int64_t* result);
+bool arith_fold(const char* expr, int64_t* result);
+char* arith_fold_word(const char* word);
+const char* arith_find_end(const char* p);
+
+#endif
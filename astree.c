@@ -1,77 +1,142 @@
 #include "astree.h"
+#include "memstats.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+** ASTreeInit():
+** 空のノードプールを用意する。領域は最初のノード追加時に確保される
+*/
+void ASTreeInit(ASTree* tree)
+{
+    memset(tree, 0, sizeof(*tree));
+}
+
+/*
+** ASTreeReset():
+** ノードプールと文字列テーブルを空にする
+** 確保済みの領域はそのまま残すので、次の行の解析ではmallocが発生しない
+*/
+void ASTreeReset(ASTree* tree)
+{
+    tree->nnodes = 0;
+    tree->strtab_len = 0;
+}
+
+/*
+** ASTreeDestroy():
+** ノードプールと文字列テーブルの領域を解放する
+** キャッシュファイルをmmapしたものであれば、munmapするだけでよい
+*/
+void ASTreeDestroy(ASTree* tree)
+{
+    if (tree->mapping != NULL) {
+        munmap(tree->mapping, tree->mapping_size);
+        ASTreeInit(tree);
+        return;
+    }
+
+    mem_free(tree->type);
+    mem_free(tree->left);
+    mem_free(tree->right);
+    mem_free(tree->str_off);
+    mem_free(tree->str_len);
+    mem_free(tree->strtab);
+    ASTreeInit(tree);
+}
+
+/*
+** ASTreeNewNode():
+** ノードプールの末尾に新しいノードを追加して、その添字を返す
+** 枝は空(AST_NULL)、文字列データは持たない状態で初期化される
+*/
+ASTreeIndex ASTreeNewNode(ASTree* tree, NodeType nodetype)
+{
+    if (tree->nnodes == tree->capacity) { /* 足りなくなったら、各配列を倍の大きさに拡張する */
+        tree->capacity = tree->capacity ? tree->capacity * 2 : 64;
+        tree->type = mem_realloc(MEM_PARSER, tree->type, sizeof(*tree->type) * tree->capacity);
+        tree->left = mem_realloc(MEM_PARSER, tree->left, sizeof(*tree->left) * tree->capacity);
+        tree->right = mem_realloc(MEM_PARSER, tree->right, sizeof(*tree->right) * tree->capacity);
+        tree->str_off = mem_realloc(MEM_PARSER, tree->str_off, sizeof(*tree->str_off) * tree->capacity);
+        tree->str_len = mem_realloc(MEM_PARSER, tree->str_len, sizeof(*tree->str_len) * tree->capacity);
+    }
+
+    ASTreeIndex node = tree->nnodes++;
+    tree->type[node] = nodetype;
+    tree->left[node] = AST_NULL;
+    tree->right[node] = AST_NULL;
+    tree->str_off[node] = 0;
+    tree->str_len[node] = 0;
+    return node;
+}
 
 /*
 ** ASTreeAttachBinaryBranch():
 ** 二分木のAST(抽象構文木)に、ノードを追加する
 ** rootは二分木のルートノードだけではなく、AST上のいずれかのノードを指定できる
 */
-void ASTreeAttachBinaryBranch(ASTreeNode* root, ASTreeNode* leftNode, ASTreeNode* rightNode)
+void ASTreeAttachBinaryBranch(ASTree* tree, ASTreeIndex root, ASTreeIndex leftNode, ASTreeIndex rightNode)
 {
-    assert(root != NULL); /* root == NULL のとき、プログラムを停止 */
-    root->left = leftNode; /* rootに対して、左の子ノードを追加 */
-    root->right = rightNode; /* rootに対して、右の子ノードを追加 */
+    assert(root < tree->nnodes); /* rootがプールの外を指しているとき、プログラムを停止 */
+    tree->left[root] = leftNode; /* rootに対して、左の子ノードを追加 */
+    tree->right[root] = rightNode; /* rootに対して、右の子ノードを追加 */
 }
 
 /*
 ** ASTreeNodeSetType():
 ** 二分木のAST(抽象構文木)のノードに、NodeTypeを設定する
 ** NodeType は、astree.hで定義されている
-** typedef enum {
-**  NODE_PIPE 			= (1 << 0),
-**  NODE_BCKGRND 		= (1 << 1),
-**  NODE_SEQ 			= (1 << 2),
-**  NODE_REDIRECT_IN 	= (1 << 3),
-**  NODE_REDIRECT_OUT 	= (1 << 4),
-**  NODE_CMDPATH		= (1 << 5),
-**  NODE_ARGUMENT		= (1 << 6),
-
-**  NODE_DATA 			= (1 << 7),
-** } NodeType;
 */
-void ASTreeNodeSetType(ASTreeNode* node, NodeType nodetype)
+void ASTreeNodeSetType(ASTree* tree, ASTreeIndex node, NodeType nodetype)
 {
-    assert(node != NULL);
-    node->type = nodetype;
+    assert(node < tree->nnodes);
+    tree->type[node] = nodetype;
 }
 
 /*
 ** ASTreeNodeSetData():
-** 指定の文字列を、nodeのszDataに保存する
-** パイプやリダイレクトなどの制御用文字ではなく、
-** データとして保持すべきトークン文字列をノードに関連付けて保存する処理である
-** トークン文字列を持つノードは、メンバnodeTypeに "NODE_DATA"が追加で付与される
-** 追加での付与なので、そのノードが持つ役割を示すタイプと並列して設定される
-** つまり、コマンドライン引数のトークンを解析して抽象構文木に登録する場合、
-** 引数であることを示す NODE_AGUMENT とともに
-** 与えられた引数の文字列を持っていることを示す NODE_DATA も追加的に設定される
+** 指定の文字列を文字列テーブルの末尾に複製して、nodeから参照できるようにする
+** トークン文字列を持つノードは、メンバtypeに "NODE_DATA"が追加で付与される
 */
-void ASTreeNodeSetData(ASTreeNode* node, char* data)
+void ASTreeNodeSetData(ASTree* tree, ASTreeIndex node, const char* data)
 {
-    assert(node != NULL);
-    if(data != NULL) { /* 引数に、保持すべきトークン文字列が与えられていたら */
-        node->szData = data;
-        node->type |= NODE_DATA; /* NODE_DATAのビットを1にする...szDataにデータが入っていることを示す？ */
+    assert(node < tree->nnodes);
+    if (data == NULL)
+        return;
+
+    uint32_t len = strlen(data);
+    if (tree->strtab_len + len + 1 > tree->strtab_cap) {
+        while (tree->strtab_len + len + 1 > tree->strtab_cap)
+            tree->strtab_cap = tree->strtab_cap ? tree->strtab_cap * 2 : 256;
+        tree->strtab = mem_realloc(MEM_PARSER, tree->strtab, tree->strtab_cap);
     }
+
+    memcpy(tree->strtab + tree->strtab_len, data, len + 1); /* 終端文字ごと複製する */
+    tree->str_off[node] = tree->strtab_len;
+    tree->str_len[node] = len;
+    tree->strtab_len += len + 1;
+    tree->type[node] |= NODE_DATA;
+}
+
+/* 現在のノードプールと文字列テーブルの使用量を記録する */
+ASTreeMark ASTreeGetMark(ASTree* tree)
+{
+    ASTreeMark mark;
+    mark.nnodes = tree->nnodes;
+    mark.strtab_len = tree->strtab_len;
+    return mark;
 }
 
 /*
-** ASTreeNodeDelete():
-** 指定したノードを削除する
-** typeにNODE_DATAが設定されている場合、文字列データも保存されているので
-** それも併せて解放する
-** また、そのノードにつながっている子ノードも再帰的に解放する
+** ASTreeRollback():
+** ノードプールを、ASTreeGetMark()で記録した時点まで巻き戻す
+** ノードは確保された順に並んでいるので、記録した時点より後のノードと文字列を捨てるだけでよい
 */
-void ASTreeNodeDelete(ASTreeNode* node)
+void ASTreeRollback(ASTree* tree, ASTreeMark mark)
 {
-    if (node == NULL)
-        return;
-
-    if (node->type & NODE_DATA) /* NODE_DATAのフラグが入っているかを検査する...szDataに値があるかどうか？ */
-        free(node->szData); /* トークン文字列が保存されている場合、それを解放 */
-
-    ASTreeNodeDelete(node->left); /* 左のノードを再帰的に解放する */
-    ASTreeNodeDelete(node->right); /* 右のノードを再帰的に解放する */
-    free(node);
+    assert(mark.nnodes <= tree->nnodes);
+    tree->nnodes = mark.nnodes;
+    tree->strtab_len = mark.strtab_len;
 }
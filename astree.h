@@ -1,39 +1,117 @@
 #ifndef ASTREE_H
 #define ASTREE_H
 
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+** NodeType:
+** ノードの種類は連番で、1バイトに詰めて保持する
+** 上位3ビットはフラグとして使う
+**   NODE_DATA   ... ノードが文字列データを持っている
+**   NODE_EXPAND ... 文字列データに、実行時に展開する $変数 が含まれている
+**   NODE_GLOB   ... 文字列データに、実行時に展開するワイルドカードが含まれている
+*/
 typedef enum {
-    NODE_PIPE 			= (1 << 0), /* パイプ ( '|' ) */
-    NODE_BCKGRND 		= (1 << 1), /* バックグラウンド実行する ( '&' ) */ 
-    NODE_SEQ 			= (1 << 2), /* 実行完了後に残りの処理に入る ( ';' ) */
-    NODE_REDIRECT_IN 	= (1 << 3), /* 入力受け取りリダイレクト ( '<' ) */
-    NODE_REDIRECT_OUT 	= (1 << 4), /* 出力先指定リダイレクト ( '>' ) */
-    NODE_CMDPATH		= (1 << 5), /* 実行ファイルのパス(コマンド名) */
-    NODE_ARGUMENT		= (1 << 6), /* 単独の引数 */
+    NODE_PIPE 			= 1, /* パイプ ( '|' ) */
+    NODE_BCKGRND 		= 2, /* バックグラウンド実行する ( '&' ) */
+    NODE_SEQ 			= 3, /* 実行完了後に残りの処理に入る ( ';' ) */
+    NODE_REDIRECT_IN 	= 4, /* 入力受け取りリダイレクト ( '<' ) */
+    NODE_REDIRECT_OUT 	= 5, /* 出力先指定リダイレクト ( '>' ) */
+                              /* リダイレクトは、ファイル名(文字列データ) [left: ディスクリプタ番号の NODE_ARGUMENT、無ければ AST_NULL] */
+                              /* [right: リダイレクトを付けるコマンド(simple command か制御構文)、またはその手前に書かれたリダイレクト] */
+    NODE_CMDPATH		= 6, /* 実行ファイルのパス(コマンド名) */
+    NODE_ARGUMENT		= 7, /* 単独の引数 */
+
+    NODE_IF				= 8, /* if [left: 条件] [right: NODE_THEN] */
+    NODE_THEN			= 9, /* [left: then の中身] [right: else の中身(elifは NODE_IF)、無ければ AST_NULL] */
+    NODE_WHILE			= 10, /* while [left: 条件] [right: do の中身] */
+    NODE_UNTIL			= 11, /* until [left: 条件] [right: do の中身] */
+    NODE_FOR			= 12, /* for 変数名(文字列データ) [left: NODE_WORDLIST、in が無ければ AST_NULL] [right: do の中身] */
+    NODE_CASE			= 13, /* case 単語(文字列データ) [right: 最初の NODE_CASE_ITEM] */
+    NODE_CASE_ITEM		= 14, /* [left: パターンの NODE_WORDLIST] [right: 次の NODE_CASE_ITEM] */
+    NODE_WORDLIST		= 15, /* 単語の並び。NODE_CMDPATH と同じく、直後に単語の数(left)だけ NODE_ARGUMENT が続く */
+                              /* NODE_CASE_ITEM のパターンとして使う場合は、right がその項目の中身 */
+    NODE_FUNCDEF		= 16, /* 関数の定義。関数名(文字列データ) [left: 中身の制御構文] */
+    NODE_GROUP			= 17, /* { ... } [left: 中身] */
+    NODE_FANOUT			= 18, /* command |{ job, job ... } [left: 出力側の <command>] [right: 最初の NODE_FANOUT_ITEM] */
+    NODE_FANOUT_ITEM	= 19, /* [left: 入力を受け取る <job>] [right: 次の NODE_FANOUT_ITEM] */
+    NODE_REDIRECT_APPEND = 20, /* 出力先のファイルの末尾に追加するリダイレクト ( '>>' ) */
+    NODE_REDIRECT_DUP	= 21, /* ディスクリプタを複製するリダイレクト ( '>&' '<&' )。文字列データは複製元の番号、'-' なら閉じる */
+    NODE_SUBSHELL		= 22, /* ( ... ) [left: 中身]。NODE_GROUP と違い、常に子プロセスで実行する */
 
+    NODE_GLOB			= (1 << 5), /* 実行時にワイルドカードを展開する */
+    NODE_EXPAND			= (1 << 6), /* 実行時に $変数 を展開する */
     NODE_DATA 			= (1 << 7), /* 制御文字ではなく、文字列データ(token)を持つことを示す */
 } NodeType;
 
+/*
+** ASTreeIndex:
+** ノードはポインタではなく、ノードプール内の32bitの添字で参照する
+** 枝が無いことは AST_NULL で表す
+*/
+typedef uint32_t ASTreeIndex;
+#define AST_NULL ((ASTreeIndex)0xffffffff)
+
 /*
 ** AST: abstract syntax tree(抽象構文木)
-** 単純な二分木構造を定義している
+** ノードを1つずつmallocするのではなく、ノードプールにまとめて確保する
+** 各メンバを別々の配列に持つ(struct of arrays)ので、木をたどる処理がキャッシュに乗りやすい
+** ノードの文字列は、1行分の文字列テーブル strtab に終端文字付きで詰めて置き、(offset, len)で参照する
+**
+** <simple command> は、NODE_CMDPATH のノードの直後に NODE_ARGUMENT のノードが連続して並ぶ
+** NODE_CMDPATH の left には、後ろに続く引数ノードの数を入れておく(ASTreeArgc()で参照する)
 */
-typedef struct ASTreeNode
+typedef struct ASTree
 {
-    int type; /* enum NodeType */
-    char* szData; /* パースした結果のトークン文字列...szDataがどんな意味かは不明 */
-    struct ASTreeNode* left; /* 左の枝へのポインタ */
-    struct ASTreeNode* right; /* 右の枝へのポインタ */
-} ASTreeNode;
+    uint8_t* type; /* enum NodeType */
+    ASTreeIndex* left; /* 左の枝 */
+    ASTreeIndex* right; /* 右の枝 */
+    uint32_t* str_off; /* 文字列データの strtab 内の位置 */
+    uint32_t* str_len; /* 文字列データの長さ */
+    uint32_t nnodes; /* 使用中のノード数 */
+    uint32_t capacity; /* 確保済みのノード数 */
+
+    char* strtab; /* 文字列テーブル */
+    uint32_t strtab_len;
+    uint32_t strtab_cap;
+
+    void* mapping; /* ファイルをmmapしたイメージを指している場合、その先頭(読み込み専用) */
+    size_t mapping_size;
+} ASTree;
+
+/*
+** ASTreeMark:
+** ノードプールと文字列テーブルの使用量の記録
+** 構文解析で試したパターンが合わなかったときに、ASTreeRollback()でこの時点まで巻き戻す
+*/
+typedef struct ASTreeMark
+{
+    uint32_t nnodes;
+    uint32_t strtab_len;
+} ASTreeMark;
 
 /*
 ** NODETYPE(a):
 ** 抽象構文木のノードを受け取り、そのメンバtypeの値からNODE_TYPEを取得する
 */
-#define NODETYPE(a) (a & (~NODE_DATA))	// get the type of the nodes
+#define NODETYPE(a) (a & (~(NODE_DATA | NODE_EXPAND | NODE_GLOB)))	// get the type of the nodes
+
+#define ASTreeType(tree, n)		((tree)->type[n])
+#define ASTreeLeft(tree, n)		((tree)->left[n])
+#define ASTreeRight(tree, n)	((tree)->right[n])
+#define ASTreeData(tree, n)		((tree)->strtab + (tree)->str_off[n])
+#define ASTreeArgc(tree, n)		((int)(tree)->left[n] + 1) /* NODE_CMDPATH: コマンド名を含めた引数の数 */
+#define ASTreeWordc(tree, n)	((int)(tree)->left[n]) /* NODE_WORDLIST: 単語の数(単語は n + 1 から並ぶ) */
 
-void ASTreeAttachBinaryBranch (ASTreeNode * root , ASTreeNode * leftNode , ASTreeNode * rightNode);
-void ASTreeNodeSetType (ASTreeNode * node , NodeType nodetype );
-void ASTreeNodeSetData (ASTreeNode * node , char * data );
-void ASTreeNodeDelete (ASTreeNode * node );
+void ASTreeInit (ASTree * tree );
+void ASTreeReset (ASTree * tree );
+void ASTreeDestroy (ASTree * tree );
+ASTreeIndex ASTreeNewNode (ASTree * tree , NodeType nodetype );
+void ASTreeAttachBinaryBranch (ASTree * tree , ASTreeIndex root , ASTreeIndex leftNode , ASTreeIndex rightNode );
+void ASTreeNodeSetType (ASTree * tree , ASTreeIndex node , NodeType nodetype );
+void ASTreeNodeSetData (ASTree * tree , ASTreeIndex node , const char * data );
+ASTreeMark ASTreeGetMark (ASTree * tree );
+void ASTreeRollback (ASTree * tree , ASTreeMark mark );
 
 #endif
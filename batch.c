@@ -0,0 +1,215 @@
+#include "batch.h"
+#include "cmdstats.h"
+#include "var.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/*
+** batch [-P n] [-n max] [-s bytes] [--] command args ...
+** ワイルドカードで引数が多くなりすぎて exec が E2BIG で失敗するコマンドを、
+** ARG_MAX に収まるように引数を分けて、同じコマンドを何回かに分けて実行する( find | xargs の代わり)
+**
+** 分けるのはワイルドカードを展開した引数の範囲( init_command_internal() が記録する)で、
+** その前後の引数は毎回そのまま付ける( batch cp *.txt backup/ は cp ... backup/ を繰り返す)
+** ワイルドカードが無ければ、コマンド名の後のすべての引数を分ける
+**   -P n      同時に n 個まで実行する(既定は 1 で、順に実行する)
+**   -n max    1回の引数を max 個までにする
+**   -s bytes  1回の argv と環境変数の大きさの上限(既定は ARG_MAX から余裕を引いたもの)
+** 終了ステータスは、すべて成功なら 0、そうでなければ各回の終了ステータスの最大値
+** (シグナルで終了したもの 128+n、見つからない 127 が、引数の誤りより優先される)
+**
+** パイプラインの途中やバックグラウンドでは、batch 自身が子プロセスで実行される( BUILTIN_PURE )
+*/
+
+#define BATCH_HEADROOM 4096 /* ARG_MAX から引いておく余裕(補助ベクタなど) */
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+extern char** environ;
+
+/*
+** Running:
+** 実行中の1回分
+*/
+typedef struct Running
+{
+	pid_t pid;
+	int pidfd; /* 終了すると読み込み可能になる。使えなければ -1 */
+} Running;
+
+static size_t arg_size(const char* arg)
+{
+	return strlen(arg) + 1 + sizeof(char*);
+}
+
+/* 起動した1回分の終了を待って、終了ステータスを返す */
+static int reap(pid_t pid)
+{
+	int status;
+	pid_t r;
+	while ((r = waitpid(pid, &status, 0)) == -1 && errno == EINTR);
+	if (r == -1)
+		return 0;
+	cmdstats_reaped(pid);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/*
+** wait_any():
+** 実行中のどれかが終了するのを待ち、その位置を返す
+** pidfd を使えない場合は、起動した順に待つ
+*/
+static int wait_any(Running* running, int n)
+{
+	struct pollfd pfds[n];
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (running[i].pidfd == -1)
+			return 0;
+		pfds[i].fd = running[i].pidfd;
+		pfds[i].events = POLLIN;
+	}
+	while (poll(pfds, n, -1) == -1)
+		if (errno != EINTR)
+			return 0;
+	for (i = 0; i < n; i++)
+		if (pfds[i].revents != 0)
+			return i;
+	return 0;
+}
+
+static void finish(Running* running, int* n, int i, int* status)
+{
+	int s = reap(running[i].pid);
+	if (s > *status)
+		*status = s;
+	if (running[i].pidfd != -1)
+		close(running[i].pidfd);
+	running[i] = running[--*n];
+}
+
+/* 1回分を起動する。パイプとシェルの状態は cmdinternal のものをそのまま使う */
+static pid_t spawn(CommandInternal* cmdinternal, char** argv, int argc)
+{
+	CommandInternal cmd = *cmdinternal;
+	cmd.argv = argv;
+	cmd.argc = argc;
+	cmd.nredirects = 0; /* リダイレクトは batch を実行する前に適用済み */
+	cmd.globbed = false;
+	cmd.exec_in_place = false; /* スクリプトの最後の batch でも、各回は起動して待つ */
+	cmd.threads = NULL;
+	return execute_command_internal(&cmd);
+}
+
+int execute_batch(CommandInternal* cmdinternal)
+{
+	char** argv = cmdinternal->argv;
+	int argc = cmdinternal->argc;
+	long parallel = 1, max_args = 0, max_bytes = 0;
+	int c = 1;
+
+	while (c < argc && argv[c][0] == '-') {
+		char* end;
+		long value = c + 1 < argc ? strtol(argv[c + 1], &end, 10) : 0;
+		if (strcmp(argv[c], "--") == 0) {
+			c++;
+			break;
+		}
+		if (value <= 0 || *end != 0)
+			value = 0; /* 下で使い方を表示する */
+		else if (strcmp(argv[c], "-P") == 0)
+			parallel = value;
+		else if (strcmp(argv[c], "-n") == 0)
+			max_args = value;
+		else if (strcmp(argv[c], "-s") == 0)
+			max_bytes = value;
+		else
+			value = 0;
+		if (value == 0) {
+			c = argc;
+			break;
+		}
+		c += 2;
+	}
+	if (c >= argc) {
+		fprintf(stderr, "usage: batch [-P n] [-n max] [-s bytes] [--] command args ...\n");
+		return 2;
+	}
+
+	/* 分ける範囲 [first, last] と、毎回付ける引数の大きさ */
+	int first = c + 1, last = argc - 1;
+	if (cmdinternal->glob_first > c) {
+		first = cmdinternal->glob_first;
+		last = cmdinternal->glob_last;
+	}
+	int i;
+	size_t fixed = sizeof(char*); /* argv の終わりの NULL */
+	for (i = c; i < argc; i++)
+		if (i < first || i > last)
+			fixed += arg_size(argv[i]);
+	for (i = 0; environ[i] != NULL; i++)
+		fixed += arg_size(environ[i]);
+	for (i = 0; i < cmdinternal->nassigns; i++)
+		fixed += arg_size(cmdinternal->assigns[i]);
+
+	if (max_bytes == 0)
+		max_bytes = sysconf(_SC_ARG_MAX) - BATCH_HEADROOM;
+	if ((long)fixed >= max_bytes) {
+		fprintf(stderr, "batch: %s: the environment and fixed arguments alone exceed %ld bytes\n", argv[c], max_bytes);
+		return 126;
+	}
+
+	/* 1回分の argv: 前の引数・分けた引数・後ろの引数 */
+	char** sub = malloc(sizeof(char*) * (argc - c + 1));
+	Running* running = malloc(sizeof(Running) * parallel);
+	int nrunning = 0, status = 0, ninvocations = 0;
+	int next = first;
+
+	while (next <= last || ninvocations == 0) {
+		int n = 0;
+		for (i = c; i < first; i++)
+			sub[n++] = argv[i];
+		size_t bytes = fixed;
+		int start = next;
+		while (next <= last && (max_args == 0 || next - start < max_args)
+			&& (next == start || bytes + arg_size(argv[next]) <= (size_t)max_bytes)) {
+			bytes += arg_size(argv[next]);
+			sub[n++] = argv[next++];
+		}
+		for (i = last + 1; i < argc; i++)
+			sub[n++] = argv[i];
+		sub[n] = NULL;
+
+		if (nrunning == parallel)
+			finish(running, &nrunning, wait_any(running, nrunning), &status);
+
+		pid_t pid = spawn(cmdinternal, sub, n);
+		ninvocations++;
+		if (pid <= 0) { /* 組み込みコマンドや関数はシェル自身で実行し終えている。-1 は起動できなかった */
+			int s = pid == 0 ? var_status() : 126;
+			if (s > status)
+				status = s;
+			continue;
+		}
+		running[nrunning].pid = pid;
+		running[nrunning].pidfd = parallel > 1 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+		nrunning++;
+	}
+	while (nrunning > 0)
+		finish(running, &nrunning, wait_any(running, nrunning), &status);
+
+	free(sub);
+	free(running);
+	return status;
+}
@@ -0,0 +1,8 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "command.h"
+
+int execute_batch(CommandInternal* cmdinternal);
+
+#endif
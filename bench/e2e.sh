@@ -0,0 +1,78 @@
+#!/bin/sh
+# mysh と dash / bash で、同じスクリプトの実行にかかる時間とリソースを比べる
+# bench/e2e/*.sh のそれぞれを、各シェルの標準入力から N 回実行して以下を表示する
+#   cmds/s    1秒あたりに実行した単純コマンドの数(スクリプトの "# commands:" の行の数 / 実行時間)
+#   run_p50/cmd, run_p99/cmd
+#             1回の実行時間(マイクロ秒)の中央値と 99 パーセンタイルを、コマンド数で割ったもの
+#             (コマンドごとに測った時間の分布ではなく、その回のコマンドの平均時間)
+#   rss_kb    最大常駐メモリ
+#   csw       1回あたりのコンテキストスイッチの数
+#   syscalls  1回あたりのシステムコールの数(子プロセスを含む。strace が無ければ -)
+# 出力は空白区切りの固定の形式なので、コミットごとの結果を diff や awk で比べられる
+#
+# usage: bench/e2e.sh [N]   (make e2e-bench)
+
+N=${1:-20}
+DIR=$(dirname "$0")
+RUN=$DIR/e2e_run
+
+# ワイルドカードの展開に使うファイル
+E2E_DIR=$(mktemp -d /tmp/mysh-e2e.XXXXXX)
+export E2E_DIR
+trap 'rm -rf "$E2E_DIR"' EXIT
+i=0
+while [ $i -lt 2000 ]; do
+	: > "$E2E_DIR/f$i.txt"
+	i=$((i + 1))
+done
+for d in 0 1 2 3 4 5 6 7 8 9; do
+	mkdir "$E2E_DIR/d$d"
+	i=0
+	while [ $i -lt 100 ]; do
+		: > "$E2E_DIR/d$d/g$i.dat"
+		i=$((i + 1))
+	done
+done
+
+# 比べるシェル。見つからないものは飛ばす
+set -- "mysh:$DIR/../shell --norc"
+command -v dash > /dev/null && set -- "$@" "dash:dash"
+command -v bash > /dev/null && set -- "$@" "bash:bash --norc --noprofile"
+
+syscalls() {
+	if command -v strace > /dev/null; then
+		out=$(mktemp /tmp/mysh-e2e-strace.XXXXXX)
+		strace -f -c -o "$out" "$@" < "$script" > /dev/null 2>&1
+		awk '/ total$/ { print $4 }' "$out"
+		rm -f "$out"
+	else
+		echo -
+	fi
+}
+
+echo "# mysh e2e-bench rev=$(git -C "$DIR" rev-parse --short HEAD 2>/dev/null || echo unknown) N=$N cpus=$(nproc)"
+printf '%-10s %-5s %12s %12s %12s %9s %8s %10s %s\n' script shell cmds/s run_p50/cmd run_p99/cmd rss_kb csw syscalls failures
+for script in "$DIR"/e2e/*.sh; do
+	name=$(basename "$script" .sh)
+	cmds=$(sed -n 's/^# commands: *//p' "$script")
+	for entry in "$@"; do
+		label=${entry%%:*}
+		cmd=${entry#*:}
+		result=$($RUN "$N" "$script" $cmd)
+		calls=$(syscalls $cmd)
+		echo "$result" | awk -v name="$name" -v label="$label" -v cmds="$cmds" -v calls="$calls" '
+		{
+			for (i = 1; i <= NF; i++) {
+				split($i, kv, "=")
+				r[kv[1]] = kv[2]
+			}
+			if (r["runs"] == 0) {
+				printf "%-10s %-5s %12s %12s %12s %9s %8s %10s %d\n", name, label, "-", "-", "-", "-", "-", calls, r["failures"]
+				next
+			}
+			printf "%-10s %-5s %12.0f %12.2f %12.2f %9d %8d %10s %d\n", name, label,
+			       cmds * r["runs"] / (r["total_us"] / 1e6), r["p50_us"] / cmds, r["p99_us"] / cmds,
+			       r["rss_kb"], r["csw"], calls, r["failures"]
+		}'
+	done
+done
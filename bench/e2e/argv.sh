@@ -0,0 +1,9 @@
+# 数千個の引数を持つコマンド
+# commands: 81
+cd $E2E_DIR
+for n in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+	/bin/echo *.txt > /dev/null
+	echo *.txt d*/*.dat > /dev/null
+	/bin/true d*/*.dat
+	printf '%s\n' *.txt d*/*.dat > /dev/null
+done
@@ -0,0 +1,7 @@
+# バックグラウンドのジョブを次々に起動する
+# commands: 602
+i=0
+while [ $i -lt 200 ]; do
+	/bin/true &
+	i=$((i + 1))
+done
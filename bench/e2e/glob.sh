@@ -0,0 +1,11 @@
+# ワイルドカードの展開(2000ファイル + 10ディレクトリ x 100ファイル)
+# commands: 30001
+cd $E2E_DIR
+for n in 1 2 3 4 5 6 7 8 9 10; do
+	for f in *.txt; do
+		:
+	done
+	for f in d*/*.dat; do
+		:
+	done
+done
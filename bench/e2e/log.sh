@@ -0,0 +1,14 @@
+# ログの書き込み(exec で開いたままのディスクリプタと、毎回開き直す '>>')
+# commands: 18006
+exec 3>> $E2E_DIR/log
+i=0
+while [ $i -lt 5000 ]; do
+	echo "line $i" >&3
+	i=$((i + 1))
+done
+exec 3>&-
+i=0
+while [ $i -lt 1000 ]; do
+	echo "line $i" >> $E2E_DIR/log
+	i=$((i + 1))
+done
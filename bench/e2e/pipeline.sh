@@ -0,0 +1,7 @@
+# 8段のパイプラインを繰り返す
+# commands: 1002
+i=0
+while [ $i -lt 100 ]; do
+	echo x | cat | cat | cat | cat | cat | cat | cat > /dev/null
+	i=$((i + 1))
+done
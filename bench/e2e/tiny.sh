@@ -0,0 +1,12 @@
+# 小さなコマンドを大量に実行する(組み込みコマンド・代入・外部コマンド)
+# commands: 15304
+i=0
+while [ $i -lt 5000 ]; do
+	true
+	i=$((i + 1))
+done
+i=0
+while [ $i -lt 100 ]; do
+	/bin/true
+	i=$((i + 1))
+done
@@ -0,0 +1,129 @@
+#!/bin/sh
+# 長時間動かしたシェルで、確保中の領域が増えていかないことを確かめる
+# 同じ内容のブロックを繰り返した N 行のスクリプトを実行し、組み込みコマンド memstats の出力を
+# 前半(100 ブロック目から20回)と最後の20ブロックで記録して、字句解析・構文解析・実行計画の単位ごとに比べる
+#   1行ずつ解析する場合(MYSH_PARSEAHEAD=0)  前半と後半のすべての記録で、確保中の数と大きさが一致すること
+#   先読みする場合(MYSH_PARSEAHEAD=1)       途中の値は解析スレッドがどこまで先に進んでいるかで揺れるので表示だけにする
+#                                           判定は、スクリプトの最後の行(解析スレッドが EOF まで読み終え、
+#                                           環状バッファが空になった後)の記録を、200ブロックだけの実行の最後の記録と比べ、
+#                                           確保中の数と大きさが一致すること
+# 常駐メモリ(rss)は、前半の最初と後半の最後の差を表示するだけで、判定には使わない
+#
+# usage: bench/memleak.sh [N]   (make leak-check)
+
+N=${1:-1000000}
+DIR=$(dirname "$0")
+SHELL_BIN=$DIR/../shell
+
+WORK=$(mktemp -d /tmp/mysh-leak.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+# 1ブロックは10行。空行・コメント・複数行の制御構文・構文エラーの行も含めて、解析のすべての経路を通す
+BLOCK=10
+NBLOCKS=$((N / BLOCK))
+if [ $NBLOCKS -lt 200 ]; then
+	echo "memleak: N must be at least $((200 * BLOCK))" >&2
+	exit 2
+fi
+LATE=$((NBLOCKS - 20))
+
+# gen_script <ブロック数> <ファイル>
+# 最後の行の memstats は ms.end に書く。その前に、値の桁数がブロック数で変わる変数を戻しておく
+gen_script()
+{
+	awk -v nblocks=$1 -v late=$(($1 - 20)) -v work="$WORK" 'BEGIN {
+		print "i=0"
+		for (b = 0; b < nblocks; b++) {
+			print "i=$((i+1))"
+			print "k=$(( (i>=100 && i<120) || i>" late " ))"
+			print "if [ $k -eq 1 ]; then"
+			print "memstats > " work "/ms.$i"
+			print "fi"
+			print "for w in a b c; do x=$w; done; case $x in c) y=1;; *) y=0;; esac"
+			print ""
+			print "# comment " b % 2
+			print "| syntax error"
+			print "v=\"word $x $y\"; let n=i*2 ; : $v $n"
+		}
+		print "i=0; n=0"
+		print "memstats > " work "/ms.end"
+	}' > "$2"
+}
+
+gen_script $NBLOCKS "$WORK/script.sh"
+gen_script 200 "$WORK/base.sh"
+
+status=0
+for mode in 0 1; do
+	rm -f "$WORK"/ms.* "$WORK"/base.end
+	if [ $mode -eq 1 ]; then
+		MYSH_PARSEAHEAD=$mode "$SHELL_BIN" --norc < "$WORK/base.sh" > /dev/null 2>&1
+		mv "$WORK/ms.end" "$WORK/base.end"
+		rm -f "$WORK"/ms.*
+	fi
+	MYSH_PARSEAHEAD=$mode "$SHELL_BIN" --norc < "$WORK/script.sh" > /dev/null 2>&1
+	mv "$WORK/ms.end" "$WORK/script.end"
+
+	# ms.<ブロック番号> を、前半(early)と後半(late)に分けて集計する
+	for f in "$WORK"/ms.*; do
+		i=${f##*.}
+		if [ $i -le $LATE ]; then
+			part=early
+		else
+			part=late
+		fi
+		awk -v part=$part -v i=$i '$1 == "rss" { print part, i, "rss", $2; next }
+			NR > 1 { print part, i, $1, $2, $3 }' "$f"
+	done | sort -k3,3 -k2,2n | awk -v mode=$mode '
+	$3 == "rss" {
+		if (rss_first == "" || ($1 == "early" && $2 < rss_first_i)) { rss_first = $4; rss_first_i = $2 }
+		if ($1 == "late" && $2 > rss_last_i) { rss_last = $4; rss_last_i = $2 }
+		next
+	}
+	{
+		key = $3
+		subsys[key] = 1
+		n[$1, key]++
+		if (n[$1, key] == 1 || $4 < min_live[$1, key]) min_live[$1, key] = $4
+		if (n[$1, key] == 1 || $4 > max_live[$1, key]) max_live[$1, key] = $4
+		if (n[$1, key] == 1 || $5 < min_bytes[$1, key]) min_bytes[$1, key] = $5
+		if (n[$1, key] == 1 || $5 > max_bytes[$1, key]) max_bytes[$1, key] = $5
+	}
+	END {
+		fail = 0
+		printf "# MYSH_PARSEAHEAD=%d\n", mode
+		printf "%-10s %19s %19s %23s %23s %s\n", "subsystem", "early live", "late live", "early bytes", "late bytes", "result"
+		for (key in subsys) {
+			if (n["early", key] != 20 || n["late", key] != 20)
+				ok = 0
+			else if (mode == 0)
+				ok = min_live["early", key] == max_live["late", key] && max_live["early", key] == min_live["late", key] \
+					&& min_bytes["early", key] == max_bytes["late", key] && max_bytes["early", key] == min_bytes["late", key]
+			else
+				ok = 1
+			printf "%-10s %9d..%-9d %9d..%-9d %11d..%-11d %11d..%-11d %s\n", key,
+				min_live["early", key], max_live["early", key], min_live["late", key], max_live["late", key],
+				min_bytes["early", key], max_bytes["early", key], min_bytes["late", key], max_bytes["late", key],
+				!ok ? "GROWING" : mode == 0 ? "ok" : "-"
+			if (!ok)
+				fail = 1
+		}
+		printf "rss_kb %d -> %d (%+d)\n", rss_first, rss_last, rss_last - rss_first
+		exit fail
+	}' || status=1
+
+	# 先読みする場合は、EOF の後の記録を 200 ブロックだけの実行と比べる
+	if [ $mode -eq 1 ]; then
+		awk 'FNR == 1 || $1 == "rss" { next }
+		FILENAME ~ /base.end$/ { base[$1] = $2 " " $3; next }
+		{
+			ok = ($1 in base) && base[$1] == $2 " " $3
+			printf "%-10s eof %s -> %s %s\n", $1, base[$1], $2 " " $3, ok ? "ok" : "GROWING"
+			if (!ok)
+				fail = 1
+		}
+		END { exit fail }' "$WORK/base.end" "$WORK/script.end" || status=1
+	fi
+done
+
+exit $status
@@ -0,0 +1,199 @@
+/*
+** parse_mt:
+** 字句解析・構文解析だけを、複数のスレッドで同時に実行したときのスループットを計測する
+** parser_ctx / lexer_t / ASTree をスレッドごとに持てば、グローバルな状態なしに並行して解析できることを確かめる
+**
+** usage: parse_mt [-r 回数] [-t 最大スレッド数] script ...
+**
+** 各スクリプトを、シェルと同じく1行ずつ(制御構文の途中なら次の行をつなげて)解析する
+** スクリプト x 回数 の仕事を、1, 2, 4 ... 最大スレッド数 のスレッドで分けあって処理し、
+** 1秒あたりの解析した行数と、1スレッドのときに対する速度の比を表示する
+** どのスレッドの結果も、最初に1スレッドで解析したときのノード数・文字列テーブルの大きさと一致しなければ失敗とする
+*/
+#include "../lexer.h"
+#include "../parser.h"
+#include "../astree.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+/* 解析する1つのスクリプト */
+typedef struct Script
+{
+	char** lines;
+	int nlines;
+	unsigned long nodes; /* 1スレッドで解析したときの、全行のノード数の合計 */
+	unsigned long strtab; /* 同じく、文字列テーブルの大きさの合計 */
+} Script;
+
+static Script* scripts;
+static int nscripts;
+static int rounds = 200;
+static long next_work; /* 次に取る仕事(スクリプト x 回数 の通し番号) */
+static long errors;
+
+/*
+** 定数式を畳み込むときの arith は変数を参照しないので、シェル本体の変数表はつながない
+*/
+const char* var_get(const char* name)
+{
+	(void)name;
+	return NULL;
+}
+
+void var_set(const char* name, const char* value)
+{
+	(void)name;
+	(void)value;
+}
+
+static void load_script(Script* script, const char* path)
+{
+	FILE* fp = fopen(path, "r");
+	char* line = NULL;
+	size_t len = 0;
+
+	memset(script, 0, sizeof(*script));
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (getline(&line, &len, fp) > 0) {
+		script->lines = realloc(script->lines, sizeof(char*) * (script->nlines + 1));
+		script->lines[script->nlines++] = strdup(line);
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+** parse_script():
+** スクリプトを1行ずつ解析し、ノード数と文字列テーブルの大きさの合計を返す
+** 解析に使う状態は、すべて引数と局所変数
+*/
+static void parse_script(const Script* script, ASTree* tree, unsigned long* nodes, unsigned long* strtab)
+{
+	char* pending = NULL;
+	size_t pending_len = 0;
+	int i;
+
+	*nodes = *strtab = 0;
+	for (i = 0; i < script->nlines; i++) {
+		size_t len = strlen(script->lines[i]);
+		pending = realloc(pending, pending_len + len + 1);
+		memcpy(pending + pending_len, script->lines[i], len + 1);
+		pending_len += len;
+
+		parser_ctx ctx;
+		lexer_t lexbuf;
+		ASTreeIndex root;
+		lexer_build(pending, pending_len, &lexbuf);
+		ASTreeReset(tree);
+		int result = lexbuf.ntoks > 0 ? parser_parse(&ctx, &lexbuf, tree, &root) : 0;
+		lexer_destroy(&lexbuf);
+		if (result == PARSE_INCOMPLETE)
+			continue;
+		if (result != 0)
+			__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+		*nodes += tree->nnodes;
+		*strtab += tree->strtab_len;
+		pending_len = 0;
+	}
+	free(pending);
+}
+
+static void* worker(void* arg)
+{
+	ASTree tree;
+	long total = (long)nscripts * rounds;
+	long work;
+	(void)arg;
+
+	ASTreeInit(&tree);
+	while ((work = __atomic_fetch_add(&next_work, 1, __ATOMIC_RELAXED)) < total) {
+		const Script* script = &scripts[work % nscripts];
+		unsigned long nodes, strtab;
+		parse_script(script, &tree, &nodes, &strtab);
+		if (nodes != script->nodes || strtab != script->strtab)
+			__atomic_fetch_add(&errors, 1, __ATOMIC_RELAXED);
+	}
+	ASTreeDestroy(&tree);
+	return NULL;
+}
+
+static double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "r:t:")) != -1) {
+		if (opt == 'r')
+			rounds = atoi(optarg);
+		else if (opt == 't')
+			max_threads = atoi(optarg);
+		else {
+			fprintf(stderr, "usage: %s [-r rounds] [-t threads] script ...\n", argv[0]);
+			return 2;
+		}
+	}
+	if (optind >= argc || rounds <= 0 || max_threads <= 0) {
+		fprintf(stderr, "usage: %s [-r rounds] [-t threads] script ...\n", argv[0]);
+		return 2;
+	}
+
+	/* 1スレッドで解析した結果を、正しい結果として覚えておく */
+	ASTree tree;
+	long lines = 0;
+	ASTreeInit(&tree);
+	nscripts = argc - optind;
+	scripts = calloc(nscripts, sizeof(Script));
+	for (i = 0; i < nscripts; i++) {
+		load_script(&scripts[i], argv[optind + i]);
+		parse_script(&scripts[i], &tree, &scripts[i].nodes, &scripts[i].strtab);
+		lines += scripts[i].nlines;
+	}
+	ASTreeDestroy(&tree);
+	if (errors > 0) {
+		fprintf(stderr, "parse_mt: the corpus has syntax errors\n");
+		return 1;
+	}
+
+	printf("# parse_mt scripts=%d lines=%ld rounds=%d\n", nscripts, lines, rounds);
+	printf("%-8s %14s %8s\n", "threads", "lines/s", "speedup");
+	double base = 0;
+	int threads;
+	for (threads = 1; ; threads = threads * 2 > max_threads && threads < max_threads ? max_threads : threads * 2) {
+		pthread_t* tids = malloc(sizeof(pthread_t) * threads);
+		next_work = 0;
+		double start = now();
+		for (i = 0; i < threads; i++)
+			pthread_create(&tids[i], NULL, worker, NULL);
+		for (i = 0; i < threads; i++)
+			pthread_join(tids[i], NULL);
+		double rate = lines * rounds / (now() - start);
+		free(tids);
+
+		if (threads == 1)
+			base = rate;
+		printf("%-8d %14.0f %7.2fx\n", threads, rate, rate / base);
+		if (threads >= max_threads)
+			break;
+	}
+
+	if (errors > 0) {
+		printf("parse_mt: %ld parses differed from the single-threaded result\n", errors);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# 組み込みコマンドのステージを含むパイプラインを N 回実行し、
+# 1回あたりの時間(us)をスレッドなし(MYSH_STAGE_THREADS=0、fork する)とスレッドありで比べる
+#
+# usage: bench/pipeline.sh [N]   (make pipeline-bench)
+
+N=${1:-2000}
+DIR=$(dirname "$0")
+SHELL_BIN=$DIR/../shell
+
+SCRIPT=$(mktemp /tmp/mysh-pipeline.XXXXXX)
+trap 'rm -f "$SCRIPT" "$SCRIPT.out"' EXIT
+
+printf "%-28s %12s %12s %8s\n" "pipeline" "fork_us" "thread_us" "speedup"
+for pipeline in 'echo $i | true' 'echo $i | echo x | true' 'echo $i | cat' 'pwd | cat > /dev/null'; do
+	{
+		echo "start=\$(date +%s%N)"
+		echo "i=0"
+		echo "while [ \$i -lt $N ]; do $pipeline; let i=i+1; done > /dev/null"
+		echo "end=\$(date +%s%N)"
+		echo "echo time \$start \$end"
+	} > "$SCRIPT"
+
+	line=""
+	for mode in 0 1; do
+		MYSH_STAGE_THREADS=$mode "$SHELL_BIN" --norc < "$SCRIPT" 2>/dev/null \
+			| sed 's/^\(swoorup % \)*//' > "$SCRIPT.out"
+		line="$line $(awk -v n=$N '$1 == "time" { printf "%.1f", ($3 - $2) / n / 1000 }' "$SCRIPT.out")"
+	done
+	echo $line | awk -v p="$pipeline" '{ printf "%-28s %12s %12s %7.2fx\n", p, $1, $2, $1 / $2 }'
+done
@@ -0,0 +1,94 @@
+#!/bin/sh
+# レビューで見つかった不具合が再発していないことを確かめる
+# それぞれのケースで mysh を実行し、出力と終了ステータスを期待値と比べる。失敗したケースがあれば 1 で終了する
+#
+# usage: bench/regress.sh   (make regress-check)
+
+DIR=$(dirname "$0")
+SHELL_BIN=$(cd "$DIR/.." && pwd)/shell
+
+WORK=$(mktemp -d /tmp/mysh-regress.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+status=0
+
+# check 名前 期待値 実際の値
+check() {
+	if [ "$2" = "$3" ]; then
+		echo "ok      $1"
+	else
+		echo "FAILED  $1"
+		echo "        expected: $2"
+		echo "        actual:   $3"
+		status=1
+	fi
+}
+
+# rcファイルの export は、2回目の起動(キャッシュを mmap した文字列テーブル)でも動くこと
+echo 'export FOO=bar' > "$WORK/rc"
+for n in 1 2; do
+	out=$(MYSHRC="$WORK/rc" "$SHELL_BIN" -c 'env | grep ^FOO=' 2>&1; echo "status $?")
+	check "rc export (start $n)" "FOO=bar
+status 0" "$out"
+done
+
+# 算術式のエラーでは、代入もコマンドも実行せず、終了ステータスを 1 にすること
+out=$("$SHELL_BIN" --norc -c 'x=0; y=5; y=$((x/0)); echo "status $? y=$y"; echo $((1/0)); echo "status $?"' 2>&1)
+check "arith error aborts the command" "arithmetic: division by zero: x/0
+status 1 y=5
+arithmetic: division by zero: 1/0
+status 1" "$out"
+
+# バックグラウンドのジョブで cgroup を使ったシェルが、終了時に自分の葉の cgroup( mysh-<pid> )を残さないこと
+pid=$("$SHELL_BIN" --norc -c 'sleep 0 & limit > /dev/null; echo $$' 2>/dev/null | tail -n 1)
+leaked=$(find /sys/fs/cgroup -maxdepth 3 -name "mysh-$pid" 2>/dev/null)
+check "cgroup leaf removed at exit" "" "$leaked"
+
+# コマンドサーバーのソケットは、umask によらずサーバーのユーザーだけが接続できる( 0600 )こと
+(umask 000; exec "$SHELL_BIN" --norc --server "$WORK/server.sock" > /dev/null 2>&1) &
+server=$!
+n=0
+while [ ! -S "$WORK/server.sock" ] && [ $n -lt 50 ]; do
+	sleep 0.1
+	n=$((n + 1))
+done
+out=$(stat -c %a "$WORK/server.sock"; "$SHELL_BIN" --client "$WORK/server.sock" echo hi 2>&1)
+kill $server
+check "server socket is 0600" "600
+hi" "$out"
+
+# コマンド置換で、batch が起動したコマンドの出力を受け取れること
+out=$("$SHELL_BIN" --norc -c 'y=$(batch /bin/echo a b); echo "[$y]"' 2>&1)
+check "batch output in command substitution" "[a b]" "$out"
+
+# コマンド置換で、timeout が起動したコマンドの出力を受け取れること
+out=$("$SHELL_BIN" --norc -c 'x=$(timeout 5 /bin/echo hi); echo "[$x]"' 2>&1)
+check "timeout output in command substitution" "[hi]" "$out"
+
+# シェルの中で実行するコマンド置換の中の、子プロセスで実行するコマンド置換でも、組み込みコマンドの出力を受け取れること
+out=$("$SHELL_BIN" --norc -c 'x=$(echo a $(echo b; ls /dev/null)); echo "[$x]"' 2>&1)
+check "nested command substitution" "[a b
+/dev/null]" "$out"
+
+# クオートやエスケープした '$' とワイルドカードは、同じ単語の中にクオートしていない部分があっても展開しないこと
+mkdir "$WORK/glob"
+: > "$WORK/glob/ab"
+: > "$WORK/glob/a*"
+out=$(cd "$WORK/glob" && "$SHELL_BIN" --norc -c 'a=1 b=2; echo '"'"'$a'"'"'$b \$HOME "\$b"; echo "a*"* a\* a*' 2>&1)
+check "quoted \$ and wildcards stay literal" '$a2 $HOME $b
+a* a* a* ab' "$out"
+
+# 大きさとハッシュ値は一致するが中身が壊れたキャッシュ(ここでは最初のルートの添字)は使わず、rcファイルを解析し直すこと
+printf 'export FOO=bar\nf() { echo "f $1"; }\n' > "$WORK/rc2"
+MYSHRC="$WORK/rc2" "$SHELL_BIN" -c true
+printf '\377\377\377\177' | dd of="$WORK/rc2.cache" bs=1 seek=56 conv=notrunc 2>/dev/null
+out=$(MYSHRC="$WORK/rc2" "$SHELL_BIN" -c 'f x; echo $FOO' 2>&1; echo "status $?")
+check "corrupted rc cache is reparsed" "f x
+bar
+status 0" "$out"
+
+# 時間が過ぎて送った KILL で終了したら、-k でなく -s KILL でも 137 を返すこと( GNU timeout と同じ)
+out=$("$SHELL_BIN" --norc -c 'timeout -s KILL 0.2 sleep 5; echo "status $?"' 2>&1)
+check "timeout -s KILL returns 137" "status 137" "$out"
+
+exit $status
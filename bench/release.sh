@@ -0,0 +1,99 @@
+#!/bin/sh
+# 最適化したビルドの効果を、作業用のスクリプト(コーパス)で計測する
+# コーパスは bench/e2e/*.sh と、ここで生成する2つのスクリプト
+#   parse  行ごとに違う制御構文を大量に並べる(実行計画のキャッシュが効かず、字句解析・構文解析が中心になる)
+#   spawn  外部コマンドとパイプラインを繰り返し起動する
+#
+# usage: bench/release.sh train [N]     ./shell でコーパスを N 回実行するだけ(make pgo のプロファイル収集)
+#        bench/release.sh compare [N]   既定・make release・make pgo のビルドを作り、
+#                                       それぞれでコーパスを N 回実行した時間(ms)と、既定のビルドからの速さを表示する
+#                                       (make release-bench。最後に既定のビルドに戻す)
+
+MODE=${1:-compare}
+N=${2:-5}
+DIR=$(cd "$(dirname "$0")" && pwd)
+TOP=$DIR/..
+
+WORK=$(mktemp -d /tmp/mysh-release.XXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+
+# bench/e2e/*.sh が使うファイル
+E2E_DIR=$WORK/files
+export E2E_DIR
+mkdir "$E2E_DIR"
+i=0
+while [ $i -lt 2000 ]; do
+	: > "$E2E_DIR/f$i.txt"
+	i=$((i + 1))
+done
+for d in 0 1 2 3 4 5 6 7 8 9; do
+	mkdir "$E2E_DIR/d$d"
+	i=0
+	while [ $i -lt 100 ]; do
+		: > "$E2E_DIR/d$d/g$i.dat"
+		i=$((i + 1))
+	done
+done
+
+i=0
+while [ $i -lt 5000 ]; do
+	echo "if [ $i -gt \$((x + $i)) ]; then x=$i; elif [ \"\$y\" = v$i ]; then y=w$i; else case \$y in v$i|w$i) z=$i ;; *) z=0 ;; esac; fi"
+	echo "f$i() { a$i=\$1; echo \"\$a$i\" > /dev/null; }; f$i $i"
+	i=$((i + 1))
+done > "$WORK/parse.sh"
+
+cat > "$WORK/spawn.sh" <<'EOF'
+i=0
+while [ $i -lt 500 ]; do
+	/bin/true
+	echo $i | cat > /dev/null
+	i=$((i + 1))
+done
+EOF
+
+CORPUS="$WORK/parse.sh $WORK/spawn.sh $(ls "$DIR"/e2e/*.sh)"
+
+# シェル $1 でコーパスのスクリプト $2 を N 回実行し、合計の時間(ms)を表示する
+run() {
+	start=$(date +%s%N)
+	n=0
+	while [ $n -lt "$N" ]; do
+		"$1" --norc < "$2" > /dev/null 2>&1
+		n=$((n + 1))
+	done
+	end=$(date +%s%N)
+	echo $(( (end - start) / 1000000 ))
+}
+
+if [ "$MODE" = train ]; then
+	for script in $CORPUS; do
+		run "$TOP/shell" "$script" > /dev/null
+	done
+	exit 0
+fi
+
+# 各ビルドを作って、コピーしておく
+for target in default release pgo; do
+	if [ $target = default ]; then
+		rm -f "$TOP"/*.o
+		make -s -C "$TOP" shell > /dev/null || exit 1
+	else
+		make -s -C "$TOP" $target > /dev/null || exit 1
+	fi
+	cp "$TOP/shell" "$WORK/shell-$target"
+done
+rm -f "$TOP"/*.o
+make -s -C "$TOP" shell > /dev/null
+
+echo "# mysh release-bench rev=$(git -C "$DIR" rev-parse --short HEAD 2>/dev/null || echo unknown) N=$N"
+printf "%-10s %10s %10s %10s %9s %9s\n" script default_ms release_ms pgo_ms release pgo
+for script in $CORPUS; do
+	d=$(run "$WORK/shell-default" "$script")
+	r=$(run "$WORK/shell-release" "$script")
+	p=$(run "$WORK/shell-pgo" "$script")
+	echo "$(basename "$script" .sh) $d $r $p"
+done | awk '{
+	printf "%-10s %10d %10d %10d %8.2fx %8.2fx\n", $1, $2, $3, $4, $2 / $3, $2 / $4
+	d += $2; r += $3; p += $4
+}
+END { printf "%-10s %10d %10d %10d %8.2fx %8.2fx\n", "total", d, r, p, d / r, d / p }'
@@ -0,0 +1,45 @@
+#!/bin/sh
+# 外部コマンドの起動にかかる時間を、シェルの常駐メモリの大きさを変えて計測する
+# シェルの変数に SIZE MB の文字列を入れて常駐メモリを大きくしてから /bin/true を N 回起動し、
+# 1回あたりの時間(us)を zygote なし(MYSH_ZYGOTE=0)と zygote あり(MYSH_ZYGOTE=1)で比べる
+#
+# usage: bench/spawn.sh [N] [SIZE MB ...]   (make spawn-bench)
+
+N=${1:-500}
+shift
+SIZES=${*:-0 64 256}
+DIR=$(dirname "$0")
+SHELL_BIN=$DIR/../shell
+
+SCRIPT=$(mktemp /tmp/mysh-spawn.XXXXXX)
+trap 'rm -f "$SCRIPT"' EXIT
+
+printf "%-8s %10s %14s %14s %8s\n" "size_mb" "rss_kb" "fork_us" "zygote_us" "speedup"
+for size in $SIZES; do
+	{
+		if [ "$size" -gt 0 ]; then
+			echo "ballast=\$(head -c $((size * 1024 * 1024)) /dev/zero | tr '\\\\0' x)"
+		fi
+		echo "memstats | grep rss"
+		echo "start=\$(date +%s%N)"
+		echo "i=0"
+		echo "while [ \$i -lt $N ]; do /bin/true; let i=i+1; done"
+		echo "end=\$(date +%s%N)"
+		echo "echo time \$start \$end"
+	} > "$SCRIPT"
+
+	line=$size
+	for mode in 0 1; do
+		MYSH_ZYGOTE=$mode MYSH_PARSEAHEAD=0 "$SHELL_BIN" --norc < "$SCRIPT" 2>/dev/null \
+			| sed 's/^\(swoorup % \)*//' > "$SCRIPT.out"
+		rss=$(awk '$1 == "rss" { print $2 }' "$SCRIPT.out")
+		us=$(awk -v n=$N '$1 == "time" { printf "%.1f", ($3 - $2) / n / 1000 }' "$SCRIPT.out")
+		if [ $mode -eq 0 ]; then
+			fork_us=$us
+			line="$line $rss"
+		fi
+		line="$line $us"
+	done
+	rm -f "$SCRIPT.out"
+	echo $line | awk '{ printf "%-8s %10s %14s %14s %7.2fx\n", $1, $2, $3, $4, $3 / $4 }'
+done
@@ -0,0 +1,37 @@
+#!/bin/sh
+# mysh の起動時間を計測する
+# 大きな rcファイルを生成し、rcなし / キャッシュなし / キャッシュあり のそれぞれで
+# 起動して exit するまでの時間を N 回計測し、1回あたりの平均(ms)を表示する
+#
+# usage: bench/startup.sh [shell] [N] [rc lines]
+
+SHELL_BIN=${1:-./shell}
+N=${2:-200}
+LINES=${3:-5000}
+
+RC=$(mktemp /tmp/myshrc.XXXXXX)
+trap 'rm -f "$RC" "$RC.cache"' EXIT
+
+i=0
+while [ $i -lt "$LINES" ]; do
+	echo "prompt \"mysh$i % \"; cd . ; prompt \"mysh % \""
+	i=$((i + 1))
+done > "$RC"
+
+run() {
+	label=$1; shift
+	start=$(date +%s%N)
+	i=0
+	while [ $i -lt "$N" ]; do
+		echo exit | env "$@" "$SHELL_BIN" > /dev/null
+		i=$((i + 1))
+	done
+	end=$(date +%s%N)
+	echo "$label" "$(( (end - start) / N / 1000 ))" | awk '{ printf "%-12s %8.3f ms/start\n", $1, $2 / 1000 }'
+}
+
+echo "# $N starts, rc file of $LINES lines"
+run norc     MYSHRC=/nonexistent
+run nocache  MYSHRC="$RC" MYSH_RCCACHE=0
+MYSHRC="$RC" "$SHELL_BIN" < /dev/null > /dev/null 2>&1 # 1回目の起動でキャッシュを作る
+run cache    MYSHRC="$RC"
@@ -0,0 +1,327 @@
+#include "cmdstats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+** コマンドごとの実行時間の統計 ( stats [-j] [-r] )
+** コマンド名ごとに、実行回数・合計・最小・最大の時間と、HDR 形式のヒストグラムを記録する
+**   組み込みコマンド: シェル自身で実行した前後の時間
+**   外部コマンド(と、子プロセスで実行した組み込みコマンド): fork する直前から、wait4() で回収するまでの時間
+**     バックグラウンドのジョブは、プロンプトの前に回収した時点までになる
+** コマンドひとつの記録は、時計を2回読むのとハッシュ表を1回引くだけにしている
+**
+** MYSH_STATS=path が設定されていれば、シェルの終了時に JSON を path に書き出す
+*/
+
+/*
+** ヒストグラムは、2 のべき乗ごとの区間をさらに 16 等分した区間で数える(誤差は 1/16 以内)
+** 16ns 未満は 1ns ごと。64 ビットのナノ秒をすべて表せる
+*/
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*
+** CmdStat:
+** ひとつのコマンド名の統計
+*/
+typedef struct CmdStat
+{
+	char* name;
+	uint64_t count;
+	uint64_t total; /* ナノ秒 */
+	uint64_t min;
+	uint64_t max;
+	uint32_t hist[HIST_BUCKETS];
+} CmdStat;
+
+/*
+** Pending:
+** 起動して、まだ回収していない子プロセス
+*/
+typedef struct Pending
+{
+	pid_t pid;
+	CmdStat* stat;
+	uint64_t start;
+} Pending;
+
+static CmdStat** table = NULL; /* コマンド名のハッシュ表(オープンアドレス法) */
+static size_t table_size = 0; /* 2 のべき乗 */
+static size_t table_used = 0;
+
+static Pending* pending = NULL;
+static int npending = 0;
+static int pending_size = 0;
+
+static pid_t owner = 0; /* 統計を持っているシェルの pid。forkした子プロセスは終了時に書き出さない */
+
+uint64_t cmdstats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t hash(const char* s)
+{
+	size_t h = 5381;
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+/* ナノ秒の値を入れるヒストグラムの区間 */
+static int hist_index(uint64_t v)
+{
+	if (v < HIST_SUB)
+		return v;
+	int e = 63 - __builtin_clzll(v); /* 最上位ビットの位置 (>= HIST_SUB_BITS) */
+	int sub = (v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1);
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB + sub;
+}
+
+/* 区間に入る値の最大値 */
+static uint64_t hist_upper(int i)
+{
+	if (i < HIST_SUB)
+		return i;
+	int e = i / HIST_SUB + HIST_SUB_BITS - 1;
+	uint64_t low = (uint64_t)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+	return low + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+/* コマンド名の統計を探す。無ければ作る */
+static CmdStat* lookup(const char* name)
+{
+	if (table_used * 2 >= table_size) { /* 半分埋まったら広げる */
+		size_t old_size = table_size;
+		CmdStat** old = table;
+		size_t i;
+		table_size = table_size ? table_size * 2 : 64;
+		table = calloc(table_size, sizeof(CmdStat*));
+		for (i = 0; i < old_size; i++) {
+			if (old[i] != NULL) {
+				size_t j = hash(old[i]->name) & (table_size - 1);
+				while (table[j] != NULL)
+					j = (j + 1) & (table_size - 1);
+				table[j] = old[i];
+			}
+		}
+		free(old);
+	}
+
+	size_t i = hash(name) & (table_size - 1);
+	while (table[i] != NULL) {
+		if (strcmp(table[i]->name, name) == 0)
+			return table[i];
+		i = (i + 1) & (table_size - 1);
+	}
+	CmdStat* stat = calloc(1, sizeof(CmdStat));
+	stat->name = strdup(name);
+	table[i] = stat;
+	table_used++;
+	return stat;
+}
+
+static void add(CmdStat* stat, uint64_t ns)
+{
+	if (stat->count == 0 || ns < stat->min)
+		stat->min = ns;
+	if (ns > stat->max)
+		stat->max = ns;
+	stat->count++;
+	stat->total += ns;
+	stat->hist[hist_index(ns)]++;
+}
+
+/*
+** cmdstats_record():
+** シェル自身で実行したコマンドの時間を記録する
+*/
+void cmdstats_record(const char* name, uint64_t ns)
+{
+	add(lookup(name), ns);
+}
+
+/*
+** cmdstats_spawned():
+** 子プロセスで起動したコマンドを、回収するまで覚えておく。start は起動する直前の時刻
+*/
+void cmdstats_spawned(const char* name, pid_t pid, uint64_t start)
+{
+	if (npending == pending_size) {
+		pending_size = pending_size ? pending_size * 2 : 16;
+		pending = realloc(pending, sizeof(Pending) * pending_size);
+	}
+	pending[npending].pid = pid;
+	pending[npending].stat = lookup(name);
+	pending[npending].start = start;
+	npending++;
+}
+
+/*
+** cmdstats_reaped():
+** 子プロセスを回収したときに呼び出し、起動してからの時間を記録する
+*/
+void cmdstats_reaped(pid_t pid)
+{
+	int i;
+	for (i = npending - 1; i >= 0; i--) {
+		if (pending[i].pid == pid) {
+			add(pending[i].stat, cmdstats_now() - pending[i].start);
+			pending[i] = pending[--npending];
+			return;
+		}
+	}
+}
+
+/* 記録を消す。実行中のコマンドは、回収したときに改めて記録する */
+void cmdstats_reset()
+{
+	size_t i;
+	for (i = 0; i < table_size; i++) {
+		if (table[i] != NULL) {
+			char* name = table[i]->name;
+			memset(table[i], 0, sizeof(CmdStat));
+			table[i]->name = name;
+		}
+	}
+}
+
+/* ヒストグラムから、p (0..1) の位置の値を求める(区間の最大値。実際の最大値は超えない) */
+static uint64_t percentile(const CmdStat* stat, double p)
+{
+	uint64_t rank = (uint64_t)(p * stat->count + 0.5);
+	uint64_t seen = 0;
+	int i;
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += stat->hist[i];
+		if (seen >= rank)
+			return hist_upper(i) < stat->max ? hist_upper(i) : stat->max;
+	}
+	return stat->max;
+}
+
+/* 表示用に、時間を読みやすい単位にする */
+static const char* format_time(char* buf, size_t size, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%lluns", (unsigned long long)ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, size, "%.2fs", ns / 1e9);
+	return buf;
+}
+
+/* 合計時間の長い順 */
+static int compare_total(const void* a, const void* b)
+{
+	const CmdStat* x = *(CmdStat* const*)a;
+	const CmdStat* y = *(CmdStat* const*)b;
+	if (x->total != y->total)
+		return x->total < y->total ? 1 : -1;
+	return strcmp(x->name, y->name);
+}
+
+static void print_json_string(FILE* fp, const char* s)
+{
+	fputc('"', fp);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(fp, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(fp, "\\u%04x", *s);
+		else
+			fputc(*s, fp);
+	}
+	fputc('"', fp);
+}
+
+/*
+** cmdstats_print():
+** 記録したコマンドを、合計時間の長い順に表示する
+** json であれば、ヒストグラムの空でない区間(区間の最大値と回数)も含めて JSON で出力する
+*/
+void cmdstats_print(FILE* fp, bool json)
+{
+	CmdStat** list = malloc(sizeof(CmdStat*) * (table_used + 1));
+	size_t i, n = 0;
+	int j;
+	for (i = 0; i < table_size; i++)
+		if (table[i] != NULL && table[i]->count > 0)
+			list[n++] = table[i];
+	qsort(list, n, sizeof(CmdStat*), compare_total);
+
+	if (json)
+		fprintf(fp, "{\"commands\":[");
+	else
+		fprintf(fp, "%-16s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+			"command", "count", "total", "mean", "min", "p50", "p90", "p99", "max");
+	for (i = 0; i < n; i++) {
+		CmdStat* s = list[i];
+		uint64_t values[7] = { s->total, s->total / s->count, s->min,
+			percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99), s->max };
+
+		if (!json) {
+			char buf[7][16];
+			for (j = 0; j < 7; j++)
+				format_time(buf[j], sizeof(buf[j]), values[j]);
+			fprintf(fp, "%-16s %8llu %10s %10s %10s %10s %10s %10s %10s\n", s->name, (unsigned long long)s->count,
+				buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6]);
+			continue;
+		}
+
+		fprintf(fp, "%s{\"name\":", i > 0 ? "," : "");
+		print_json_string(fp, s->name);
+		fprintf(fp, ",\"count\":%llu,\"total_ns\":%llu,\"mean_ns\":%llu,\"min_ns\":%llu,"
+			"\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,\"histogram\":[",
+			(unsigned long long)s->count, (unsigned long long)values[0], (unsigned long long)values[1],
+			(unsigned long long)values[2], (unsigned long long)values[3], (unsigned long long)values[4],
+			(unsigned long long)values[5], (unsigned long long)values[6]);
+		bool first = true;
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			if (s->hist[j] == 0)
+				continue;
+			fprintf(fp, "%s[%llu,%u]", first ? "" : ",", (unsigned long long)hist_upper(j), s->hist[j]);
+			first = false;
+		}
+		fprintf(fp, "]}");
+	}
+	if (json)
+		fprintf(fp, "]}\n");
+	free(list);
+}
+
+/* MYSH_STATS=path の場合に、終了時に JSON を書き出す */
+static void dump_at_exit()
+{
+	const char* path = getenv("MYSH_STATS");
+	if (getpid() != owner || path == NULL)
+		return;
+	FILE* fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror(path);
+		return;
+	}
+	cmdstats_print(fp, true);
+	fclose(fp);
+}
+
+/*
+** cmdstats_init():
+** シェルの起動時に呼び出す。MYSH_STATS が設定されていれば、終了時に書き出す
+*/
+void cmdstats_init()
+{
+	owner = getpid();
+	if (getenv("MYSH_STATS") != NULL)
+		atexit(dump_at_exit);
+}
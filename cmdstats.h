@@ -0,0 +1,17 @@
+#ifndef CMDSTATS_H
+#define CMDSTATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+void cmdstats_init();
+uint64_t cmdstats_now();
+void cmdstats_record(const char* name, uint64_t ns);
+void cmdstats_spawned(const char* name, pid_t pid, uint64_t start);
+void cmdstats_reaped(pid_t pid);
+void cmdstats_reset();
+void cmdstats_print(FILE* fp, bool json);
+
+#endif
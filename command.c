@@ -1,4 +1,15 @@
 #include "command.h"
+#include "script.h"
+#include "var.h"
+#include "function.h"
+#include "arith.h"
+#include "subst.h"
+#include "memstats.h"
+#include "zygote.h"
+#include "cmdstats.h"
+#include "batch.h"
+#include "timeout.h"
+#include "stagethread.h"
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
@@ -9,9 +20,12 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <errno.h>
 
 char* prompt = NULL; /* 入力待ち受け時に表示する文字列の領域のポインタ */
 bool signalset = false;
+static bool forked_child = false; /* このプロセスが、コマンドを実行するためにforkした子プロセスか */
+static int extra_fds = 0; /* リダイレクトで開いたままにしている 3 番以降のディスクリプタの数( exec で切り替えたものは戻さない) */
 void   (*SIGINT_handler)(int);
 
 /* 受け取った文字列をpromptに代入して、画面上に表示する準備をする */
@@ -58,28 +72,34 @@ void ignore_signal_for_shell()
 */
 void restore_sigint_in_child()
 {
+	forked_child = true; /* どの子プロセスも最初にここを通る */
 	if (signalset)
 		signal(SIGINT, SIGINT_handler);
 }
 
 // built-in command cd
-void execute_cd(CommandInternal* cmdinternal)
+int execute_cd(CommandInternal* cmdinternal)
 {
     if (cmdinternal->argc == 1) {
 		struct passwd *pw = getpwuid(getuid());
 		const char *homedir = pw->pw_dir;
 		chdir(homedir);
 	}
-    else if (cmdinternal->argc > 2)
+    else if (cmdinternal->argc > 2) {
         printf("cd: Too many arguments\n");
+        return 1;
+    }
     else {
-        if (chdir(cmdinternal->argv[1]) != 0)
+        if (chdir(cmdinternal->argv[1]) != 0) {
             perror(cmdinternal->argv[1]);
+            return 1;
+        }
     }
+    return 0;
 }
 
 // built-in command prompt /* 組み込みコマンド prompt */
-void execute_prompt(CommandInternal* cmdinternal)
+int execute_prompt(CommandInternal* cmdinternal)
 {
     if (cmdinternal->argc == 1)
         printf("prompt: Please specify the prompt string\n");
@@ -87,224 +107,986 @@ void execute_prompt(CommandInternal* cmdinternal)
         printf("prompt: Too many arguments\n");
     else {
         set_prompt(cmdinternal->argv[1]);
+        return 0;
     }
+    return 1;
+}
+
+// built-in command source /* 組み込みコマンド source ... ファイルの内容を現在のシェルで実行する */
+int execute_source(CommandInternal* cmdinternal)
+{
+    if (cmdinternal->argc == 1)
+        printf("source: Please specify the file name\n");
+    else if (cmdinternal->argc > 2)
+        printf("source: Too many arguments\n");
+    else if (source_file(cmdinternal->argv[1]) == 0)
+        return var_status(); /* 最後に実行したコマンドの終了ステータス */
+    return 1;
 }
 
 // built-in command pwd /* 組み込みコマンド pwd */
-void execute_pwd(CommandInternal* cmdinternal)
+int execute_pwd(CommandInternal* cmdinternal)
 {
-    pid_t pid;
-    if((pid = fork()) == 0 ) {
-        if (cmdinternal->redirect_out) {
-            int fd = open(cmdinternal->redirect_out, O_WRONLY | O_CREAT | O_TRUNC,
-                          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-            if (fd == -1) {
-                perror(cmdinternal->redirect_out);
-                exit(1);
+    (void)cmdinternal;
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd() error");
+        return 1;
+    }
+    fprintf(stage_thread_stdout(), "%s\n", cwd);
+    return 0;
+}
+
+// built-in command echo /* 組み込みコマンド echo [-n] 文字列... */
+int execute_echo(CommandInternal* cmdinternal)
+{
+    FILE* out = stage_thread_stdout(); /* パイプラインのステージをスレッドで実行していれば、そのパイプ */
+    bool newline = true;
+    int i = 1;
+
+    if (cmdinternal->argc > 1 && strcmp(cmdinternal->argv[1], "-n") == 0) {
+        newline = false;
+        i++;
+    }
+    for (; i < cmdinternal->argc; i++) {
+        fputs(cmdinternal->argv[i], out);
+        if (i + 1 < cmdinternal->argc)
+            putc(' ', out);
+    }
+    if (newline)
+        putc('\n', out);
+    return 0;
+}
+
+// built-in command exit /* 組み込みコマンド exit [n] ... 省略時は直前の終了ステータスで終了する */
+int execute_exit(CommandInternal* cmdinternal)
+{
+    int status = cmdinternal->argc > 1 ? atoi(cmdinternal->argv[1]) : var_status();
+    if (forked_child) { /* 子プロセスでは exit() を使わない。親と共有している標準入力の読み込み位置が巻き戻されてしまうため */
+        fflush(stdout);
+        _exit(status);
+    }
+    exit(status);
+    return 0;
+}
+
+// built-in command true, : /* 何もせずに成功する */
+int execute_true(CommandInternal* cmdinternal)
+{
+    (void)cmdinternal;
+    return 0;
+}
+
+// built-in command false /* 何もせずに失敗する */
+int execute_false(CommandInternal* cmdinternal)
+{
+    (void)cmdinternal;
+    return 1;
+}
+
+/* test の数値比較に使う整数を読み取る。整数でなければ false */
+static bool test_number(const char* s, long* value)
+{
+    char* end;
+    errno = 0;
+    *value = strtol(s, &end, 10);
+    return errno == 0 && end != s && *end == 0;
+}
+
+/*
+** test_expr():
+** test の式を評価する。真なら 0、偽なら 1、式が正しくなければ 2 を返す
+** 対応している式:
+**   ! <式>   <文字列>   -n / -z <文字列>   -e / -f / -d / -r / -w / -x / -s <ファイル>
+**   <文字列> = / != <文字列>   <整数> -eq / -ne / -lt / -le / -gt / -ge <整数>
+*/
+static int test_expr(int argc, char** argv)
+{
+    if (argc > 0 && strcmp(argv[0], "!") == 0) {
+        int result = test_expr(argc - 1, argv + 1);
+        return result == 2 ? 2 : !result;
+    }
+
+    if (argc == 0)
+        return 1;
+    if (argc == 1)
+        return argv[0][0] == 0;
+
+    if (argc == 2) {
+        const char* op = argv[0];
+        const char* arg = argv[1];
+        struct stat st;
+
+        if (strcmp(op, "-n") == 0)
+            return arg[0] == 0;
+        if (strcmp(op, "-z") == 0)
+            return arg[0] != 0;
+        if (strcmp(op, "-r") == 0)
+            return access(arg, R_OK) != 0;
+        if (strcmp(op, "-w") == 0)
+            return access(arg, W_OK) != 0;
+        if (strcmp(op, "-x") == 0)
+            return access(arg, X_OK) != 0;
+        if (strlen(op) == 2 && op[0] == '-' && strchr("efds", op[1]) != NULL) {
+            if (stat(arg, &st) != 0)
+                return 1;
+            switch (op[1])
+            {
+            case 'f': return !S_ISREG(st.st_mode);
+            case 'd': return !S_ISDIR(st.st_mode);
+            case 's': return st.st_size == 0;
+            default: return 0;
             }
+        }
+    }
 
-            dup2(fd, STDOUT_FILENO);
+    if (argc == 3) {
+        const char* op = argv[1];
+        long a, b;
+
+        if (strcmp(op, "=") == 0)
+            return strcmp(argv[0], argv[2]) != 0;
+        if (strcmp(op, "!=") == 0)
+            return strcmp(argv[0], argv[2]) == 0;
+
+        static const char* ops[] = { "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+        int i;
+        for (i = 0; i < 6; i++) {
+            if (strcmp(op, ops[i]) != 0)
+                continue;
+            if (!test_number(argv[0], &a) || !test_number(argv[2], &b)) {
+                fprintf(stage_thread_stdout(), "test: integer expression expected\n");
+                return 2;
+            }
+            switch (i)
+            {
+            case 0: return !(a == b);
+            case 1: return !(a != b);
+            case 2: return !(a < b);
+            case 3: return !(a <= b);
+            case 4: return !(a > b);
+            default: return !(a >= b);
+            }
         }
+    }
 
-        if (cmdinternal->stdout_pipe)
-			dup2(cmdinternal->pipe_write, STDOUT_FILENO);
+    fprintf(stage_thread_stdout(), "test: unknown expression\n");
+    return 2;
+}
 
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != NULL)
-            fprintf(stdout, "%s\n", cwd);
-        else
-            perror("getcwd() error");
+// built-in command test, [ /* 組み込みコマンド test ... 条件式を評価する。ループの条件でforkしないように組み込みにしている */
+int execute_test(CommandInternal* cmdinternal)
+{
+    int argc = cmdinternal->argc - 1;
+    if (strcmp(cmdinternal->argv[0], "[") == 0) {
+        if (argc == 0 || strcmp(cmdinternal->argv[argc], "]") != 0) {
+            fprintf(stage_thread_stdout(), "[: missing ']'\n");
+            return 2;
+        }
+        argc--;
+    }
+    return test_expr(argc, cmdinternal->argv + 1);
+}
 
-        exit(0);
+// built-in command return /* 組み込みコマンド return [n] ... 実行中の関数から戻る */
+int execute_return(CommandInternal* cmdinternal)
+{
+    if (!function_request_return()) {
+        printf("return: can only return from a function\n");
+        return 1;
     }
-    else if (pid < 0) {
-        perror("fork");
+    return cmdinternal->argc > 1 ? atoi(cmdinternal->argv[1]) : var_status();
+}
+
+// built-in command export /* 組み込みコマンド export name[=value] ... シェル変数を環境変数にする */
+int execute_export(CommandInternal* cmdinternal)
+{
+    int i;
+    for (i = 1; i < cmdinternal->argc; i++) {
+        char* arg = cmdinternal->argv[i];
+        if (var_assign(arg)) {
+            /* argv は抽象構文木の文字列テーブル(キャッシュの rcファイルでは mmap した領域)を指すので、書き換えない */
+            const char* eq = strchr(arg, '=');
+            char* name = strndup(arg, eq - arg);
+            setenv(name, eq + 1, 1);
+            free(name);
+        }
+        else if (var_is_name(arg)) {
+            const char* value = var_get(arg);
+            if (value != NULL)
+                setenv(arg, value, 1);
+        }
+        else {
+            printf("export: '%s': not a valid identifier\n", arg);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// built-in command let /* 組み込みコマンド let 式 ... ((式)) もこれになる。最後の式の値が0なら 1 を返す */
+int execute_let(CommandInternal* cmdinternal)
+{
+    int64_t value = 0;
+    int i;
+
+    if (cmdinternal->argc < 2) {
+        printf("let: expression expected\n");
+        return 1;
+    }
+    for (i = 1; i < cmdinternal->argc; i++)
+        if (!arith_eval(cmdinternal->argv[i], &value))
+            return 1;
+    return value != 0 ? 0 : 1;
+}
+
+/* jobs -l で、ジョブの資源の使用量を表示する */
+static void print_job_usage(Job* job)
+{
+    char buf[256];
+    int i;
+
+    printf("\tpids");
+    for (i = 0; i < job->npids; i++)
+        printf(" %d", (int)job->pids[i]);
+    printf("  (finished: user %ld.%03lds sys %ld.%03lds maxrss %ldKiB)\n",
+           (long)job->usage.ru_utime.tv_sec, (long)job->usage.ru_utime.tv_usec / 1000,
+           (long)job->usage.ru_stime.tv_sec, (long)job->usage.ru_stime.tv_usec / 1000,
+           job->usage.ru_maxrss);
+
+    if (job->cgroup == NULL)
         return;
+    printf("\tcgroup %s\n", job->cgroup);
+    if (job_cgroup_read(job, "cpu.stat", buf, sizeof(buf)) != NULL)
+        printf("\t%s", buf); /* usage_usec N */
+    if (job_cgroup_read(job, "memory.current", buf, sizeof(buf)) != NULL)
+        printf("  memory.current %s", buf);
+    if (job_cgroup_read(job, "cpu.max", buf, sizeof(buf)) != NULL)
+        printf("  cpu.max %s", buf);
+    if (job_cgroup_read(job, "memory.max", buf, sizeof(buf)) != NULL)
+        printf("  memory.max %s", buf);
+    printf("\n");
+}
+
+// built-in command jobs /* 組み込みコマンド jobs [-l] ... バックグラウンドのジョブの一覧。-l で資源の使用量も表示する */
+int execute_jobs(CommandInternal* cmdinternal)
+{
+    bool verbose = cmdinternal->argc > 1 && strcmp(cmdinternal->argv[1], "-l") == 0;
+    Job* job;
+
+    job_reap(true); /* 終了したジョブは、一覧を表示する前に回収しておく */
+    for (job = job_list(); job != NULL; job = job->next) {
+        printf("[%d] Running\t%s\n", job->id, job->command != NULL ? job->command : "");
+        if (verbose)
+            print_job_usage(job);
     }
-    else
-		while (waitpid(pid, NULL, 0) <= 0);
+    return 0;
+}
 
-    return;
+/* limit の mem= の値を読み取る。K / M / G の接尾辞を使える */
+static bool parse_bytes(const char* s, char* out, size_t size)
+{
+    char* end;
+    unsigned long long value = strtoull(s, &end, 10);
+    if (end == s)
+        return false;
+    switch (*end)
+    {
+    case 'G': case 'g': value <<= 10; /* fall through */
+    case 'M': case 'm': value <<= 10; /* fall through */
+    case 'K': case 'k': value <<= 10; end++; break;
+    }
+    if (*end != 0)
+        return false;
+    snprintf(out, size, "%llu", value);
+    return true;
 }
 
-void zombie_process_handler(int signum)
+/* limit の cpu= の値(CPU 1個分を 100% とした割合)を、cpu.max の "quota period" にする */
+static bool parse_cpu(const char* s, char* out, size_t size)
 {
-    int more = 1;        // more zombies to claim
-    pid_t pid;           // pid of the zombie
-    int status;          // termination status of the zombie
+    char* end;
+    double percent = strtod(s, &end);
+    if (end == s || percent <= 0 || (*end != 0 && strcmp(end, "%") != 0))
+        return false;
+    snprintf(out, size, "%ld 100000", (long)(percent * 1000)); /* 周期 100ms のうち使ってよい時間(μs) */
+    return true;
+}
 
-    while (more) {
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid > 0)
-            printf("\n%d terminated\n", pid);
-        if (pid<=0)
-            more = 0;
+/*
+** limit [%ジョブ] [cpu=割合%|max] [mem=大きさ|max]
+** バックグラウンドのジョブの cgroup に、cpu.max と memory.max を設定する
+** ジョブを省略すると、最後に起動したジョブ。設定を省略すると、現在の値を表示する
+*/
+int execute_limit(CommandInternal* cmdinternal)
+{
+    int i = 1;
+    const char* spec = NULL;
+    char value[64], buf[64];
+
+    if (i < cmdinternal->argc && cmdinternal->argv[i][0] == '%')
+        spec = cmdinternal->argv[i++];
+
+    job_reap(true);
+    Job* job = job_find(spec);
+    if (job == NULL) {
+        printf("limit: %s: no such job\n", spec != NULL ? spec : "current");
+        return 1;
+    }
+    if (job->cgroup == NULL) {
+        printf("limit: %%%d: no cgroup for this job (cgroup v2 is not available)\n", job->id);
+        return 1;
     }
+
+    if (i == cmdinternal->argc) {
+        printf("[%d] cpu.max %s", job->id, job_cgroup_read(job, "cpu.max", buf, sizeof(buf)) ? buf : "(unavailable)");
+        printf("  memory.max %s\n", job_cgroup_read(job, "memory.max", buf, sizeof(buf)) ? buf : "(unavailable)");
+        return 0;
+    }
+
+    for (; i < cmdinternal->argc; i++) {
+        const char* arg = cmdinternal->argv[i];
+        const char* file;
+        bool ok;
+        if (strncmp(arg, "cpu=", 4) == 0) {
+            file = "cpu.max";
+            ok = strcmp(arg + 4, "max") == 0 ? (strcpy(value, "max"), true) : parse_cpu(arg + 4, value, sizeof(value));
+        }
+        else if (strncmp(arg, "mem=", 4) == 0) {
+            file = "memory.max";
+            ok = strcmp(arg + 4, "max") == 0 ? (strcpy(value, "max"), true) : parse_bytes(arg + 4, value, sizeof(value));
+        }
+        else {
+            printf("limit: usage: limit [%%job] [cpu=percent|max] [mem=size|max]\n");
+            return 2;
+        }
+        if (!ok) {
+            printf("limit: %s: invalid value\n", arg);
+            return 2;
+        }
+        if (!job_cgroup_write(job, file, value)) {
+            if (errno == ENOENT) /* 親の cgroup でコントローラーが有効になっていない */
+                printf("limit: %s: controller is not enabled for job cgroups\n", file);
+            else
+                printf("limit: %s: %s\n", file, strerror(errno));
+            return 1;
+        }
+    }
+    return 0;
 }
 
-void execute_command_internal(CommandInternal* cmdinternal)
+/*
+** sched [-j] [-c CPU一覧 | -a] [-n nice値] [-i クラス[:レベル]] コマンド ...
+** 接頭辞としての sched は execute_plan() が取り除くので、ここに来るのはコマンドを付けない場合
+** 以降のジョブの既定値を設定する( -r で消す、引数が無ければ表示する)
+*/
+int execute_sched(CommandInternal* cmdinternal)
 {
+    SchedHint hint;
 
-    if (cmdinternal->argc < 0)
-        return;
+    if (cmdinternal->argc == 1) {
+        sched_print_defaults();
+        return 0;
+    }
+    if (cmdinternal->argc == 2 && strcmp(cmdinternal->argv[1], "-r") == 0) {
+        sched_set_defaults(NULL);
+        return 0;
+    }
 
-    // check for built-in commands /* 組み込みコマンドの実行 */
-    if (strcmp(cmdinternal->argv[0], "cd") == 0) {
-        execute_cd(cmdinternal);
-        return;
+    int n = sched_parse(cmdinternal->argc, cmdinternal->argv, &hint);
+    if (n < 0 || (hint.flags & SCHED_HINT_CPUS)) {
+        printf("usage: sched [-j] [-c cpus | -a] [-n nice] [-i idle|be[:level]|rt[:level]] [--] command ...\n");
+        printf("       sched [-a] [-n nice] [-i class[:level]]   (defaults: spread pipelines, background priority)\n");
+        printf("       sched -r\n");
+        return 2;
     }
-    else if (strcmp(cmdinternal->argv[0], "prompt") == 0) {
-		execute_prompt(cmdinternal);
-        return;
-	}
-    else if (strcmp(cmdinternal->argv[0], "pwd") == 0)
-        return execute_pwd(cmdinternal);
-    else if(strcmp(cmdinternal->argv[0], "exit") == 0) {
-		exit(0);
-		return;
-	}
+    sched_set_defaults(&hint);
+    return 0;
+}
 
-    pid_t pid;
-    if((pid = fork()) == 0 ) {
-		// restore the signals in the child process
-        /* -> 子プロセスのシグナルを復元する */
-		restore_sigint_in_child();
-		
-		// store the stdout file desc
-        /* 出力先のファイルディスクリプタを格納 */
-        int stdoutfd = dup(STDOUT_FILENO);
-
-		// for bckgrnd jobs redirect stdin from /dev/null
-        /* -> バックグラウンド処理のジョブの場合、標準入力をdev/null からリダイレクトする */
-        if (cmdinternal->asynchrnous) {
-            int fd = open("/dev/null", O_RDWR);
-            if (fd == -1) {
-                perror("/dev/null");
-                exit(1);
-            }
-            dup2(fd, STDIN_FILENO);
+/*
+** stats [-j] [-r]
+** コマンド名ごとの実行回数と実行時間(合計・平均・最小・パーセンタイル・最大)を、合計時間の長い順に表示する
+** -j は JSON(ヒストグラムを含む)、-r は表示した後に記録を消す
+** (パイプラインの中で実行した場合は子プロセスで実行するので、-r はシェルの記録を消さない)
+*/
+int execute_stats(CommandInternal* cmdinternal)
+{
+    bool json = false, reset = false;
+    int i;
+
+    for (i = 1; i < cmdinternal->argc; i++) {
+        if (strcmp(cmdinternal->argv[i], "-j") == 0)
+            json = true;
+        else if (strcmp(cmdinternal->argv[i], "-r") == 0)
+            reset = true;
+        else {
+            fprintf(stderr, "usage: stats [-j] [-r]\n");
+            return 2;
         }
+    }
+    cmdstats_print(stdout, json);
+    if (reset)
+        cmdstats_reset();
+    return 0;
+}
 
-        // redirect stdin from file if specified
-        /* -> ファイルディスクリプタが指定されていた場合、標準入力をそのファイルからリダイレクトする */
-        if (cmdinternal->redirect_in) {
-            int fd = open(cmdinternal->redirect_in, O_RDONLY);
-            if (fd == -1) {
-                perror(cmdinternal->redirect_in);
-                exit(1);
-            }
+// built-in command memstats /* 組み込みコマンド memstats ... 字句解析・構文解析・実行計画が確保中の領域と、常駐メモリを表示する */
+int execute_memstats(CommandInternal* cmdinternal)
+{
+    (void)cmdinternal;
+    mem_print(stdout);
+    return 0;
+}
 
-            dup2(fd, STDIN_FILENO);
+/*
+** exec [コマンド [引数 ...]] [リダイレクト ...]
+** コマンドを付けなければ、リダイレクトをシェル自身に適用したままにする
+** (exec 3>> log のように開いたディスクリプタは、以降に起動するコマンドに引き継がれる)
+** コマンドを付けた場合は、リダイレクトを適用してからシェルをそのコマンドに置き換える
+*/
+int execute_exec(CommandInternal* cmdinternal)
+{
+    if (!apply_redirects(cmdinternal->redirects, cmdinternal->nredirects, NULL))
+        return 1;
+    if (cmdinternal->argc < 2)
+        return 0;
+
+    int i;
+    for (i = 0; i < cmdinternal->nassigns; i++)
+        putenv(cmdinternal->assigns[i]);
+    fflush(stdout);
+    zygote_stop(); /* 置き換わった後に、知らない子プロセスとして残らないようにする */
+    job_cgroup_release(); /* atexit() の後片付けは exec では行われない */
+    execvp(cmdinternal->argv[1], cmdinternal->argv + 1);
+    printf("Command not found: \'%s\'\n", cmdinternal->argv[1]);
+    return 127;
+}
+
+/*
+** 組み込みコマンドの一覧
+** シェル自身のプロセスで実行し、関数の戻り値を終了ステータスにする
+** BUILTIN_PURE のコマンドは、出力するだけでシェルの状態を変えない
+** (パイプやリダイレクトがある場合は、出力先を切り替えるために子プロセスで実行する)
+*/
+typedef struct Builtin
+{
+    const char* name;
+    int (*func)(CommandInternal* cmdinternal);
+    int flags;
+} Builtin;
+
+static const Builtin builtins[] = {
+    { "cd", execute_cd, 0 },
+    { "prompt", execute_prompt, 0 },
+    { "source", execute_source, 0 },
+    { ".", execute_source, 0 },
+    { "pwd", execute_pwd, BUILTIN_PURE | BUILTIN_THREAD },
+    { "echo", execute_echo, BUILTIN_PURE | BUILTIN_THREAD },
+    { "exit", execute_exit, 0 },
+    { "true", execute_true, BUILTIN_PURE | BUILTIN_THREAD },
+    { ":", execute_true, BUILTIN_PURE | BUILTIN_THREAD },
+    { "false", execute_false, BUILTIN_PURE | BUILTIN_THREAD },
+    { "test", execute_test, BUILTIN_PURE | BUILTIN_THREAD },
+    { "[", execute_test, BUILTIN_PURE | BUILTIN_THREAD },
+    { "export", execute_export, 0 },
+    { "return", execute_return, BUILTIN_RETURN },
+    { "let", execute_let, 0 },
+    { "jobs", execute_jobs, 0 },
+    { "limit", execute_limit, 0 },
+    { "sched", execute_sched, 0 },
+    { "memstats", execute_memstats, BUILTIN_PURE },
+    { "stats", execute_stats, BUILTIN_PURE },
+    { "batch", execute_batch, BUILTIN_PURE | BUILTIN_SPAWN },
+    { "timeout", execute_timeout, BUILTIN_PURE | BUILTIN_SPAWN },
+    { "exec", execute_exec, BUILTIN_REDIRECT },
+    { NULL, NULL, 0 }
+};
+
+static const Builtin* find_builtin(const char* name)
+{
+    const Builtin* b;
+    for (b = builtins; b->name != NULL; b++)
+        if (strcmp(b->name, name) == 0)
+            return b;
+    return NULL;
+}
+
+/*
+** builtin_flags():
+** 組み込みコマンドの性質(BUILTIN_PURE など)を返す。組み込みコマンドでなければ -1
+*/
+int builtin_flags(const char* name)
+{
+    const Builtin* b = find_builtin(name);
+    return b != NULL ? b->flags : -1;
+}
+
+/*
+** prepare_child():
+** forkした子プロセスで、コマンドを実行する前にシグナル・cgroup・環境変数・ディスクリプタ・CPU の割り当てを設定する
+** zygote から起動する子プロセスも、ここを通る
+** 返り値は元の標準出力の複製で、コマンドが見つからない場合のメッセージに使う
+*/
+int prepare_child(CommandInternal* cmdinternal)
+{
+	// restore the signals in the child process
+    /* -> 子プロセスのシグナルを復元する */
+	restore_sigint_in_child();
+    job_enter_cgroup(cmdinternal->job);
+    if (cmdinternal->new_pgrp)
+        setpgid(0, 0);
+
+    /* コマンド名の前の name=value は、このコマンドだけの環境変数にする */
+    int i;
+    for (i = 0; i < cmdinternal->nassigns; i++)
+        putenv(cmdinternal->assigns[i]);
+
+	// store the stdout file desc
+    /* 出力先のファイルディスクリプタを格納(リダイレクトで番号を指定されそうな小さい番号は避け、コマンドには渡さない) */
+    int stdoutfd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+
+	// for bckgrnd jobs redirect stdin from /dev/null
+    /* -> バックグラウンド処理のジョブの場合、標準入力をdev/null からリダイレクトする */
+    if (cmdinternal->asynchrnous) {
+        int fd = open("/dev/null", O_RDWR);
+        if (fd == -1) {
+            perror("/dev/null");
+            _exit(1);
         }
+        dup2(fd, STDIN_FILENO);
+    }
 
-        // redirect stdout to file if specified
-        /* -> ファイルの指定がある場合、標準出力をファイルにリダイレクト */
-        else if (cmdinternal->redirect_out) {
-            int fd = open(cmdinternal->redirect_out, O_WRONLY | O_CREAT | O_TRUNC,
-                          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-            if (fd == -1) {
-                perror(cmdinternal->redirect_out);
-                exit(1);
-            }
+    // read stdin from pipe if present
+    /* -> 標準入力があれば、パイプから読み込む */
+    if (cmdinternal->stdin_pipe)
+        dup2(cmdinternal->pipe_read, STDIN_FILENO);
+
+	// write stdout to pipe if present
+    /* -> 標準出力があれば、パイプに書き込む */
+    if (cmdinternal->stdout_pipe)
+        dup2(cmdinternal->pipe_write, STDOUT_FILENO);
+
+    /* リダイレクトは、パイプをつないだ後に書かれた順に適用する( cmd 2>&1 | ... ではエラー出力もパイプに流れる) */
+    if (!apply_redirects(cmdinternal->redirects, cmdinternal->nredirects, NULL))
+        _exit(1);
+
+    /* CPU の割り当てと優先度は、exec する前にこのプロセスに設定する */
+    sched_apply(cmdinternal->sched);
+
+    return stdoutfd;
+}
 
-            dup2(fd, STDOUT_FILENO);
+/*
+** exec_child():
+** prepare_child() を済ませた子プロセスで、外部コマンドを exec する。戻らない
+*/
+void exec_child(CommandInternal* cmdinternal, int stdoutfd)
+{
+    if (execvp(cmdinternal->argv[0], cmdinternal->argv) == -1) {
+		// restore the stdout for displaying error message
+        /* -> エラーメッセージを表示するための、標準出力の復元 */
+        dup2(stdoutfd, STDOUT_FILENO);
+
+        if (errno == E2BIG) { /* ワイルドカードで引数が多くなりすぎた */
+            printf("Argument list too long: \'%s\' (%d arguments; batch %s ... splits them)\n",
+                   cmdinternal->argv[0], cmdinternal->argc - 1, cmdinternal->argv[0]);
+            fflush(stdout);
+            _exit(126);
         }
+        printf("Command not found: \'%s\'\n", cmdinternal->argv[0]);
+        fflush(stdout);
+		_exit(127);
+    }
+}
+
+/*
+** execute_command_internal():
+** コマンドをひとつ起動する
+** 外部コマンドの場合はforkした子プロセスのpidを返し、終了を待つのは呼び出し側(実行計画のPLAN_WAIT)の役割
+** 組み込みコマンドをシェル自身で実行した場合と、起動に失敗した場合は 0 以下を返す
+** (組み込みコマンドの終了ステータスは、ここで $? に設定する)
+*/
+pid_t execute_command_internal(CommandInternal* cmdinternal)
+{
+
+    if (cmdinternal->argc <= 0) {
+        if (cmdinternal->nassigns == 0)
+            return -1;
+
+        /* name=value だけのコマンドは、シェル変数への代入 */
+        /* 終了ステータスは、値の中で実行したコマンド置換の最後のもの。無ければ 0 */
+        int i, status = 0;
+        for (i = 0; i < cmdinternal->nassigns; i++)
+            var_assign(cmdinternal->assigns[i]);
+        command_subst_status(&status);
+        var_set_status(status);
+        return 0;
+    }
+
+    /*
+    ** シェル関数は PATH を探す前に呼び出す
+    ** パイプラインのステージ・バックグラウンド・リダイレクトの場合は、子プロセスで実行する(下のfork以降)
+    */
+    Function* func = function_lookup(cmdinternal->argv[0]);
+    if (func != NULL && !cmdinternal->stdin_pipe && !cmdinternal->stdout_pipe && !cmdinternal->asynchrnous
+        && cmdinternal->nredirects == 0) {
+        var_set_status(function_call(func, cmdinternal->argc, cmdinternal->argv));
+        return 0;
+    }
+
+    /*
+    ** 組み込みコマンドの実行
+    ** リダイレクトは、シェル自身のディスクリプタを切り替えて実行し、終わったら元に戻す
+    ** (echo ... >&3 のようにログを書くたびに、fork や open をしない)
+    */
+    const Builtin* builtin = func == NULL ? find_builtin(cmdinternal->argv[0]) : NULL;
+
+    /*
+    ** パイプラインの途中の組み込みコマンド( echo ... | cmd )は、fork せずにシェルの中のスレッドで実行する
+    ** スレッドは自分のディスクリプタ表でパイプに書く。終了は実行計画の PLAN_WAIT で待つ
+    */
+    if (builtin != NULL && (builtin->flags & BUILTIN_THREAD) && cmdinternal->threads != NULL
+        && cmdinternal->stdout_pipe && !cmdinternal->asynchrnous && cmdinternal->nredirects == 0
+        && stage_thread_start(cmdinternal->threads, builtin->func, cmdinternal))
+        return 0;
 
-        // read stdin from pipe if present
-        /* -> 標準入力があれば、パイプから読み込む */
-        if (cmdinternal->stdin_pipe)
-            dup2(cmdinternal->pipe_read, STDIN_FILENO);
-
-		// write stdout to pipe if present
-        /* -> 標準出力があれば、パイプに書き込む */
-        if (cmdinternal->stdout_pipe)
-            dup2(cmdinternal->pipe_write, STDOUT_FILENO);
-
-        if (execvp(cmdinternal->argv[0], cmdinternal->argv) == -1) {
-			// restore the stdout for displaying error message
-            /* -> エラーメッセージを表示するための、標準出力の復元 */
-            dup2(stdoutfd, STDOUT_FILENO);
-			
-            printf("Command not found: \'%s\'\n", cmdinternal->argv[0]);
-			exit(1);
+    if (builtin != NULL && (!(builtin->flags & BUILTIN_PURE)
+        || (!cmdinternal->stdout_pipe && !cmdinternal->asynchrnous))) {
+        int saved[MAX_REDIRECTS];
+        uint64_t start = cmdstats_now();
+        if (builtin->flags & BUILTIN_REDIRECT)
+            var_set_status(builtin->func(cmdinternal));
+        else if (!apply_redirects(cmdinternal->redirects, cmdinternal->nredirects, saved))
+            var_set_status(1);
+        else {
+            int status = builtin->func(cmdinternal);
+            restore_redirects(cmdinternal->redirects, cmdinternal->nredirects, saved);
+            var_set_status(status);
         }
-        
+        cmdstats_record(cmdinternal->argv[0], cmdstats_now() - start);
+        return 0;
+    }
+
+    fflush(stdout); /* 組み込みコマンドなどの出力途中のバッファが、子プロセスに複製されないようにする */
+
+    /*
+    ** スクリプトの最後のコマンド( execute_plan_tail() )は、fork して待つだけのシェルを残さず、
+    ** シェル自身を外部コマンドに置き換える。終了ステータスはコマンドのものがそのままシェルのものになる
+    */
+    if (cmdinternal->exec_in_place && func == NULL && builtin == NULL) {
+        zygote_stop();
+        job_cgroup_release();
+        exec_child(cmdinternal, prepare_child(cmdinternal));
+    }
+
+    /* 実行時間は、回収したときに( cmdstats_reaped() )記録する */
+    uint64_t start = cmdstats_now();
+
+    /* 外部コマンドは、zygote が起動していればそこから起動させる(シェルの大きなアドレス空間を複製しない) */
+    pid_t pid;
+    if (func == NULL && builtin == NULL && (pid = zygote_spawn(cmdinternal)) > 0) {
+        cmdstats_spawned(cmdinternal->argv[0], pid, start);
+        return pid;
+    }
+
+    if((pid = fork()) == 0 ) {
+        int stdoutfd = prepare_child(cmdinternal);
+
+        if (func != NULL) { /* パイプラインのステージになっている関数 */
+            int status = function_call(func, cmdinternal->argc, cmdinternal->argv);
+            fflush(stdout);
+            _exit(status);
+        }
+        if (builtin != NULL) { /* 出力先を切り替えた組み込みコマンド */
+            int status = builtin->func(cmdinternal);
+            fflush(stdout);
+            _exit(status);
+        }
+        exec_child(cmdinternal, stdoutfd);
     }
     else if (pid < 0) {
         perror("fork");
-        return;
+        return -1;
     }
 
-    if (!cmdinternal->asynchrnous)
+    if (func == NULL) /* パイプラインのステージになっている関数は、中のコマンドをそれぞれ子プロセスが記録する */
+        cmdstats_spawned(cmdinternal->argv[0], pid, start);
+    return pid;
+}
+
+/*
+** open_redirect():
+** リダイレクトひとつ分のファイルを開くか、複製元のディスクリプタを確かめる
+** fd を閉じる場合( '>&-' )は fd を返す。失敗したらエラーを表示して -1 を返す
+*/
+static int open_redirect(const Redirect* r)
+{
+    int fd;
+
+    switch (r->type)
     {
-        // wait till the process has not finished
-        /* -> プロセスが終了していない状態で待つ */
-        while (waitpid(pid, NULL, 0) <= 0);
+    case NODE_REDIRECT_IN:
+        fd = open(r->target, O_RDONLY);
+        break;
+    case NODE_REDIRECT_APPEND:
+        fd = open(r->target, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        break;
+    case NODE_REDIRECT_DUP:
+        if (strcmp(r->target, "-") == 0)
+            return r->fd;
+        if (r->target[0] == 0 || strspn(r->target, "0123456789") != strlen(r->target)
+            || fcntl(fd = atoi(r->target), F_GETFD) == -1) {
+            fprintf(stderr, "%s: bad file descriptor\n", r->target);
+            return -1;
+        }
+        return fd;
+    default:
+        fd = open(r->target, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        break;
     }
-    else
-    {
-		// set the sigchild handler for the spawned process
-        /* -> 起動したプロセスのシグナルIDのハンドラを設定する */
-        printf("%d started\n", pid);
-        struct sigaction act;
-        act.sa_flags = 0;
-        act.sa_handler = zombie_process_handler;
-        sigfillset( & (act.sa_mask) ); // to block all
+    if (fd == -1)
+        perror(r->target);
+    return fd;
+}
+
+/*
+** fd_marks:
+** 3 番以降のディスクリプタごとに、リダイレクトで開いたものかを覚えておく(番号で引く。extra_fds は FD_REDIRECTED の数)
+** 組み込みコマンドのリダイレクトで元のディスクリプタを退避するときは、印も退避先に FD_SAVED として移し、戻すときに戻す
+*/
+enum { FD_NONE, FD_REDIRECTED, FD_SAVED };
+static char* fd_marks = NULL;
+static int fd_marks_size = 0;
+
+static int fd_mark(int fd)
+{
+    return fd < fd_marks_size ? fd_marks[fd] : FD_NONE;
+}
+
+static void set_fd_mark(int fd, int mark)
+{
+    if (fd >= fd_marks_size) {
+        if (mark == FD_NONE)
+            return;
+        int size = fd_marks_size ? fd_marks_size : 16;
+        while (fd >= size)
+            size *= 2;
+        fd_marks = realloc(fd_marks, size);
+        memset(fd_marks + fd_marks_size, FD_NONE, size - fd_marks_size);
+        fd_marks_size = size;
+    }
+    extra_fds += (mark == FD_REDIRECTED) - (fd_marks[fd] == FD_REDIRECTED);
+    fd_marks[fd] = mark;
+}
+
+/*
+** apply_redirects():
+** リダイレクトの一覧を、書かれた順にこのプロセスのディスクリプタに適用する
+** saved が NULL でなければ、切り替える前のディスクリプタを複製して saved に残しておき、
+** 後で restore_redirects() で元に戻せるようにする(シェル自身で実行する組み込みコマンド)
+** 失敗したらエラーを表示し、saved があればそこまでの切り替えを戻して false を返す
+*/
+bool apply_redirects(const Redirect* redirects, int nredirects, int* saved)
+{
+    int i;
+
+    if (saved != NULL)
+        fflush(stdout); /* 切り替える前の出力先に書いたものを、先に書き出しておく */
+    for (i = 0; i < nredirects; i++) {
+        const Redirect* r = &redirects[i];
+        if (saved != NULL) { /* 元のディスクリプタは close-on-exec にして、起動するコマンドに渡さない */
+            saved[i] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+            if (saved[i] >= 0 && fd_mark(r->fd) == FD_REDIRECTED)
+                set_fd_mark(saved[i], FD_SAVED);
+        }
+
+        int fd = open_redirect(r);
+        if (fd == -1) {
+            if (saved != NULL)
+                restore_redirects(redirects, i + 1, saved);
+            return false;
+        }
+        bool closing = r->type == NODE_REDIRECT_DUP && strcmp(r->target, "-") == 0;
+        if (closing)
+            close(r->fd);
+        else if (fd != r->fd) {
+            dup2(fd, r->fd);
+            if (r->type != NODE_REDIRECT_DUP) /* 開いたファイルは、切り替えた番号でだけ持つ */
+                close(fd);
+        }
+        if (r->fd > STDERR_FILENO)
+            set_fd_mark(r->fd, closing ? FD_NONE : FD_REDIRECTED);
+    }
+    return true;
+}
+
+/* apply_redirects() で切り替えたディスクリプタを、逆の順に元に戻す */
+void restore_redirects(const Redirect* redirects, int nredirects, int* saved)
+{
+    int i;
 
-        if (sigaction(SIGCHLD, &act, NULL) != 0)
-            perror("sigaction");
+    fflush(stdout);
+    for (i = nredirects - 1; i >= 0; i--) {
+        if (redirects[i].fd > STDERR_FILENO) /* 切り替える前の印に戻す */
+            set_fd_mark(redirects[i].fd, saved[i] >= 0 && fd_mark(saved[i]) == FD_SAVED ? FD_REDIRECTED : FD_NONE);
+        if (saved[i] >= 0) {
+            set_fd_mark(saved[i], FD_NONE);
+            dup2(saved[i], redirects[i].fd);
+            close(saved[i]);
+        }
+        else /* 切り替える前は閉じていた */
+            close(redirects[i].fd);
     }
+}
 
-    return;
+/*
+** shell_has_extra_fds():
+** シェル自身が 3 番以降のディスクリプタを切り替えているか
+** 起動するコマンドはそれを引き継ぐので、zygote からは起動できない
+*/
+bool shell_has_extra_fds()
+{
+    return extra_fds > 0;
+}
+
+/*
+** argv_buffer:
+** init_command_internal() で argv を組み立てるための、シェル全体で使い回す配列
+** argv を使うのは execute_command_internal() の間だけ(forkした子プロセスは自分の複製を持つ)なので、
+** 次のコマンドを組み立てる時点で上書きしてよい
+** ただし、単語の展開中にコマンド置換で別のコマンドを組み立てることがあるので、スタックとして使う
+** (argv_top より後ろが空き。destroy_command_internal() で組み立てる前の位置に戻す)
+*/
+static char** argv_buffer = NULL;
+static int argv_buffer_size = 0;
+static int argv_top = 0;
+
+/* argv_buffer に n 個以上の要素を確保する。足りないときだけ拡張するので、通常はmallocが発生しない */
+static void argv_reserve(int n)
+{
+    if (n > argv_buffer_size) {
+        while (n > argv_buffer_size)
+            argv_buffer_size = argv_buffer_size ? argv_buffer_size * 2 : 64;
+        argv_buffer = (char**)realloc(argv_buffer, sizeof(char*) * argv_buffer_size);
+    }
 }
 
 /*
 ** init_command_internal():
 ** コマンド情報を取りまとめて設定する構造体 CommandInternal を、
 ** 引数の内容で設定する
-** 実行コマンドの情報がすべて決定する execute_simple_command()で呼び出される
+** 実行計画の PLAN_SPAWN を解釈するときに、execute_plan() から呼び出される
+**
+** $変数 とワイルドカードは、ここで(実行する直前に)展開する
+** 展開の必要が無い単語は、抽象構文木の文字列テーブルを直接指す(複製しない)
 */
-int init_command_internal(ASTreeNode* simplecmdNode,
+int init_command_internal(ASTree* tree,
+                          ASTreeIndex simplecmdNode,
                           CommandInternal* cmdinternal,
                           bool async,
                           bool stdin_pipe,
                           bool stdout_pipe,
                           int pipe_read,
                           int pipe_write,
-                          char* redirect_in,
-                          char* redirect_out)
+                          const Redirect* redirects,
+                          int nredirects)
 {
-    /* simplecmdNode の値がNULLもしくはtypeがNODE_CMDPATHではない場合、エラー */
-    if (simplecmdNode == NULL || !(NODETYPE(simplecmdNode->type) == NODE_CMDPATH))
+    cmdinternal->globbed = false;
+    cmdinternal->nassigns = 0;
+    cmdinternal->job = NULL;
+    cmdinternal->sched = NULL;
+    cmdinternal->new_pgrp = false;
+    cmdinternal->exec_in_place = false;
+    cmdinternal->threads = NULL;
+    cmdinternal->argv_base = argv_top;
+    cmdinternal->argbytes = 0;
+    cmdinternal->glob_first = cmdinternal->glob_last = -1;
+    command_subst_status(NULL); /* 代入だけのコマンドの終了ステータスは、このコマンドの展開で決まる */
+    var_expand_failed(); /* 前のコマンドまでの展開のエラーは関係ない */
+
+    /* simplecmdNode の値がAST_NULLもしくはtypeがNODE_CMDPATHではない場合、エラー */
+    if (simplecmdNode == AST_NULL || !(NODETYPE(ASTreeType(tree, simplecmdNode)) == NODE_CMDPATH))
     {
         cmdinternal->argc = 0;
+        cmdinternal->argv = NULL;
         return -1;
     }
 
-    /* 引数を取り出していくため、argNodeを設定 */
-    ASTreeNode* argNode = simplecmdNode;
+    /* 引数ノードは NODE_CMDPATH の直後に連続して並んでいるので、数える必要はない */
+    int nwords = ASTreeArgc(tree, simplecmdNode);
 
-    int i = 0;
-    /* 引数の数をカウントするため、右の枝にNODE_ARGUMENTかNODE_CMDPATHがつづく数を数える */
-    while (argNode != NULL && (NODETYPE(argNode->type) == NODE_ARGUMENT || NODETYPE(argNode->type) == NODE_CMDPATH)) {
-        argNode = argNode->right;
-        i++;
-    }
+    /* 最後にNULLポインタをつけるので、単語の数よりひとつ多く必要 */
+    int base = argv_top;
+    argv_reserve(base + nwords + 1);
 
-    /* カウントした分だけ、文字列ポインタを確保する。最後にNULLポインタをつけるので、数えた数よりひとつ多く確保しておく */
-    cmdinternal->argv = (char**)malloc(sizeof(char*) * (i + 1));
-    argNode = simplecmdNode; /* argNodeを巻き戻し */
-    i = 0; /* 引数文字列の数をカウント。最後にargcになる */
-    while (argNode != NULL && (NODETYPE(argNode->type) == NODE_ARGUMENT || NODETYPE(argNode->type) == NODE_CMDPATH)) {
-        cmdinternal->argv[i] = (char*)malloc(strlen(argNode->szData) + 1);
-        strcpy(cmdinternal->argv[i], argNode->szData); /* 各ノードの文字列データを複製する */
+    int argc = 0;
+    int nassigns = 0; /* 先頭に並んでいる name=value の数 */
+    int i;
+    size_t k;
+    for (i = 0; i < nwords; i++) {
+        uint8_t type = ASTreeType(tree, simplecmdNode + i);
+        char* word = ASTreeData(tree, simplecmdNode + i);
 
-        argNode = argNode->right; /* 次のノードへ進む */
-        i++;
+        /* 代入かどうかは展開前の単語で判定する */
+        bool assign = argc == nassigns && var_is_assignment(word);
+
+        if ((type & NODE_EXPAND) && strcmp(word, "$@") == 0) {
+            /* "$@" だけの単語は、位置パラメータをそれぞれ別の引数にする */
+            int j;
+            argv_reserve(base + argc + var_argc() + (nwords - i) + 1);
+            for (j = 1; j <= var_argc(); j++)
+                argv_buffer[base + argc++] = (char*)var_arg(j);
+            continue;
+        }
+
+        bool globbing = (type & NODE_GLOB) && !assign;
+        if (type & (NODE_EXPAND | NODE_GLOB)) { /* クオートされていた文字の印を取り除くので、ワイルドカードだけの単語も通す */
+            argv_top = base + argc + (nwords - i) + 1; /* コマンド置換が組み立て途中の argv を上書きしないように */
+            word = globbing ? var_expand_pattern(word) : var_expand(word); /* 展開結果は PLAN_SEQ で捨てられるまで有効 */
+        }
+
+        if (globbing) {
+            /* 一致したパスを globbuf の後ろに追加していき、argv からはその文字列を指す */
+            size_t first = cmdinternal->globbed ? cmdinternal->globbuf.gl_pathc : 0;
+            var_glob(word, GLOB_TILDE | (cmdinternal->globbed ? GLOB_APPEND : 0), &cmdinternal->globbuf);
+            cmdinternal->globbed = true;
+
+            argv_reserve(base + argc + (cmdinternal->globbuf.gl_pathc - first) + (nwords - i) + 1);
+            if (cmdinternal->glob_first < 0)
+                cmdinternal->glob_first = argc;
+            for (k = first; k < cmdinternal->globbuf.gl_pathc; k++)
+                argv_buffer[base + argc++] = cmdinternal->globbuf.gl_pathv[k];
+            cmdinternal->glob_last = argc - 1;
+        }
+        else {
+            argv_buffer[base + argc++] = word;
+            if (assign)
+                nassigns++;
+        }
     }
+    argv_buffer[base + argc] = NULL; /* 引数文字列の末尾ポインタをNULLに設定 */
+    argv_top = base + argc + 1;
 
-    cmdinternal->argv[i] = NULL; /* 引数文字列の末尾ポインタをNULLに設定 */
-    cmdinternal->argc = i;
+    /* $((x/0)) のように展開に失敗したコマンドは、代入もコマンドも実行しない(終了ステータスは 1) */
+    if (var_expand_failed()) {
+        var_set_status(1);
+        argc = nassigns = 0;
+    }
+
+    /* exec するときに必要な大きさ(batch が ARG_MAX を超えないように分割するのに使う) */
+    for (i = 0; i < argc; i++)
+        cmdinternal->argbytes += strlen(argv_buffer[base + i]) + 1 + sizeof(char*);
+
+    /* 先頭の name=value はコマンドの引数に含めない */
+    cmdinternal->assigns = argv_buffer + base;
+    cmdinternal->nassigns = nassigns;
+    cmdinternal->argv = argv_buffer + base + nassigns;
+    cmdinternal->argc = argc - nassigns;
+    if (cmdinternal->glob_first >= 0) {
+        cmdinternal->glob_first -= nassigns;
+        cmdinternal->glob_last -= nassigns;
+    }
 
     /* 引数として渡された値をそのままcmdinternalに保存する */
     cmdinternal->asynchrnous = async;
@@ -312,19 +1094,23 @@ int init_command_internal(ASTreeNode* simplecmdNode,
     cmdinternal->stdout_pipe = stdout_pipe;
     cmdinternal->pipe_read = pipe_read;
     cmdinternal->pipe_write = pipe_write;
-    cmdinternal->redirect_in = redirect_in;
-    cmdinternal->redirect_out = redirect_out;
+    cmdinternal->redirects = redirects;
+    cmdinternal->nredirects = nredirects;
 
     return 0;
 }
 
-/* 入力コマンド情報を破棄・解放(free)する */
+/*
+** 入力コマンド情報を破棄する
+** argv の文字列は抽象構文木のもの、配列は argv_buffer なので、ここでは解放しない
+** ワイルドカードを展開した結果だけは、ここで解放する
+*/
 void destroy_command_internal(CommandInternal* cmdinternal)
 {
-    int i;
-    for (i = 0; i < cmdinternal->argc; i++)
-        free(cmdinternal->argv[i]);
-
-    free(cmdinternal->argv);
+    if (cmdinternal->globbed)
+        globfree(&cmdinternal->globbuf);
+    cmdinternal->globbed = false;
+    cmdinternal->argv = NULL;
     cmdinternal->argc = 0;
+    argv_top = cmdinternal->argv_base; /* argv_buffer の使用位置を、組み立てる前に戻す */
 }
@@ -3,7 +3,23 @@
 
 #include <unistd.h>
 #include <stdbool.h>
+#include <glob.h>
 #include "astree.h"
+#include "jobs.h"
+#include "schedhint.h"
+
+/*
+** Redirect:
+** コマンドのディスクリプタ fd の切り替えひとつ分。書かれた順に適用する
+*/
+typedef struct Redirect
+{
+	int fd; /* 切り替えるディスクリプタ */
+	NodeType type; /* NODE_REDIRECT_IN / NODE_REDIRECT_OUT / NODE_REDIRECT_APPEND / NODE_REDIRECT_DUP */
+	const char* target; /* ファイル名。NODE_REDIRECT_DUP では複製元の番号で、"-" なら fd を閉じる */
+} Redirect;
+
+#define MAX_REDIRECTS 16 /* ひとつのコマンドに書けるリダイレクトの数 */
 
 /*
 ** CommandInternal:
@@ -18,29 +34,73 @@ struct CommandInternal
 	bool stdout_pipe; /* 出力の指定ディスクリプタがあるか */
 	int pipe_read; /* 入力ディスクリプタ番号 */
 	int pipe_write; /* 出力ディスクリプタ番号 */
-	char* redirect_in; /* 入力になるファイル名 */
-	char* redirect_out; /* 出力先のファイル名 */
+	const Redirect* redirects; /* リダイレクトの一覧(書かれた順) */
+	int nredirects;
 	bool asynchrnous; /* 同期的実行か、非同期的実行かの真偽値 */
+	char **assigns; /* コマンド名の前に書かれた name=value。外部コマンドの環境変数になる */
+	int nassigns;
+	glob_t globbuf; /* ワイルドカードを展開した結果。argv の一部がここを指す */
+	bool globbed; /* globbuf を使ったか */
+	int argv_base; /* argv を組み立てた argv_buffer 内の位置 */
+	size_t argbytes; /* exec するときの argv と代入の大きさ(文字列とポインタ)。ARG_MAX と比べる */
+	int glob_first, glob_last; /* ワイルドカードを展開した引数の範囲(argv の添字)。展開していなければ -1 */
+	Job* job; /* 子プロセスを入れるジョブ(cgroup)。execute_plan() が設定する */
+	const SchedHint* sched; /* 子プロセスの CPU の割り当てと優先度。execute_plan() が設定する */
+	bool new_pgrp; /* 子プロセスを新しいプロセスグループにする(timeout がグループ全体にシグナルを送るため) */
+	bool exec_in_place; /* 外部コマンドであれば fork せず、シェル自身をコマンドに置き換える(スクリプトの最後のコマンド) */
+	struct StageThread** threads; /* 組み込みコマンドのステージをスレッドで実行したら加える一覧( execute_plan() が待つ)。NULL ならスレッドを使わない */
 };
 
 typedef struct CommandInternal CommandInternal;
 
+enum
+{ /* 組み込みコマンドの性質 ( builtin_flags() ) */
+	BUILTIN_PURE = (1 << 0), /* 出力するだけで、シェルの変数や作業ディレクトリなどを変えない */
+	BUILTIN_RETURN = (1 << 1), /* return。関数の中でだけ意味を持つ */
+	BUILTIN_REDIRECT = (1 << 2), /* リダイレクトを自分で処理する(exec)。実行の前後で切り替えたり戻したりしない */
+	BUILTIN_THREAD = (1 << 3), /* シェルの状態を読みも書きもせず、stage_thread_stdout() にだけ出力する。パイプラインのステージはスレッドで実行できる */
+	BUILTIN_SPAWN = (1 << 4), /* 外部コマンドを起動する。コマンドはディスクリプタ 1 に直接書くので、stdout を差し替えただけでは出力を受け取れない */
+};
+
 void set_prompt(char* str);
 char* getprompt();
 void ignore_signal_for_shell();
-void execute_cd(CommandInternal* cmdinternal);
-void execute_prompt(CommandInternal* cmdinternal);
-void execute_pwd(CommandInternal* cmdinternal);
-void execute_command_internal(CommandInternal* cmdinternal);
-int init_command_internal(ASTreeNode* simplecmdNode, 
+void restore_sigint_in_child();
+int execute_cd(CommandInternal* cmdinternal);
+int execute_prompt(CommandInternal* cmdinternal);
+int execute_source(CommandInternal* cmdinternal);
+int execute_pwd(CommandInternal* cmdinternal);
+int execute_echo(CommandInternal* cmdinternal);
+int execute_exit(CommandInternal* cmdinternal);
+int execute_true(CommandInternal* cmdinternal);
+int execute_false(CommandInternal* cmdinternal);
+int execute_test(CommandInternal* cmdinternal);
+int execute_export(CommandInternal* cmdinternal);
+int execute_return(CommandInternal* cmdinternal);
+int execute_let(CommandInternal* cmdinternal);
+int execute_jobs(CommandInternal* cmdinternal);
+int execute_limit(CommandInternal* cmdinternal);
+int execute_sched(CommandInternal* cmdinternal);
+int execute_memstats(CommandInternal* cmdinternal);
+int execute_stats(CommandInternal* cmdinternal);
+int execute_exec(CommandInternal* cmdinternal);
+int builtin_flags(const char* name);
+pid_t execute_command_internal(CommandInternal* cmdinternal);
+bool apply_redirects(const Redirect* redirects, int nredirects, int* saved);
+void restore_redirects(const Redirect* redirects, int nredirects, int* saved);
+bool shell_has_extra_fds();
+int prepare_child(CommandInternal* cmdinternal);
+void exec_child(CommandInternal* cmdinternal, int stdoutfd);
+int init_command_internal(ASTree* tree,
+						  ASTreeIndex simplecmdNode,
 						  CommandInternal* cmdinternal, 
 						  bool async,
 						  bool stdin_pipe,
 						  bool stdout_pipe,
 						  int pipe_read,
 						  int pipe_write,
-						  char* redirect_in,
-						  char* redirect_out
+						  const Redirect* redirects,
+						  int nredirects
 );
 void destroy_command_internal(CommandInternal* cmdinternal);
 
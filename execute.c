@@ -1,221 +1,609 @@
 #include "command.h"
+#include "plan.h"
+#include "var.h"
+#include "function.h"
+#include "execute.h"
+#include "jobs.h"
+#include "fanout.h"
+#include "memstats.h"
+#include "stagethread.h"
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <fnmatch.h>
+#include <sys/wait.h>
 
 /*
-** execute_simple_command():
-** コマンド実行の最小単位
-** execute_commandから呼び出される
-** execute_commandで、リダイレクトの記述は解釈されており、
-** 引数にredirect_in や redirect_outの値として渡される
+** JobState:
+** 実行中のジョブについて、命令をまたいで持ち回る状態
+** パイプ・リダイレクト・非同期実行の指定と、終了を待つプロセスの一覧
 */
-void execute_simple_command(ASTreeNode* simple_cmd_node,
-                             bool async,
-                             bool stdin_pipe,
-                             bool stdout_pipe,
-                             int pipe_read,
-                             int pipe_write,
-                             char* redirect_in,
-                             char* redirect_out
-                            )
+typedef struct JobState
 {
+    bool async; /* 現在のジョブがバックグラウンド実行か */
+    bool stdin_pipe, stdout_pipe;
+    int pipe_read, pipe_write;
+    int next_read; /* PLAN_PIPEで作ったパイプの読み込み側。次のステージの入力になる */
+    Redirect redirects[MAX_REDIRECTS]; /* 次に起動するステージのリダイレクト */
+    int nredirects;
 
-    // printf("\t - execute_simple_commnad here.\n");
-    // printf("\t - NODE_TYPE(simple_cmd_node->type): %d\n", NODETYPE(simple_cmd_node->type));
-    // printf("\t - simple_cmd_node->szData: %s\n", simple_cmd_node->szData);
+    Job* job; /* 起動したプロセス。最初に fork するとき(バックグラウンドは PLAN_BACKGROUND)に作る */
+    int first_op; /* ジョブの最初の命令の位置。jobs で表示するコマンドラインを作るのに使う */
+    pid_t last_pid; /* 最後のステージのプロセス。組み込みコマンドなら 0 */
+    int stage; /* 次に起動するステージの番号 */
+    SchedHint sched; /* sched -j で指定した、ジョブ全体の CPU の割り当てと優先度 */
+    StageThread* threads; /* スレッドで実行している組み込みコマンドのステージ。フォアグラウンドのジョブだけ */
+} JobState;
 
-    // if (simple_cmd_node->right != NULL)
-    // {
-    //     printf("\t - NODE_TYPE(simple_cmd_node->right->type): %d\n", NODETYPE(simple_cmd_node->right->type));
-    //     printf("\t - simple_cmd_node->right->szData: %s\n", simple_cmd_node->right->szData);
+/*
+** PlanSlot:
+** for / case / 出力の複製 / リダイレクトを付けた制御構文の実行中の状態
+** 実行計画はキャッシュされて入れ子でも実行されるので、Plan ではなく実行のたびに確保する
+*/
+typedef struct PlanSlot
+{
+    char** words; /* 展開済みの単語(for の単語の並び、case の単語) */
+    int nwords;
+    int next; /* for で次に代入する単語の位置。出力の複製では、次に渡す複製の位置 */
+    int* fds; /* 出力の複製の、消費側の標準入力にする読み込み側 */
+    int nfds;
+    Redirect* redirects; /* 制御構文の間だけシェル自身に適用しているリダイレクト */
+    int* saved; /* 切り替える前のディスクリプタ。元に戻したら NULL */
+    int nredirects;
+} PlanSlot;
 
-    // }
-    // printf("\n");
+static void slot_clear(PlanSlot* slot)
+{
+    int i;
+    for (i = 0; i < slot->nwords; i++)
+        mem_free(slot->words[i]);
+    mem_free(slot->words);
+    for (i = slot->next; i < slot->nfds; i++) { /* 消費側に渡さなかった複製 */
+        fanout_claim(slot->fds[i]);
+        close(slot->fds[i]);
+    }
+    mem_free(slot->fds);
+    if (slot->saved != NULL) /* return などで、PLAN_GROUP_END を通らずに抜けた場合も元に戻す */
+        restore_redirects(slot->redirects, slot->nredirects, slot->saved);
+    mem_free(slot->saved);
+    mem_free(slot->redirects);
+    memset(slot, 0, sizeof(*slot));
+}
 
-    CommandInternal cmdinternal;
-    init_command_internal(simple_cmd_node, &cmdinternal, async, stdin_pipe, stdout_pipe,
-                          pipe_read, pipe_write, redirect_in, redirect_out
-                         );
-	execute_command_internal(&cmdinternal);
-	destroy_command_internal(&cmdinternal);
+static void slot_add_word(PlanSlot* slot, const char* word)
+{
+    slot->words = mem_realloc(MEM_EXECUTOR, slot->words, sizeof(char*) * (slot->nwords + 1));
+    slot->words[slot->nwords++] = mem_strdup(MEM_EXECUTOR, word);
 }
 
 /*
-** execute_command():
-** 単一のコマンドの実行
-** execute_jobから呼び出される
-** パイプ文字を含んだ、入出力連携はexecute_jobにより解釈されて、
-** commandには入出力先のディスクリプタを指定する形で情報が引き渡される
+** slot_expand_words():
+** NODE_WORDLIST の単語を、$変数 とワイルドカードを展開して slot に複製する
+** "$@" だけの単語は、位置パラメータをそれぞれ別の単語にする
 */
-void execute_command(ASTreeNode* cmdNode,
-                      bool async, /* 実行の同期・非同期(';' と '&' に関係) */
-                      bool stdin_pipe, /* 入力の指定ディスクリプタがあるか */
-                      bool stdout_pipe, /* 出力の指定ディスクリプタがあるか */
-                      int pipe_read,  /* 入力ディスクリプタ番号 */
-                      int pipe_write) /* 出力ディスクリプタ番号 */
+static void slot_expand_words(PlanSlot* slot, ASTree* tree, ASTreeIndex wordlist)
 {
-    if (cmdNode == NULL)
-        return;
-
-    // printf("\t - execute_command here.\n");
-    // printf("\t - NODE_TYPE(cmdNode->type): %d\n", NODETYPE(cmdNode->type));
-    // printf("\t - cmdNode->szData: %s\n", cmdNode->szData);
-    // printf("\n");
+    int n = ASTreeWordc(tree, wordlist);
+    int i;
+    size_t k;
+    for (i = 1; i <= n; i++) {
+        uint8_t type = ASTreeType(tree, wordlist + i);
+        char* word = ASTreeData(tree, wordlist + i);
+        if ((type & NODE_EXPAND) && strcmp(word, "$@") == 0) {
+            int j;
+            for (j = 1; j <= var_argc(); j++)
+                slot_add_word(slot, var_arg(j));
+            continue;
+        }
+        if (type & NODE_GLOB) {
+            glob_t globbuf;
+            var_glob(var_expand_pattern(word), GLOB_TILDE, &globbuf);
+            for (k = 0; k < globbuf.gl_pathc; k++)
+                slot_add_word(slot, globbuf.gl_pathv[k]);
+            globfree(&globbuf);
+        }
+        else
+            slot_add_word(slot, (type & NODE_EXPAND) ? var_expand(word) : word);
+    }
+}
 
-    switch (NODETYPE(cmdNode->type)) /* NODETYPEにより分岐 */
-    {
-    case NODE_REDIRECT_IN:		// right side contains simple cmd node /* 右の枝に、入力となるファイルが指定されている場合 ( '<' ) */
-        execute_simple_command(cmdNode->right,
-                               async,
-                               stdin_pipe,
-                               stdout_pipe,
-                               pipe_read,
-                               pipe_write,
-                               cmdNode->szData, NULL
-                              );
-        break;
-    case NODE_REDIRECT_OUT:		// right side contains simple cmd node /* 右の枝に、出力先のファイルが指定されている場合 ( '>' ) */
-        execute_simple_command(cmdNode->right,
-                               async,
-                               stdin_pipe,
-                               stdout_pipe,
-                               pipe_read,
-                               pipe_write,
-                               NULL, cmdNode->szData
-                              );
-        break;
-    case NODE_CMDPATH: /* リダイレクト( '<' / '>' )が設定されていない場合 */
-        execute_simple_command(cmdNode,
-                               async,
-                               stdin_pipe,
-                               stdout_pipe,
-                               pipe_read,
-                               pipe_write,
-                               NULL, NULL
-                              );
-        break;
+/* case のパターンのどれかに、slot の単語が一致するか */
+static bool case_match(PlanSlot* slot, ASTree* tree, ASTreeIndex patterns)
+{
+    int n = ASTreeWordc(tree, patterns);
+    int i;
+    for (i = 1; i <= n; i++) {
+        char* pattern = ASTreeData(tree, patterns + i);
+        if (ASTreeType(tree, patterns + i) & (NODE_EXPAND | NODE_GLOB))
+            pattern = var_expand_pattern(pattern);
+        if (fnmatch(pattern, slot->words[0], 0) == 0)
+            return true;
     }
+    return false;
 }
 
 /*
-** execute_pipline():
-** パイプライン付きコマンドの実行
-** execute_jobから呼び出される
-** 
+** wait_job():
+** フォアグラウンドのジョブで起動したプロセスとスレッドを、すべて待つ
+** 最後のステージが外部コマンドであれば、その終了ステータスを $? に設定する
 */
-void execute_pipeline(ASTreeNode* t, bool async)
+static void wait_job(JobState* job)
 {
-    int file_desc[2];
+    if (job->job != NULL) {
+        int status = job_wait(job->job);
+        if (job->last_pid > 0)
+            var_set_status(status);
+        job_free(job->job);
+        job->job = NULL;
+    }
+    stage_thread_join_all(&job->threads);
+}
 
-    // printf("\t - execute_pipeline here.\n");
-    // printf("\t - NODETYPE(t->type): %d\n", NODETYPE(t->type));
-    // printf("\t - t->szData: %s\n", t->szData);
+/*
+** job_command():
+** jobs で表示するために、ジョブの命令からコマンドラインの文字列を作る
+** 単語は展開する前のもの。子プロセスで実行する制御構文は、そのキーワードだけにする
+*/
+static char* job_command(Plan* plan, int start, int end)
+{
+    static const char* compound_names[] = {
+        [NODE_IF] = "if ...", [NODE_WHILE] = "while ...", [NODE_UNTIL] = "until ...",
+        [NODE_FOR] = "for ...", [NODE_CASE] = "case ...", [NODE_GROUP] = "{ ... }",
+        [NODE_SUBSHELL] = "( ... )",
+    };
+    char* text = NULL;
+    size_t len = 0;
+    FILE* fp = open_memstream(&text, &len);
+    const char* sep = " | "; /* 次のステージの前に置く区切り */
+    bool first = true;
+    int i;
 
-    pipe(file_desc);
-    int pipewrite = file_desc[1];
-    int piperead = file_desc[0];
+    for (i = start; i < end; i++) {
+        PlanOp* op = &plan->ops[i];
+        if (op->type == PLAN_FANOUT) /* 最初の消費側の前は '|{' */
+            sep = " |{ ";
+        else if (op->type == PLAN_FANOUT_BRANCH && strcmp(sep, " |{ ") != 0)
+            sep = ", ";
+        else if (op->type == PLAN_FANOUT_END)
+            fputs(" }", fp);
+        if (op->type != PLAN_SPAWN && op->type != PLAN_SUBSHELL)
+            continue;
+        if (!first)
+            fputs(sep, fp);
+        first = false;
+        sep = " | ";
 
-	// read input from stdin for the first job
-    /* 最初のjob(左のノード)のために、stdinから入力を読み込みます */
-    execute_command(t->left, async, false, true, 0, pipewrite);
-    ASTreeNode* jobNode = t->right;
+        if (op->type == PLAN_SUBSHELL) {
+            int type = NODETYPE(ASTreeType(&plan->tree, op->node));
+            fputs(type <= NODE_SUBSHELL && compound_names[type] != NULL ? compound_names[type] : "...", fp);
+            i = op->jump - 1;
+            continue;
+        }
+        int n = ASTreeArgc(&plan->tree, op->node);
+        int j;
+        for (j = 0; j < n; j++)
+            fprintf(fp, j > 0 ? " %s" : "%s", ASTreeData(&plan->tree, op->node + j));
+    }
+    fclose(fp);
+    return text;
+}
 
-    // printf("\t - NODETYPE(jobNode->type): %d\n", NODETYPE(jobNode->type));
-    // printf("\t - jobNode->szData: %s\n", jobNode->szData);
-    // printf("\n");
+/*
+** finish_stage():
+** ステージをひとつ起動し終えた後の処理
+** 起動したプロセスをジョブに加え、子プロセスに渡したディスクリプタを閉じる
+*/
+static void finish_stage(JobState* job, pid_t pid)
+{
+    job->last_pid = pid > 0 ? pid : 0; /* 組み込みコマンドは、実行した時点で $? を設定している */
+    job->stage++;
+    if (pid > 0 && job->async)
+        var_set_status(0);
+    if (pid > 0) {
+        if (job->job == NULL)
+            job->job = job_start(false);
+        job_add_process(job->job, pid);
+    }
 
-    /*  多重パイプの処理 ... typeにNODE_PIPEが設定されている間は繰り返し */
-    while (jobNode != NULL && NODETYPE(jobNode->type) == NODE_PIPE)
-    {
-        close(pipewrite); // close the write end　/* パイプの書き込み側を閉じる */
-        pipe(file_desc); /* 新しくpipeをひらく */
-        pipewrite = file_desc[1]; /* 新しい方のディスクリプタをpipewriteに設定 */
+    /* 子プロセスに渡し終えたディスクリプタは閉じる */
+    if (job->stdout_pipe)
+        close(job->pipe_write);
+    if (job->stdin_pipe)
+        close(job->pipe_read);
 
-        /* 先に実行するコマンド(左の枝) */
-        execute_command(jobNode->left, async, true, true, piperead, pipewrite);
-        close(piperead); /* 読み込み側のパイプをとじる */
-        piperead = file_desc[0]; /* 新しく作ったほうのディスクリプタを設定 */
+    /* このステージの出力パイプが、次のステージの入力になる */
+    job->stdin_pipe = job->stdout_pipe;
+    job->pipe_read = job->next_read;
+    job->stdout_pipe = false;
+    job->nredirects = 0;
+}
 
-        jobNode = jobNode->right; /* 結果の引き渡し先になるコマンド(右の枝)に進む */
+/*
+** end_job():
+** ジョブの区切り( PLAN_SEQ )での後始末
+** バックグラウンドのジョブは一覧に残して番号を表示し、プロセスを起動しなかったものは捨てる
+*/
+static void end_job(JobState* job, Plan* plan, int end)
+{
+    if (job->job != NULL && job->async) {
+        if (job->job->npids > 0) {
+            job_set_command(job->job, job_command(plan, job->first_op, end));
+            job_announce(job->job);
+        }
+        else
+            job_free(job->job);
     }
+    else if (job->job != NULL || job->threads != NULL) /* PLAN_WAIT の無いフォアグラウンドのジョブ(通常は無い) */
+        wait_job(job);
+    job->job = NULL;
+    job->async = false;
+    job->stage = 0;
+    job->sched.flags = 0;
+}
+
+/*
+** start_fanout():
+** 出力側のステージの出力パイプから、消費側の数だけ複製するポンプを起動する
+** 消費側の標準入力にする読み込み側は slot に置き、PLAN_FANOUT_BRANCH で順に渡す
+*/
+static void start_fanout(JobState* job, PlanSlot* slot, ASTree* tree, ASTreeIndex fanoutNode)
+{
+    ASTreeIndex item;
+    int n = 0;
 
-    piperead = file_desc[0]; /* 読み込み側のパイプを指定 */
-    close(pipewrite); /* 書き込み側のディスクリプタは使い終わっているので、閉じておく */
+    if (!job->stdin_pipe)
+        return;
+    job->stdin_pipe = false; /* 出力パイプの読み込み側は、ポンプに渡す */
+
+    for (item = ASTreeRight(tree, fanoutNode); item != AST_NULL; item = ASTreeRight(tree, item))
+        n++;
+    if (job->job == NULL)
+        job->job = job_start(false);
+    slot->fds = mem_alloc(MEM_EXECUTOR, sizeof(int) * n);
+    pid_t pid = fanout_spawn(job->job, job->pipe_read, n, slot->fds);
+    if (pid > 0) {
+        slot->nfds = n;
+        job_add_process(job->job, pid);
+    }
+}
 
-	// write output to stdout for the last job
-    /* 最後のジョブ(右の枝)の実行結果を、stdoutに出力する */
-    execute_command(jobNode, async, true, false, piperead, 0);	// only wait for the last command if necessary /* 必要であれば、直前のコマンドを待つだけ */
-    close(piperead);
+/*
+** stage_sched():
+** ステージの CPU の割り当てと優先度を決める
+** コマンドに接頭辞 sched のオプションが付いていれば、argv から取り除いてそのステージの設定にする
+** (-j / -a はジョブの残りのステージにも使う)
+*/
+static void stage_sched(JobState* job, CommandInternal* cmdinternal, SchedHint* hint)
+{
+    hint->flags = 0;
+    if (cmdinternal != NULL && cmdinternal->argc > 1 && strcmp(cmdinternal->argv[0], "sched") == 0) {
+        int n = sched_parse(cmdinternal->argc, cmdinternal->argv, hint);
+        if (n > 0 && n < cmdinternal->argc) {
+            cmdinternal->argv += n;
+            cmdinternal->argc -= n;
+            if (hint->flags & SCHED_HINT_JOB)
+                job->sched = *hint;
+        }
+        else
+            hint->flags = 0; /* コマンドが無い・オプションが正しくない場合は、組み込みコマンドの sched が扱う */
+    }
+    sched_resolve(hint, &job->sched, job->async, job->stdin_pipe || job->stdout_pipe, job->stage);
 }
 
 /*
-** execute_job():
-** execute_cmdline から呼び出される
-** 第2引数のasyncの値は、同期実行にするか非同期実行にするかを切り替えるもの
-** 
+** start_group():
+** PLAN_GROUP_BEGIN: ここまでの PLAN_REDIRECT を、シェル自身のディスクリプタに適用する
+** 切り替える前のディスクリプタを slot に残し、PLAN_GROUP_END の slot_clear() で元に戻す
+** 開けなかったリダイレクトがあれば、そこまでの切り替えを戻して slot->saved を NULL のままにする
 */
-void execute_job(ASTreeNode* jobNode, bool async)
+static void start_group(JobState* job, PlanSlot* slot)
 {
-    if (jobNode == NULL)
+    slot_clear(slot);
+    if (job->nredirects == 0)
         return;
 
-    // printf("\t - execute_job here.\n");
-    // printf("\t - NODETYPE(jobNode->type): %d\n", NODETYPE(jobNode->type));
-    // printf("\t - jobNode->szData: %s\n", jobNode->szData);
-    // printf("\n");
+    int* saved = mem_alloc(MEM_EXECUTOR, sizeof(int) * job->nredirects);
+    if (!apply_redirects(job->redirects, job->nredirects, saved)) {
+        mem_free(saved);
+        return;
+    }
+    slot->redirects = mem_alloc(MEM_EXECUTOR, sizeof(Redirect) * job->nredirects);
+    memcpy(slot->redirects, job->redirects, sizeof(Redirect) * job->nredirects);
+    slot->saved = saved;
+    slot->nredirects = job->nredirects;
+}
 
-    switch (NODETYPE(jobNode->type))
-    {
-    case NODE_PIPE: /* '|' の場合 */
-        execute_pipeline(jobNode, async); /**/
-        break;
-    case NODE_CMDPATH: /* '|' がなく、単独のコマンドの場合 */
-    default:
-        execute_command(jobNode, async, false, false, 0, 0);
-        break;
+/*
+** spawn_subshell():
+** 実行計画の start から end の手前までを、子プロセスでひとつのステージとして実行する
+** パイプラインの途中やバックグラウンドで使われた制御構文を実行するために使う
+*/
+static pid_t spawn_subshell(Plan* plan, int start, int end, JobState* job)
+{
+    SchedHint hint;
+    stage_sched(job, NULL, &hint);
+    fflush(stdout); /* 出力途中のバッファが子プロセスに複製されないようにする */
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        restore_sigint_in_child();
+        job_enter_cgroup(job->job);
+        fanout_close_pending(); /* 他の消費側への複製は持たない */
+
+        if (job->async) { /* バックグラウンド処理の場合、標準入力は /dev/null にする */
+            int fd = open("/dev/null", O_RDWR);
+            if (fd != -1)
+                dup2(fd, STDIN_FILENO);
+        }
+        if (job->stdin_pipe)
+            dup2(job->pipe_read, STDIN_FILENO);
+        if (job->stdout_pipe) {
+            dup2(job->pipe_write, STDOUT_FILENO);
+            close(job->next_read);
+        }
+        if (!apply_redirects(job->redirects, job->nredirects, NULL)) /* ( ... ) > file などは、中身全体の出力先にする */
+            _exit(1);
+        sched_apply(&hint);
+
+        int status = execute_plan_range(plan, start, end);
+        fflush(stdout);
+        _exit(status); /* 親と共有している標準入力の読み込み位置を変えないように、exit()は使わない */
     }
+    else if (pid < 0)
+        perror("fork");
+
+    return pid;
 }
 
 /*
-** execute_cmdline():
-** execute_syntax_tree から呼び出される
-** 引数で渡された抽象構文木のnodeのtypeを見て処理を振り分ける
+** in_tail_position():
+** 実行計画の from から end の手前までに、終了を待つ・ジョブを区切る以外の命令が無いか
+** (分岐やループの途中、リダイレクトを付けた制御構文の中のコマンドは、後に命令が残るので当てはまらない)
 */
-void execute_cmdline(ASTreeNode* cmdline)
+static bool in_tail_position(Plan* plan, int from, int end)
 {
-    /* node がNULLのとき、実行すべきものがないのでreturn */
-    if (cmdline == NULL)
-        return;
+    int i;
+    for (i = from; i < end; i++)
+        if (plan->ops[i].type != PLAN_WAIT && plan->ops[i].type != PLAN_SEQ)
+            return false;
+    return true;
+}
 
-    // printf("\t - execute_cmdline here.\n");
-    // printf("\t - NODETYPE(cmdline->type): %d\n", NODETYPE(cmdline->type));
-    // printf("\t - cmdline->szData: %s\n", cmdline->szData);
-    // printf("\n");
+/*
+** run_plan():
+** 実行計画の start から end の手前までの命令を順に解釈し、最後の終了ステータスを返す
+** 木をたどり直すことはせず、ジョブの状態(JobState)と for / case の状態(PlanSlot)だけを持ち回る
+** 関数の中で return が実行されたら、残りの命令は解釈しない
+** tail であれば、最後に実行されるコマンドをシェル自身と置き換えて exec する( execute_plan_tail() )
+*/
+static int run_plan(Plan* plan, int start, int end, bool tail)
+{
+    JobState job;
+    memset(&job, 0, sizeof(job));
+
+    PlanSlot* slots = NULL;
+    if (plan->nslots > 0)
+        slots = mem_calloc(MEM_EXECUTOR, plan->nslots, sizeof(PlanSlot));
 
-    switch(NODETYPE(cmdline->type)) /* NODETYPEによって処理を振り分ける */
+    /* ジョブの区切りごとに、そのジョブで展開した文字列をまとめて捨てる */
+    VarMark mark = var_expand_mark();
+
+    int i;
+    for (i = start; i < end && !function_returning(); i++)
     {
-    case NODE_SEQ: /* ';' の場合  */
-        execute_job(cmdline->left, false); /* async(非同期実行) の引数をfalseにして、同期実行にする */
-        execute_cmdline(cmdline->right); /* 右の枝は再度解析するので、execute_cmdlineへ渡す */
-        break;
-
-    case NODE_BCKGRND: /* '&' の 場合 */
-        execute_job(cmdline->left, true); // job to be background /* asyncの引数をtrueにして、非同期実行にする */
-        execute_cmdline(cmdline->right); /* 右の枝は再度解析するので、execute_cmdlineへ渡す */
-        break;
-    default:
-        execute_job(cmdline, false); /* ';' や '&' がない単独のコマンドの場合 */
+        PlanOp* op = &plan->ops[i];
+        CommandInternal cmdinternal;
+        SchedHint sched;
+        int file_desc[2];
+        Redirect* redirect;
+        pid_t pid;
+
+        switch (op->type)
+        {
+        case PLAN_BACKGROUND:
+            job.async = true;
+            job.job = job_start(true); /* 子プロセスを cgroup に入れるので、起動する前に作る */
+            job.first_op = i + 1;
+            break;
+
+        case PLAN_REDIRECT:
+            if (job.nredirects == MAX_REDIRECTS) {
+                fprintf(stderr, "%s: too many redirections\n", op->target);
+                break;
+            }
+            redirect = &job.redirects[job.nredirects++];
+            redirect->fd = op->fd;
+            redirect->type = NODETYPE(ASTreeType(&plan->tree, op->node));
+            redirect->target = op->target;
+            if (ASTreeType(&plan->tree, op->node) & (NODE_EXPAND | NODE_GLOB)) /* ワイルドカードは展開しないが、クオートの印は取り除く */
+                redirect->target = var_expand(op->target);
+            break;
+
+        case PLAN_PIPE:
+            pipe(file_desc);
+            fcntl(file_desc[0], F_SETFD, FD_CLOEXEC); /* 読み込み側を出力側のコマンドが持っていると、 */
+            fcntl(file_desc[1], F_SETFD, FD_CLOEXEC); /* 読む側が先に終了しても SIGPIPE が届かない */
+            job.stdout_pipe = true;
+            job.pipe_write = file_desc[1];
+            job.next_read = file_desc[0];
+            break;
+
+        case PLAN_SPAWN:
+            init_command_internal(&plan->tree, op->node, &cmdinternal, job.async,
+                                  job.stdin_pipe, job.stdout_pipe, job.pipe_read, job.pipe_write,
+                                  job.redirects, job.nredirects);
+            cmdinternal.job = job.job;
+            stage_sched(&job, &cmdinternal, &sched);
+            cmdinternal.sched = &sched;
+            cmdinternal.threads = job.async ? NULL : &job.threads;
+            /* パイプやバックグラウンドではなく、回収していないジョブも無ければ、待つためだけのシェルは要らない */
+            cmdinternal.exec_in_place = tail && !job.async && !job.stdin_pipe && !job.stdout_pipe
+                && job.job == NULL && job_list() == NULL && in_tail_position(plan, i + 1, end);
+            pid = execute_command_internal(&cmdinternal);
+            destroy_command_internal(&cmdinternal);
+            finish_stage(&job, pid);
+            break;
+
+        case PLAN_SUBSHELL:
+            pid = spawn_subshell(plan, i + 1, op->jump, &job);
+            finish_stage(&job, pid);
+            i = op->jump - 1; /* 中身は子プロセスが実行したので、読み飛ばす */
+            break;
+
+        case PLAN_FANOUT:
+            slot_clear(&slots[op->slot]);
+            start_fanout(&job, &slots[op->slot], &plan->tree, op->node);
+            break;
+
+        case PLAN_FANOUT_BRANCH:
+            if (slots[op->slot].next < slots[op->slot].nfds) {
+                job.stdin_pipe = true;
+                job.pipe_read = slots[op->slot].fds[slots[op->slot].next++];
+                fanout_claim(job.pipe_read);
+            }
+            break;
+
+        case PLAN_FANOUT_END:
+            slot_clear(&slots[op->slot]);
+            break;
+
+        case PLAN_GROUP_BEGIN:
+            start_group(&job, &slots[op->slot]);
+            if (slots[op->slot].saved == NULL && job.nredirects > 0) {
+                var_set_status(1);
+                i = op->jump - 1; /* 開けなかったので、中身は実行しない */
+            }
+            job.nredirects = 0;
+            break;
+
+        case PLAN_GROUP_END:
+            slot_clear(&slots[op->slot]);
+            break;
+
+        case PLAN_FUNCDEF:
+            function_define(ASTreeData(&plan->tree, op->node), plan, i + 1, op->jump);
+            var_set_status(0);
+            i = op->jump - 1; /* 中身は呼び出されたときに実行する */
+            break;
+
+        case PLAN_WAIT:
+            wait_job(&job);
+            break;
+
+        case PLAN_SEQ:
+            end_job(&job, plan, i);
+            var_expand_release(mark);
+            break;
+
+        case PLAN_JUMP:
+            i = op->jump - 1;
+            break;
+
+        case PLAN_JUMP_IF_FALSE:
+            if (var_status() != 0)
+                i = op->jump - 1;
+            break;
+
+        case PLAN_JUMP_IF_TRUE:
+            if (var_status() == 0)
+                i = op->jump - 1;
+            break;
+
+        case PLAN_TRUE:
+            var_set_status(0);
+            break;
+
+        case PLAN_FOR_INIT:
+            slot_clear(&slots[op->slot]);
+            if (ASTreeLeft(&plan->tree, op->node) != AST_NULL)
+                slot_expand_words(&slots[op->slot], &plan->tree, ASTreeLeft(&plan->tree, op->node));
+            else { /* in が無ければ、位置パラメータについて繰り返す */
+                int j;
+                for (j = 1; j <= var_argc(); j++)
+                    slot_add_word(&slots[op->slot], var_arg(j));
+            }
+            var_expand_release(mark);
+            var_set_status(0);
+            break;
+
+        case PLAN_FOR_NEXT:
+            if (slots[op->slot].next < slots[op->slot].nwords)
+                var_set(ASTreeData(&plan->tree, op->node), slots[op->slot].words[slots[op->slot].next++]);
+            else {
+                slot_clear(&slots[op->slot]);
+                i = op->jump - 1;
+            }
+            break;
+
+        case PLAN_CASE_WORD:
+            slot_clear(&slots[op->slot]);
+            if (ASTreeType(&plan->tree, op->node) & (NODE_EXPAND | NODE_GLOB))
+                slot_add_word(&slots[op->slot], var_expand(ASTreeData(&plan->tree, op->node)));
+            else
+                slot_add_word(&slots[op->slot], ASTreeData(&plan->tree, op->node));
+            var_expand_release(mark);
+            break;
+
+        case PLAN_CASE_TEST:
+            if (!case_match(&slots[op->slot], &plan->tree, op->node))
+                i = op->jump - 1;
+            var_expand_release(mark);
+            break;
+        }
+    }
+
+    end_job(&job, plan, end); /* return や範囲の終わりで、ジョブの途中で抜けた場合 */
+    var_expand_release(mark);
+    if (slots != NULL) {
+        for (i = 0; i < plan->nslots; i++)
+            slot_clear(&slots[i]);
+        mem_free(slots);
     }
+    return var_status();
+}
+
+/*
+** execute_plan_range():
+** 実行計画の start から end の手前までの命令を順に解釈し、最後の終了ステータスを返す
+*/
+int execute_plan_range(Plan* plan, int start, int end)
+{
+    return run_plan(plan, start, end, false);
+}
+
+/*
+** execute_plan():
+** 実行計画の命令を先頭から順に解釈し、最後の終了ステータスを返す
+*/
+int execute_plan(Plan* plan)
+{
+    return execute_plan_range(plan, 0, plan->nops);
+}
+
+/*
+** execute_plan_tail():
+** シェルが最後に実行する実行計画( -c の文字列やスクリプトファイルの最後の行)を実行する
+** 最後に実行されるのが外部コマンドであれば、fork せずにシェル自身をそのコマンドに置き換えるので戻らない
+** (プロセスがひとつ減り、コマンドのシグナルや終了ステータスは呼び出し元にそのまま届く)
+*/
+int execute_plan_tail(Plan* plan)
+{
+    return run_plan(plan, 0, plan->nops, true);
 }
 
 /*
 ** execute_syntax_tree():
 ** shell.cから直接呼び出される関数
-** astのルートからコマンドの実行を開始する
+** 抽象構文木を実行計画にコンパイルして実行し、使い終わった計画は捨てる
 */
-void execute_syntax_tree(ASTreeNode* tree)
+void execute_syntax_tree(ASTree* tree, ASTreeIndex root)
 {
-	// interpret the syntax tree
-    execute_cmdline(tree);
+    Plan* plan = plan_compile(tree, root);
+    execute_plan(plan);
+    plan_release(plan);
 }
@@ -2,8 +2,12 @@
 #define EXECUTE_H
 
 #include "astree.h"
+#include "plan.h"
 #include <stdbool.h>
 
-void execute_syntax_tree(ASTreeNode* tree);
+int execute_plan(Plan* plan);
+int execute_plan_range(Plan* plan, int start, int end);
+int execute_plan_tail(Plan* plan);
+void execute_syntax_tree(ASTree* tree, ASTreeIndex root);
 
 #endif
\ No newline at end of file
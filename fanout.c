@@ -0,0 +1,263 @@
+#define _GNU_SOURCE /* tee() と splice() */
+#include "fanout.h"
+#include "command.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+/*
+** 出力の複製 ( command |{ job, job ... } )
+** 出力側のコマンドと消費側の各ジョブの間に、複製を受け持つ子プロセス(ポンプ)を置く
+**
+**   command --> [in] ポンプ --> [out 0] job 0
+**                          +--> [out 1] job 1 ...
+**
+** ポンプはデータをユーザー空間にコピーしない
+** tee() で in の先頭を各 out のパイプにページ単位で複製し、最後の1つには splice() で移す
+** (splice() で移した分だけ、in から取り除かれる)
+** tee() / splice() は出力先のパイプに空きが無ければ待つので、一番遅い消費側に合わせて
+** 出力側のコマンドも待たされる(バッファは各パイプの容量だけで、際限なく溜め込まない)
+**
+** 途中で終了した消費側への出力はやめて、残りの消費側にだけ送り続ける
+** すべての消費側が終了したら、ポンプも終了する(出力側のコマンドには SIGPIPE が届く)
+*/
+
+#define FANOUT_CHUNK 65536 /* 1回に複製する量。パイプの既定の容量と同じ */
+
+/*
+** まだ消費側に渡していない複製の読み込み側
+** 他の子プロセス(ポンプや子プロセスで実行する制御構文)が持ったままだと、その消費側が
+** 先に終了してもポンプが EPIPE に気付けないので、子プロセスではすべて閉じる
+** (exec するコマンドには close-on-exec で渡らない)
+*/
+static int* pending = NULL;
+static int npending = 0;
+static int cappending = 0;
+
+static void pending_add(int fd)
+{
+	if (npending == cappending) {
+		cappending = cappending == 0 ? 8 : cappending * 2;
+		pending = realloc(pending, sizeof(int) * cappending);
+	}
+	pending[npending++] = fd;
+}
+
+/*
+** fanout_claim():
+** 複製の読み込み側 fd を、消費側に渡した(または閉じる)ものとして一覧から外す
+*/
+void fanout_claim(int fd)
+{
+	int i;
+	for (i = 0; i < npending; i++)
+		if (pending[i] == fd) {
+			pending[i] = pending[--npending];
+			return;
+		}
+}
+
+/*
+** fanout_close_pending():
+** 子プロセスで、他の消費側のための複製の読み込み側を閉じる
+*/
+void fanout_close_pending()
+{
+	int i;
+	for (i = 0; i < npending; i++)
+		close(pending[i]);
+	npending = 0;
+}
+
+/* close-on-exec のパイプを作る。消費側のコマンドに、他の消費側のパイプを渡さないようにする */
+static int cloexec_pipe(int fds[2])
+{
+	if (pipe(fds) == -1)
+		return -1;
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+/* len バイトをすべて書き込む。相手が終了していれば false */
+static bool write_all(int fd, const char* buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* in の先頭の len バイトを、すべて読み込む(捨てる場合は出力先が無い) */
+static bool read_all(int fd, char* buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = read(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*
+** fanout_pump():
+** in の内容を、outs のすべてのパイプに複製する。ポンプの子プロセスの本体
+** tee() が途中までしか複製できなかった出力先がある回だけ、in から読み込んで残りを write() する
+*/
+static void fanout_pump(int in, int* outs, int n)
+{
+	static char buf[FANOUT_CHUNK];
+	size_t* sent = calloc(n, sizeof(size_t));
+	int alive = n;
+	int k;
+
+	while (alive > 0) {
+		int lead = 0, mover = n - 1; /* 最初に tee() する出力先と、最後に splice() で移す出力先 */
+		while (outs[lead] == -1)
+			lead++;
+		while (outs[mover] == -1)
+			mover--;
+
+		/* 最初の出力先への tee() で、in にデータが来るのを待つ */
+		ssize_t len;
+		if (lead == mover)
+			len = splice(in, NULL, outs[mover], NULL, FANOUT_CHUNK, SPLICE_F_MOVE);
+		else
+			len = tee(in, outs[lead], FANOUT_CHUNK, 0);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len == -1 && errno == EPIPE) {
+			close(outs[lead]);
+			outs[lead] = -1;
+			alive--;
+			continue;
+		}
+		if (len <= 0)
+			break; /* 入力の終わり */
+		if (lead == mover)
+			continue;
+
+		bool partial = false;
+		sent[lead] = len;
+		for (k = lead + 1; k < mover; k++) {
+			if (outs[k] == -1)
+				continue;
+			ssize_t got;
+			do
+				got = tee(in, outs[k], len, 0);
+			while (got == -1 && errno == EINTR);
+			if (got == -1 && errno == EPIPE) {
+				close(outs[k]);
+				outs[k] = -1;
+				alive--;
+				continue;
+			}
+			sent[k] = got > 0 ? got : 0;
+			if (sent[k] < (size_t)len)
+				partial = true;
+		}
+
+		/* すべての出力先に複製できたので、最後の出力先には in から移す */
+		size_t moved = 0;
+		while (!partial && moved < (size_t)len) {
+			ssize_t m = splice(in, NULL, outs[mover], NULL, len - moved, SPLICE_F_MOVE);
+			if (m == -1 && errno == EINTR)
+				continue;
+			if (m <= 0) { /* 最後の出力先が終了した。残りは読み込んで捨てる */
+				close(outs[mover]);
+				outs[mover] = -1;
+				alive--;
+				break;
+			}
+			moved += m;
+		}
+		if (moved == (size_t)len)
+			continue;
+
+		/* 複製しきれなかった分は、in から読み込んで書き込む */
+		if (!read_all(in, buf, len - moved))
+			break;
+		for (k = lead; k <= mover; k++) {
+			if (outs[k] == -1)
+				continue;
+			size_t from = k == mover ? moved : sent[k]; /* buf の先頭は in の moved バイト目 */
+			if (from < (size_t)len && !write_all(outs[k], buf + (from - moved), len - from)) {
+				close(outs[k]);
+				outs[k] = -1;
+				alive--;
+			}
+		}
+	}
+	free(sent);
+}
+
+/*
+** fanout_spawn():
+** 出力側のコマンドの出力を読むパイプ in から、n 個の消費側へ複製するポンプの子プロセスを作り、pid を返す
+** read_fds には各消費側の標準入力にするディスクリプタを返す。in は子プロセスに渡し終えたら閉じる
+** read_fds は、消費側に渡すときか閉じるときに fanout_claim() で一覧から外す
+** ポンプは job に入れて、ジョブの他のプロセスと一緒に待つ
+*/
+pid_t fanout_spawn(Job* job, int in, int n, int* read_fds)
+{
+	int* writes = malloc(sizeof(int) * n);
+	pid_t pid;
+	int k;
+
+	for (k = 0; k < n; k++) {
+		int out[2];
+		if (cloexec_pipe(out) == -1) {
+			perror("pipe");
+			while (k-- > 0) {
+				close(read_fds[k]);
+				close(writes[k]);
+			}
+			close(in);
+			free(writes);
+			return -1;
+		}
+		read_fds[k] = out[0];
+		writes[k] = out[1];
+	}
+
+	fflush(stdout); /* 出力途中のバッファが子プロセスに複製されないようにする */
+	pid = fork();
+	if (pid == 0) {
+		restore_sigint_in_child();
+		job_enter_cgroup(job);
+		signal(SIGPIPE, SIG_IGN); /* 終了した消費側は EPIPE で知る */
+		fanout_close_pending();
+		for (k = 0; k < n; k++)
+			close(read_fds[k]);
+		fanout_pump(in, writes, n);
+		_exit(0);
+	}
+
+	close(in);
+	for (k = 0; k < n; k++)
+		close(writes[k]);
+	free(writes);
+	if (pid < 0) {
+		perror("fork");
+		for (k = 0; k < n; k++)
+			close(read_fds[k]);
+		return pid;
+	}
+	for (k = 0; k < n; k++)
+		pending_add(read_fds[k]);
+	return pid;
+}
@@ -0,0 +1,11 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include "jobs.h"
+#include <sys/types.h>
+
+pid_t fanout_spawn(Job* job, int in, int n, int* read_fds);
+void fanout_claim(int fd);
+void fanout_close_pending();
+
+#endif
@@ -0,0 +1,137 @@
+#include "function.h"
+#include "execute.h"
+#include "var.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+** シェル関数の表
+** 関数名をキーにした、チェイン法のハッシュ表
+** コマンドを実行するたびに引くので、関数が定義されていなければすぐに戻る
+*/
+static Function** function_table = NULL;
+static unsigned int function_buckets = 0; /* バケットの数(2のべき乗) */
+static unsigned int function_count = 0;
+
+static int function_depth = 0; /* 実行中の関数の入れ子の深さ */
+static bool return_requested = false; /* 組み込みコマンド return が実行された */
+
+/* FNV-1a ハッシュ */
+static uint32_t function_hash(const char* s)
+{
+	uint32_t h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+/* 関数の数がバケットの数を超えたら、バケットを倍に増やして入れ直す */
+static void function_grow()
+{
+	unsigned int nbuckets = function_buckets ? function_buckets * 2 : 32;
+	Function** table = calloc(nbuckets, sizeof(Function*));
+	unsigned int i;
+
+	for (i = 0; i < function_buckets; i++) {
+		Function* f = function_table[i];
+		while (f != NULL) {
+			Function* next = f->next;
+			uint32_t h = function_hash(f->name) & (nbuckets - 1);
+			f->next = table[h];
+			table[h] = f;
+			f = next;
+		}
+	}
+	free(function_table);
+	function_table = table;
+	function_buckets = nbuckets;
+}
+
+/* 関数を探す。定義されていなければNULL */
+Function* function_lookup(const char* name)
+{
+	if (function_count == 0)
+		return NULL;
+
+	Function* f = function_table[function_hash(name) & (function_buckets - 1)];
+	for (; f != NULL; f = f->next)
+		if (strcmp(f->name, name) == 0)
+			return f;
+	return NULL;
+}
+
+/*
+** function_define():
+** 関数を定義する。同じ名前の関数があれば置き換える
+** 中身の命令は plan の start から end の手前まで。plan への参照をひとつ持つ
+*/
+void function_define(const char* name, Plan* plan, int start, int end)
+{
+	Function* f = function_lookup(name);
+
+	plan_retain(plan);
+	if (f != NULL)
+		plan_release(f->plan); /* 実行中であれば、function_call() が持っている参照で残る */
+	else {
+		if (function_count + 1 > function_buckets)
+			function_grow();
+
+		f = malloc(sizeof(*f));
+		f->name = strdup(name);
+		uint32_t h = function_hash(name) & (function_buckets - 1);
+		f->next = function_table[h];
+		function_table[h] = f;
+		function_count++;
+	}
+
+	f->plan = plan;
+	f->start = start;
+	f->end = end;
+}
+
+/*
+** function_call():
+** 関数を現在のシェルのプロセスで実行し、終了ステータスを返す
+** argv[0] は関数名で、argv[1] 以降が位置パラメータ $1 $2 ... になる
+*/
+int function_call(Function* func, int argc, char** argv)
+{
+	/* 実行中に関数が定義し直されても、中身の命令が解放されないようにする */
+	Plan* plan = func->plan;
+	int start = func->start, end = func->end;
+	plan_retain(plan);
+
+	VarArgs saved = var_push_args(argc - 1, argv + 1);
+	function_depth++;
+
+	int status = execute_plan_range(plan, start, end);
+	if (return_requested) {
+		return_requested = false;
+		status = var_status(); /* return で指定された終了ステータス */
+	}
+
+	function_depth--;
+	var_pop_args(saved);
+	plan_release(plan);
+	return status;
+}
+
+/*
+** function_request_return():
+** 組み込みコマンド return から呼び出され、実行中の関数から戻るように要求する
+** 関数の外であれば false を返す
+*/
+bool function_request_return()
+{
+	if (function_depth == 0)
+		return false;
+	return_requested = true;
+	return true;
+}
+
+/* return が要求されているか。実行計画のインタプリタは、これが true なら命令の解釈をやめる */
+bool function_returning()
+{
+	return return_requested;
+}
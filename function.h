@@ -0,0 +1,27 @@
+#ifndef FUNCTION_H
+#define FUNCTION_H
+
+#include <stdbool.h>
+#include "plan.h"
+
+/*
+** Function:
+** シェル関数。定義した行の実行計画の中にある、関数の中身の命令の範囲を指す
+** 実行計画は参照カウントで保持するので、キャッシュから追い出されても中身は残る
+*/
+typedef struct Function
+{
+	char* name;
+	Plan* plan; /* 関数の中身を含む実行計画 */
+	int start; /* 中身の最初の命令の位置 */
+	int end; /* 中身の最後の命令の次の位置 */
+	struct Function* next; /* 同じバケットに入る次の関数 */
+} Function;
+
+void function_define(const char* name, Plan* plan, int start, int end);
+Function* function_lookup(const char* name);
+int function_call(Function* func, int argc, char** argv);
+bool function_request_return();
+bool function_returning();
+
+#endif
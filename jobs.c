@@ -0,0 +1,505 @@
+#include "jobs.h"
+#include "cmdstats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/*
+** ジョブの管理
+** フォアグラウンドのジョブは終了を待つまでの間だけ、バックグラウンドのジョブは終了を回収するまで一覧に残す
+** プロセスの回収には wait4() を使い、終了したプロセスの資源の使用量をジョブごとに合計する
+** (SIGCHLDのハンドラで回収すると、フォアグラウンドのプロセスまで回収してしまうので、
+**  バックグラウンドのジョブはプロンプトを表示する前にまとめて回収する)
+**
+** cgroup v2 の階層がこのユーザーに委譲されていて書き込める場合は、
+** バックグラウンドのジョブごとに cgroup を作り、子プロセスを fork の直後にそこへ移す
+** 使えない場合は cgroup を作らないだけで、ジョブの実行と資源の集計はそのまま行う
+*/
+
+static Job* jobs = NULL; /* バックグラウンドのジョブの一覧(起動した順) */
+
+static int cgroup_state = 0; /* 0: まだ調べていない、1: 使える、-1: 使えない */
+static char* cgroup_root = NULL; /* シェルが属している cgroup のディレクトリ。ジョブの cgroup はこの下に作る */
+
+/* ファイルに文字列を書き込む */
+static bool write_file(const char* path, const char* value)
+{
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	bool ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+	close(fd);
+	return ok;
+}
+
+/* cgroup2 がマウントされている場所を探す */
+static char* cgroup2_mount()
+{
+	FILE* fp = fopen("/proc/self/mounts", "re");
+	if (fp == NULL)
+		return NULL;
+
+	char* line = NULL;
+	size_t len = 0;
+	char* mount = NULL;
+	while (mount == NULL && getline(&line, &len, fp) > 0) {
+		char dir[4096], type[64];
+		if (sscanf(line, "%*s %4095s %63s", dir, type) == 2 && strcmp(type, "cgroup2") == 0)
+			mount = strdup(dir);
+	}
+	free(line);
+	fclose(fp);
+	return mount;
+}
+
+/* /proc/self/cgroup から、cgroup v2 の階層でのシェルの位置( "0::/..." )を読む */
+static char* cgroup2_path()
+{
+	FILE* fp = fopen("/proc/self/cgroup", "re");
+	if (fp == NULL)
+		return NULL;
+
+	char* line = NULL;
+	size_t len = 0;
+	char* path = NULL;
+	while (path == NULL && getline(&line, &len, fp) > 0) {
+		if (strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = 0;
+			path = strdup(line + 3);
+		}
+	}
+	free(line);
+	fclose(fp);
+	return path;
+}
+
+/* subtree_control に書けるコントローラー */
+#define CGROUP_CPU 1
+#define CGROUP_MEMORY 2
+
+static int cgroup_controllers = 0; /* 子の cgroup で有効になっているコントローラー */
+static int cgroup_enabled_here = 0; /* そのうち、このシェルが有効にしたもの */
+static char* cgroup_leaf = NULL; /* シェル自身を移した葉の cgroup のディレクトリ。移していなければ NULL */
+static pid_t cgroup_owner = 0; /* 葉の cgroup に移ったシェルのプロセス(子プロセスでは片付けない) */
+
+/* path のファイルの内容(空白区切り)に word があるか */
+static bool file_has_word(const char* path, const char* word)
+{
+	FILE* fp = fopen(path, "re");
+	if (fp == NULL)
+		return false;
+	char buf[64];
+	bool found = false;
+	while (!found && fscanf(fp, "%63s", buf) == 1)
+		found = strcmp(buf, word) == 0;
+	fclose(fp);
+	return found;
+}
+
+/* シェル自身を葉の cgroup に移す */
+static bool cgroup_enter_leaf()
+{
+	char file[4096];
+	cgroup_leaf = malloc(strlen(cgroup_root) + 32);
+	sprintf(cgroup_leaf, "%s/mysh-%d", cgroup_root, (int)getpid());
+	snprintf(file, sizeof(file), "%s/cgroup.procs", cgroup_leaf);
+	if ((mkdir(cgroup_leaf, 0755) == 0 || errno == EEXIST) && write_file(file, "0")) {
+		cgroup_owner = getpid();
+		return true;
+	}
+	rmdir(cgroup_leaf);
+	free(cgroup_leaf);
+	cgroup_leaf = NULL;
+	return false;
+}
+
+/* cgroup_root に、葉の cgroup 以外の子の cgroup があるか(ほかのシェルやジョブがコントローラーを使っているかもしれない) */
+static bool cgroup_has_other_children()
+{
+	DIR* dir = opendir(cgroup_root);
+	if (dir == NULL)
+		return true;
+	const char* leaf = strrchr(cgroup_leaf, '/') + 1;
+	struct dirent* ent;
+	bool found = false;
+	while (!found && (ent = readdir(dir)) != NULL)
+		found = ent->d_type == DT_DIR && strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0
+			&& strcmp(ent->d_name, leaf) != 0;
+	closedir(dir);
+	return found;
+}
+
+/*
+** job_cgroup_release():
+** シェルを葉の cgroup から元の cgroup に戻し、葉の cgroup を削除する
+** 終了時( atexit )と、シェルが exec でコマンドに置き換わる前に呼び出す
+** 元の cgroup では、このシェルが有効にしたコントローラーを、ほかに子の cgroup が無ければ無効に戻す
+** (コントローラーが有効な cgroup にはプロセスを置けないので、戻せなければ葉の cgroup を残す)
+*/
+void job_cgroup_release()
+{
+	if (cgroup_leaf == NULL || getpid() != cgroup_owner)
+		return;
+
+	char file[4096];
+	if (cgroup_enabled_here != 0 && !cgroup_has_other_children()) {
+		snprintf(file, sizeof(file), "%s/cgroup.subtree_control", cgroup_root);
+		if (cgroup_enabled_here & CGROUP_CPU)
+			write_file(file, "-cpu");
+		if (cgroup_enabled_here & CGROUP_MEMORY)
+			write_file(file, "-memory");
+	}
+	snprintf(file, sizeof(file), "%s/cgroup.procs", cgroup_root);
+	if (write_file(file, "0"))
+		rmdir(cgroup_leaf);
+	free(cgroup_leaf);
+	cgroup_leaf = NULL;
+}
+
+/*
+** コントローラー name を子の cgroup で使えるようにする。使えるようになれば cgroup_controllers に bit を加える
+** cgroup v2 では、プロセスが属している cgroup の子でコントローラーを有効にできない(EBUSY)
+** その場合は、シェル自身を葉の cgroup に移してから有効にする
+*/
+static void cgroup_enable(const char* name, int bit)
+{
+	char file[4096], value[32];
+	snprintf(file, sizeof(file), "%s/cgroup.subtree_control", cgroup_root);
+	if (file_has_word(file, name)) {
+		cgroup_controllers |= bit;
+		return;
+	}
+
+	snprintf(value, sizeof(value), "+%s", name);
+	bool ok = write_file(file, value);
+	if (!ok && errno == EBUSY && cgroup_leaf == NULL && cgroup_enter_leaf())
+		ok = write_file(file, value);
+	if (ok) {
+		cgroup_controllers |= bit;
+		cgroup_enabled_here |= bit;
+	}
+}
+
+/*
+** cgroup_init():
+** ジョブの cgroup を作れるかを調べ、cpu と memory のコントローラーを子の cgroup で使えるようにする
+** どちらも有効にできなければ、ジョブの cgroup は使わない(葉の cgroup に移っていれば戻す)
+** 環境変数 MYSH_NO_CGROUP があれば使わない
+*/
+static void cgroup_init()
+{
+	cgroup_state = -1;
+	if (getenv("MYSH_NO_CGROUP") != NULL)
+		return;
+
+	char* mount = cgroup2_mount();
+	char* path = cgroup2_path();
+	if (mount != NULL && path != NULL) {
+		cgroup_root = malloc(strlen(mount) + strlen(path) + 1);
+		strcpy(cgroup_root, mount);
+		if (strcmp(path, "/") != 0)
+			strcat(cgroup_root, path);
+	}
+	free(mount);
+	free(path);
+	if (cgroup_root == NULL || access(cgroup_root, W_OK) != 0) {
+		free(cgroup_root);
+		cgroup_root = NULL;
+		return;
+	}
+
+	cgroup_enable("cpu", CGROUP_CPU);
+	cgroup_enable("memory", CGROUP_MEMORY); /* 片方だけ有効にできた場合は、もう片方を limit で設定できないだけ */
+	if (cgroup_leaf != NULL)
+		atexit(job_cgroup_release);
+
+	if (cgroup_controllers == 0) {
+		job_cgroup_release();
+		return;
+	}
+	cgroup_state = 1;
+}
+
+/* ジョブの cgroup を作る。作れなければ NULL */
+static char* cgroup_create(int id)
+{
+	if (cgroup_state == 0)
+		cgroup_init();
+	if (cgroup_state < 0)
+		return NULL;
+
+	char* dir = malloc(strlen(cgroup_root) + 64);
+	sprintf(dir, "%s/mysh-%d-job%d", cgroup_root, (int)getpid(), id);
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		free(dir);
+		return NULL;
+	}
+	return dir;
+}
+
+/*
+** job_cgroup_available():
+** cgroup v2 でジョブの cgroup を作れるか
+*/
+bool job_cgroup_available()
+{
+	if (cgroup_state == 0)
+		cgroup_init();
+	return cgroup_state > 0;
+}
+
+/* 使われていない一番小さいジョブ番号 */
+static int next_job_id()
+{
+	int id = 1;
+	Job* job;
+	for (job = jobs; job != NULL; job = job->next)
+		if (job->id >= id)
+			id = job->id + 1;
+	return id;
+}
+
+/*
+** job_start():
+** ジョブを作る。バックグラウンドのジョブは一覧に加え、cgroup を作る
+*/
+Job* job_start(bool background)
+{
+	Job* job = calloc(1, sizeof(Job));
+	if (!background)
+		return job;
+
+	job->id = next_job_id();
+	job->cgroup = cgroup_create(job->id);
+
+	Job** tail = &jobs;
+	while (*tail != NULL)
+		tail = &(*tail)->next;
+	*tail = job;
+	return job;
+}
+
+/* jobs で表示するコマンドラインを設定する。command はジョブが引き取る */
+void job_set_command(Job* job, char* command)
+{
+	free(job->command);
+	job->command = command;
+}
+
+/*
+** job_add_process():
+** 起動したプロセスをジョブに加える。最後に加えたものが最後のステージになる
+*/
+void job_add_process(Job* job, pid_t pid)
+{
+	if (job->npids == job->cappids) {
+		job->cappids = job->cappids ? job->cappids * 2 : 8;
+		job->pids = realloc(job->pids, sizeof(pid_t) * job->cappids);
+	}
+	job->pids[job->npids++] = pid;
+	job->nrunning++;
+	job->last_pid = pid;
+}
+
+/*
+** job_enter_cgroup():
+** forkした子プロセスで呼び出し、自分をジョブの cgroup に移す
+** exec する前に移すので、そこから起動されるプロセスもすべてジョブの cgroup に入る
+*/
+void job_enter_cgroup(Job* job)
+{
+	if (job == NULL || job->cgroup == NULL)
+		return;
+
+	char file[4096];
+	snprintf(file, sizeof(file), "%s/cgroup.procs", job->cgroup);
+	write_file(file, "0");
+}
+
+/* バックグラウンドのジョブを起動したことを表示する */
+void job_announce(Job* job)
+{
+	printf("[%d] %d\n", job->id, (int)job->last_pid);
+}
+
+/* 終了したプロセスの資源の使用量を、ジョブの合計に加える */
+static void add_usage(struct rusage* total, const struct rusage* ru)
+{
+	timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+	timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+	if (ru->ru_maxrss > total->ru_maxrss)
+		total->ru_maxrss = ru->ru_maxrss;
+	total->ru_minflt += ru->ru_minflt;
+	total->ru_majflt += ru->ru_majflt;
+	total->ru_inblock += ru->ru_inblock;
+	total->ru_oublock += ru->ru_oublock;
+	total->ru_nvcsw += ru->ru_nvcsw;
+	total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* waitpid() の status を、$? に入れる終了ステータスに変換する */
+static int exit_status(int status)
+{
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+/*
+** reap():
+** ジョブの i 番目のプロセスの終了を回収する。回収したら(既に回収されていた場合も) true
+*/
+static bool reap(Job* job, int i, int options)
+{
+	struct rusage ru;
+	int status;
+	pid_t r;
+
+	while ((r = wait4(job->pids[i], &status, options, &ru)) < 0 && errno == EINTR);
+	if (r == 0)
+		return false; /* まだ実行中 */
+
+	if (r > 0) {
+		add_usage(&job->usage, &ru);
+		cmdstats_reaped(r);
+	}
+	if (job->pids[i] == job->last_pid)
+		job->status = r > 0 ? exit_status(status) : 0;
+	job->pids[i] = 0; /* 回収済み */
+	job->nrunning--;
+	return true;
+}
+
+/*
+** job_wait():
+** ジョブのプロセスがすべて終了するのを待ち、最後のステージの終了ステータスを返す
+*/
+int job_wait(Job* job)
+{
+	int i;
+	for (i = 0; i < job->npids; i++)
+		if (job->pids[i] != 0)
+			reap(job, i, 0);
+	return job->status;
+}
+
+/*
+** job_free():
+** ジョブを一覧から外して解放する
+** cgroup は、中のプロセスがすべて終了していれば削除する
+*/
+void job_free(Job* job)
+{
+	Job** p;
+	for (p = &jobs; *p != NULL; p = &(*p)->next) {
+		if (*p == job) {
+			*p = job->next;
+			break;
+		}
+	}
+
+	if (job->cgroup != NULL)
+		rmdir(job->cgroup);
+	free(job->cgroup);
+	free(job->command);
+	free(job->pids);
+	free(job);
+}
+
+/*
+** job_reap():
+** 終了したバックグラウンドのジョブを回収して一覧から外す
+** notify が true なら、終了したジョブを表示する
+*/
+void job_reap(bool notify)
+{
+	Job* job = jobs;
+	while (job != NULL) {
+		Job* next = job->next;
+		int i;
+		for (i = 0; i < job->npids; i++)
+			if (job->pids[i] != 0)
+				reap(job, i, WNOHANG);
+
+		if (job->nrunning == 0) {
+			if (notify) {
+				if (job->status == 0)
+					printf("[%d] Done\t%s\n", job->id, job->command != NULL ? job->command : "");
+				else
+					printf("[%d] Exit %d\t%s\n", job->id, job->status, job->command != NULL ? job->command : "");
+			}
+			job_free(job);
+		}
+		job = next;
+	}
+}
+
+/*
+** job_find():
+** %N または N で指定したバックグラウンドのジョブを返す。spec が NULL なら最後に起動したジョブ
+*/
+Job* job_find(const char* spec)
+{
+	Job* job;
+	Job* last = NULL;
+
+	if (spec != NULL && *spec == '%')
+		spec++;
+	for (job = jobs; job != NULL; job = job->next) {
+		if (spec != NULL && job->id == atoi(spec))
+			return job;
+		last = job;
+	}
+	return spec == NULL ? last : NULL;
+}
+
+/* バックグラウンドのジョブの一覧の先頭 */
+Job* job_list()
+{
+	return jobs;
+}
+
+/*
+** job_cgroup_read():
+** ジョブの cgroup のファイルの内容を buf に読み込む。末尾の改行は取り除く
+** cgroup が無い場合や、ファイルが無い(コントローラーが有効でない)場合は NULL
+*/
+const char* job_cgroup_read(Job* job, const char* file, char* buf, size_t size)
+{
+	if (job->cgroup == NULL)
+		return NULL;
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", job->cgroup, file);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+	ssize_t n = read(fd, buf, size - 1);
+	close(fd);
+	if (n < 0)
+		return NULL;
+	buf[n] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	return buf;
+}
+
+/*
+** job_cgroup_write():
+** ジョブの cgroup のファイルに値を書き込む
+*/
+bool job_cgroup_write(Job* job, const char* file, const char* value)
+{
+	if (job->cgroup == NULL)
+		return false;
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%s", job->cgroup, file);
+	return write_file(path, value);
+}
@@ -0,0 +1,44 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/*
+** Job:
+** ひとつのジョブ(パイプラインでつながったプロセスの集まり)
+** 終了したプロセスの資源の使用量(wait4() の rusage)を、ジョブ全体で合計していく
+** バックグラウンドのジョブは、cgroup v2 を使える場合はジョブごとの cgroup に入れる
+*/
+typedef struct Job
+{
+	int id; /* ジョブ番号 ( %1 %2 ... )。フォアグラウンドのジョブは 0 */
+	char* command; /* jobs で表示するコマンドライン */
+	pid_t* pids; /* ジョブのプロセス */
+	int npids, cappids;
+	int nrunning; /* まだ終了していないプロセスの数 */
+	pid_t last_pid; /* 最後のステージのプロセス。ジョブの終了ステータスになる */
+	int status; /* 最後のステージの終了ステータス */
+	struct rusage usage; /* 終了したプロセスの資源の使用量の合計 */
+	char* cgroup; /* ジョブの cgroup のディレクトリ。使えない場合は NULL */
+	struct Job* next; /* ジョブの一覧の次のジョブ */
+} Job;
+
+Job* job_start(bool background);
+void job_set_command(Job* job, char* command);
+void job_add_process(Job* job, pid_t pid);
+void job_enter_cgroup(Job* job);
+void job_announce(Job* job);
+int job_wait(Job* job);
+void job_free(Job* job);
+void job_reap(bool notify);
+Job* job_find(const char* spec);
+Job* job_list();
+
+bool job_cgroup_available();
+const char* job_cgroup_read(Job* job, const char* file, char* buf, size_t size);
+bool job_cgroup_write(Job* job, const char* file, const char* value);
+void job_cgroup_release();
+
+#endif
@@ -2,7 +2,10 @@
 #include <glob.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include "lexer.h"
+#include "arith.h"
+#include "memstats.h"
 
 
 /*
@@ -70,6 +73,12 @@ int getchartype(char c)
 		case '<':
 			return CHAR_LESSER;
 			break;
+		case '(':
+			return CHAR_LPAREN;
+			break;
+		case ')':
+			return CHAR_RPAREN;
+			break;
 		case 0:
 			return CHAR_NULL;
 			break;
@@ -80,15 +89,68 @@ int getchartype(char c)
 	return CHAR_GENERAL;
 }
 
-/* クオートを取り除く処理 */
-void strip_quotes(char* src, char* dest)
+/*
+** subst_span():
+** "$(" の '(' の位置を受け取り、対応する ')' までの文字数( ')' を含む)を返す
+** 中のクオートの中にあるかっこは数えない。閉じていなければ 0
+*/
+int subst_span(const char* s)
 {
-	int n = strlen(src);
-	if (n <= 1) { /* コピー元の文字列の長さが0,または1のとき、複製だけして終了 */
-		strcpy(dest, src);
-		return;
+	int depth = 0;
+	char lastquote = 0;
+	int i;
+
+	for (i = 0; s[i]; i++)
+	{
+		char c = s[i];
+		if (lastquote != 0) {
+			if (c == lastquote)
+				lastquote = 0;
+		}
+		else if (c == '\'' || c == '\"')
+			lastquote = c;
+		else if (c == '(')
+			depth++;
+		else if (c == ')' && --depth == 0)
+			return i + 1;
 	}
-	
+	return 0;
+}
+
+/*
+** raw_span():
+** s が $( ... ) または ` ... ` の始まりであれば、閉じるところまでの文字数を返す。そうでなければ 0
+** この範囲は実行時にコマンドラインとして解釈するので、字句解析ではそのまま1つの単語の中に写す
+*/
+static int raw_span(const char* s)
+{
+	if (s[0] == '$' && s[1] == '(') {
+		int span = subst_span(s + 1);
+		return span > 0 ? span + 1 : 0;
+	}
+	if (s[0] == '`') {
+		const char* close = strchr(s + 1, '`');
+		return close != NULL ? close + 1 - s : 0;
+	}
+	return 0;
+}
+
+/* 実行時の展開で意味を持つので、クオートの中では CHAR_QUOTED を前に置いて区別する文字 */
+static bool quoted_special(char c)
+{
+	return c != 0 && strchr("$`*?[~\\", c) != NULL;
+}
+
+/*
+** strip_quotes():
+** クオートを取り除く処理
+** mark が true なら、クオートの中の特殊文字の前に CHAR_QUOTED を置く(実行時の展開で文字として扱う)
+** 字句解析でエスケープした文字( CHAR_QUOTED と1文字)は、mark が true ならそのまま、false なら文字だけを写す
+** dest には src の2倍の長さが必要
+*/
+void strip_quotes(char* src, char* dest, bool mark)
+{
+	int n = strlen(src);
 	int i; /* srcのインデックス */
 	char lastquote = 0; /* 直前に合ったのが、ダブルクオートかシングルクオート化 */
 	int j = 0; /* destのインデックス */
@@ -96,34 +158,89 @@ void strip_quotes(char* src, char* dest)
 	for (i=0; i < n; i++) /* srcの最後(n文字目)まで1文字ずつ処理 */
 	{
 		char c = src[i];
+		int span;
+		if (c == CHAR_QUOTED && i + 1 < n) { /* エスケープした文字 */
+			if (mark)
+				dest[j++] = c;
+			dest[j++] = src[++i];
+			continue;
+		}
+		if (lastquote != '\'' && (span = raw_span(src + i)) > 0) { /* $( ... ) の中は実行時に解釈するので、そのまま写す */
+			memcpy(dest + j, src + i, span);
+			j += span;
+			i += span - 1;
+			continue;
+		}
 		if ((c == '\'' || c == '\"') && lastquote == 0) /* 最初にクオートを見つけたら、lastquoteに記憶して読み飛ばし */
 			lastquote = c;
 		else if (c == lastquote) /* 直前に現れたクオートと同じなら、lastquoteをリセットして読み飛ばし */
 			lastquote = 0;
-		else
+		else {
+			/* ダブルクオートの中の '$' と '`' は展開するので、印を付けない( "$?" "$*" の '$' の次の文字も) */
+			bool active = lastquote == '\"' && (c == '$' || c == '`' || (i > 0 && src[i - 1] == '$' && (i < 2 || src[i - 2] != CHAR_QUOTED)));
+			if (mark && lastquote != 0 && quoted_special(c) && !active)
+				dest[j++] = CHAR_QUOTED;
 			dest[j++] = c; /* クオート以外の文字、またはlastquoteに記憶したクオートと違う種類のものだったら、destにコピー */
+		}
 	}
 	
 	dest[j] = 0; /* 末尾に終端文字をつける */
 }
 
+/*
+** word_flags():
+** クオートを取り除く前の単語を調べ、実行時に必要な展開の種類(TOK_EXPAND / TOK_GLOB)を返す
+** シングルクオートの中の '$' は展開しない。クオートの中のワイルドカードと、エスケープした文字も展開しない
+*/
+int word_flags(const char* word)
+{
+	int flags = 0;
+	char lastquote = 0;
+	int i;
+
+	for (i = 0; word[i]; i++)
+	{
+		char c = word[i];
+		if (c == CHAR_QUOTED && word[i + 1] != 0) /* エスケープした文字は展開しない */
+			i++;
+		else if ((c == '\'' || c == '\"') && lastquote == 0)
+			lastquote = c;
+		else if (c == lastquote)
+			lastquote = 0;
+		else if ((c == '$' || c == '`') && lastquote != '\'') {
+			flags |= TOK_EXPAND;
+			int span = raw_span(word + i); /* $( ... ) の中の文字はワイルドカードとして扱わない */
+			if (span > 0)
+				i += span - 1;
+		}
+		else if ((c == '*' || c == '?' || (c == '~' && i == 0)) && lastquote == 0)
+			flags |= TOK_GLOB;
+		else if (c == '[' && lastquote == 0 && strchr(word + i + 1, ']') != NULL)
+			flags |= TOK_GLOB; /* 閉じていない '[' (コマンドの [ など)は文字として扱う */
+	}
+	return flags;
+}
+
 /* tokenの内容を初期化する */
 void tok_init(tok_t* tok, int datasize)
 {
 	/* 入力された文字列がひとつのtokenだった場合に備えて、最大サイズ + 1で領域を確保する */
-	tok->data = malloc(datasize + 1); // 1 for null terminator
+	tok->data = mem_alloc(MEM_LEXER, datasize + 1); // 1 for null terminator
 	tok->data[0] = 0;
 	
 	/* いったん、内容をNULLにしておく */
 	tok->type = CHAR_NULL;
+	tok->flags = 0;
 	tok->next = NULL;
 }
 
+/* 連結リストをたどって、末尾までのtokenを解放する(長い行でもスタックを使わないように、ループで行う) */
 void tok_destroy(tok_t* tok) {
-	if (tok != NULL) {
-		free(tok->data);
-		tok_destroy(tok->next);
-		free(tok);
+	while (tok != NULL) {
+		tok_t* next = tok->next;
+		mem_free(tok->data);
+		mem_free(tok);
+		tok = next;
 	}
 }
 
@@ -140,11 +257,12 @@ int lexer_build(char* input, int size, lexer_t* lexerbuf)
 		return -1;
 	
 	if (size == 0) { /* 1文字も入力されてない場合 */
+		lexerbuf->llisttok = NULL; /* lexer_destroy() で解放するものは無い */
 		lexerbuf->ntoks = 0; /* tokenの数を0に設定 */
 		return 0;
 	}
 	
-	lexerbuf->llisttok = malloc(sizeof(tok_t)); /* 最初のtokenを入れるポインタを作成 */
+	lexerbuf->llisttok = mem_alloc(MEM_LEXER, sizeof(tok_t)); /* 最初のtokenを入れるポインタを作成 */
 	
 	/* リストの先頭になるtokenポインタを確保する */
 	// allocate the first token
@@ -156,6 +274,8 @@ int lexer_build(char* input, int size, lexer_t* lexerbuf)
 	
 	char c; /* 1文字ずつ、input文字列の中身を確認していく */
 	int state = STATE_GENERAL;
+	int fanout = 0; /* 閉じていない '|{' の数。この中では ',' が区切りになる */
+	int braces = 0; /* '|{' の中で開いている { ... } の数 */
 	
 	do
 	{
@@ -180,57 +300,170 @@ int lexer_build(char* input, int size, lexer_t* lexerbuf)
 					token->type = TOKEN;
 					break;
 					
-				case CHAR_ESCAPESEQUENCE: /* i文字目がエスケープ(\\)だった場合…1文字のバックスラッシュとして処理 */
+				case CHAR_ESCAPESEQUENCE: /* i文字目がエスケープ(\\)だった場合…次の1文字を、印を付けて文字として写す */
+					if (input[i + 1] == 0)
+						break;
+					token->data[j++] = CHAR_QUOTED;
 					token->data[j++] = input[++i];
 					token->type = TOKEN;
 					break;
 					
 				case CHAR_GENERAL: /* 通常の文字のとき */
+					if (c == '#' && j == 0) { /* 単語の先頭の '#' から行末まではコメントとして読み飛ばす */
+						while (input[i + 1] != '\n' && input[i + 1] != 0)
+							i++;
+						break;
+					}
+					if (fanout > 0 && c == ',') { /* '|{' の中の ',' は、消費側のジョブの区切り */
+						if (j > 0) {
+							token->data[j] = 0;
+							token->next = mem_alloc(MEM_LEXER, sizeof(tok_t));
+							token = token->next;
+							tok_init(token, size - i);
+							j = 0;
+						}
+						token->data[0] = ',';
+						token->data[1] = 0;
+						token->type = TOKEN_COMMA;
+						token->next = mem_alloc(MEM_LEXER, sizeof(tok_t));
+						token = token->next;
+						tok_init(token, size - i);
+						break;
+					}
+					if (fanout > 0 && j == 0 && (c == '{' || c == '}') && strchr(" \t\n;&|)", input[i + 1]) != NULL) {
+						if (c == '{')
+							braces++;
+						else if (braces > 0)
+							braces--;
+						else
+							fanout--; /* '|{' を閉じる '}' */
+					}
+					int span = raw_span(input + i); /* $( ... ) などは、中の空白やかっこも含めて1つの単語にする */
+					if (span > 0) {
+						memcpy(token->data + j, input + i, span);
+						j += span;
+						i += span - 1;
+						token->type = TOKEN;
+						break;
+					}
 					token->data[j++] = c; /* 現在のトークンの末尾に1文字追加 */
 					token->type = TOKEN; /*  */
 					break;
 					
 				case CHAR_WHITESPACE:
+				case CHAR_TAB: /* スクリプトの字下げに使われるタブも、空白と同じく単語の区切りにする */
 					if (j > 0) {
 						token->data[j] = 0;
-						token->next = malloc(sizeof(tok_t));
+						token->next = mem_alloc(MEM_LEXER, sizeof(tok_t));
 						token = token->next;
 						tok_init(token, size - i);
 						j = 0;
 					}
 					break;
 					
-				case CHAR_SEMICOLON: /* セミコロンの場合 */
 				case CHAR_GREATER: /* 大なり記号の場合 */
 				case CHAR_LESSER: /* 小なり記号の場合 */
+					/*
+					** リダイレクト演算子は、'>' '>>' '>&' '<' '<&' をひとつのトークンにする
+					** 直前に空白を空けずに数字だけの単語があれば、切り替えるディスクリプタの番号として演算子に含める( '2>' '3>>' '2>&' )
+					*/
+					token->data[j] = 0;
+					if (j > 0 && strspn(token->data, "0123456789") != (size_t)j) {
+						token->next = mem_alloc(MEM_LEXER, sizeof(tok_t));
+						token = token->next;
+						tok_init(token, size - i);
+						j = 0;
+					}
+					token->data[j++] = c;
+					if (chtype == CHAR_GREATER && input[i + 1] == '>')
+						token->data[j++] = input[++i];
+					else if (input[i + 1] == '&')
+						token->data[j++] = input[++i];
+					token->data[j] = 0;
+					token->type = chtype;
+
+					token->next = mem_alloc(MEM_LEXER, sizeof(tok_t));
+					token = token->next;
+					tok_init(token, size - i);
+					j = 0;
+					break;
+
+				case CHAR_SEMICOLON: /* セミコロンの場合 */
 				case CHAR_AMPERSAND: /* アンパサンドの場合 */
 				case CHAR_PIPE: /* パイプ記号の場合 */
+				case CHAR_LPAREN: /* 丸かっこの場合 */
+				case CHAR_RPAREN:
+				case CHAR_NEWLINE: /* 改行は ';' と同じくコマンドの区切りになる */
 					
 					/* 読み取っていたトークンがあれば終了させておく */
 					// end the token that was being read before
 					if (j > 0) {
 						token->data[j] = 0;
-						token->next = malloc(sizeof(tok_t));
+						token->next = mem_alloc(MEM_LEXER, sizeof(tok_t));
 						token = token->next;
 						tok_init(token, size - i);
 						j = 0;
 					}
 					
+					/* 行頭などの (( 式 )) は、式をそのまま持つ1つのトークンにする */
+					const char* arith_end;
+					if (chtype == CHAR_LPAREN && input[i + 1] == '(' && (arith_end = arith_find_end(input + i + 2)) != NULL) {
+						int len = arith_end - (input + i + 2);
+						memcpy(token->data, input + i + 2, len);
+						token->data[len] = 0;
+						token->type = TOKEN_ARITH;
+						i = arith_end + 1 - input;
+
+						token->next = mem_alloc(MEM_LEXER, sizeof(tok_t));
+						token = token->next;
+						tok_init(token, size - i);
+						break;
+					}
+
 					/* 単独の文字でトークンを生成する */
 					// next token
 					token->data[0] = chtype;
 					token->data[1] = 0;
 					token->type = chtype; /* token_typeはTOKEN(-1)ではなくそれぞれのchartypeを設定しておく */
+
+					if (chtype == CHAR_SEMICOLON && input[i + 1] == ';') { /* ';;' はひとつのトークンにする */
+						token->data[1] = ';';
+						token->data[2] = 0;
+						token->type = TOKEN_DSEMI;
+						i++;
+					}
+					else if (chtype == CHAR_PIPE && input[i + 1] == '{') { /* '|{' は出力を複数のジョブに分ける */
+						token->data[1] = '{';
+						token->data[2] = 0;
+						token->type = TOKEN_FANOUT;
+						fanout++;
+						i++;
+					}
 					
 					/* そして次のトークンを生成 */
-					token->next = malloc(sizeof(tok_t));
+					token->next = mem_alloc(MEM_LEXER, sizeof(tok_t));
 					token = token->next;
 					tok_init(token, size - i);
 					break;
 			}
 		}
 		else if (state == STATE_IN_DQUOTE) { /* ダブルクオート文字列内のとき */
-			token->data[j++] = c; /* 末尾に1文字追加 */
+			int span = raw_span(input + i); /* "$( ... )" の中のダブルクオートでは、文字列を終わらせない */
+			if (chtype == CHAR_ESCAPESEQUENCE && input[i + 1] != 0 && strchr("$`\"\\", input[i + 1]) != NULL) {
+				/* ダブルクオートの中では、'$' '`' '"' '\\' だけをエスケープできる */
+				token->data[j++] = CHAR_QUOTED;
+				token->data[j++] = input[++i];
+				c = input[i];
+			}
+			else if (span > 0) {
+				memcpy(token->data + j, input + i, span);
+				j += span;
+				i += span - 1;
+				c = input[i];
+				chtype = CHAR_GENERAL;
+			}
+			else
+				token->data[j++] = c; /* 末尾に1文字追加 */
 			if (chtype == CHAR_DQUOTE)
 				state = STATE_GENERAL; /* i文字目がダブルクオートだった場合、ダブルクオート文字列の状態を終了 */
 			
@@ -252,60 +485,38 @@ int lexer_build(char* input, int size, lexer_t* lexerbuf)
 		i++;
 	} while (c != '\0'); /* i文字目が終端でなければ繰り返し */
 	
-	/* glob()関数を用いて、ワイルドカード記号を展開する処理を行う */
+	/*
+	** 単語のtokenについて、実行時に必要な展開の種類を調べてから、クオートを取り除く
+	** 変数やワイルドカードの展開は、その時点の変数の値やディレクトリの内容を使うため、実行時に行う
+	*/
 	token = lexerbuf->llisttok; /* 先頭のトークンのポインタに戻す */
 	int k = 0; 
 	while (token != NULL) /* 末尾のトークンまで順に実施 */
 	{
-		if (token->type == TOKEN)
+		if (token->type == TOKEN_ARITH) {
+			token->flags = strchr(token->data, '$') != NULL ? TOK_EXPAND : 0;
+			k++;
+		}
+		else if (token->type == TOKEN)
 		{ /* 通常のトークンの場合(type==token) */
-			glob_t globbuf;
-			glob(token->data, GLOB_TILDE, NULL, &globbuf);
-			
-			// show_globbuf(globbuf);
-
-			if (globbuf.gl_pathc > 0)
-			{
-				k += globbuf.gl_pathc; /* pathcはマッチしたパスの数。これをいままでの処理結果に加算 */
-				/* 後で連結できるように、次のトークンのポインタを保持しておく */
-				// save the next token so we can attach it later
-				tok_t* saved = token->next;
+			token->flags = word_flags(token->data);
 
-				/* 現在のトークンを、最初のトークンと置き換える */				
-				// replace the current token with the first one
-				free(token->data); 
-				token->data = malloc(strlen(globbuf.gl_pathv[0]) + 1);
-				strcpy(token->data, globbuf.gl_pathv[0]);
-								
-				int i; /* 2つ目以降の文字列をループでトークンのリストに追加する */
-				for (i = 1; i < globbuf.gl_pathc; i++)
-				{
-					token->next = malloc(sizeof(tok_t));
-					tok_init(token->next, strlen(globbuf.gl_pathv[i]));
-					token = token->next;
-					token->type = TOKEN;
-					strcpy(token->data, globbuf.gl_pathv[i]);
-				}
-				
-				token->next = saved; /* 最後に、保持しておいたもともとのトークンのリストをつなげる */
-			}
-			/* globでパスのマッチがない場合( == 置換が必要なワイルドカードを含んでいなかった場合) */
-			else {
-				/* ユーザーからのトークンは、特殊文字をエスケープするために引用符で囲まれている場合があるので、それを取り除く */
-				// token from the user might be inside quotation to escape special characters
-				// hence strip the quotation symbol
-				char* stripped = malloc(strlen(token->data) + 1);
-				strip_quotes(token->data, stripped);
-				free(token->data);
-				token->data = stripped;
-				k++;
-			}
+			/* ユーザーからのトークンは、特殊文字をエスケープするために引用符で囲まれている場合があるので、それを取り除く */
+			// token from the user might be inside quotation to escape special characters
+			// hence strip the quotation symbol
+			char* stripped = mem_alloc(MEM_LEXER, strlen(token->data) * 2 + 1);
+			strip_quotes(token->data, stripped, token->flags != 0);
+			mem_free(token->data);
+			token->data = stripped;
+			k++;
 		}
+		else if (token->type == CHAR_LPAREN) /* 行頭の '(' だけの行も、サブシェルの始まりとして解析する */
+			k++;
 		
 		token = token->next; /* 処理を次のtokenへ進める */
 	}
 	
-	lexerbuf->ntoks = k; /* ワイルドカードをすべて展開した後のtoken数に更新 */
+	lexerbuf->ntoks = k; /* 単語と '(' のtoken数 */
 	return k;
 }
 
@@ -315,4 +526,5 @@ void lexer_destroy(lexer_t* lexerbuf)
 		return;
 	
 	tok_destroy(lexerbuf->llisttok);
+	lexerbuf->llisttok = NULL;
 }
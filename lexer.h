@@ -15,9 +15,26 @@ enum TokenType /* 入力されたコマンドのtokenを種類分けしている
 	CHAR_NEWLINE = '\n',
 	CHAR_GREATER = '>',
 	CHAR_LESSER = '<',
+	CHAR_LPAREN = '(',
+	CHAR_RPAREN = ')',
 	CHAR_NULL = 0,
 	
 	TOKEN	= -1,
+	TOKEN_DSEMI = -2, /* case の項目の終わり ( ';;' ) */
+	TOKEN_ARITH = -3, /* (( 式 )) 。data は式の部分 */
+	TOKEN_FANOUT = -4, /* 出力を複数のジョブに分ける ( '|{' ) */
+	TOKEN_COMMA = -5, /* '|{' の中の、消費側のジョブの区切り ( ',' ) */
+};
+
+enum
+{ /* tokenの単語としての性質。実行時の展開で使う */
+	TOK_EXPAND = (1 << 0), /* シングルクオートの外に '$' があり、変数の展開が必要 */
+	TOK_GLOB = (1 << 1), /* クオートの外にワイルドカード( '*' '?' '[' 先頭の '~' )がある */
+};
+
+enum
+{ /* 単語の文字列の中の印 */
+	CHAR_QUOTED = 1, /* 次の1文字はクオートの中にあったか、エスケープされていた。$変数 やワイルドカードとして扱わない */
 };
 
 enum
@@ -36,6 +53,7 @@ struct tok
 { /* 入力されたコマンドを解析した結果、tokenの一覧として連結リストにしている */
 	char* data;
 	int type;
+	int flags; /* TOK_EXPAND / TOK_GLOB 。どちらかがあれば、data のクオートされていた特殊文字の前に CHAR_QUOTED を置く */
 	tok_t* next;
 };
 
@@ -46,5 +64,6 @@ struct lexer
 };
 
 int lexer_build(char* input, int size, lexer_t* lexerbuf);
+int subst_span(const char* s);
 void lexer_destroy(lexer_t* lexerbuf);
 #endif
@@ -0,0 +1,139 @@
+#include "memstats.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+** 確保した領域の計数
+** 字句解析・構文解析・実行計画の領域は mem_alloc() などで確保し、単位ごとに数と大きさを数える
+** 各領域の前に大きさと単位を書いたヘッダを置くので、mem_free() は単位を指定しなくてよい
+** (mem_alloc() などで確保した領域は、必ず mem_free() で解放する。free() と混ぜない)
+**
+** 先読みの解析スレッドも字句解析・構文解析の領域を確保するので、カウンタはアトミックに更新する
+** 組み込みコマンド memstats で表示し、長い時間動かしても確保中の領域が増えていかないことを確かめる
+*/
+
+typedef struct MemHeader
+{
+	size_t size;
+	size_t subsys; /* 領域の先頭を 16 byte 境界にそろえるため、size_t にしておく */
+} MemHeader;
+
+static MemStats counters[MEM_NSUBSYS];
+
+static const char* subsys_names[MEM_NSUBSYS] = {
+	[MEM_LEXER] = "lexer",
+	[MEM_PARSER] = "parser",
+	[MEM_EXECUTOR] = "executor",
+};
+
+static void count_alloc(int subsys, long size, long count)
+{
+	MemStats* c = &counters[subsys];
+	long bytes = __atomic_add_fetch(&c->bytes, size, __ATOMIC_RELAXED);
+	long peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&c->live, count, __ATOMIC_RELAXED);
+	if (count > 0)
+		__atomic_add_fetch(&c->total, count, __ATOMIC_RELAXED);
+	while (bytes > peak && !__atomic_compare_exchange_n(&c->peak, &peak, bytes, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void* mem_alloc(int subsys, size_t size)
+{
+	MemHeader* h = malloc(sizeof(MemHeader) + size);
+	if (h == NULL)
+		return NULL;
+	h->size = size;
+	h->subsys = subsys;
+	count_alloc(subsys, size, 1);
+	return h + 1;
+}
+
+void* mem_calloc(int subsys, size_t n, size_t size)
+{
+	if (size != 0 && n > (SIZE_MAX - sizeof(MemHeader)) / size)
+		return NULL;
+	MemHeader* h = calloc(1, sizeof(MemHeader) + n * size);
+	if (h == NULL)
+		return NULL;
+	h->size = n * size;
+	h->subsys = subsys;
+	count_alloc(subsys, n * size, 1);
+	return h + 1;
+}
+
+/* 領域を拡張する。単位は最初に確保したときのまま */
+void* mem_realloc(int subsys, void* p, size_t size)
+{
+	if (p == NULL)
+		return mem_alloc(subsys, size);
+
+	MemHeader* h = (MemHeader*)p - 1;
+	size_t old = h->size;
+	h = realloc(h, sizeof(MemHeader) + size);
+	if (h == NULL)
+		return NULL;
+	h->size = size;
+	count_alloc(h->subsys, (long)size - (long)old, 0);
+	return h + 1;
+}
+
+char* mem_strdup(int subsys, const char* s)
+{
+	size_t len = strlen(s) + 1;
+	char* copy = mem_alloc(subsys, len);
+	if (copy != NULL)
+		memcpy(copy, s, len);
+	return copy;
+}
+
+void mem_free(void* p)
+{
+	if (p == NULL)
+		return;
+	MemHeader* h = (MemHeader*)p - 1;
+	count_alloc(h->subsys, -(long)h->size, -1);
+	free(h);
+}
+
+void mem_stats(int subsys, MemStats* stats)
+{
+	stats->live = __atomic_load_n(&counters[subsys].live, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&counters[subsys].bytes, __ATOMIC_RELAXED);
+	stats->peak = __atomic_load_n(&counters[subsys].peak, __ATOMIC_RELAXED);
+	stats->total = __atomic_load_n(&counters[subsys].total, __ATOMIC_RELAXED);
+}
+
+const char* mem_subsys_name(int subsys)
+{
+	return subsys_names[subsys];
+}
+
+/*
+** mem_print():
+** 組み込みコマンド memstats の出力
+** 単位ごとの確保中の数と大きさ・最大の大きさ・確保した回数と、プロセス全体の常駐メモリを表示する
+*/
+void mem_print(FILE* fp)
+{
+	int i;
+
+	fprintf(fp, "%-10s %10s %12s %12s %12s\n", "subsystem", "live", "bytes", "peak", "allocs");
+	for (i = 0; i < MEM_NSUBSYS; i++) {
+		MemStats stats;
+		mem_stats(i, &stats);
+		fprintf(fp, "%-10s %10ld %12ld %12ld %12ld\n", subsys_names[i], stats.live, stats.bytes, stats.peak, stats.total);
+	}
+
+	FILE* statm = fopen("/proc/self/statm", "r");
+	long size, resident;
+	if (statm != NULL) {
+		if (fscanf(statm, "%ld %ld", &size, &resident) == 2)
+			fprintf(fp, "rss %ld KiB\n", resident * (sysconf(_SC_PAGESIZE) / 1024));
+		fclose(statm);
+	}
+}
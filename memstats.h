@@ -0,0 +1,37 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+enum
+{ /* 確保した領域を数える単位 */
+	MEM_LEXER, /* token の一覧 */
+	MEM_PARSER, /* 抽象構文木のノードプールと文字列テーブル */
+	MEM_EXECUTOR, /* 実行計画と、実行中の for / case / 出力の複製の状態 */
+	MEM_NSUBSYS,
+};
+
+/*
+** MemStats:
+** 1つの単位の、確保中の領域の数と大きさ
+*/
+typedef struct MemStats
+{
+	long live; /* 確保中の領域の数 */
+	long bytes; /* 確保中の大きさ */
+	long peak; /* bytes の最大値 */
+	long total; /* これまでに確保した回数 */
+} MemStats;
+
+void* mem_alloc(int subsys, size_t size);
+void* mem_calloc(int subsys, size_t n, size_t size);
+void* mem_realloc(int subsys, void* p, size_t size);
+char* mem_strdup(int subsys, const char* s);
+void mem_free(void* p);
+
+void mem_stats(int subsys, MemStats* stats);
+const char* mem_subsys_name(int subsys);
+void mem_print(FILE* fp);
+
+#endif
@@ -1,6 +1,7 @@
 #include "parser.h"
 #include "lexer.h"
 #include "astree.h"
+#include "arith.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -125,528 +126,762 @@
  *
 **/
 
-ASTreeNode* CMDLINE();		//	test all command line production orderwise
-ASTreeNode* CMDLINE1();		//	<job> ';' <command line>
-ASTreeNode* CMDLINE2();		//	<job> ';'
-ASTreeNode* CMDLINE3();		//	<job> '&' <command line>
-ASTreeNode* CMDLINE4();		//	<job> '&'
-ASTreeNode* CMDLINE5();		//	<job>
+/*
+** 制御構文(if / while / until / for / case)を追加した構文
+** 複合コマンドの中身(<compound list>)は複数行にまたがるため、改行も ';' と同じ区切りとして扱う
+**
+** バックトラックで同じ <job> を何度も解析し直すと、制御構文が入れ子になったときに
+** 解析の手間が入れ子の深さに対して指数的に増えてしまう
+** そこで、共通の先頭部分(<job> や <command>)を一度だけ解析してから、次のtokenで分岐する(左ファクタリング)
+**
+	<command line>	::=		<job> <separator> <command line>
+						|	<job> <separator>
+						|	<job>
+	<separator>		::=		';' | '&' | '\n'
 
-ASTreeNode* JOB();			// test all job production in order
-ASTreeNode* JOB1();			// <command> '|' <job>
-ASTreeNode* JOB2();			// <command>
+	<job>			::=		<command> '|' <job>
+						|	<command> '|{' <job> [ ',' <job> ... ] '}'	... <command> の出力を、すべての <job> の入力に複製する
+						|	<command>
 
-ASTreeNode* CMD();			// test all command production orderwise
-ASTreeNode* CMD1();			//	<simple command> '<' <filename>
-ASTreeNode* CMD2();			//	<simple command> '>' <filename>
-ASTreeNode* CMD3();			//	<simple command>
+	<command>		::=		<function definition>
+						|	<compound command>
+						|	'((' <expression> '))'		... 'let' <expression> と同じ。定数式なら 'true' / 'false' に置き換える
+						|	<compound command> <redirect> ...	... リダイレクトは中身全体に一度だけ適用する
+						|	<simple command> <redirect> ...
+						|	<simple command>
 
-ASTreeNode* SIMPLECMD();	// test simple cmd production
-ASTreeNode* SIMPLECMD1();	// <pathname> <token list>
+	<redirect>		::=		[n] '<' <filename> | [n] '>' <filename> | [n] '>>' <filename>
+						|	[n] '>&' <fd> | [n] '<&' <fd>		... <fd> が '-' なら閉じる。n は演算子の直前に空白を空けずに書く
 
-ASTreeNode* TOKENLIST();	// test tokenlist production
-ASTreeNode* TOKENLIST1();	//	<token> <token list>
-ASTreeNode* TOKENLIST2();	//	EMPTY
+	<compound command> ::=	'if' <compound list> 'then' <compound list> <else part> 'fi'
+						|	'while' <compound list> 'do' <compound list> 'done'
+						|	'until' <compound list> 'do' <compound list> 'done'
+						|	'for' <name> [ 'in' <token list> ] <separator> 'do' <compound list> 'done'
+						|	'case' <token> 'in' <case item> ... 'esac'
+						|	'{' <compound list> '}'		... シェル自身で実行する
+						|	'(' <compound list> ')'		... 子プロセス(サブシェル)で実行する
 
-/*
-** グローバル変数として現在処理中のトークンのポインタを宣言
-*/
-// curtok token pointer
-tok_t* curtok = NULL;
+	<function definition> ::= <name> '(' ')' <compound command>
+
+	<else part>		::=		'elif' <compound list> 'then' <compound list> <else part>
+						|	'else' <compound list>
+						|	(EMPTY)
+
+	<case item>		::=		[ '(' ] <pattern> [ '|' <pattern> ... ] ')' [ <compound list> ] [ ';;' ]
+
+ * // 予約語(if, then, fi など)は、<simple command> のコマンド名としては受け付けない
+ * // そうすることで、<compound list> が 'then' や 'done' の手前で終わる
+**/
+
+ASTreeIndex CMDLINE(parser_ctx* p);		//	<job> [ <separator> [ <command line> ] ]
+ASTreeIndex JOB(parser_ctx* p);			//	<command> [ '|' <job> ]
+ASTreeIndex CMD(parser_ctx* p);			//	<function definition> | ( <compound command> | <simple command> ) [ <redirect> ... ]
+ASTreeIndex SIMPLECMD(parser_ctx* p);	//	<pathname> <token list>
+ASTreeIndex FUNCDEF(parser_ctx* p);		//	<name> '(' ')' <compound command>
+ASTreeIndex COMPOUNDCMD(parser_ctx* p);	//	if / while / until / for / case / { } / ( )
+ASTreeIndex COMPOUNDLIST(parser_ctx* p);	//	制御構文の中の <command line>
+ASTreeIndex ARITHCMD(parser_ctx* p);		//	'((' <expression> '))'
+ASTreeIndex FANOUT(parser_ctx* p, ASTreeIndex producer);	//	'|{' <job> [ ',' <job> ... ] '}'
+
+/* 予約語。コマンド名の位置に現れた場合は、<simple command> として扱わない */
+static const char* reserved_words[] = {
+	"if", "then", "elif", "else", "fi", "while", "until", "for", "do", "done", "case", "esac", "{", "}", NULL
+};
 
 /*
 ** term():
-** curtok(現在解析中のtoken)のメンバ変数 typeが、引数で与えられた tokentypeと一致するかを判定する。
+** p->curtok(現在解析中のtoken)のメンバ変数 typeが、引数で与えられた tokentypeと一致するかを判定する。
 ** curtoe->typeと引数で与えられたtokentypeと一致すればtrueを返し、そうでなければfalseを返す。
 ** 引数で与えられるtokentypeは、lexer.hで宣言されている enum TokenType で指定される。
-** 判定結果がtrueの場合にbufferptrが与えられていれば、bufferptrにcurtokの値を複製する。
-** (後で再帰的にASTに追加する際に必要になるので)
-** tokenの値を順次確認していくため、検査終了時にcurtokの値をnextに更新する。
+** 判定結果がtrueの場合にtokptrが与えられていれば、tokptrにp->curtokを指させる。
+** (ASTreeNodeSetData()で文字列テーブルに複製するので、ここではコピーしない)
+** 一致した場合だけ、p->curtokの値をnextに更新する。
 */
-bool term(int toketype, char** bufferptr)
+bool term(parser_ctx* p, int toketype, tok_t** tokptr)
 {
-	if (curtok == NULL) /* curtokはNULL以外のものでなければならない */
+	if (p->curtok == NULL) /* p->curtokはNULL以外のものでなければならない */
 		return false; 
 	
-    if (curtok->type == toketype)
+    if (p->curtok->type == toketype)
     {
-		if (bufferptr != NULL) { /* ASTに再帰的に登録できるように、bufferptrに内容を複製しておく */
-			*bufferptr = malloc(strlen(curtok->data) + 1);
-			strcpy(*bufferptr, curtok->data);
-		}
-		curtok = curtok->next;
+		if (tokptr != NULL) /* ASTに登録できるように、tokptrにtokenを渡しておく */
+			*tokptr = p->curtok;
+		p->curtok = p->curtok->next;
         return true;
     }
 
-    curtok = curtok->next;
     return false;
 }
 
-/*
-** CMDLINE():
-** parse()から呼び出される、構文解析の再帰処理の根元になる関数
-** <cmdline>の構文パターンを順番に検証する
-*/
-ASTreeNode *CMDLINE()
+/* 入力の終わりまで解析したか */
+static bool at_end(parser_ctx* p)
 {
-    /*
-    ** 処理中のtokenのポインタをいったん保存する
-    ** 解析のコマンドでcurtokを先に進めてしまうので、
-    ** 元の位置に戻れるようにするためにポインタを保持しておく
-    */
-    tok_t *save = curtok; 
-
-    ASTreeNode *node; /* 抽象構文木の要素となるポインタを宣言 */
-
-    if ((curtok = save, node = CMDLINE1()) != NULL) //	<job> ';' <command line>
-        return node; /* 条件に一致していた場合、nodeを返す */
-
-    if ((curtok = save /* ポインタを戻す */, node = CMDLINE2()) != NULL) //	<job> ';'
-        return node;
-
-    if ((curtok = save /* ポインタを戻す */, node = CMDLINE3()) != NULL) //	<job> '&' <command line>
-        return node;
-
-    if ((curtok = save /* ポインタを戻す */, node = CMDLINE4()) != NULL) //	<job> '&'
-        return node;
+	return p->curtok == NULL || p->curtok->type == CHAR_NULL;
+}
 
-    if ((curtok = save /* ポインタを戻す */, node = CMDLINE5()) != NULL) //	<job>
-        return node;
+/* 改行のtokenを読み飛ばす */
+static void skip_newlines(parser_ctx* p)
+{
+	while (term(p, CHAR_NEWLINE, NULL));
+}
 
-    /* どれにも当てはまらなかったら、NULLを返す(終端ってことかな…) */
-    return NULL;
+/* p->curtokが予約語 word であれば、読み進めてtrueを返す */
+static bool keyword(parser_ctx* p, const char* word)
+{
+	if (p->curtok == NULL || p->curtok->type != TOKEN || strcmp(p->curtok->data, word) != 0)
+		return false;
+	p->curtok = p->curtok->next;
+	return true;
 }
 
 /*
-** CMDLINE1():
-** 以下のパターンに合致するかを検証する
-** <job> ';' <command line>
+** expect():
+** 制御構文の終わりなど、必ず来るはずの予約語を読み取る
+** 入力が先に終わってしまった場合は、続きの行があれば正しい構文になるので p->incomplete を立てる
 */
-ASTreeNode* CMDLINE1()
+static bool expect(parser_ctx* p, const char* word)
 {
-    ASTreeNode* jobNode;
-    ASTreeNode* cmdlineNode;
-    ASTreeNode* result;
-
-    if ((jobNode = JOB()) == NULL) // <job> に合致するか判定
-        return NULL;
-
-    if (!term(CHAR_SEMICOLON, NULL)) { // ';' に合致するか判定
-        ASTreeNodeDelete(jobNode); // ';' でない場合、直前にASTに追加したjobNodeを削除
-        return NULL;
-    }
-
-    if ((cmdlineNode = CMDLINE()) == NULL) { // <command line> でない場合、直前にASTに追加したjobNodeを削除
-        ASTreeNodeDelete(jobNode);
-        return NULL;
-    }
-
-    /* 以下、<job> ; <command line> に合致する場合の処理 */
-    result = malloc(sizeof(*result)); /* ASTreeNode のポインタをメモリ確保 */
-    ASTreeNodeSetType(result, NODE_SEQ); /* jobの完了後に残りのcommandlineの処理に入ることがわかるようにしておく...sequence？ */
-    ASTreeAttachBinaryBranch(result, jobNode, cmdlineNode); /* [left: jobNode] --- [root: result(NODE_SEQ)] --- [right: cmdlineNode] */
+	skip_newlines(p);
+	if (keyword(p, word))
+		return true;
+	if (at_end(p))
+		p->incomplete = true;
+	return false;
+}
 
-    return result;
+static bool is_reserved(const char* word)
+{
+	int i;
+	for (i = 0; reserved_words[i] != NULL; i++)
+		if (strcmp(reserved_words[i], word) == 0)
+			return true;
+	return false;
 }
 
 /*
-** CMDLINE2():
-** 以下のパターンに合致するかを検証する
-** <job> ';'
+** set_word():
+** 単語のtokenの文字列をノードに保存し、実行時に必要な展開の種類をノードの種類に付け加える
 */
-ASTreeNode* CMDLINE2()
+static void set_word(parser_ctx* p, ASTreeIndex node, tok_t* tok)
 {
-    ASTreeNode* jobNode;
-    ASTreeNode* result;
-
-    if ((jobNode = JOB()) == NULL)
-        return NULL;
-
-	if (!term(CHAR_SEMICOLON, NULL)) {
-        ASTreeNodeDelete(jobNode);
-        return NULL;
-    }
-
-    result = malloc(sizeof(*result));
-    ASTreeNodeSetType(result, NODE_SEQ); /* jobの完了後に残りのcommandlineの処理に入ることがわかるようにしておく...sequence？ */
-    ASTreeAttachBinaryBranch(result, jobNode, NULL); /* [left: jobNode] --- [root: result(NODE_SEQ)] --- [right: NULL] */
-
-    return result;
+	int flags = tok->flags;
+	char* folded = NULL;
+
+	/* $(( 定数式 )) は、ここで計算結果の数値に置き換えておく */
+	if ((flags & TOK_EXPAND) && (folded = arith_fold_word(tok->data)) != NULL && strchr(folded, '$') == NULL)
+		flags &= ~TOK_EXPAND;
+
+	ASTreeNodeSetData(p->tree, node, folded != NULL ? folded : tok->data);
+	free(folded);
+	if (flags & TOK_EXPAND)
+		ASTreeNodeSetType(p->tree, node, ASTreeType(p->tree, node) | NODE_EXPAND);
+	if (tok->flags & TOK_GLOB)
+		ASTreeNodeSetType(p->tree, node, ASTreeType(p->tree, node) | NODE_GLOB);
 }
 
 /*
-** CMDLINE3():
-** 以下のパターンに合致するかを検証する
-** <job> '&' <command line>
+** CMDLINE():
+** parse()から呼び出される、構文解析の再帰処理の根元になる関数
+** <job> を解析してから、区切り文字の有無で以下のパターンを判定する
+**   <job> ';' <command line>  /  <job> ';'  ... NODE_SEQ (改行も ';' と同じ)
+**   <job> '&' <command line>  /  <job> '&'  ... NODE_BCKGRND
+**   <job>
 */
-ASTreeNode* CMDLINE3()
+ASTreeIndex CMDLINE(parser_ctx* p)
 {
-    ASTreeNode* jobNode;
-    ASTreeNode* cmdlineNode;
-    ASTreeNode* result;
+    ASTreeIndex jobNode;
+    ASTreeIndex cmdlineNode;
+    ASTreeIndex result;
+    tok_t* sep;
 
-    if ((jobNode = JOB()) == NULL)
-        return NULL;
+    skip_newlines(p); /* 空行は読み飛ばす */
 
-    if (!term(CHAR_AMPERSAND, NULL)) {
-        ASTreeNodeDelete(jobNode);
-        return NULL;
-    }
+    if ((jobNode = JOB(p)) == AST_NULL) // <job> に合致するか判定
+        return AST_NULL;
 
-    if ((cmdlineNode = CMDLINE()) == NULL) {
-        ASTreeNodeDelete(jobNode);
-        return NULL;
-    }
+    if (!term(p, CHAR_SEMICOLON, &sep) && !term(p, CHAR_NEWLINE, &sep) && !term(p, CHAR_AMPERSAND, &sep))
+        return jobNode; /* 区切り文字が無ければ、<job> だけ */
+
+    /*
+    ** 区切り文字の後ろに <command line> が続かなくてもよい
+    ** (行末の ';' や、制御構文の中身の最後の改行など)
+    ** 合致しなかった場合、CMDLINE() の中でノードプールは巻き戻されている
+    */
+    tok_t* save = p->curtok;
+    if ((cmdlineNode = CMDLINE(p)) == AST_NULL)
+        p->curtok = save;
 
-    result = malloc(sizeof(*result));
-    ASTreeNodeSetType(result, NODE_BCKGRND); /* バックグラウンド実行するジョブであることがわかるようにしておく */
-    ASTreeAttachBinaryBranch(result, jobNode, cmdlineNode); /* [left: jobNode] --- [root: result(NODE_BCKGRND)] --- [right: cmdlineNode] */
+    if (sep->type == CHAR_AMPERSAND)
+        result = ASTreeNewNode(p->tree, NODE_BCKGRND); /* バックグラウンド実行するジョブであることがわかるようにしておく */
+    else
+        result = ASTreeNewNode(p->tree, NODE_SEQ); /* jobの完了後に残りのcommandlineの処理に入ることがわかるようにしておく...sequence？ */
+    ASTreeAttachBinaryBranch(p->tree, result, jobNode, cmdlineNode); /* [left: jobNode] --- [root: result] --- [right: cmdlineNode] */
 
     return result;
 }
 
 /*
-** CMDLINE4():
-** 以下のパターンに合致するかを検証する
-** <job> '&'
+** JOB():
+** CMDLINE の検証を行う関数から呼び出される
+** <command> を解析してから、'|' が続くかどうかで以下のパターンを判定する
+**   <command> '|' <job>
+**   <command>
 */
-ASTreeNode* CMDLINE4()
+ASTreeIndex JOB(parser_ctx* p)
 {
-    ASTreeNode* jobNode;
-    ASTreeNode* result;
+    ASTreeMark mark = ASTreeGetMark(p->tree); /* 合致しなかったときに、ここまでノードプールを巻き戻す */
+    ASTreeIndex cmdNode;
+    ASTreeIndex jobNode;
+    ASTreeIndex result;
+
+    if ((cmdNode = CMD(p)) == AST_NULL)
+        return AST_NULL;
+
+    if (term(p, TOKEN_FANOUT, NULL)) { /* <command> '|{' <job> , ... '}' */
+        if ((result = FANOUT(p, cmdNode)) == AST_NULL)
+            ASTreeRollback(p->tree, mark);
+        return result;
+    }
 
-    if ((jobNode = JOB()) == NULL)
-        return NULL;
+    if (!term(p, CHAR_PIPE, NULL))
+        return cmdNode; /* <command> */
 
-	if (!term(CHAR_AMPERSAND, NULL)) {
-        ASTreeNodeDelete(jobNode);
-        return NULL;
+    skip_newlines(p); /* '|' の後ろでは改行できる */
+    if ((jobNode = JOB(p)) == AST_NULL) {
+        if (at_end(p)) /* '|' で入力が終わっている場合は、続きの行を待つ */
+            p->incomplete = true;
+        ASTreeRollback(p->tree, mark);
+        return AST_NULL;
     }
 
-    result = malloc(sizeof(*result));
-    ASTreeNodeSetType(result, NODE_BCKGRND); /* バックグラウンド実行するジョブであることがわかるようにしておく */
-    ASTreeAttachBinaryBranch(result, jobNode, NULL); /* [left: jobNode] --- [root: result(NODE_SEQ)] --- [right: NULL] */
+    result = ASTreeNewNode(p->tree, NODE_PIPE); /* パイプにより分割されていることがわかるように、nodetypeを NODE_PIPE に設定する */
+    ASTreeAttachBinaryBranch(p->tree, result, cmdNode, jobNode); /* [left: cmdNode] --- [root: result(NODE_PIPE)] --- [right: jobNode] */
 
     return result;
 }
 
 /*
-** CMDLINE5():
-** 以下のパターンに合致するかを検証する
-** <job>
+** FANOUT():
+** '|{' の後ろの、カンマ区切りの <job> の並びと閉じる '}' を解析する
+** 結果は [left: producer] --- [root: NODE_FANOUT] --- [right: 最初の NODE_FANOUT_ITEM] になり、
+** NODE_FANOUT_ITEM は [left: <job>] --- [right: 次の NODE_FANOUT_ITEM] で並ぶ
+** 各 <job> の前後では改行できる
 */
-ASTreeNode* CMDLINE5()
+ASTreeIndex FANOUT(parser_ctx* p, ASTreeIndex producer)
 {
-    /* 残っているtokenが<job> に当てはまるかどうか…これに合致しなければNULL */
-    return JOB();
+    ASTreeIndex first = AST_NULL;
+    ASTreeIndex last = AST_NULL;
+    ASTreeIndex jobNode;
+    ASTreeIndex item;
+    ASTreeIndex result;
+
+    p->fanout_depth++;
+    do {
+        skip_newlines(p);
+        if ((jobNode = JOB(p)) == AST_NULL) {
+            if (at_end(p))
+                p->incomplete = true;
+            p->fanout_depth--;
+            return AST_NULL;
+        }
+        item = ASTreeNewNode(p->tree, NODE_FANOUT_ITEM);
+        ASTreeAttachBinaryBranch(p->tree, item, jobNode, AST_NULL);
+        if (last == AST_NULL)
+            first = item;
+        else
+            ASTreeAttachBinaryBranch(p->tree, last, ASTreeLeft(p->tree, last), item);
+        last = item;
+        skip_newlines(p);
+    } while (term(p, TOKEN_COMMA, NULL));
+    p->fanout_depth--;
+
+    if (!expect(p, "}"))
+        return AST_NULL;
+
+    result = ASTreeNewNode(p->tree, NODE_FANOUT);
+    ASTreeAttachBinaryBranch(p->tree, result, producer, first);
+    return result;
 }
 
 /*
-** JOB():
-** CMDLINE の検証を行う関数から呼び出される
-** <job>の構文パターンを順番に検証する
+** REDIRECT():
+** CMD から呼び出され、<command> に続くリダイレクトをひとつ解析する
+**   [n]'<' <filename>  [n]'>' <filename>  [n]'>>' <filename>  [n]'>&' <fd>  [n]'<&' <fd>
+** 演算子のtokenは、字句解析でディスクリプタ番号と一緒にひとつにまとめてある
+** 番号を省略した場合は、'<' '<&' なら標準入力、それ以外は標準出力を切り替える
 */
-ASTreeNode* JOB()
+static ASTreeIndex REDIRECT(parser_ctx* p, ASTreeIndex cmdNode)
 {
-    /*
-    ** 処理中のtokenのポインタをいったん保存する
-    ** 解析のコマンドでcurtokを先に進めてしまうので、
-    ** 元の位置に戻れるようにするためにポインタを保持しておく
-    */
-    tok_t* save = curtok;
-
-    ASTreeNode* node;
-
-    if ((curtok = save /* ポインタを戻す */, node = JOB1()) != NULL) // <command> '|' <job>
-        return node;
-
-    if ((curtok = save /* ポインタを戻す */, node = JOB2()) != NULL) // <command>
-        return node;
+    tok_t* op;
+    tok_t* filename;
+
+    if (!term(p, CHAR_LESSER, &op) && !term(p, CHAR_GREATER, &op))
+        return AST_NULL;
+    if (!term(p, TOKEN, &filename))
+        return AST_NULL;
+
+    size_t ndigits = strspn(op->data, "0123456789");
+    const char* symbol = op->data + ndigits;
+    NodeType type;
+    if (strcmp(symbol, "<") == 0)
+        type = NODE_REDIRECT_IN; /* filename からの入力を受け取るコマンドであることがわかるようにしておく */
+    else if (strcmp(symbol, ">") == 0)
+        type = NODE_REDIRECT_OUT; /* filename への出力を行うことがわかるようにしておく */
+    else if (strcmp(symbol, ">>") == 0)
+        type = NODE_REDIRECT_APPEND;
+    else
+        type = NODE_REDIRECT_DUP;
+
+    /* ディスクリプタの番号を書いた場合は、左の枝に番号のノードを付ける('<&' は省略しても標準入力の 0) */
+    ASTreeIndex fdNode = AST_NULL;
+    if (ndigits > 0 || strcmp(symbol, "<&") == 0) {
+        char fd[16];
+        snprintf(fd, sizeof(fd), "%.*s", ndigits > 0 ? (int)ndigits : 1, ndigits > 0 ? op->data : "0");
+        fdNode = ASTreeNewNode(p->tree, NODE_ARGUMENT);
+        ASTreeNodeSetData(p->tree, fdNode, fd);
+    }
 
-    return NULL; //<job> の構文パターンのどちらにも当てはまらない場合、NULLを返す
+    ASTreeIndex result = ASTreeNewNode(p->tree, type);
+    set_word(p, result, filename); /* resultのnodeに、テキストを保存する */
+    ASTreeAttachBinaryBranch(p->tree, result, fdNode, cmdNode); /* [left: fdNode] --- [root: result] --- [right: cmdNode] */
+    return result;
 }
 
 /*
-** JOB1():
-** 以下のパターンに合致するかを検証する
-** <command> '|' <job>
+** CMD():
+** JOB の検証を行う関数から呼び出される
+** 関数の定義でなければ制御構文か <simple command> を解析し、続くリダイレクトを書かれた順に解析する
+**   <compound command> <redirect> <redirect> ...
+**   <simple command> <redirect> <redirect> ...
+**   <simple command>
+** リダイレクトのノードは、右の枝に手前のリダイレクト(最初のものはコマンド)を持つ
+** 最後に書いたリダイレクトが根になるので、コンパイル時には右の枝から順にたどれば書かれた順になる
 */
-ASTreeNode* JOB1()
+ASTreeIndex CMD(parser_ctx* p)
 {
-    ASTreeNode* cmdNode;
-    ASTreeNode* jobNode;
-    ASTreeNode* result;
+    ASTreeMark mark = ASTreeGetMark(p->tree);
+    ASTreeIndex result;
 
-    if ((cmdNode = CMD()) == NULL)
-        return NULL;
+    if ((result = FUNCDEF(p)) != AST_NULL) // <function definition>
+        return result;
 
-    if (!term(CHAR_PIPE, NULL)) {
-        ASTreeNodeDelete(cmdNode);
-        return NULL;
-    }
+    if ((result = ARITHCMD(p)) != AST_NULL) // '((' <expression> '))'
+        return result;
 
-    if ((jobNode = JOB()) == NULL) {
-        ASTreeNodeDelete(cmdNode);
-        return NULL;
-    }
+    if ((result = COMPOUNDCMD(p)) == AST_NULL && (result = SIMPLECMD(p)) == AST_NULL)
+        return AST_NULL;
 
-    result = malloc(sizeof(*result));
-    ASTreeNodeSetType(result, NODE_PIPE); /* パイプにより分割されていることがわかるように、nodetypeを NODE_PIPE に設定する */
-    ASTreeAttachBinaryBranch(result, cmdNode, jobNode); /* [left: cmdNode] --- [root: result(NODE_PIPE)] --- [right: jobNode] */
+    while (p->curtok != NULL && (p->curtok->type == CHAR_LESSER || p->curtok->type == CHAR_GREATER)) {
+        if ((result = REDIRECT(p, result)) == AST_NULL) { /* ファイル名が無い */
+            ASTreeRollback(p->tree, mark);
+            return AST_NULL;
+        }
+    }
 
     return result;
 }
 
 /*
-** JOB2():
+** SIMPLECMD():
+** CMD の検証を行う関数から呼び出される
 ** 以下のパターンに合致するかを検証する
-** <command>
+** <pathname> <token list>
+**
+** <token list> ::= <token> <token list> | EMPTY は、再帰ではなくループで読み取る
+** 引数のノードを NODE_CMDPATH の直後に連続して確保することで、
+** 引数の一覧をノードプール内の連続した範囲として扱えるようにしている
 */
-ASTreeNode* JOB2()
+ASTreeIndex SIMPLECMD(parser_ctx* p)
 {
-    /* 残っているtokenが<command> に当てはまるかどうか…これに合致しなければNULL */
-    return CMD();
+    ASTreeIndex result;
+    ASTreeIndex argNode;
+
+    if (p->curtok != NULL && p->curtok->type == TOKEN && is_reserved(p->curtok->data))
+        return AST_NULL; /* 予約語はコマンド名にならない */
+
+    tok_t* pathname;
+    if (!term(p, TOKEN, &pathname))
+        return AST_NULL;
+
+    result = ASTreeNewNode(p->tree, NODE_CMDPATH); /* 実行ファイルへのパスだとわかるようにしておく */
+    set_word(p, result, pathname);  /* resultのnodeに、テキストを保存する */
+
+    /* <token list>: TOKENが続く限り、引数ノードを追加する。0個でも正しい構文 */
+    uint32_t nargs = 0;
+    tok_t* arg;
+    while (!(p->fanout_depth > 0 && p->curtok != NULL && p->curtok->type == TOKEN && strcmp(p->curtok->data, "}") == 0) /* '|{' を閉じる '}' */
+           && term(p, TOKEN, &arg)) {
+        argNode = ASTreeNewNode(p->tree, NODE_ARGUMENT); /* 単独の引数としてノードタイプを設定 */
+        set_word(p, argNode, arg); /* 引数のnodeに、テキストを保存する */
+        nargs++;
+    }
+
+    /* [left: 引数の数] --- [root: result(NODE_CMDPATH)] --- [right: AST_NULL] 引数は result + 1 から nargs 個並んでいる */
+    ASTreeAttachBinaryBranch(p->tree, result, nargs, AST_NULL);
+
+    return result;
 }
 
 /*
-** CMD():
-** JOB の検証を行う関数から呼び出される
-** <cmd>の構文パターンを順番に検証する
+** ARITHCMD():
+** (( 式 )) を、式を1つの引数にした let コマンドの <simple command> として解析する
+** 変数を含まない定数式は、ここで計算して引数の無い true / false に置き換える
 */
-ASTreeNode* CMD()
+ASTreeIndex ARITHCMD(parser_ctx* p)
 {
-    /*
-    ** 処理中のtokenのポインタをいったん保存する
-    ** 解析のコマンドでcurtokを先に進めてしまうので、
-    ** 元の位置に戻れるようにするためにポインタを保持しておく
-    */
-    tok_t* save = curtok;
-
-    ASTreeNode* node;
-
-    if ((curtok = save /* ポインタを戻す */, node = CMD1()) != NULL) //	<simple command> '<' <filename>
-        return node;
-
-    if ((curtok = save /* ポインタを戻す */, node = CMD2()) != NULL) //	<simple command> '>' <filename>
-        return node;
+    ASTreeIndex result;
+    tok_t* expr;
+    int64_t value;
+
+    if (!term(p, TOKEN_ARITH, &expr))
+        return AST_NULL;
+
+    result = ASTreeNewNode(p->tree, NODE_CMDPATH);
+    if (strchr(expr->data, '$') == NULL && arith_fold(expr->data, &value)) {
+        ASTreeNodeSetData(p->tree, result, value != 0 ? "true" : "false");
+        ASTreeAttachBinaryBranch(p->tree, result, 0, AST_NULL);
+        return result;
+    }
 
-    if ((curtok = save /* ポインタを戻す */, node = CMD3()) != NULL) //	<simple command>
-        return node;
+    ASTreeNodeSetData(p->tree, result, "let");
+    ASTreeIndex argNode = ASTreeNewNode(p->tree, NODE_ARGUMENT);
+    set_word(p, argNode, expr);
+    ASTreeAttachBinaryBranch(p->tree, result, 1, AST_NULL);
 
-    return NULL;
+    return result;
 }
 
 /*
-** CMD1():
-** 以下のパターンに合致するかを検証する
-** <simple command> '<' <filename>
+** COMPOUNDLIST():
+** 制御構文の中身になる <command line> を解析する
+** 中身が無いまま入力が終わった場合は、続きの行を待つために p->incomplete を立てる
 */
-ASTreeNode* CMD1()
+ASTreeIndex COMPOUNDLIST(parser_ctx* p)
 {
-    ASTreeNode* simplecmdNode;
-    ASTreeNode* result;
+    ASTreeIndex node;
 
-    if ((simplecmdNode = SIMPLECMD()) == NULL)
-        return NULL;
-
-    if (!term(CHAR_LESSER, NULL)) {
-		ASTreeNodeDelete(simplecmdNode);
-		return NULL;
-	}
-	
-	char* filename;
-	if (!term(TOKEN, &filename)) {
-		free(filename);
-        ASTreeNodeDelete(simplecmdNode);
-        return NULL;
-    }
-
-    result = malloc(sizeof(*result)); /* ASTreeNode のポインタをメモリ確保 */
-    ASTreeNodeSetType(result, NODE_REDIRECT_IN); /* filename からの入力を受け取るコマンドであることがわかるようにしておく */
-    ASTreeNodeSetData(result, filename); /* resultのnodeに、テキストを保存する */
-    ASTreeAttachBinaryBranch(result, NULL, simplecmdNode); /* [left: NULL] --- [root: result(NODE_REDIRECT_IN)] --- [right: simplecmdNode] */
-
-    return result;
+    skip_newlines(p);
+    if ((node = CMDLINE(p)) == AST_NULL && at_end(p))
+        p->incomplete = true;
+    return node;
 }
 
 /*
-** CMD2():
-** 以下のパターンに合致するかを検証する
-** <simple command> '>' <filename>
+** WORDLIST():
+** TOKENが続く限り読み取り、NODE_WORDLIST の直後に NODE_ARGUMENT として並べる
+** 予約語も単語として扱う
 */
-ASTreeNode* CMD2()
+static ASTreeIndex WORDLIST(parser_ctx* p)
 {
-    ASTreeNode* simplecmdNode;
-    ASTreeNode* result;
-
-    if ((simplecmdNode = SIMPLECMD()) == NULL)
-        return NULL;
+    ASTreeIndex result = ASTreeNewNode(p->tree, NODE_WORDLIST);
+    uint32_t nwords = 0;
+    tok_t* word;
 
-	if (!term(CHAR_GREATER, NULL)) {
-		ASTreeNodeDelete(simplecmdNode);
-		return NULL;
-	}
-	
-	char* filename;
-	if (!term(TOKEN, &filename)) {
-		free(filename);
-		ASTreeNodeDelete(simplecmdNode);
-		return NULL;
-	}
-
-    result = malloc(sizeof(*result));
-    ASTreeNodeSetType(result, NODE_REDIRECT_OUT); /* filename への出力を行うことがわかるようにしておく */
-    ASTreeNodeSetData(result, filename);  /* resultのnodeに、テキストを保存する */
-	ASTreeAttachBinaryBranch(result, NULL, simplecmdNode); /* [left: NULL] --- [root: result(NODE_REDIRECT_OUT)] --- [right: simplecmdNode] */
+    while (term(p, TOKEN, &word)) {
+        set_word(p, ASTreeNewNode(p->tree, NODE_ARGUMENT), word);
+        nwords++;
+    }
 
+    ASTreeAttachBinaryBranch(p->tree, result, nwords, AST_NULL); /* [left: 単語の数] 単語は result + 1 から並んでいる */
     return result;
 }
 
 /*
-** CMD3():
-** 以下のパターンに合致するかを検証する
-** <simple command>
+** IFCLAUSE():
+** 'if' または 'elif' を読み取った後の部分を解析する
+** <compound list> 'then' <compound list> <else part> 'fi'
+** 'elif' は、else の中身に入れ子の NODE_IF を置く。入れ子の NODE_IF が 'fi' までを読み取る
 */
-ASTreeNode* CMD3()
+static ASTreeIndex IFCLAUSE(parser_ctx* p)
 {
-    /* 残っているtoken が<simplecommand> に当てはまるかどうか */
-    return SIMPLECMD();
+    ASTreeIndex condNode, thenNode, elseNode = AST_NULL;
+    ASTreeIndex result, thenPart;
+
+    if ((condNode = COMPOUNDLIST(p)) == AST_NULL || !expect(p, "then"))
+        return AST_NULL;
+    if ((thenNode = COMPOUNDLIST(p)) == AST_NULL)
+        return AST_NULL;
+
+    skip_newlines(p);
+    if (keyword(p, "elif")) {
+        if ((elseNode = IFCLAUSE(p)) == AST_NULL)
+            return AST_NULL;
+    }
+    else {
+        if (keyword(p, "else") && (elseNode = COMPOUNDLIST(p)) == AST_NULL)
+            return AST_NULL;
+        if (!expect(p, "fi"))
+            return AST_NULL;
+    }
+
+    thenPart = ASTreeNewNode(p->tree, NODE_THEN);
+    ASTreeAttachBinaryBranch(p->tree, thenPart, thenNode, elseNode); /* [left: then の中身] --- [root: NODE_THEN] --- [right: else の中身] */
+    result = ASTreeNewNode(p->tree, NODE_IF);
+    ASTreeAttachBinaryBranch(p->tree, result, condNode, thenPart); /* [left: 条件] --- [root: NODE_IF] --- [right: NODE_THEN] */
+    return result;
 }
 
 /*
-** SIMPLECMD():
-** CMD の検証を行う関数から呼び出される
-** <simplecommand> の構文パターンを順番に検証する
+** LOOPCLAUSE():
+** 'while' / 'until' を読み取った後の部分を解析する
+** <compound list> 'do' <compound list> 'done'
 */
-ASTreeNode* SIMPLECMD()
+static ASTreeIndex LOOPCLAUSE(parser_ctx* p, NodeType type)
 {
-    /*
-    ** 処理中のtokenのポインタをいったん保存する
-    ** 解析のコマンドでcurtokを先に進めてしまうので、
-    ** 元の位置に戻れるようにするためにポインタを保持しておく
-    */
-    tok_t* save = curtok;
+    ASTreeIndex condNode, bodyNode, result;
+
+    if ((condNode = COMPOUNDLIST(p)) == AST_NULL || !expect(p, "do"))
+        return AST_NULL;
+    if ((bodyNode = COMPOUNDLIST(p)) == AST_NULL || !expect(p, "done"))
+        return AST_NULL;
 
-    /* <simplecommand> のパターンは一つしかない…ので、そのまま検証用の関数にわたす */
-    return SIMPLECMD1(); // <pathname> <token list>
+    result = ASTreeNewNode(p->tree, type);
+    ASTreeAttachBinaryBranch(p->tree, result, condNode, bodyNode); /* [left: 条件] --- [root: NODE_WHILE / NODE_UNTIL] --- [right: 中身] */
+    return result;
 }
 
 /*
-** SIMPLECMD1():
-** 以下のパターンに合致するかを検証する
-** <pathname> <token list>
+** FORCLAUSE():
+** 'for' を読み取った後の部分を解析する
+** <name> [ 'in' <token list> ] <separator> 'do' <compound list> 'done'
 */
-ASTreeNode* SIMPLECMD1()
+static ASTreeIndex FORCLAUSE(parser_ctx* p)
 {
-    ASTreeNode* tokenListNode;
-    ASTreeNode* result;
+    ASTreeIndex listNode = AST_NULL, bodyNode, result;
+    tok_t* name;
 
-    char* pathname;
-    if (!term(TOKEN, &pathname))
-        return NULL;
+    if (!term(p, TOKEN, &name)) {
+        if (at_end(p))
+            p->incomplete = true;
+        return AST_NULL;
+    }
 
-    tokenListNode = TOKENLIST();
-    // we don't check whether tokenlistNode is NULL since its a valid grammer
-    /* tokenlistNodeは、NULLも正しい構文なので、エラーチェックしない */
-    /* 他の単位のときは、NULLだったらreturn NULLしている */
-    /* 例: if ((cmdNode = CMD()) == NULL) return (NULL); */
+    if (keyword(p, "in"))
+        listNode = WORDLIST(p);
+    if (!term(p, CHAR_SEMICOLON, NULL))
+        skip_newlines(p); /* ';' の代わりに改行でもよい */
 
-    result = malloc(sizeof(*result)); /* ASTreeNode のポインタをメモリ確保 */
-    ASTreeNodeSetType(result, NODE_CMDPATH); /* 実行ファイルへのパスだとわかるようにしておく */
-    ASTreeNodeSetData(result, pathname);  /* resultのnodeに、テキストを保存する */
-	ASTreeAttachBinaryBranch(result, NULL, tokenListNode); /* [left: NULL] --- [root: result(NODE_REDIRECT_IN)] --- [right: tokenListNode] */
+    if (!expect(p, "do"))
+        return AST_NULL;
+    if ((bodyNode = COMPOUNDLIST(p)) == AST_NULL || !expect(p, "done"))
+        return AST_NULL;
 
+    result = ASTreeNewNode(p->tree, NODE_FOR);
+    ASTreeNodeSetData(p->tree, result, name->data); /* ループ変数の名前 */
+    ASTreeAttachBinaryBranch(p->tree, result, listNode, bodyNode); /* [left: NODE_WORDLIST] --- [root: NODE_FOR] --- [right: 中身] */
     return result;
 }
 
 /*
-** TOKENLIST():
-** SIMPLECMDの検証を行う関数から呼び出される
-** <tokenlist>の構文パターンを順番に検証する
+** CASECLAUSE():
+** 'case' を読み取った後の部分を解析する
+** <token> 'in' <case item> ... 'esac'
+** 項目は NODE_CASE_ITEM の right でつないだ連結リストにする
 */
-ASTreeNode* TOKENLIST()
+static ASTreeIndex CASECLAUSE(parser_ctx* p)
 {
-    /*
-    ** 処理中のtokenのポインタをいったん保存する
-    ** 解析のコマンドでcurtokを先に進めてしまうので、
-    ** 元の位置に戻れるようにするためにポインタを保持しておく
-    */
-    tok_t* save = curtok;
+    ASTreeIndex result, item, prev = AST_NULL, first = AST_NULL;
+    tok_t* word;
 
-    ASTreeNode* node;
+    if (!term(p, TOKEN, &word) || !expect(p, "in")) {
+        if (at_end(p))
+            p->incomplete = true;
+        return AST_NULL;
+    }
 
-    if ((curtok = save /* ポインタを戻す */, node = TOKENLIST1()) != NULL) //	<token> <token list>
-        return node;
+    result = ASTreeNewNode(p->tree, NODE_CASE);
+    set_word(p, result, word);
 
-    if ((curtok = save /* ポインタを戻す */, node = TOKENLIST2()) != NULL) //	EMPTY
-        return node;
+    while (skip_newlines(p), !keyword(p, "esac"))
+    {
+        if (at_end(p)) {
+            p->incomplete = true;
+            return AST_NULL;
+        }
+
+        /* [ '(' ] <pattern> [ '|' <pattern> ... ] ')' */
+        term(p, CHAR_LPAREN, NULL);
+        ASTreeIndex patterns = ASTreeNewNode(p->tree, NODE_WORDLIST);
+        uint32_t npatterns = 0;
+        tok_t* pattern;
+        do {
+            if (!term(p, TOKEN, &pattern))
+                return AST_NULL;
+            set_word(p, ASTreeNewNode(p->tree, NODE_ARGUMENT), pattern);
+            npatterns++;
+        } while (term(p, CHAR_PIPE, NULL));
+        if (!term(p, CHAR_RPAREN, NULL))
+            return AST_NULL;
+
+        /* 項目の中身は空でもよい */
+        ASTreeIndex bodyNode = COMPOUNDLIST(p);
+        if (bodyNode == AST_NULL && p->incomplete)
+            return AST_NULL;
+        skip_newlines(p);
+        if (!term(p, TOKEN_DSEMI, NULL) && !(p->curtok != NULL && p->curtok->type == TOKEN && strcmp(p->curtok->data, "esac") == 0)) {
+            if (at_end(p))
+                p->incomplete = true;
+            return AST_NULL; /* 最後の項目以外は ';;' で終わる */
+        }
+
+        ASTreeAttachBinaryBranch(p->tree, patterns, npatterns, bodyNode); /* [left: パターンの数] --- [root: NODE_WORDLIST] --- [right: 中身] */
+        item = ASTreeNewNode(p->tree, NODE_CASE_ITEM);
+        ASTreeAttachBinaryBranch(p->tree, item, patterns, AST_NULL);
+        if (prev == AST_NULL)
+            first = item;
+        else
+            ASTreeAttachBinaryBranch(p->tree, prev, ASTreeLeft(p->tree, prev), item);
+        prev = item;
+    }
 
-    return NULL;
+    ASTreeAttachBinaryBranch(p->tree, result, AST_NULL, first); /* [right: 最初の NODE_CASE_ITEM] */
+    return result;
 }
 
 /*
-** TOKENLIST1():
-** 以下のパターンに合致するかを検証する
-** <token> <token list>
+** COMPOUNDCMD():
+** CMD の検証を行う関数から呼び出される
+** 先頭の予約語で制御構文の種類を判定する。制御構文でなければ、何も読まずにAST_NULLを返す
+** 途中で合致しなくなった場合は、ノードプールを巻き戻してAST_NULLを返す
 */
-ASTreeNode* TOKENLIST1()
+ASTreeIndex COMPOUNDCMD(parser_ctx* p)
 {
-    ASTreeNode* tokenListNode;
-    ASTreeNode* result;
-
-    char* arg;
-    if (!term(TOKEN, &arg))
-        return NULL;
-
-    tokenListNode = TOKENLIST();
-    // we don't check whether tokenlistNode is NULL since its a valid grammer
-    /* tokenListNodeがNULLである場合も有効な文法であるため、エラーとしてチェックしない */
-
-    result = malloc(sizeof(*result)); /* ASTreeNode のポインタをメモリ確保 */
-    ASTreeNodeSetType(result, NODE_ARGUMENT); /* 単独の引数としてノードタイプを設定 */
-    ASTreeNodeSetData(result, arg); /* resultのnodeに、テキストを保存する */
-	ASTreeAttachBinaryBranch(result, NULL, tokenListNode);  /* [left: NULL] --- [root: result(NODE_ARGUMENT)] --- [right: tokenListNode] */
+    ASTreeMark mark = ASTreeGetMark(p->tree);
+    tok_t* save = p->curtok;
+    ASTreeIndex result;
+
+    if (keyword(p, "if"))
+        result = IFCLAUSE(p);
+    else if (keyword(p, "while"))
+        result = LOOPCLAUSE(p, NODE_WHILE);
+    else if (keyword(p, "until"))
+        result = LOOPCLAUSE(p, NODE_UNTIL);
+    else if (keyword(p, "for"))
+        result = FORCLAUSE(p);
+    else if (keyword(p, "case"))
+        result = CASECLAUSE(p);
+    else if (keyword(p, "{")) {
+        /* '{' <compound list> '}' */
+        ASTreeIndex listNode;
+        result = AST_NULL;
+        if ((listNode = COMPOUNDLIST(p)) != AST_NULL && expect(p, "}")) {
+            result = ASTreeNewNode(p->tree, NODE_GROUP);
+            ASTreeAttachBinaryBranch(p->tree, result, listNode, AST_NULL); /* [left: 中身] --- [root: NODE_GROUP] */
+        }
+    }
+    else if (term(p, CHAR_LPAREN, NULL)) {
+        /* '(' <compound list> ')' */
+        ASTreeIndex listNode;
+        result = AST_NULL;
+        if ((listNode = COMPOUNDLIST(p)) != AST_NULL) {
+            skip_newlines(p);
+            if (term(p, CHAR_RPAREN, NULL)) {
+                result = ASTreeNewNode(p->tree, NODE_SUBSHELL);
+                ASTreeAttachBinaryBranch(p->tree, result, listNode, AST_NULL); /* [left: 中身] --- [root: NODE_SUBSHELL] */
+            }
+            else if (at_end(p))
+                p->incomplete = true; /* ')' は次の行にある */
+        }
+    }
+    else
+        return AST_NULL;
 
+    if (result == AST_NULL) {
+        ASTreeRollback(p->tree, mark);
+        if (!p->incomplete)
+            p->curtok = save; /* エラーの位置として、制御構文の先頭を示す */
+    }
     return result;
 }
 
 /*
-** TOKENLIST2():
+** FUNCDEF():
+** CMD の検証を行う関数から呼び出される
 ** 以下のパターンに合致するかを検証する
-** EMPTY
+** <name> '(' ')' <compound command>
+** 名前の次が '(' でなければ、何も読まずにAST_NULLを返す
 */
-ASTreeNode* TOKENLIST2()
+ASTreeIndex FUNCDEF(parser_ctx* p)
 {
-    /* <tokenlist>が解析されていき、<token> の連なりに分解されたら、最終的にはEMPTYになる */
-    return NULL;
+    ASTreeIndex bodyNode, result;
+    tok_t* name = p->curtok;
+
+    if (p->curtok == NULL || p->curtok->type != TOKEN || is_reserved(p->curtok->data)
+        || p->curtok->next == NULL || p->curtok->next->type != CHAR_LPAREN)
+        return AST_NULL;
+
+    p->curtok = p->curtok->next->next;
+    bodyNode = AST_NULL;
+    if (term(p, CHAR_RPAREN, NULL)) {
+        skip_newlines(p); /* 中身は次の行から始まってもよい */
+        bodyNode = COMPOUNDCMD(p);
+    }
+    if (bodyNode == AST_NULL) {
+        if (at_end(p))
+            p->incomplete = true;
+        else
+            p->curtok = name; /* 関数の定義ではなかった */
+        return AST_NULL;
+    }
+
+    result = ASTreeNewNode(p->tree, NODE_FUNCDEF);
+    ASTreeNodeSetData(p->tree, result, name->data); /* 関数名 */
+    ASTreeAttachBinaryBranch(p->tree, result, bodyNode, AST_NULL); /* [left: 中身] --- [root: NODE_FUNCDEF] */
+    return result;
 }
 
 /*
-** perser():
+** parser_parse():
 ** tokensから抽象構文木を生成する
+** ノードは tree のノードプールに確保され、ルートの添字が syntax_tree に格納される
+** 制御構文などの途中で入力が終わっている場合は、PARSE_INCOMPLETE を返す
+** 構文エラーの場合は -1 を返し、表示するメッセージを ctx->error に入れる(ここでは表示しない)
+** 解析の途中の状態はすべて ctx に持つので、別々の ctx と tree を使えば複数のスレッドで同時に解析できる
 */
-int parse(lexer_t* lexbuf, ASTreeNode** syntax_tree)
+int parser_parse(parser_ctx* p, lexer_t* lexbuf, ASTree* tree, ASTreeIndex* syntax_tree)
 {
+	p->error[0] = 0;
 	if (lexbuf->ntoks == 0) /* tokenがひとつもない場合、終了する */
 		return -1;
 	
     /* curtok: current token pointer
     ** とりあえずlexbufが保持しているtokenリストの先頭のポインタを取っている…
     */
-	curtok = lexbuf->llisttok;
+	p->curtok = lexbuf->llisttok;
+	p->tree = tree;
+	p->incomplete = false;
+	p->fanout_depth = 0;
 
     /*
     ** tokenリストを解析した結果の抽象構文木を返してくる関数CMDLINEを実行
     ** CMDLINE内部で、<command line> -> <job> -> <command> -> <simple command> -> <token list> -> <token> の順に分割しながら解析を行ってくれる
     */
-    *syntax_tree = CMDLINE();
+    *syntax_tree = CMDLINE(p);
+	skip_newlines(p);
 	
     /* 解析すべきtokenが残っているのに、CMDLINE()から処理が戻っている = エラー */
-    if (curtok != NULL && curtok->type != 0)
+    if (*syntax_tree == AST_NULL || !at_end(p))
     {
-        printf("Syntax Error near: %s\n", curtok->data);
+        if (p->incomplete) /* 入力の終わりまでは正しい構文だった */
+            return PARSE_INCOMPLETE;
+        snprintf(p->error, sizeof(p->error), "Syntax Error near: %s", at_end(p) ? "end of input" :
+                 p->curtok->type == CHAR_NEWLINE ? "newline" : p->curtok->data);
         return -1;
     }
 	
 	return 0;
 }
+
+/*
+** perser():
+** parser_parse() を、その場で用意した状態で呼び出す
+** 構文エラーのメッセージは、ここで表示する
+*/
+int parse(lexer_t* lexbuf, ASTree* tree, ASTreeIndex* syntax_tree)
+{
+	parser_ctx ctx;
+	int result = parser_parse(&ctx, lexbuf, tree, syntax_tree);
+	if (ctx.error[0] != 0)
+		printf("%s\n", ctx.error);
+	return result;
+}
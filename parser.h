@@ -4,6 +4,27 @@
 #include "astree.h"
 #include "lexer.h"
 
-int parse(lexer_t* lexbuf, ASTreeNode** syntax_tree);
+#include <stdbool.h>
+
+#define PARSE_INCOMPLETE 1 /* 制御構文などの途中で入力が終わっている。続きの行を読めば解析できる */
+
+/*
+** parser_ctx:
+** 構文解析の途中の状態
+** 解析する関数はすべてこれを受け取り、グローバル変数を使わない
+** 字句解析の状態は lexer_t(lexer_build() の結果)が持つので、
+** ctx / lexer_t / ASTree をスレッドごとに用意すれば、同時にいくつでも解析できる
+*/
+typedef struct parser_ctx
+{
+	tok_t* curtok; /* 現在解析中のtoken */
+	ASTree* tree; /* 構文解析の結果を格納するノードプール */
+	bool incomplete; /* 制御構文などの途中で入力が終わったか(続きの行を読めば正しい構文になる可能性がある) */
+	int fanout_depth; /* 解析中の '|{' ... '}' の深さ。この中では、引数の位置の '}' を '|{' の終わりとして扱う */
+	char error[128]; /* 構文エラーのメッセージ */
+} parser_ctx;
+
+int parser_parse(parser_ctx* ctx, lexer_t* lexbuf, ASTree* tree, ASTreeIndex* syntax_tree);
+int parse(lexer_t* lexbuf, ASTree* tree, ASTreeIndex* syntax_tree);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,518 @@
+#include "plan.h"
+#include "memstats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+** plan_emit():
+** 実行計画の末尾に命令をひとつ追加し、そのポインタを返す
+** 領域が足りなくなったら、倍の大きさに拡張する
+*/
+static PlanOp* plan_emit(Plan* plan, PlanOpType type)
+{
+    if (plan->nops == plan->capacity) {
+        plan->capacity = plan->capacity ? plan->capacity * 2 : 16;
+        plan->ops = mem_realloc(MEM_EXECUTOR, plan->ops, sizeof(PlanOp) * plan->capacity);
+    }
+
+    PlanOp* op = &plan->ops[plan->nops++];
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+    return op;
+}
+
+/*
+** compile_simple_command():
+** <simple command> を PLAN_SPAWN に変換する
+** 引数の数は NODE_CMDPATH のノードが持っているので、実行時に数え直す必要はない
+** パイプやバックグラウンドの情報は、実行時にインタプリタが設定する
+*/
+static void compile_simple_command(Plan* plan, ASTree* tree, ASTreeIndex simplecmdNode)
+{
+    if (simplecmdNode == AST_NULL || NODETYPE(ASTreeType(tree, simplecmdNode)) != NODE_CMDPATH)
+        return; /* コマンドになっていないノードは命令にしない */
+
+    plan_emit(plan, PLAN_SPAWN)->node = simplecmdNode;
+}
+
+static void compile_cmdline(Plan* plan, ASTree* tree, ASTreeIndex cmdline);
+static void compile_job(Plan* plan, ASTree* tree, ASTreeIndex jobNode, bool async);
+
+/* 制御構文のノードか */
+static bool is_compound(ASTree* tree, ASTreeIndex node)
+{
+    switch (NODETYPE(ASTreeType(tree, node)))
+    {
+    case NODE_IF:
+    case NODE_WHILE:
+    case NODE_UNTIL:
+    case NODE_FOR:
+    case NODE_CASE:
+    case NODE_GROUP:
+    case NODE_SUBSHELL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+** emit_jump():
+** 分岐命令を追加し、その位置を返す
+** 分岐先が後ろにある場合は、分岐先をコンパイルし終えてから plan->ops[位置].jump を埋める
+** (opsは拡張で移動するので、ポインタではなく位置で覚えておく)
+*/
+static int emit_jump(Plan* plan, PlanOpType type, int jump)
+{
+    int at = plan->nops;
+    plan_emit(plan, type)->jump = jump;
+    return at;
+}
+
+/*
+** compile_if():
+**   <条件> JUMP_IF_FALSE else  <then の中身> JUMP end  else: <else の中身> end:
+** else が無い場合、条件が偽なら if の終了ステータスは 0 になる
+*/
+static void compile_if(Plan* plan, ASTree* tree, ASTreeIndex ifNode)
+{
+    ASTreeIndex thenPart = ASTreeRight(tree, ifNode);
+    ASTreeIndex elsePart = ASTreeRight(tree, thenPart);
+
+    compile_cmdline(plan, tree, ASTreeLeft(tree, ifNode));
+    int tofalse = emit_jump(plan, PLAN_JUMP_IF_FALSE, 0);
+    compile_cmdline(plan, tree, ASTreeLeft(tree, thenPart));
+    int toend = emit_jump(plan, PLAN_JUMP, 0);
+
+    plan->ops[tofalse].jump = plan->nops;
+    if (elsePart == AST_NULL)
+        plan_emit(plan, PLAN_TRUE);
+    else if (NODETYPE(ASTreeType(tree, elsePart)) == NODE_IF) /* elif */
+        compile_if(plan, tree, elsePart);
+    else
+        compile_cmdline(plan, tree, elsePart);
+    plan->ops[toend].jump = plan->nops;
+}
+
+/*
+** compile_loop():
+**   top: <条件> JUMP_IF_FALSE end (until は JUMP_IF_TRUE)  <中身> JUMP top  end: TRUE
+*/
+static void compile_loop(Plan* plan, ASTree* tree, ASTreeIndex loopNode)
+{
+    PlanOpType leave = NODETYPE(ASTreeType(tree, loopNode)) == NODE_WHILE ? PLAN_JUMP_IF_FALSE : PLAN_JUMP_IF_TRUE;
+    int top = plan->nops;
+
+    compile_cmdline(plan, tree, ASTreeLeft(tree, loopNode));
+    int toend = emit_jump(plan, leave, 0);
+    compile_cmdline(plan, tree, ASTreeRight(tree, loopNode));
+    emit_jump(plan, PLAN_JUMP, top);
+
+    plan->ops[toend].jump = plan->nops;
+    plan_emit(plan, PLAN_TRUE);
+}
+
+/*
+** compile_for():
+**   FOR_INIT  top: FOR_NEXT end  <中身> JUMP top  end:
+*/
+static void compile_for(Plan* plan, ASTree* tree, ASTreeIndex forNode)
+{
+    int slot = plan->nslots++;
+    PlanOp* op = plan_emit(plan, PLAN_FOR_INIT);
+    op->node = forNode;
+    op->slot = slot;
+
+    int top = plan->nops;
+    op = plan_emit(plan, PLAN_FOR_NEXT);
+    op->node = forNode;
+    op->slot = slot;
+
+    compile_cmdline(plan, tree, ASTreeRight(tree, forNode));
+    emit_jump(plan, PLAN_JUMP, top);
+    plan->ops[top].jump = plan->nops;
+}
+
+/*
+** compile_case():
+**   CASE_WORD  CASE_TEST next1 <中身1> JUMP end  next1: CASE_TEST next2 <中身2> JUMP end ... TRUE end:
+** 末尾の JUMP は、分岐先が決まるまで jump に一つ前の JUMP の位置を入れてつないでおく
+*/
+static void compile_case(Plan* plan, ASTree* tree, ASTreeIndex caseNode)
+{
+    int slot = plan->nslots++;
+    PlanOp* op = plan_emit(plan, PLAN_CASE_WORD);
+    op->node = caseNode;
+    op->slot = slot;
+
+    int pending = -1; /* 分岐先が未定の JUMP */
+    ASTreeIndex item;
+    for (item = ASTreeRight(tree, caseNode); item != AST_NULL; item = ASTreeRight(tree, item)) {
+        ASTreeIndex patterns = ASTreeLeft(tree, item);
+        int test = plan->nops;
+        op = plan_emit(plan, PLAN_CASE_TEST);
+        op->node = patterns;
+        op->slot = slot;
+
+        if (ASTreeRight(tree, patterns) == AST_NULL) /* 中身の無い項目 */
+            plan_emit(plan, PLAN_TRUE);
+        else
+            compile_cmdline(plan, tree, ASTreeRight(tree, patterns));
+        pending = emit_jump(plan, PLAN_JUMP, pending);
+        plan->ops[test].jump = plan->nops;
+    }
+    plan_emit(plan, PLAN_TRUE); /* どの項目にも一致しなかった */
+
+    while (pending != -1) {
+        int prev = plan->ops[pending].jump;
+        plan->ops[pending].jump = plan->nops;
+        pending = prev;
+    }
+}
+
+/*
+** compile_compound():
+** 制御構文を、分岐命令を使ってその場に展開する
+** 中身のコマンドはシェル自身のプロセスで順番に解釈されるので、ループのたびにforkすることはない
+*/
+static void compile_compound(Plan* plan, ASTree* tree, ASTreeIndex node)
+{
+    switch (NODETYPE(ASTreeType(tree, node)))
+    {
+    case NODE_IF:
+        compile_if(plan, tree, node);
+        break;
+    case NODE_WHILE:
+    case NODE_UNTIL:
+        compile_loop(plan, tree, node);
+        break;
+    case NODE_FOR:
+        compile_for(plan, tree, node);
+        break;
+    case NODE_CASE:
+        compile_case(plan, tree, node);
+        break;
+    case NODE_GROUP:
+    case NODE_SUBSHELL: /* 子プロセスにするのは PLAN_SUBSHELL で、ここでは中身を並べるだけ */
+        compile_cmdline(plan, tree, ASTreeLeft(tree, node));
+        break;
+    }
+}
+
+/*
+** compile_funcdef():
+**   FUNCDEF end  <関数の中身>  end:
+** 中身は定義した場所では実行せずに読み飛ばし、呼び出されたときに FUNCDEF の次から end の手前までを実行する
+** 関数の表は Plan を参照して中身の命令と抽象構文木を使うので、コンパイルし直す必要はない
+*/
+static void compile_funcdef(Plan* plan, ASTree* tree, ASTreeIndex funcNode)
+{
+    int def = emit_jump(plan, PLAN_FUNCDEF, 0);
+    plan->ops[def].node = funcNode;
+    compile_job(plan, tree, ASTreeLeft(tree, funcNode), false); /* f() ( ... ) の中身は子プロセスで実行する */
+    plan->ops[def].jump = plan->nops;
+}
+
+/* リダイレクトのノードか */
+static bool is_redirect(ASTree* tree, ASTreeIndex node)
+{
+    int type = NODETYPE(ASTreeType(tree, node));
+    return type == NODE_REDIRECT_IN || type == NODE_REDIRECT_OUT
+        || type == NODE_REDIRECT_APPEND || type == NODE_REDIRECT_DUP;
+}
+
+/* リダイレクトを付けたコマンド。最初に書かれたリダイレクトの右の枝にある */
+static ASTreeIndex redirect_target(ASTree* tree, ASTreeIndex node)
+{
+    while (is_redirect(tree, node))
+        node = ASTreeRight(tree, node);
+    return node;
+}
+
+/*
+** compile_redirects():
+** コマンドに付いたリダイレクトの命令を、書かれた順に追加する
+** 右の枝が手前に書かれたリダイレクトなので、右の枝を先にコンパイルする
+** ファイル名に $変数 があれば、実行時にノードから展開する
+*/
+static void compile_redirects(Plan* plan, ASTree* tree, ASTreeIndex redirectNode)
+{
+    if (!is_redirect(tree, redirectNode))
+        return;
+    compile_redirects(plan, tree, ASTreeRight(tree, redirectNode));
+
+    int type = NODETYPE(ASTreeType(tree, redirectNode));
+    ASTreeIndex fdNode = ASTreeLeft(tree, redirectNode);
+    PlanOp* op = plan_emit(plan, PLAN_REDIRECT);
+    op->node = redirectNode;
+    op->target = ASTreeData(tree, redirectNode);
+    if (fdNode != AST_NULL)
+        op->fd = atoi(ASTreeData(tree, fdNode));
+    else
+        op->fd = type == NODE_REDIRECT_IN ? STDIN_FILENO : STDOUT_FILENO;
+}
+
+/*
+** compile_command():
+** <command> をコンパイルする
+** リダイレクトがあれば、PLAN_SPAWN / PLAN_SUBSHELL の前に書かれた順に PLAN_REDIRECT を置く
+** パイプラインのステージやバックグラウンドの制御構文と ( ... ) は、PLAN_SUBSHELL で子プロセスにまとめる
+*/
+static void compile_command(Plan* plan, ASTree* tree, ASTreeIndex cmdNode)
+{
+    if (cmdNode == AST_NULL)
+        return;
+
+    if (is_redirect(tree, cmdNode)) {
+        compile_redirects(plan, tree, cmdNode);
+        compile_command(plan, tree, redirect_target(tree, cmdNode));
+        return;
+    }
+
+    switch (NODETYPE(ASTreeType(tree, cmdNode)))
+    {
+    case NODE_CMDPATH:
+        compile_simple_command(plan, tree, cmdNode);
+        break;
+    default:
+        if (is_compound(tree, cmdNode)) {
+            int subshell = emit_jump(plan, PLAN_SUBSHELL, 0);
+            plan->ops[subshell].node = cmdNode; /* jobs で表示するため */
+            compile_compound(plan, tree, cmdNode);
+            plan->ops[subshell].jump = plan->nops; /* 子プロセスはここで終了する */
+        }
+        break;
+    }
+}
+
+static void compile_stages(Plan* plan, ASTree* tree, ASTreeIndex jobNode);
+
+/*
+** compile_fanout():
+**   PIPE <出力側> FANOUT  BRANCH <消費側 0 のステージ>  BRANCH <消費側 1 のステージ> ...  FANOUT_END
+** 消費側のステージも同じジョブに入れて、PLAN_WAIT でまとめて終了を待つ
+** 消費側の中にさらに '|{' があってもよいように、複製のディスクリプタはそれぞれの slot に置く
+*/
+static void compile_fanout(Plan* plan, ASTree* tree, ASTreeIndex fanoutNode)
+{
+    int slot = plan->nslots++;
+    ASTreeIndex item;
+    PlanOp* op;
+
+    plan_emit(plan, PLAN_PIPE); /* 出力側の出力は、ポンプへ */
+    compile_command(plan, tree, ASTreeLeft(tree, fanoutNode));
+    op = plan_emit(plan, PLAN_FANOUT);
+    op->node = fanoutNode;
+    op->slot = slot;
+
+    for (item = ASTreeRight(tree, fanoutNode); item != AST_NULL; item = ASTreeRight(tree, item)) {
+        op = plan_emit(plan, PLAN_FANOUT_BRANCH);
+        op->node = item;
+        op->slot = slot;
+        compile_stages(plan, tree, ASTreeLeft(tree, item));
+    }
+    plan_emit(plan, PLAN_FANOUT_END)->slot = slot;
+}
+
+/*
+** compile_stages():
+** パイプラインのステージを並べる
+** NODE_PIPE の右に連なるコマンドを、先頭から順に PLAN_PIPE + ステージとして並べる
+** 最後が '|{' なら、その出力側と消費側のジョブを続けて並べる
+*/
+static void compile_stages(Plan* plan, ASTree* tree, ASTreeIndex jobNode)
+{
+    while (NODETYPE(ASTreeType(tree, jobNode)) == NODE_PIPE) {
+        plan_emit(plan, PLAN_PIPE); /* 左の枝の出力は、次のステージへ */
+        compile_command(plan, tree, ASTreeLeft(tree, jobNode));
+        jobNode = ASTreeRight(tree, jobNode);
+    }
+    if (NODETYPE(ASTreeType(tree, jobNode)) == NODE_FANOUT)
+        compile_fanout(plan, tree, jobNode);
+    else
+        compile_command(plan, tree, jobNode); /* 最後のステージ */
+}
+
+/*
+** compile_group():
+**   REDIRECT ...  GROUP_BEGIN end  <制御構文>  end: GROUP_END
+** 制御構文の前後で、リダイレクトをシェル自身のディスクリプタに適用して元に戻す
+** ({ a; b; } > out は、out を一度だけ開いて a と b の出力先にする)
+** 切り替える前のディスクリプタは slot に置く。開けなかった場合は中身を実行しない
+*/
+static void compile_group(Plan* plan, ASTree* tree, ASTreeIndex redirectNode, ASTreeIndex compoundNode)
+{
+    int slot = plan->nslots++;
+
+    compile_redirects(plan, tree, redirectNode);
+    int begin = emit_jump(plan, PLAN_GROUP_BEGIN, 0);
+    plan->ops[begin].slot = slot;
+    compile_compound(plan, tree, compoundNode);
+    plan->ops[begin].jump = plan->nops;
+    plan_emit(plan, PLAN_GROUP_END)->slot = slot;
+}
+
+/*
+** compile_job():
+** <job> をコンパイルする
+** フォアグラウンドのジョブは最後に PLAN_WAIT でまとめて終了を待つ
+** 単独の制御構文をフォアグラウンドで実行する場合は、子プロセスを作らずにその場に展開する
+*/
+static void compile_job(Plan* plan, ASTree* tree, ASTreeIndex jobNode, bool async)
+{
+    if (jobNode == AST_NULL)
+        return;
+
+    if (NODETYPE(ASTreeType(tree, jobNode)) == NODE_FUNCDEF) {
+        compile_funcdef(plan, tree, jobNode); /* 定義するだけなので、バックグラウンドでも同じ */
+        return;
+    }
+
+    if (!async && is_compound(tree, jobNode) && NODETYPE(ASTreeType(tree, jobNode)) != NODE_SUBSHELL) {
+        compile_compound(plan, tree, jobNode);
+        return;
+    }
+
+    /* リダイレクトを付けた制御構文も、切り替えたディスクリプタのままシェル自身で実行する */
+    ASTreeIndex target = redirect_target(tree, jobNode);
+    if (!async && target != jobNode && is_compound(tree, target) && NODETYPE(ASTreeType(tree, target)) != NODE_SUBSHELL) {
+        compile_group(plan, tree, jobNode, target);
+        return;
+    }
+
+    if (async)
+        plan_emit(plan, PLAN_BACKGROUND);
+
+    compile_stages(plan, tree, jobNode);
+
+    if (!async)
+        plan_emit(plan, PLAN_WAIT);
+    plan_emit(plan, PLAN_SEQ);
+}
+
+/*
+** compile_cmdline():
+** <command line> をコンパイルする
+** ';' と '&' で区切られたジョブを、左から順番に並べていく
+*/
+static void compile_cmdline(Plan* plan, ASTree* tree, ASTreeIndex cmdline)
+{
+    while (cmdline != AST_NULL) {
+        switch (NODETYPE(ASTreeType(tree, cmdline)))
+        {
+        case NODE_SEQ: /* ';' */
+            compile_job(plan, tree, ASTreeLeft(tree, cmdline), false);
+            cmdline = ASTreeRight(tree, cmdline);
+            break;
+        case NODE_BCKGRND: /* '&' */
+            compile_job(plan, tree, ASTreeLeft(tree, cmdline), true);
+            cmdline = ASTreeRight(tree, cmdline);
+            break;
+        default: /* ';' や '&' がない単独のジョブ */
+            compile_job(plan, tree, cmdline, false);
+            cmdline = AST_NULL;
+        }
+    }
+}
+
+/*
+** plan_compile():
+** 抽象構文木を、実行計画(命令の配列)に変換する
+** tree のノードプールは Plan に引き取られ(文字列をコピーせずに移し替える)、tree は空になる
+*/
+Plan* plan_compile(ASTree* tree, ASTreeIndex root)
+{
+    return plan_compile_list(tree, &root, 1);
+}
+
+/*
+** plan_compile_list():
+** 同じノードプールに入っている複数行分の抽象構文木を、順番にひとつの実行計画にまとめる
+** (rcファイルのキャッシュのように、ファイル全体を一度に解析したもの)
+** 返した Plan の参照カウントは1で、使い終わったら plan_release() する
+*/
+Plan* plan_compile_list(ASTree* tree, const ASTreeIndex* roots, int nroots)
+{
+    Plan* plan = mem_calloc(MEM_EXECUTOR, 1, sizeof(*plan));
+    int i;
+    for (i = 0; i < nroots; i++)
+        compile_cmdline(plan, tree, roots[i]);
+
+    plan->tree = *tree;
+    ASTreeInit(tree);
+    plan->refs = 1;
+    return plan;
+}
+
+/* 実行計画への参照を増やす。実行中にキャッシュから追い出されても解放されないようにする */
+void plan_retain(Plan* plan)
+{
+    plan->refs++;
+}
+
+/* 実行計画への参照を減らし、誰も使わなくなったら引き取った抽象構文木ごと解放する */
+void plan_release(Plan* plan)
+{
+    if (plan == NULL || --plan->refs > 0)
+        return;
+
+    ASTreeDestroy(&plan->tree);
+    mem_free(plan->ops);
+    mem_free(plan);
+}
+
+/*
+** 実行計画のキャッシュ
+** スクリプトやループで同じ行が繰り返し実行される場合に、
+** 字句解析・構文解析・コンパイルを省略するため、入力行の文字列をキーにして Plan を保持する
+** 入力行のハッシュ値で格納位置を決める(ダイレクトマップ)ので、衝突したら古い方を捨てる
+*/
+#define PLAN_CACHE_SIZE 256
+
+typedef struct PlanCacheEntry
+{
+    char* line; /* キーになる入力行 */
+    uint32_t hash;
+    Plan* plan;
+} PlanCacheEntry;
+
+static PlanCacheEntry plan_cache[PLAN_CACHE_SIZE];
+
+/* FNV-1a ハッシュ */
+static uint32_t plan_hash(const char* s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+/* 入力行に対応するコンパイル済みの Plan を返す。無ければNULL */
+Plan* plan_cache_lookup(const char* line)
+{
+    uint32_t h = plan_hash(line);
+    PlanCacheEntry* e = &plan_cache[h % PLAN_CACHE_SIZE];
+
+    if (e->line != NULL && e->hash == h && strcmp(e->line, line) == 0)
+        return e->plan;
+    return NULL;
+}
+
+/*
+** plan_cache_insert():
+** Plan をキャッシュに登録する。呼び出し元が持っていた参照は、キャッシュが引き継ぐ
+*/
+void plan_cache_insert(const char* line, Plan* plan)
+{
+    uint32_t h = plan_hash(line);
+    PlanCacheEntry* e = &plan_cache[h % PLAN_CACHE_SIZE];
+
+    if (e->line != NULL) { /* 同じ位置にあったものを捨てる */
+        mem_free(e->line);
+        plan_release(e->plan);
+    }
+    e->line = mem_strdup(MEM_EXECUTOR, line);
+    e->hash = h;
+    e->plan = plan;
+}
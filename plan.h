@@ -0,0 +1,87 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdbool.h>
+#include "astree.h"
+#include "command.h"
+
+/*
+** PlanOpType:
+** 抽象構文木をコンパイルした結果の、実行計画(plan)の命令の種類
+** 実行時は、先頭から順番に命令を解釈していくだけでよい
+*/
+typedef enum {
+    PLAN_SPAWN,         /* 1つのステージ(simple command)を起動する */
+    PLAN_REDIRECT,      /* 次に起動するステージのディスクリプタ fd を、ファイルか別のディスクリプタに切り替える ( '<' '>' '>>' '>&' ) */
+    PLAN_PIPE,          /* 次に起動するステージの標準出力を、その次のステージとパイプでつなぐ ( '|' ) */
+    PLAN_WAIT,          /* フォアグラウンドのジョブのすべてのプロセスの終了を待つ */
+    PLAN_SEQ,           /* ジョブの区切り。ジョブ単位の状態をリセットする ( ';' ) */
+    PLAN_BACKGROUND,    /* これから始まるジョブをバックグラウンドで実行する ( '&' ) */
+
+    /* 制御構文。分岐先は命令の位置(jump)で持つ */
+    PLAN_JUMP,          /* jump の位置へ移る */
+    PLAN_JUMP_IF_FALSE, /* 直前の終了ステータスが 0 以外なら jump の位置へ移る ( if / while ) */
+    PLAN_JUMP_IF_TRUE,  /* 直前の終了ステータスが 0 なら jump の位置へ移る ( until ) */
+    PLAN_TRUE,          /* 終了ステータスを 0 にする */
+    PLAN_FOR_INIT,      /* for の単語の並びを展開して slot に保存する */
+    PLAN_FOR_NEXT,      /* slot の次の単語をループ変数に代入する。単語が無くなったら jump の位置へ移る */
+    PLAN_CASE_WORD,     /* case の単語を展開して slot に保存する */
+    PLAN_CASE_TEST,     /* slot の単語がパターンのどれにも一致しなければ jump の位置へ移る */
+    PLAN_SUBSHELL,      /* 次の命令から jump の手前までを、子プロセスでひとつのステージとして実行する */
+    PLAN_FUNCDEF,       /* 次の命令から jump の手前までを、関数の中身として登録する(その場では実行しない) */
+
+    /* 出力の複製 ( command |{ job, job ... } )。消費側の標準入力にするディスクリプタは slot に置く */
+    PLAN_FANOUT,        /* 直前のステージの出力を、消費側の数だけ複製するポンプを起動する */
+    PLAN_FANOUT_BRANCH, /* 次に起動するステージの標準入力を、slot の次の複製にする */
+    PLAN_FANOUT_END,    /* 使われなかった複製を閉じる */
+
+    /* リダイレクトを付けた制御構文 ( { ...; } > file )。切り替える前のディスクリプタは slot に置く */
+    PLAN_GROUP_BEGIN,   /* ここまでの PLAN_REDIRECT をシェル自身に適用する。開けなければ jump の位置へ移る */
+    PLAN_GROUP_END,     /* PLAN_GROUP_BEGIN で切り替えたディスクリプタを元に戻す */
+} PlanOpType;
+
+/*
+** PlanOp:
+** 実行計画の命令ひとつ分
+** コマンドのノードやリダイレクト先はコンパイル時に解決しておき、実行時に木をたどり直さない
+** 文字列は Plan が引き取った抽象構文木の文字列テーブルをそのまま指す
+*/
+typedef struct PlanOp
+{
+    PlanOpType type;
+    ASTreeIndex node; /* PLAN_SPAWN: <simple command> の NODE_CMDPATH ノード */
+                      /* PLAN_REDIRECT: リダイレクトのノード(種類はノードの種類) */
+                      /* PLAN_FOR_INIT / PLAN_FOR_NEXT: NODE_FOR、PLAN_CASE_WORD: NODE_CASE */
+                      /* PLAN_CASE_TEST: パターンの NODE_WORDLIST、PLAN_FUNCDEF: NODE_FUNCDEF */
+                      /* PLAN_SUBSHELL: 子プロセスで実行する制御構文のノード */
+                      /* PLAN_FANOUT: NODE_FANOUT、PLAN_FANOUT_BRANCH: NODE_FANOUT_ITEM */
+    char* target; /* PLAN_REDIRECT: リダイレクト先のファイル名、'>&' '<&' では複製元の番号 */
+    int fd; /* PLAN_REDIRECT: 切り替えるディスクリプタ */
+    int jump; /* 分岐する命令の分岐先 */
+    int slot; /* for / case / 出力の複製 / リダイレクトを付けた制御構文の実行中の状態を置く場所の番号 */
+} PlanOp;
+
+/*
+** Plan:
+** 命令の配列。ひとつのコマンドライン分の実行計画になる
+** argv を文字列テーブルから直接組み立てるため、抽象構文木のノードプールも保持する
+*/
+typedef struct Plan
+{
+    PlanOp* ops;
+    int nops; /* 命令の数 */
+    int capacity; /* opsに確保済みの要素数 */
+    int nslots; /* for / case / 出力の複製 / リダイレクトを付けた制御構文の状態を置く場所の数。実行のたびに確保する */
+    ASTree tree; /* コンパイル元の抽象構文木 */
+    int refs; /* 参照カウント。キャッシュと実行中の処理がそれぞれ1つずつ持つ */
+} Plan;
+
+Plan* plan_compile(ASTree* tree, ASTreeIndex root);
+Plan* plan_compile_list(ASTree* tree, const ASTreeIndex* roots, int nroots);
+void plan_retain(Plan* plan);
+void plan_release(Plan* plan);
+
+Plan* plan_cache_lookup(const char* line);
+void plan_cache_insert(const char* line, Plan* plan);
+
+#endif
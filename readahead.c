@@ -0,0 +1,220 @@
+#include "readahead.h"
+#include "lexer.h"
+#include "parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+** スクリプトの先読み
+** 標準入力がスクリプトの場合、解析スレッドが先の行を読み込んで実行計画までコンパイルしておき、
+** 実行側(メインスレッド)は前のコマンドの子プロセスを待っている間に、次の計画を用意してもらう
+** 標準入力は先までまとめて読むので、スクリプトの中のコマンドは標準入力からスクリプトの続きを読めない
+** (そのため MYSH_PARSEAHEAD=1 を指定した場合だけ使う)
+**
+** 2つのスレッドは、固定長の環状バッファでつなぐ(1つずつの書き込み側と読み込み側だけなので、ロックは使わない)
+** head は実行側だけが、tail は解析側だけが進める。空・満杯のときだけ futex で相手を待つ
+** 構文エラーも項目として順番に並べるので、エラーはその行を実行する順番で表示される
+**
+** 解析側は、字句解析・構文解析・コンパイルだけを行う(変数や関数の表には触れない)
+** 構文解析の状態は parser_ctx に、ノードプールはこのスレッドの ASTree に持つ
+*/
+
+#define READAHEAD_DEPTH 64 /* 先読みしておく項目の数 */
+#define READAHEAD_CHUNK 65536 /* 1回の read() の大きさ */
+
+struct ReadAhead
+{
+	ReadAheadItem items[READAHEAD_DEPTH];
+	atomic_uint head; /* 次に取り出す位置 */
+	atomic_uint tail; /* 次に入れる位置 */
+	atomic_int reader_waiting; /* 実行側が、空のバッファを待っている */
+	atomic_int writer_waiting; /* 解析側が、満杯のバッファを待っている */
+	int fd;
+	pthread_t thread;
+};
+
+static void futex_wait(atomic_uint* word, unsigned int seen)
+{
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+static void futex_wake(atomic_uint* word)
+{
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* 解析側: 項目をバッファの末尾に入れる。満杯なら、実行側が取り出すまで待つ */
+static void push(ReadAhead* ra, const ReadAheadItem* item)
+{
+	unsigned int tail = atomic_load(&ra->tail);
+	unsigned int head;
+
+	while (tail - (head = atomic_load(&ra->head)) == READAHEAD_DEPTH) {
+		atomic_store(&ra->writer_waiting, 1);
+		if (tail - atomic_load(&ra->head) == READAHEAD_DEPTH)
+			futex_wait(&ra->head, head);
+	}
+	ra->items[tail % READAHEAD_DEPTH] = *item;
+	atomic_store(&ra->tail, tail + 1);
+	if (atomic_exchange(&ra->reader_waiting, 0))
+		futex_wake(&ra->tail);
+}
+
+/*
+** readahead_next():
+** 実行側: 次の項目を取り出す。まだ解析されていなければ、解析側が入れるまで待つ
+** eof の項目の後には呼び出さない
+*/
+void readahead_next(ReadAhead* ra, ReadAheadItem* item)
+{
+	unsigned int head = atomic_load(&ra->head);
+	unsigned int tail;
+
+	while ((tail = atomic_load(&ra->tail)) == head) {
+		atomic_store(&ra->reader_waiting, 1);
+		if (atomic_load(&ra->tail) == head)
+			futex_wait(&ra->tail, tail);
+	}
+	*item = ra->items[head % READAHEAD_DEPTH];
+	atomic_store(&ra->head, head + 1);
+	if (atomic_exchange(&ra->writer_waiting, 0))
+		futex_wake(&ra->head);
+}
+
+/*
+** parse_lines():
+** 読み込んだ行(続きの行をつなげたもの)を解析し、実行計画にコンパイルする
+** 制御構文の途中で終わっていれば PARSE_INCOMPLETE を返し、何も入れない
+*/
+static int parse_lines(ReadAhead* ra, char* text, size_t len, int nlines, ASTree* tree)
+{
+	ReadAheadItem item;
+	lexer_t lexbuf;
+	parser_ctx ctx;
+	ASTreeIndex root;
+	int result = 0;
+
+	memset(&item, 0, sizeof(item));
+	item.nlines = nlines;
+	lexer_build(text, len, &lexbuf);
+	if (lexbuf.ntoks > 0) {
+		ASTreeReset(tree);
+		result = parser_parse(&ctx, &lexbuf, tree, &root);
+		if (result == 0)
+			item.plan = plan_compile(tree, root);
+		else if (result != PARSE_INCOMPLETE)
+			strcpy(item.error, ctx.error);
+	}
+	lexer_destroy(&lexbuf);
+
+	if (result != PARSE_INCOMPLETE)
+		push(ra, &item);
+	return result;
+}
+
+/*
+** reader_main():
+** 解析スレッドの本体
+** 入力を行に分け、シェルの対話的な読み込みと同じく、制御構文が閉じるまで続きの行をつなげて解析する
+*/
+static void* reader_main(void* arg)
+{
+	ReadAhead* ra = arg;
+	char* buf = malloc(READAHEAD_CHUNK);
+	size_t buflen = 0; /* buf の中の、まだ行に分けていない部分の長さ */
+	char* pending = NULL; /* 解析する行。制御構文の途中であれば、続きの行をつなげていく */
+	size_t pending_len = 0;
+	int nlines = 0;
+	ASTree tree;
+	bool eof = false;
+
+	ASTreeInit(&tree);
+	while (!eof) {
+		ssize_t n = read(ra->fd, buf + buflen, READAHEAD_CHUNK - buflen);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			eof = true;
+			if (buflen == 0)
+				break;
+			n = 0; /* 改行で終わっていない最後の行 */
+		}
+		buflen += n;
+
+		char* start = buf;
+		char* newline;
+		while ((newline = memchr(start, '\n', buf + buflen - start)) != NULL || (eof && start < buf + buflen)) {
+			size_t len = newline != NULL ? (size_t)(newline + 1 - start) : (size_t)(buf + buflen - start);
+			pending = realloc(pending, pending_len + len + 1);
+			memcpy(pending + pending_len, start, len);
+			pending_len += len;
+			pending[pending_len] = 0;
+			nlines++;
+			start += len;
+
+			if (parse_lines(ra, pending, pending_len, nlines, &tree) != PARSE_INCOMPLETE) {
+				pending_len = 0;
+				nlines = 0;
+			}
+		}
+
+		/* 行の途中までしか読めていなければ、残りを先頭に寄せて続きを読む */
+		buflen = buf + buflen - start;
+		memmove(buf, start, buflen);
+		if (buflen == READAHEAD_CHUNK) { /* バッファより長い行は、読めた分だけ行にためておく */
+			pending = realloc(pending, pending_len + buflen + 1);
+			memcpy(pending + pending_len, buf, buflen);
+			pending_len += buflen;
+			buflen = 0;
+		}
+	}
+
+	/* 入力の終わり。閉じていない制御構文の行と、最後のプロンプトを表示する */
+	ReadAheadItem item;
+	memset(&item, 0, sizeof(item));
+	item.nlines = nlines + 1;
+	item.eof = true;
+	push(ra, &item);
+
+	ASTreeDestroy(&tree);
+	free(pending);
+	free(buf);
+	return NULL;
+}
+
+/*
+** readahead_start():
+** fd からスクリプトを読み込んで解析するスレッドを起動する
+** スレッドを作れなければ NULL を返す(呼び出し側は1行ずつ読み込む)
+*/
+ReadAhead* readahead_start(int fd)
+{
+	ReadAhead* ra = calloc(1, sizeof(ReadAhead));
+	sigset_t all, saved;
+
+	ra->fd = fd;
+	sigfillset(&all); /* シグナルはメインスレッドで受け取る */
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	int err = pthread_create(&ra->thread, NULL, reader_main, ra);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (err != 0) {
+		free(ra);
+		return NULL;
+	}
+	return ra;
+}
+
+/* eof の項目を取り出した後に、解析スレッドの終了を待って片付ける */
+void readahead_finish(ReadAhead* ra)
+{
+	pthread_join(ra->thread, NULL);
+	free(ra);
+}
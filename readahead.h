@@ -0,0 +1,25 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "plan.h"
+#include <stdbool.h>
+
+/*
+** ReadAheadItem:
+** 解析スレッドが先に読んで解析しておいた、1つのコマンドライン分の結果
+*/
+typedef struct ReadAheadItem
+{
+	Plan* plan; /* 実行計画。空行や構文エラーの場合は NULL */
+	int nlines; /* 読み込んだ行数(制御構文の続きの行を含む)。行ごとにプロンプトを表示する(2行目からは "> ") */
+	bool eof; /* 入力の終わり。最後のプロンプトを表示したら、それ以上の項目は無い */
+	char error[128]; /* 構文エラーのメッセージ */
+} ReadAheadItem;
+
+typedef struct ReadAhead ReadAhead;
+
+ReadAhead* readahead_start(int fd);
+void readahead_next(ReadAhead* ra, ReadAheadItem* item);
+void readahead_finish(ReadAhead* ra);
+
+#endif
@@ -0,0 +1,325 @@
+#define _GNU_SOURCE /* sched_setaffinity() と cpu_set_t */
+#include "schedhint.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+/*
+** ステージの CPU の割り当てと優先度
+** 組み込みコマンドの接頭辞 sched で、ステージまたはジョブ全体に指定する
+**   sched [-j] [-c CPU一覧 | -a] [-n nice値] [-i クラス[:レベル]] [--] コマンド ...
+** コマンドを付けずに実行すると、以降のジョブの既定値になる
+**   -a                 パイプラインのステージを、1つの NUMA ノードの別々のコアに散らす
+**   -n / -i            バックグラウンドのジョブの優先度
+**
+** 設定は子プロセスで fork から exec までの間に行うので、シェル自身には影響しない
+*/
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+/* ioprio_set() の定数(glibc にはラッパーが無い) */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+
+static SchedHint defaults; /* コマンドを付けずに sched で設定した既定値 */
+
+static int* spread_cpus = NULL; /* -a で使う CPU の一覧。最初に使うときに調べる */
+static int spread_ncpus = 0;
+
+static void cpus_set(unsigned long* cpus, int cpu)
+{
+	if (cpu >= 0 && cpu < SCHED_MAX_CPUS)
+		cpus[cpu / BITS_PER_WORD] |= 1UL << (cpu % BITS_PER_WORD);
+}
+
+static bool cpus_isset(const unsigned long* cpus, int cpu)
+{
+	return (cpus[cpu / BITS_PER_WORD] >> (cpu % BITS_PER_WORD)) & 1;
+}
+
+/* "0-3,8,10-11" の形式の CPU 一覧を読み取る */
+static bool parse_cpulist(const char* s, unsigned long* cpus)
+{
+	memset(cpus, 0, sizeof(unsigned long) * (SCHED_MAX_CPUS / BITS_PER_WORD));
+	while (*s && *s != '\n') {
+		char* end;
+		long first = strtol(s, &end, 10), last;
+		if (end == s || first < 0 || first >= SCHED_MAX_CPUS)
+			return false;
+		last = first;
+		s = end;
+		if (*s == '-') {
+			last = strtol(s + 1, &end, 10);
+			if (end == s + 1 || last < first || last >= SCHED_MAX_CPUS)
+				return false;
+			s = end;
+		}
+		for (; first <= last; first++)
+			cpus_set(cpus, first);
+		if (*s == ',')
+			s++;
+		else if (*s && *s != '\n')
+			return false;
+	}
+	return true;
+}
+
+/* "idle" / "be:4" / "rt:0" の形式の I/O の優先度を読み取る */
+static bool parse_ioprio(const char* s, int* ioprio)
+{
+	int class, level = 4;
+	const char* colon = strchr(s, ':');
+	size_t len = colon != NULL ? (size_t)(colon - s) : strlen(s);
+
+	if (len == 4 && strncmp(s, "idle", 4) == 0)
+		class = IOPRIO_CLASS_IDLE, level = 0;
+	else if (len == 2 && strncmp(s, "be", 2) == 0)
+		class = IOPRIO_CLASS_BE;
+	else if (len == 2 && strncmp(s, "rt", 2) == 0)
+		class = IOPRIO_CLASS_RT;
+	else
+		return false;
+
+	if (colon != NULL) {
+		char* end;
+		level = strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != 0 || level < 0 || level > 7)
+			return false;
+	}
+	*ioprio = (class << IOPRIO_CLASS_SHIFT) | level;
+	return true;
+}
+
+/*
+** sched_parse():
+** argv[0] の "sched" に続くオプションを hint に読み取り、オプションの後ろの位置(コマンドの位置)を返す
+** オプションが正しくなければ -1
+*/
+int sched_parse(int argc, char** argv, SchedHint* hint)
+{
+	int i;
+	memset(hint, 0, sizeof(*hint));
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		const char* opt = argv[i];
+		if (strcmp(opt, "--") == 0)
+			return i + 1;
+		if (strcmp(opt, "-j") == 0)
+			hint->flags |= SCHED_HINT_JOB;
+		else if (strcmp(opt, "-a") == 0)
+			hint->flags |= SCHED_HINT_SPREAD | SCHED_HINT_JOB;
+		else if (i + 1 < argc && strcmp(opt, "-c") == 0) {
+			if (!parse_cpulist(argv[++i], hint->cpus))
+				return -1;
+			hint->flags |= SCHED_HINT_CPUS;
+		}
+		else if (i + 1 < argc && strcmp(opt, "-n") == 0) {
+			char* end;
+			hint->nice = strtol(argv[++i], &end, 10);
+			if (*end != 0 || end == argv[i])
+				return -1;
+			hint->flags |= SCHED_HINT_NICE;
+		}
+		else if (i + 1 < argc && strcmp(opt, "-i") == 0) {
+			if (!parse_ioprio(argv[++i], &hint->ioprio))
+				return -1;
+			hint->flags |= SCHED_HINT_IOPRIO;
+		}
+		else
+			return -1;
+	}
+	return i;
+}
+
+/* 現在の CPU を含む NUMA ノードの CPU 一覧を読む。ノードの情報が無ければ false */
+static bool numa_node_cpus(int cpu, unsigned long* cpus)
+{
+	DIR* dir = opendir("/sys/devices/system/node");
+	if (dir == NULL)
+		return false;
+
+	bool found = false;
+	struct dirent* ent;
+	while (!found && (ent = readdir(dir)) != NULL) {
+		if (strncmp(ent->d_name, "node", 4) != 0 || !isdigit((unsigned char)ent->d_name[4]))
+			continue;
+
+		char path[300], buf[4096];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", ent->d_name);
+		FILE* fp = fopen(path, "re");
+		if (fp == NULL)
+			continue;
+		if (fgets(buf, sizeof(buf), fp) != NULL && parse_cpulist(buf, cpus) && cpus_isset(cpus, cpu))
+			found = true;
+		fclose(fp);
+	}
+	closedir(dir);
+	return found;
+}
+
+/* cpu と同じ物理コアの論理 CPU ( SMT の兄弟)の一覧を読む。情報が無ければ false */
+static bool core_siblings(int cpu, unsigned long* cpus)
+{
+	char path[128], buf[4096];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+	FILE* fp = fopen(path, "re");
+	if (fp == NULL)
+		return false;
+	bool ok = fgets(buf, sizeof(buf), fp) != NULL && parse_cpulist(buf, cpus);
+	fclose(fp);
+	return ok;
+}
+
+/*
+** spread_init():
+** -a で使う CPU の一覧を作る
+** シェルが今動いている CPU の NUMA ノードのうち、シェルに許されている CPU を使う
+** 物理コアごとに1つの論理 CPU を先に並べ、SMT の兄弟はその後ろに並べる
+** (ステージがコアの数より多い場合だけ、同じコアの別の論理 CPU を使う)
+*/
+static void spread_init()
+{
+	cpu_set_t allowed;
+	unsigned long node[SCHED_MAX_CPUS / BITS_PER_WORD];
+	unsigned long covered[SCHED_MAX_CPUS / BITS_PER_WORD]; /* 一覧に加えた CPU と、その SMT の兄弟 */
+	unsigned long siblings[SCHED_MAX_CPUS / BITS_PER_WORD];
+	int cpu = sched_getcpu();
+	int i, j;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		CPU_ZERO(&allowed);
+	bool have_node = cpu >= 0 && numa_node_cpus(cpu, node);
+
+	spread_cpus = malloc(sizeof(int) * SCHED_MAX_CPUS);
+	memset(covered, 0, sizeof(covered));
+	for (i = 0; i < SCHED_MAX_CPUS && i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &allowed) || (have_node && !cpus_isset(node, i)) || cpus_isset(covered, i))
+			continue;
+		spread_cpus[spread_ncpus++] = i;
+		cpus_set(covered, i);
+		if (core_siblings(i, siblings))
+			for (j = 0; j < (int)(SCHED_MAX_CPUS / BITS_PER_WORD); j++)
+				covered[j] |= siblings[j];
+	}
+
+	/* 残った SMT の兄弟 */
+	int ncores = spread_ncpus;
+	for (i = 0; i < SCHED_MAX_CPUS && i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, &allowed) || (have_node && !cpus_isset(node, i)))
+			continue;
+		for (j = 0; j < ncores && spread_cpus[j] != i; j++);
+		if (j == ncores)
+			spread_cpus[spread_ncpus++] = i;
+	}
+}
+
+/*
+** sched_resolve():
+** ステージに指定された設定(hint)に、ジョブ全体の設定と既定値を補って、実際に使う設定にする
+** -a では、ジョブの stage 番目のステージに、stage 番目の CPU を割り当てる
+*/
+void sched_resolve(SchedHint* hint, const SchedHint* job, bool async, bool piped, int stage)
+{
+	int flags = hint->flags;
+
+	if (!(flags & (SCHED_HINT_CPUS | SCHED_HINT_SPREAD)) && (job->flags & (SCHED_HINT_CPUS | SCHED_HINT_SPREAD))) {
+		memcpy(hint->cpus, job->cpus, sizeof(hint->cpus));
+		flags |= job->flags & (SCHED_HINT_CPUS | SCHED_HINT_SPREAD);
+	}
+	if (!(flags & SCHED_HINT_NICE) && (job->flags & SCHED_HINT_NICE)) {
+		hint->nice = job->nice;
+		flags |= SCHED_HINT_NICE;
+	}
+	if (!(flags & SCHED_HINT_IOPRIO) && (job->flags & SCHED_HINT_IOPRIO)) {
+		hint->ioprio = job->ioprio;
+		flags |= SCHED_HINT_IOPRIO;
+	}
+
+	/* 既定値。優先度はバックグラウンドのジョブだけ、-a はパイプラインだけに使う */
+	if (async && !(flags & SCHED_HINT_NICE) && (defaults.flags & SCHED_HINT_NICE)) {
+		hint->nice = defaults.nice;
+		flags |= SCHED_HINT_NICE;
+	}
+	if (async && !(flags & SCHED_HINT_IOPRIO) && (defaults.flags & SCHED_HINT_IOPRIO)) {
+		hint->ioprio = defaults.ioprio;
+		flags |= SCHED_HINT_IOPRIO;
+	}
+	if (piped && !(flags & SCHED_HINT_CPUS) && (defaults.flags & SCHED_HINT_SPREAD))
+		flags |= SCHED_HINT_SPREAD;
+
+	if ((flags & SCHED_HINT_SPREAD) && !(flags & SCHED_HINT_CPUS)) {
+		if (spread_cpus == NULL)
+			spread_init();
+		if (spread_ncpus > 0) {
+			memset(hint->cpus, 0, sizeof(hint->cpus));
+			cpus_set(hint->cpus, spread_cpus[stage % spread_ncpus]);
+			flags |= SCHED_HINT_CPUS;
+		}
+	}
+	hint->flags = flags & ~(SCHED_HINT_SPREAD | SCHED_HINT_JOB);
+}
+
+/*
+** sched_apply():
+** forkした子プロセスで、exec する前に CPU の割り当てと優先度を設定する
+** 設定できなくてもコマンドは実行する
+*/
+void sched_apply(const SchedHint* hint)
+{
+	if (hint == NULL || hint->flags == 0)
+		return;
+
+	if (hint->flags & SCHED_HINT_CPUS) {
+		cpu_set_t set;
+		int i;
+		CPU_ZERO(&set);
+		for (i = 0; i < SCHED_MAX_CPUS && i < CPU_SETSIZE; i++)
+			if (cpus_isset(hint->cpus, i))
+				CPU_SET(i, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) != 0)
+			perror("sched: sched_setaffinity");
+	}
+	if (hint->flags & SCHED_HINT_NICE) {
+		errno = 0; /* nice() は新しい nice 値を返すので、-1 が成功のこともある */
+		if (nice(hint->nice) == -1 && errno != 0)
+			perror("sched: nice");
+	}
+	if (hint->flags & SCHED_HINT_IOPRIO) {
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, hint->ioprio) != 0)
+			perror("sched: ioprio_set");
+	}
+}
+
+/*
+** sched_set_defaults():
+** 以降のジョブの既定値を設定する。hint が NULL なら既定値を消す
+*/
+void sched_set_defaults(const SchedHint* hint)
+{
+	if (hint == NULL)
+		memset(&defaults, 0, sizeof(defaults));
+	else
+		defaults = *hint;
+}
+
+/* 既定値を表示する */
+void sched_print_defaults()
+{
+	static const char* classes[] = { "none", "rt", "be", "idle" };
+
+	printf("spread pipelines: %s\n", (defaults.flags & SCHED_HINT_SPREAD) ? "on" : "off");
+	if (defaults.flags & SCHED_HINT_NICE)
+		printf("background nice: %d\n", defaults.nice);
+	if (defaults.flags & SCHED_HINT_IOPRIO)
+		printf("background ioprio: %s:%d\n", classes[(defaults.ioprio >> IOPRIO_CLASS_SHIFT) & 3],
+		       defaults.ioprio & 7);
+}
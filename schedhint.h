@@ -0,0 +1,35 @@
+#ifndef SCHEDHINT_H
+#define SCHEDHINT_H
+
+#include <stdbool.h>
+
+#define SCHED_MAX_CPUS 1024
+
+enum
+{ /* SchedHint のどの設定が指定されているか */
+	SCHED_HINT_CPUS = (1 << 0), /* cpus の CPU だけで実行する */
+	SCHED_HINT_NICE = (1 << 1), /* nice 値を加える */
+	SCHED_HINT_IOPRIO = (1 << 2), /* I/O の優先度 */
+	SCHED_HINT_SPREAD = (1 << 3), /* ステージごとに、1つの NUMA ノードの別々のコアを割り当てる */
+	SCHED_HINT_JOB = (1 << 4), /* ステージだけでなく、ジョブの残りのステージにも使う */
+};
+
+/*
+** SchedHint:
+** 子プロセスで fork から exec までの間に設定する、CPU の割り当てと優先度
+*/
+typedef struct SchedHint
+{
+	int flags; /* SCHED_HINT_* */
+	unsigned long cpus[SCHED_MAX_CPUS / (8 * sizeof(unsigned long))]; /* CPU 番号のビット集合 */
+	int nice; /* nice() に渡す増分 */
+	int ioprio; /* ioprio_set() に渡す値(クラスとレベル) */
+} SchedHint;
+
+int sched_parse(int argc, char** argv, SchedHint* hint);
+void sched_resolve(SchedHint* hint, const SchedHint* job, bool async, bool piped, int stage);
+void sched_apply(const SchedHint* hint);
+void sched_set_defaults(const SchedHint* hint);
+void sched_print_defaults();
+
+#endif
@@ -0,0 +1,529 @@
+#include "script.h"
+#include "lexer.h"
+#include "parser.h"
+#include "plan.h"
+#include "execute.h"
+#include "var.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+** 抽象構文木のノードプール。行ごとに空にして使い回す
+** 解析が終わった木は実行計画に引き取られるので、
+** source のように実行中に次の行を解析する場合でも上書きの心配はない
+*/
+static ASTree exectree;
+
+/*
+** compile_line():
+** 1行分のコマンド文字列を、字句解析・構文解析して実行計画にコンパイルする
+** 同じ行をコンパイル済みであれば、キャッシュの実行計画を再利用する
+** 計画は参照を1つ増やして *planp に返すので、使い終わったら plan_release() する
+** 実行するものが無い場合や構文エラーの場合は *planp を NULL にする
+** 制御構文の途中で行が終わっている場合は PARSE_INCOMPLETE を返す
+*/
+int compile_line(char* line, Plan** planp)
+{
+	lexer_t lexerbuf; /* 解析したトークンを保持するもので、連結リストになっている */
+	ASTreeIndex exectop; /* 抽象構文木のルートを定義している */
+
+	*planp = plan_cache_lookup(line);
+	if (*planp != NULL) {
+		plan_retain(*planp); /* 実行中にキャッシュから追い出されても解放されないようにする */
+		return 0;
+	}
+
+	lexer_build(line, strlen(line), &lexerbuf); /* 字句解析を行い、トークン一覧を作成する */
+
+	/* 一つ以上のトークンがある場合、parserに処理を渡す */
+	// parse the tokens into an abstract syntax tree
+	ASTreeReset(&exectree);
+	int result = 0;
+	if (lexerbuf.ntoks)
+		result = parse(&lexerbuf, &exectree, &exectop); /* tokenの連結リストを、構文解析にかける */
+	lexer_destroy(&lexerbuf); /* 空行・構文エラー・制御構文の途中の場合も、トークンは解放する */
+	if (!lexerbuf.ntoks || result != 0)
+		return result;
+
+	/* 抽象構文木を実行計画にコンパイルする。計画ができたら木は不要 */
+	Plan* plan = plan_compile(&exectree, exectop);
+
+	/* $変数 やワイルドカードは実行時に展開するので、どの行の実行計画もキャッシュできる */
+	plan_cache_insert(line, plan);
+	plan_retain(plan);
+	*planp = plan;
+	return 0;
+}
+
+/*
+** execute_line():
+** 1行分のコマンド文字列を、コンパイルして実行する
+** 制御構文の途中で行が終わっている場合は、何も実行せずに PARSE_INCOMPLETE を返す
+** (呼び出し元は次の行をつなげて、もう一度呼び出す)
+*/
+int execute_line(char* line)
+{
+	Plan* plan;
+	int result = compile_line(line, &plan);
+	if (plan == NULL)
+		return result;
+
+	/* 生成された実行計画に沿ってコマンドを実行 */
+	execute_plan(plan);
+	plan_release(plan);
+	return 0;
+}
+
+/*
+** append_line():
+** 制御構文の続きの行を、それまでの行の後ろにつなげる
+** pending が NULL であれば、line の複製を返す
+*/
+char* append_line(char* pending, const char* line)
+{
+	size_t len = pending != NULL ? strlen(pending) : 0;
+	pending = realloc(pending, len + strlen(line) + 1);
+	strcpy(pending + len, line);
+	return pending;
+}
+
+/*
+** source_file():
+** ファイルを1行ずつ読み込み、現在のシェルのプロセスで実行する
+** 組み込みコマンド source から呼び出される
+*/
+int source_file(const char* path)
+{
+	FILE* fp = fopen(path, "re"); /* 子プロセスには引き継がない */
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	char* line = NULL;
+	size_t len = 0;
+	char* pending = NULL; /* 制御構文の途中までの行 */
+	while (getline(&line, &len, fp) > 0) {
+		pending = append_line(pending, line);
+		if (execute_line(pending) != PARSE_INCOMPLETE) {
+			free(pending);
+			pending = NULL;
+		}
+	}
+
+	if (pending != NULL) { /* 制御構文が閉じないままファイルが終わった */
+		printf("%s: Syntax Error near: end of file\n", path);
+		free(pending);
+	}
+	free(line);
+	fclose(fp);
+	return 0;
+}
+
+/*
+** execute_script():
+** -c の文字列やスクリプトファイルを1行ずつ実行し、最後の終了ステータスを返す
+** 次の行を先に読んでおき、最後の行は execute_plan_tail() で実行する
+** (最後に実行されるのが外部コマンドであれば、シェル自身がそのコマンドに置き換わって戻らない)
+** MYSH_STATS で終了時に統計を書き出す場合は、置き換えずに待つ
+*/
+int execute_script(FILE* fp, const char* name)
+{
+	bool tail = getenv("MYSH_STATS") == NULL;
+	char* line = NULL;
+	size_t len = 0;
+	char* pending = NULL; /* 制御構文の途中までの行 */
+	bool more = getline(&line, &len, fp) > 0;
+
+	while (more) {
+		pending = append_line(pending, line);
+		more = getline(&line, &len, fp) > 0;
+
+		Plan* plan;
+		int result = compile_line(pending, &plan);
+		if (result == PARSE_INCOMPLETE)
+			continue;
+		free(pending);
+		pending = NULL;
+		if (result != 0) /* 構文エラー。その行は実行せずに続ける */
+			var_set_status(2);
+		if (plan == NULL)
+			continue;
+		if (!more && tail) {
+			free(line);
+			fclose(fp); /* 戻らないことがあるので、先に閉じておく */
+			fp = NULL;
+			execute_plan_tail(plan);
+		}
+		else
+			execute_plan(plan);
+		plan_release(plan);
+	}
+
+	if (pending != NULL) { /* 制御構文が閉じないまま終わった */
+		printf("%s: Syntax Error near: end of file\n", name);
+		free(pending);
+		var_set_status(2);
+	}
+	if (fp != NULL) {
+		free(line);
+		fclose(fp);
+	}
+	return var_status();
+}
+
+/*
+** rcファイルのキャッシュ
+** rcファイル全体を解析したノードプールを、そのまま rcファイル名 + ".cache" に書き出しておく
+** 次回の起動では、キャッシュをmmapしてノードプールとして使うので、字句解析・構文解析が不要になる
+** 文字列テーブルは実行中に書き換えない( argv はそこを直接指す)。書き込み可の MAP_PRIVATE で map するので、誤って書いてもファイルは変わらない
+** rcファイルの更新時刻・大きさ・内容のハッシュ値が一致しない場合は作り直す
+**
+** ファイルの構成(すべて4byte境界にそろえる)
+**   RcCacheHeader
+**   roots[nroots]      各行の抽象構文木のルート
+**   type[nnodes]       (4byte境界まで詰め物)
+**   left[nnodes], right[nnodes], str_off[nnodes], str_len[nnodes]
+**   strtab[strtab_len]
+*/
+#define RC_CACHE_MAGIC "MYSHRC\0\3" /* ノードの形式を変えたら番号を上げる(3: 単語にクオートの印 CHAR_QUOTED が入る) */
+
+typedef struct RcCacheHeader
+{
+	char magic[8];
+	int64_t mtime_sec; /* rcファイルの更新時刻 */
+	int64_t mtime_nsec;
+	uint64_t size; /* rcファイルの大きさ */
+	uint64_t hash; /* rcファイルの内容のハッシュ値 */
+	uint32_t nroots;
+	uint32_t nnodes;
+	uint32_t strtab_len;
+	uint32_t pad;
+} RcCacheHeader;
+
+/* FNV-1a ハッシュ(64bit) */
+static uint64_t rc_hash(const char* data, size_t size)
+{
+	uint64_t h = 14695981039346656037ull;
+	size_t i;
+	for (i = 0; i < size; i++)
+		h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+	return h;
+}
+
+/* 4byte境界にそろえた大きさ */
+#define RC_ALIGN(n) (((n) + 3) & ~(size_t)3)
+
+/* キャッシュファイル全体の大きさ */
+static size_t rc_cache_size(uint32_t nroots, uint32_t nnodes, uint32_t strtab_len)
+{
+	return sizeof(RcCacheHeader) + sizeof(uint32_t) * nroots + RC_ALIGN(nnodes)
+		+ sizeof(uint32_t) * 4 * (size_t)nnodes + strtab_len;
+}
+
+/* キャッシュファイルの名前を作る。呼び出し元でfreeする */
+static char* rc_cache_path(const char* path)
+{
+	char* cache = malloc(strlen(path) + sizeof(".cache"));
+	strcpy(cache, path);
+	strcat(cache, ".cache");
+	return cache;
+}
+
+/* rcファイルの内容をすべて読み込む。呼び出し元でfreeする */
+static char* rc_read(const char* path, struct stat* st)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	char* data = NULL;
+	if (fstat(fd, st) == 0) {
+		data = malloc(st->st_size + 1);
+		if (read(fd, data, st->st_size) != st->st_size) {
+			free(data);
+			data = NULL;
+		}
+		else
+			data[st->st_size] = 0;
+	}
+	close(fd);
+	return data;
+}
+
+/* ノードの文字列データが文字列テーブルの中にあり、終端文字で終わっているか */
+static bool rc_cache_valid_data(const ASTree* tree, ASTreeIndex n)
+{
+	uint32_t off = tree->str_off[n], len = tree->str_len[n];
+	return off < tree->strtab_len && len < tree->strtab_len - off && tree->strtab[off + len] == 0;
+}
+
+/*
+** rc_cache_valid():
+** キャッシュのノードプールを、使う前にすべて確かめる(壊れたキャッシュで範囲外を読まないように)
+** ルートから木をたどり、枝の添字と文字列データの範囲がプールに収まっていること、
+** ノードの種類が正しいこと、同じノードを2回たどらない(循環や共有が無い)ことを確かめる
+** NODE_CMDPATH と NODE_WORDLIST の left は、直後に続く単語の数として確かめる
+*/
+static bool rc_cache_valid(const ASTree* tree, const ASTreeIndex* roots, uint32_t nroots)
+{
+	uint32_t nnodes = tree->nnodes;
+	uint8_t* seen = calloc(nnodes + 1, 1);
+	ASTreeIndex* stack = malloc(sizeof(ASTreeIndex) * (nnodes + 1));
+	uint32_t top = 0, i, j;
+	bool ok = true;
+
+	for (i = 0; ok && i < nroots; i++) {
+		ok = roots[i] < nnodes && !seen[roots[i]];
+		if (ok) {
+			seen[roots[i]] = 1;
+			stack[top++] = roots[i];
+		}
+		while (ok && top > 0) {
+			ASTreeIndex n = stack[--top];
+			uint8_t type = tree->type[n];
+			int nodetype = NODETYPE(type);
+			if (nodetype < NODE_PIPE || nodetype > NODE_SUBSHELL || ((type & NODE_DATA) && !rc_cache_valid_data(tree, n))) {
+				ok = false;
+				break;
+			}
+
+			ASTreeIndex child[2] = { tree->left[n], tree->right[n] };
+			if (nodetype == NODE_CMDPATH || nodetype == NODE_WORDLIST) { /* 直後の単語は、ここで確かめる */
+				uint32_t count = child[0];
+				child[0] = AST_NULL;
+				if (count >= nnodes - n) {
+					ok = false;
+					break;
+				}
+				for (j = n + 1; ok && j <= n + count; j++) {
+					ok = !seen[j] && tree->type[j] == (NODE_ARGUMENT | NODE_DATA | (tree->type[j] & (NODE_EXPAND | NODE_GLOB)))
+						&& rc_cache_valid_data(tree, j);
+					seen[j] = 1;
+				}
+			}
+			for (j = 0; ok && j < 2; j++) {
+				if (child[j] == AST_NULL)
+					continue;
+				ok = child[j] < nnodes && !seen[child[j]];
+				if (ok) {
+					seen[child[j]] = 1;
+					stack[top++] = child[j];
+				}
+			}
+		}
+	}
+
+	free(seen);
+	free(stack);
+	return ok;
+}
+
+/*
+** rc_cache_load():
+** キャッシュファイルをmmapし、rcファイルと一致していれば実行計画にして返す
+** 使えるキャッシュが無ければNULL
+*/
+static Plan* rc_cache_load(const char* path, const char* data, struct stat* st)
+{
+	char* cache = rc_cache_path(path);
+	int fd = open(cache, O_RDONLY | O_CLOEXEC);
+	free(cache);
+	if (fd == -1)
+		return NULL;
+
+	struct stat cst;
+	void* map = MAP_FAILED;
+	if (fstat(fd, &cst) == 0 && cst.st_size >= (off_t)sizeof(RcCacheHeader))
+		map = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); /* 書き込んでもファイルには戻らない(コピーオンライト) */
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	RcCacheHeader* hdr = map;
+	if (memcmp(hdr->magic, RC_CACHE_MAGIC, sizeof(hdr->magic)) != 0
+		|| hdr->mtime_sec != st->st_mtim.tv_sec
+		|| hdr->mtime_nsec != st->st_mtim.tv_nsec
+		|| hdr->size != (uint64_t)st->st_size
+		|| rc_cache_size(hdr->nroots, hdr->nnodes, hdr->strtab_len) != (size_t)cst.st_size
+		|| hdr->hash != rc_hash(data, st->st_size)) {
+		munmap(map, cst.st_size);
+		return NULL;
+	}
+
+	/* mmapした領域を、そのままノードプールの各配列として使う */
+	char* p = (char*)map + sizeof(RcCacheHeader);
+	ASTreeIndex* roots = (ASTreeIndex*)p;
+	p += sizeof(uint32_t) * hdr->nroots;
+
+	ASTree tree;
+	ASTreeInit(&tree);
+	tree.nnodes = tree.capacity = hdr->nnodes;
+	tree.type = (uint8_t*)p;
+	p += RC_ALIGN(hdr->nnodes);
+	tree.left = (ASTreeIndex*)p;
+	p += sizeof(uint32_t) * hdr->nnodes;
+	tree.right = (ASTreeIndex*)p;
+	p += sizeof(uint32_t) * hdr->nnodes;
+	tree.str_off = (uint32_t*)p;
+	p += sizeof(uint32_t) * hdr->nnodes;
+	tree.str_len = (uint32_t*)p;
+	p += sizeof(uint32_t) * hdr->nnodes;
+	tree.strtab = p;
+	tree.strtab_len = tree.strtab_cap = hdr->strtab_len;
+	tree.mapping = map; /* 実行計画を解放するときにmunmapされる */
+	tree.mapping_size = cst.st_size;
+
+	if (!rc_cache_valid(&tree, roots, hdr->nroots)) { /* 壊れている。rcファイルを解析し直す(キャッシュも書き直される) */
+		munmap(map, cst.st_size);
+		return NULL;
+	}
+	return plan_compile_list(&tree, roots, hdr->nroots);
+}
+
+/* キャッシュファイルを書き出す。書けなかった場合は何もしない */
+static void rc_cache_write(const char* path, struct stat* st, const char* data,
+						   ASTree* tree, ASTreeIndex* roots, uint32_t nroots)
+{
+	RcCacheHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, RC_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.mtime_sec = st->st_mtim.tv_sec;
+	hdr.mtime_nsec = st->st_mtim.tv_nsec;
+	hdr.size = st->st_size;
+	hdr.hash = rc_hash(data, st->st_size);
+	hdr.nroots = nroots;
+	hdr.nnodes = tree->nnodes;
+	hdr.strtab_len = tree->strtab_len;
+
+	/* 書きかけのファイルを読まれないように、一時ファイルに書いてから置き換える */
+	char* cache = rc_cache_path(path);
+	char* tmp = malloc(strlen(cache) + sizeof(".tmp"));
+	strcpy(tmp, cache);
+	strcat(tmp, ".tmp");
+
+	FILE* fp = fopen(tmp, "we");
+	if (fp != NULL) {
+		static const char zero[4];
+		bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+		ok = ok && fwrite(roots, sizeof(uint32_t), nroots, fp) == nroots;
+		ok = ok && fwrite(tree->type, 1, tree->nnodes, fp) == tree->nnodes;
+		ok = ok && fwrite(zero, 1, RC_ALIGN(tree->nnodes) - tree->nnodes, fp) == RC_ALIGN(tree->nnodes) - tree->nnodes;
+		ok = ok && fwrite(tree->left, sizeof(uint32_t), tree->nnodes, fp) == tree->nnodes;
+		ok = ok && fwrite(tree->right, sizeof(uint32_t), tree->nnodes, fp) == tree->nnodes;
+		ok = ok && fwrite(tree->str_off, sizeof(uint32_t), tree->nnodes, fp) == tree->nnodes;
+		ok = ok && fwrite(tree->str_len, sizeof(uint32_t), tree->nnodes, fp) == tree->nnodes;
+		ok = ok && fwrite(tree->strtab, 1, tree->strtab_len, fp) == tree->strtab_len;
+		ok = (fclose(fp) == 0) && ok;
+
+		if (!ok || rename(tmp, cache) != 0)
+			unlink(tmp);
+	}
+	free(tmp);
+	free(cache);
+}
+
+/*
+** rc_cache_build():
+** rcファイル全体を解析してキャッシュファイルに書き出し、実行計画にして返す
+** 構文エラーのある行があればキャッシュは作らずNULLを返す
+** 制御構文が複数行にまたがる場合は、閉じるまで次の行をつなげて解析する
+*/
+static Plan* rc_cache_build(const char* path, char* data, struct stat* st)
+{
+	ASTree tree;
+	ASTreeInit(&tree);
+
+	ASTreeIndex* roots = NULL;
+	uint32_t nroots = 0, caproots = 0;
+	bool ok = true;
+
+	char* line = data;
+	char* end = strchr(line, '\n');
+	if (end != NULL)
+		*end = 0; /* 1行ずつに区切る */
+	while (ok && *line != 0) {
+		lexer_t lexerbuf;
+		ASTreeIndex root;
+		ASTreeMark mark = ASTreeGetMark(&tree);
+		lexer_build(line, strlen(line), &lexerbuf);
+		if (lexerbuf.ntoks) {
+			int result = parse(&lexerbuf, &tree, &root);
+			if (result == PARSE_INCOMPLETE && end != NULL) {
+				/* 次の行までつなげて、解析し直す */
+				lexer_destroy(&lexerbuf);
+				ASTreeRollback(&tree, mark);
+				*end = '\n';
+				end = strchr(end + 1, '\n');
+				if (end != NULL)
+					*end = 0;
+				continue;
+			}
+			if (result != 0)
+				ok = false;
+			else {
+				if (nroots == caproots) {
+					caproots = caproots ? caproots * 2 : 64;
+					roots = realloc(roots, sizeof(*roots) * caproots);
+				}
+				roots[nroots++] = root;
+			}
+		}
+		lexer_destroy(&lexerbuf);
+
+		if (end == NULL)
+			break;
+		*end = '\n'; /* ハッシュ値の計算のために元に戻す */
+		line = end + 1;
+		end = strchr(line, '\n');
+		if (end != NULL)
+			*end = 0;
+	}
+
+	Plan* plan = NULL;
+	if (ok) {
+		rc_cache_write(path, st, data, &tree, roots, nroots);
+		plan = plan_compile_list(&tree, roots, nroots);
+	}
+	else
+		ASTreeDestroy(&tree);
+
+	free(roots);
+	return plan;
+}
+
+/*
+** source_rc():
+** 起動時に rcファイル(~/.myshrc)を読み込んで実行する
+** 環境変数 MYSH_RCCACHE が "0" のときは、キャッシュを使わずに1行ずつ実行する
+*/
+int source_rc(const char* path)
+{
+	const char* usecache = getenv("MYSH_RCCACHE");
+	if (usecache != NULL && strcmp(usecache, "0") == 0)
+		return source_file(path);
+
+	struct stat st;
+	char* data = rc_read(path, &st);
+	if (data == NULL)
+		return source_file(path);
+
+	Plan* plan = rc_cache_load(path, data, &st);
+	if (plan == NULL)
+		plan = rc_cache_build(path, data, &st);
+	free(data);
+
+	if (plan == NULL) /* キャッシュにできない rcファイルは、1行ずつ実行する */
+		return source_file(path);
+
+	execute_plan(plan);
+	plan_release(plan);
+	return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include "plan.h"
+#include <stdio.h>
+
+int compile_line(char* line, Plan** planp);
+int execute_line(char* line);
+char* append_line(char* pending, const char* line);
+int source_file(const char* path);
+int source_rc(const char* path);
+int execute_script(FILE* fp, const char* name);
+
+#endif
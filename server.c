@@ -0,0 +1,398 @@
+#define _GNU_SOURCE /* accept4() */
+#include "server.h"
+#include "script.h"
+#include "execute.h"
+#include "command.h"
+#include "parser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+/*
+** コマンドサーバー ( mysh --server path.sock / mysh --client path.sock command ... )
+** 短いコマンドのたびに新しいシェルを起動すると、プロセスの起動と rcファイルの解析が毎回かかる
+** サーバーは起動したまま Unix ドメインソケットでコマンドラインを受け付け、
+** 同じプロセスで解析・コンパイルするので、rcファイルの内容と実行計画のキャッシュが要求をまたいで残る
+**
+** 要求ごとの実行は、コンパイルした計画を持って fork した子プロセスが行う
+** 子プロセスはクライアントから SCM_RIGHTS で受け取ったディスクリプタを標準入力・標準出力・
+** 標準エラー出力と作業ディレクトリにするので、クライアントから直接コマンドを実行したのと同じになる
+** (cd や変数の代入は、その要求の中だけで有効。他の要求やサーバー自身には影響しない)
+** 実行中の子プロセスは pidfd で待つので、長いコマンドを実行している間も次の要求を受け付ける
+**
+** 要求はサーバーの権限で実行されるので、ソケットはサーバーと同じユーザーだけが接続できるようにする
+** (ソケットファイルを 0600 で作り、さらに接続ごとに SO_PEERCRED で相手のユーザーを確かめる)
+*/
+
+#define SERVER_MAX_REQUESTS 64 /* 同時に実行する要求の数。これ以上は、終わるまで accept しない */
+#define SERVER_MAX_LINE (1 << 20) /* 受け付けるコマンドラインの長さ */
+#define SERVER_RECV_TIMEOUT 5 /* 要求を受け取り終わるまで待つ秒数。送ってこないクライアントで止まらないように */
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+/*
+** Request:
+** 実行中の要求。子プロセスが終了したら、終了ステータスを conn に返して閉じる
+*/
+typedef struct Request
+{
+	int conn; /* クライアントとの接続 */
+	int pidfd; /* 実行している子プロセス。終了すると読み込み可能になる */
+	pid_t pid;
+} Request;
+
+static Request requests[SERVER_MAX_REQUESTS];
+static int nrequests = 0;
+static int listen_fd = -1;
+
+/* len バイトを読み切る。途中で接続が切れたら false */
+static bool read_full(int fd, void* buf, size_t len)
+{
+	char* p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*
+** recv_request():
+** ヘッダとディスクリプタ、続くコマンドラインを受け取る
+** 受け取ったディスクリプタは fds に、コマンドラインは malloc した文字列にして返す
+*/
+static char* recv_request(int conn, int* fds)
+{
+	ServerRequest req;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * SERVER_NFDS)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { &req, sizeof(req) };
+	struct msghdr msg;
+	int i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	for (i = 0; i < SERVER_NFDS; i++)
+		fds[i] = -1;
+
+	ssize_t n;
+	while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			int fd;
+			memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+			if (i < SERVER_NFDS)
+				fds[i] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	/* ヘッダの残りとコマンドライン */
+	if (n <= 0 || !read_full(conn, (char*)&req + n, sizeof(req) - n) || req.len > SERVER_MAX_LINE)
+		return NULL;
+	for (i = 0; i < SERVER_NFDS; i++)
+		if (fds[i] == -1)
+			return NULL;
+	char* line = malloc(req.len + 1);
+	if (!read_full(conn, line, req.len)) {
+		free(line);
+		return NULL;
+	}
+	line[req.len] = 0;
+	return line;
+}
+
+static void close_fds(int* fds)
+{
+	int i;
+	for (i = 0; i < SERVER_NFDS; i++)
+		if (fds[i] != -1)
+			close(fds[i]);
+}
+
+/* 終了ステータスを返して、接続を閉じる。クライアントが先に切断していても、SIGPIPE で終了しない */
+static void reply(int conn, int status)
+{
+	int32_t value = status;
+	send(conn, &value, sizeof(value), MSG_NOSIGNAL);
+	close(conn);
+}
+
+/*
+** compile_request():
+** サーバー自身でコマンドラインを解析・コンパイルする(実行計画のキャッシュを温めておくため)
+** 構文エラーのメッセージは、クライアントの標準出力に表示する
+*/
+static int compile_request(char* line, int* fds, Plan** planp)
+{
+	fflush(stdout);
+	int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+	dup2(fds[1], STDOUT_FILENO);
+
+	int result = compile_line(line, planp);
+	if (result == PARSE_INCOMPLETE)
+		printf("Syntax Error near: end of input\n");
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	return result;
+}
+
+/*
+** run_request():
+** fork した子プロセスで、クライアントのディスクリプタに切り替えて実行計画を実行する
+** 子プロセスは他の要求の接続やソケットを持たないように閉じてから実行する
+*/
+static pid_t run_request(Plan* plan, int* fds)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+
+	int i;
+	restore_sigint_in_child();
+	close(listen_fd);
+	for (i = 0; i < nrequests; i++) {
+		close(requests[i].conn);
+		close(requests[i].pidfd);
+	}
+	if (fchdir(fds[3]) == -1)
+		perror("fchdir");
+	for (i = 0; i < 3; i++)
+		dup2(fds[i], i);
+	close_fds(fds);
+
+	int status = execute_plan(plan);
+	fflush(stdout);
+	_exit(status);
+}
+
+/* 接続をひとつ受け付けて、コマンドラインを受け取ったら実行を始める */
+static void start_request(int conn)
+{
+	int fds[SERVER_NFDS];
+	struct timeval timeout = { SERVER_RECV_TIMEOUT, 0 };
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char* line = recv_request(conn, fds);
+	if (line == NULL) {
+		close_fds(fds);
+		close(conn);
+		return;
+	}
+
+	Plan* plan;
+	int result = compile_request(line, fds, &plan);
+	free(line);
+	if (plan == NULL) { /* 空行か構文エラー */
+		close_fds(fds);
+		reply(conn, result == 0 ? 0 : 2);
+		return;
+	}
+
+	pid_t pid = run_request(plan, fds);
+	plan_release(plan);
+	close_fds(fds);
+	int pidfd = pid > 0 ? syscall(SYS_pidfd_open, pid, 0) : -1;
+	if (pid > 0 && pidfd == -1) /* 待てないので、ここで終了を待つ */
+		waitpid(pid, NULL, 0);
+	if (pidfd == -1) {
+		if (pid < 0)
+			perror("fork");
+		reply(conn, 1);
+		return;
+	}
+	fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+
+	requests[nrequests].conn = conn;
+	requests[nrequests].pidfd = pidfd;
+	requests[nrequests].pid = pid;
+	nrequests++;
+}
+
+/* 終了した子プロセスを回収して、クライアントに終了ステータスを返す */
+static void finish_request(int i)
+{
+	int status = 0;
+	pid_t r;
+	while ((r = waitpid(requests[i].pid, &status, 0)) == -1 && errno == EINTR);
+
+	if (WIFSIGNALED(status))
+		status = 128 + WTERMSIG(status);
+	else
+		status = WEXITSTATUS(status);
+	reply(requests[i].conn, status);
+	close(requests[i].pidfd);
+	requests[i] = requests[--nrequests];
+}
+
+/* 接続してきたプロセスが、サーバーと同じユーザー(か root )か */
+static bool peer_is_trusted(int conn)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+	return cred.uid == getuid() || cred.uid == 0;
+}
+
+/*
+** server_run():
+** path に Unix ドメインソケットを作り、クライアントの要求を受け付け続ける
+** 古いソケットファイルが残っていれば作り直す
+*/
+int server_run(const char* path)
+{
+	struct sockaddr_un addr;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return 2;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(path);
+	mode_t mask = umask(0177); /* bind() で作るソケットファイルを、最初から 0600 にする */
+	bool bound = listen_fd != -1 && bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+	umask(mask);
+	if (!bound || chmod(path, 0600) == -1 || listen(listen_fd, SOMAXCONN) == -1) {
+		perror(path);
+		return 1;
+	}
+
+	while (1) {
+		struct pollfd pfds[SERVER_MAX_REQUESTS + 1];
+		int i, n = 0;
+
+		for (i = 0; i < nrequests; i++) {
+			pfds[n].fd = requests[i].pidfd;
+			pfds[n++].events = POLLIN;
+		}
+		if (nrequests < SERVER_MAX_REQUESTS) { /* いっぱいなら、実行中の要求が終わるまで待たせておく */
+			pfds[n].fd = listen_fd;
+			pfds[n++].events = POLLIN;
+		}
+
+		if (poll(pfds, n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		/* 後ろから回収する(finish_request() は、末尾の要求を空いた位置に移すため) */
+		for (i = nrequests - 1; i >= 0; i--)
+			if (pfds[i].revents != 0)
+				finish_request(i);
+
+		if (pfds[n - 1].fd == listen_fd && (pfds[n - 1].revents & POLLIN)) {
+			int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+			if (conn != -1 && !peer_is_trusted(conn)) { /* 何も返さずに切る */
+				close(conn);
+				conn = -1;
+			}
+			if (conn != -1)
+				start_request(conn);
+		}
+	}
+}
+
+/*
+** client_run():
+** mysh --client path.sock command ...
+** 引数を空白でつないだコマンドラインを、このプロセスの標準入出力と作業ディレクトリと一緒にサーバーに送り、
+** 返ってきた終了ステータスで終了する
+*/
+int client_run(const char* path, int argc, char** argv)
+{
+	struct sockaddr_un addr;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+	char* line = malloc(len + 1);
+	line[0] = 0;
+	for (i = 0; i < argc; i++) {
+		strcat(line, argv[i]);
+		strcat(line, i + 1 < argc ? " " : "\n");
+	}
+	len = strlen(line);
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return 2;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror(path);
+		return 2;
+	}
+
+	int fds[SERVER_NFDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC) };
+	if (fds[3] == -1) {
+		perror(".");
+		return 2;
+	}
+	ServerRequest req = { len };
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { &req, sizeof(req) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	int32_t status;
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(req) || send(fd, line, len, MSG_NOSIGNAL) != (ssize_t)len
+		|| !read_full(fd, &status, sizeof(status))) {
+		fprintf(stderr, "%s: connection to the server was lost\n", path);
+		return 2;
+	}
+	free(line);
+	close(fds[3]);
+	close(fd);
+	return status;
+}
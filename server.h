@@ -0,0 +1,23 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+/*
+** ServerRequest:
+** クライアントが最初に送るヘッダ
+** SCM_RIGHTS で標準入力・標準出力・標準エラー出力と作業ディレクトリのディスクリプタを一緒に送り、
+** 続けて len バイトのコマンドラインを送る
+** サーバーは実行が終わったら、終了ステータスを int32_t で返す
+*/
+typedef struct ServerRequest
+{
+	uint32_t len; /* コマンドラインの長さ */
+} ServerRequest;
+
+#define SERVER_NFDS 4 /* 送るディスクリプタの数(標準入力・標準出力・標準エラー出力・作業ディレクトリ) */
+
+int server_run(const char* path);
+int client_run(const char* path, int argc, char** argv);
+
+#endif
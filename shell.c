@@ -3,10 +3,19 @@
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pwd.h>
 #include "lexer.h"
 #include "parser.h"
 #include "execute.h"
 #include "command.h"
+#include "script.h"
+#include "jobs.h"
+#include "readahead.h"
+#include "server.h"
+#include "zygote.h"
+#include "cmdstats.h"
+#include "var.h"
 
 void show_lexerlist(tok_t *tokens)
 {
@@ -26,7 +35,69 @@ void show_lexerlist(tok_t *tokens)
 	return ;
 }
 
-int main()
+/*
+** load_rc():
+** 起動時に実行するrcファイルを読み込む
+** 環境変数 MYSHRC があればそのファイルを、無ければ ~/.myshrc を使う
+*/
+void load_rc()
+{
+	const char *rc = getenv("MYSHRC");
+	char *path = NULL;
+
+	if (rc == NULL) {
+		const char *home = getenv("HOME");
+		if (home == NULL) {
+			struct passwd *pw = getpwuid(getuid());
+			home = pw != NULL ? pw->pw_dir : NULL;
+		}
+		if (home == NULL)
+			return;
+		path = malloc(strlen(home) + sizeof("/.myshrc"));
+		strcpy(path, home);
+		strcat(path, "/.myshrc");
+		rc = path;
+	}
+
+	if (access(rc, R_OK) == 0) /* rcファイルが無ければ何もしない */
+		source_rc(rc);
+	free(path);
+}
+
+/*
+** run_script_ahead():
+** 標準入力がスクリプト(端末ではない)の場合の実行
+** 解析スレッドが先の行を実行計画にしておくので、ここでは順番に取り出して実行するだけ
+** プロンプトや構文エラーは、1行ずつ読み込む場合と同じ順番で表示する
+** 解析スレッドを起動できなかった場合は false を返す
+*/
+static bool run_script_ahead()
+{
+	ReadAhead* ra = readahead_start(STDIN_FILENO);
+	ReadAheadItem item;
+
+	if (ra == NULL)
+		return false;
+	do {
+		readahead_next(ra, &item);
+		int i;
+		for (i = 0; i < item.nlines; i++) {
+			job_reap(true);
+			printf("%s", i > 0 ? "> " : getprompt());
+		}
+		if (item.error[0] != 0)
+			printf("%s\n", item.error);
+		if (item.plan != NULL) {
+			execute_plan(item.plan);
+			plan_release(item.plan);
+		}
+	} while (!item.eof);
+
+	readahead_finish(ra);
+	return true;
+}
+
+int main(int argc, char **argv)
 {
 	/* shell プロセスのシグナルハンドラを設定する */
 	ignore_signal_for_shell();
@@ -34,20 +105,87 @@ int main()
 	// プロンプト文字を表示
 	set_prompt("swoorup % ");
 
+	/*
+	** オプション
+	**   --norc               rcファイルを読み込まない
+	**   --server PATH        PATH のソケットでコマンドを受け付けるサーバーになる
+	**   --client PATH cmd... cmd をサーバーで実行し、その終了ステータスで終了する
+	**   -c STRING args...    STRING を実行して終了する。args は位置パラメータ $1 $2 ... になる
+	**   FILE args...         スクリプトファイル FILE を実行して終了する
+	** -c とスクリプトファイルでは、プロンプトを表示せず、最後のコマンドはシェル自身と置き換えて実行する
+	*/
+	bool norc = false;
+	const char *server_path = NULL;
+	const char *command = NULL, *script = NULL;
+	char **args = NULL;
+	int nargs = 0;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--norc") == 0)
+			norc = true;
+		else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc)
+			server_path = argv[++i];
+		else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc)
+			return client_run(argv[i + 1], argc - i - 2, argv + i + 2); /* rcファイルはサーバーが読み込んでいる */
+		else if ((strcmp(argv[i], "-c") == 0 && i + 1 < argc) || argv[i][0] != '-') {
+			if (argv[i][0] == '-')
+				command = argv[++i];
+			else
+				script = argv[i];
+			args = argv + i + 1;
+			nargs = argc - i - 1;
+			break;
+		}
+	}
+
+	/* MYSH_STATS=path であれば、終了時にコマンドの実行時間の統計を書き出す */
+	cmdstats_init();
+
+	/* MYSH_ZYGOTE=1 であれば、コマンドを起動する zygote をシェルが小さいうちに作っておく(サーバーの要求は fork した子プロセスが実行するので使わない) */
+	const char *zygote = getenv("MYSH_ZYGOTE");
+	if (server_path == NULL && zygote != NULL && strcmp(zygote, "1") == 0)
+		zygote_start();
+
+	/* rcファイルの内容を実行する。--norc が指定されていれば読み込まない */
+	if (!norc)
+		load_rc();
+
+	if (server_path != NULL)
+		return server_run(server_path);
+
+	if (command != NULL || script != NULL) {
+		FILE *fp = command != NULL ? fmemopen((char *)command, strlen(command), "r") : fopen(script, "re");
+		if (fp == NULL) {
+			perror(command != NULL ? "-c" : script);
+			return 127;
+		}
+		var_push_args(nargs, args);
+		return execute_script(fp, command != NULL ? "-c" : script);
+	}
+
+	/*
+	** MYSH_PARSEAHEAD=1 であれば、標準入力のスクリプトを解析スレッドに先読みさせる
+	** 解析スレッドは標準入力を先まで読んでしまうので、スクリプトの中で標準入力を読むコマンド
+	** ( mysh < script の中の read や cat など)には、続きの入力が届かない。そのため既定では使わない
+	*/
+	const char *ahead = getenv("MYSH_PARSEAHEAD");
+	if (!isatty(STDIN_FILENO) && ahead != NULL && strcmp(ahead, "1") == 0 && run_script_ahead())
+		exit(0);
+
+	char *pending = NULL; /* 制御構文の途中までの行。続きの行をつなげて実行する */
+
 	while (1)
 	{
 		char *linebuffer; /* 読み込んだコマンド行を保持する */
 		size_t len; /* linebufferの領域の大きさ。getlineで自動設定する */
 
-		lexer_t lexerbuf; /* 解析したトークンを保持するもので、連結リストになっている */
-		ASTreeNode *exectree; /* 抽象構文木のルートを定義している */
-
 		/* 割り込みが発生した場合に備えて、getline関数の実行をループにしておく */
 		// keep getline in a loop in case interruption occurs
 		int again = 1; /* getline関数(標準入力からのコマンド取得)をループするかどうかの真偽値 */
 		while (again) {
 			again = 0; /* ループしないようにしとく */
-			printf("%s", getprompt()); /* プロンプトを出力 */
+			job_reap(true); /* 終了したバックグラウンドのジョブを、プロンプトの前に表示する */
+			printf("%s", pending != NULL ? "> " : getprompt()); /* プロンプトを出力。続きの行では "> " */
 			linebuffer = NULL; /* 標準入力から受け取るための文字列ポインタの領域を空に */
 			len = 0; /* linebufferの大きさ */
 
@@ -80,25 +218,12 @@ int main()
 			return 0;
 		}
 		
-		lexer_build(linebuffer, len, &lexerbuf); /* 字句解析を行い、トークン一覧を作成する */
+		pending = append_line(pending, linebuffer);
 		free(linebuffer);
-
-		// printf("\n----- end lexer_buid -----\n");
-		// show_lexerlist(lexerbuf.llisttok);
-
-		/* 一つ以上のトークンがある場合、parserに処理を渡す */
-		// parse the tokens into an abstract syntax tree
-		if (!lexerbuf.ntoks || parse(&lexerbuf, &exectree) != 0) { /* tokenの連結リストを、構文解析にかける */
-			continue; /* 入力文字の受け取りまで戻る */
+		if (execute_line(pending) != PARSE_INCOMPLETE) { /* 字句解析・構文解析を行い、コマンドを実行する */
+			free(pending);
+			pending = NULL;
 		}
-
-		/* 生成された抽象構文木に沿ってコマンドを実行 */
-		execute_syntax_tree(exectree);
-
-		/* 実行完了後…コマンドの入力データをfreeする */
-		// free the structures
-		ASTreeNodeDelete(exectree);
-		lexer_destroy(&lexerbuf);
 	}
 
 	return 0;
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE /* unshare() */
+#include "stagethread.h"
+#include "cmdstats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+/*
+** 組み込みコマンドだけのステージのスレッド実行
+** echo ... | cmd のような、出力するだけの組み込みコマンドのステージは、これまで出力先を切り替えるために fork していた
+** ここでは、シェルの中のスレッドで実行する( fork とアドレス空間の複製が無い)
+**
+** スレッドは最初に unshare(CLONE_FILES) で自分だけのディスクリプタ表を持ち、
+** パイプを 0 / 1 に付け替えて、それ以外を閉じる(シェルや他のステージのディスクリプタには影響しない)
+** 組み込みコマンドは stage_thread_stdout() に書く。スレッドでは 1 番に書く FILE、それ以外では stdout になる
+** スレッドが終了すると、ディスクリプタ表ごとパイプが閉じられ、次のステージに EOF が届く
+**
+** シグナルはすべてブロックしておく。読む側が先に終了した場合、SIGPIPE でシェルが終了せず、書き込みが EPIPE になる
+** ステージの CPU の割り当て( sched )と cgroup は、スレッドには適用しない
+** MYSH_STAGE_THREADS=0 であれば、これまで通り fork する
+*/
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
+
+struct StageThread
+{
+	pthread_t thread;
+	sem_t ready; /* ディスクリプタ表を分け終えた。それまでは、シェルがパイプを閉じてはいけない */
+	bool ok; /* ディスクリプタ表を分けて、出力の FILE を作れた */
+	int (*func)(CommandInternal* cmdinternal);
+	CommandInternal cmd; /* argv はスレッドが持つ複製を指す */
+	uint64_t start;
+	StageThread* next;
+};
+
+static __thread FILE* thread_stdout = NULL;
+
+/* 組み込みコマンドの出力先 */
+FILE* stage_thread_stdout()
+{
+	return thread_stdout != NULL ? thread_stdout : stdout;
+}
+
+/* ディスクリプタ表を分けて、パイプだけを 0 / 1 に持つ */
+static bool own_fds(StageThread* t)
+{
+	if (unshare(CLONE_FILES) == -1)
+		return false;
+	if (t->cmd.stdin_pipe && dup2(t->cmd.pipe_read, STDIN_FILENO) == -1)
+		return false;
+	if (dup2(t->cmd.pipe_write, STDOUT_FILENO) == -1)
+		return false;
+	if (syscall(SYS_close_range, 3, ~0U, 0) == -1) /* 次のステージの読み込み側などを持ったままにしない */
+		return false;
+	thread_stdout = fdopen(STDOUT_FILENO, "w");
+	return thread_stdout != NULL;
+}
+
+static void* thread_main(void* arg)
+{
+	StageThread* t = arg;
+
+	t->ok = own_fds(t);
+	sem_post(&t->ready);
+	if (!t->ok)
+		return NULL;
+	t->func(&t->cmd); /* 途中のステージなので、終了ステータスは使わない */
+	fclose(thread_stdout);
+	return NULL;
+}
+
+/* argv を、ひとつの領域に複製する(元の argv はシェルが次のコマンドで上書きする) */
+static char** copy_argv(int argc, char** argv)
+{
+	size_t size = sizeof(char*) * (argc + 1);
+	int i;
+	for (i = 0; i < argc; i++)
+		size += strlen(argv[i]) + 1;
+
+	char** copy = malloc(size);
+	char* p = (char*)(copy + argc + 1);
+	for (i = 0; i < argc; i++) {
+		copy[i] = p;
+		p = stpcpy(p, argv[i]) + 1;
+	}
+	copy[argc] = NULL;
+	return copy;
+}
+
+/*
+** stage_thread_start():
+** 組み込みコマンドのステージを、スレッドで実行し始める。スレッドは list に加え、終了は stage_thread_join_all() で待つ
+** 戻ったときには、スレッドはパイプを自分のディスクリプタ表に持っているので、呼び出し側はパイプを閉じてよい
+** スレッドを使えなければ false を返す(呼び出し側が fork する)
+*/
+bool stage_thread_start(StageThread** list, int (*func)(CommandInternal* cmdinternal), CommandInternal* cmdinternal)
+{
+	static int enabled = -1;
+	if (enabled == -1) {
+		const char* env = getenv("MYSH_STAGE_THREADS");
+		enabled = env == NULL || strcmp(env, "0") != 0;
+	}
+	if (!enabled)
+		return false;
+
+	StageThread* t = malloc(sizeof(StageThread));
+	sigset_t all, saved;
+
+	t->func = func;
+	t->cmd = *cmdinternal;
+	t->cmd.argv = copy_argv(cmdinternal->argc, cmdinternal->argv);
+	t->cmd.nassigns = 0;
+	t->cmd.globbed = false;
+	t->cmd.threads = NULL;
+	t->start = cmdstats_now();
+	sem_init(&t->ready, 0, 0);
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	int err = pthread_create(&t->thread, NULL, thread_main, t);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (err == 0) {
+		while (sem_wait(&t->ready) == -1 && errno == EINTR);
+		if (t->ok) {
+			t->next = *list;
+			*list = t;
+			return true;
+		}
+		pthread_join(t->thread, NULL);
+	}
+	sem_destroy(&t->ready);
+	free(t->cmd.argv);
+	free(t);
+	return false;
+}
+
+/*
+** stage_thread_join_all():
+** list のスレッドがすべて終了するのを待ち、実行時間を記録して片付ける
+*/
+void stage_thread_join_all(StageThread** list)
+{
+	while (*list != NULL) {
+		StageThread* t = *list;
+		*list = t->next;
+		pthread_join(t->thread, NULL);
+		cmdstats_record(t->cmd.argv[0], cmdstats_now() - t->start);
+		sem_destroy(&t->ready);
+		free(t->cmd.argv);
+		free(t);
+	}
+}
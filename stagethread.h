@@ -0,0 +1,14 @@
+#ifndef STAGETHREAD_H
+#define STAGETHREAD_H
+
+#include "command.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+typedef struct StageThread StageThread;
+
+bool stage_thread_start(StageThread** list, int (*func)(CommandInternal* cmdinternal), CommandInternal* cmdinternal);
+void stage_thread_join_all(StageThread** list);
+FILE* stage_thread_stdout();
+
+#endif
@@ -0,0 +1,281 @@
+#include "subst.h"
+#include "script.h"
+#include "execute.h"
+#include "function.h"
+#include "command.h"
+#include "var.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+** コマンド置換 $( ... ) と ` ... `
+** 中のコマンドラインを実行計画にして実行し、標準出力に書かれた内容を取り込む
+**   $(< file)                ... ファイルをそのまま読み込む。プロセスは作らない
+**   組み込みコマンド・関数だけ ... シェル自身のプロセスで実行し、stdout をメモリ上のバッファに向ける
+**   それ以外                   ... forkした子プロセスで実行し、パイプから読み込む
+** どの場合も、末尾の改行は取り除く
+*/
+
+#define CAPTURE_CHUNK (64 * 1024) /* 1回の read() で読み込む最小の大きさ */
+#define FORK_FREE_DEPTH 8 /* 関数の中の関数をたどる深さの上限 */
+
+static int last_status = -1; /* 最後に実行したコマンド置換の終了ステータス。無ければ -1 */
+
+/*
+** Capture:
+** 読み込んだ出力を溜めるバッファ。足りなくなったら倍に広げる
+*/
+typedef struct Capture
+{
+	char* buf;
+	size_t len;
+	size_t cap;
+} Capture;
+
+/* fd を終わりまで読み込む。常に CAPTURE_CHUNK 以上の空きを用意してから read() する */
+static void capture_fd(Capture* c, int fd)
+{
+	for (;;) {
+		if (c->cap - c->len < CAPTURE_CHUNK) {
+			c->cap = c->cap ? c->cap * 2 : CAPTURE_CHUNK * 2;
+			c->buf = realloc(c->buf, c->cap);
+		}
+
+		ssize_t n = read(fd, c->buf + c->len, c->cap - c->len - 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		c->len += n;
+	}
+}
+
+/* 末尾の改行を取り除いて、終端文字をつける */
+static char* capture_finish(Capture* c, size_t* len)
+{
+	if (c->buf == NULL)
+		c->buf = malloc(1);
+	while (c->len > 0 && c->buf[c->len - 1] == '\n')
+		c->len--;
+	c->buf[c->len] = 0;
+	*len = c->len;
+	return c->buf;
+}
+
+/*
+** read_file():
+** $(< file) のファイル名を展開して、内容を読み込む
+*/
+static void read_file(Capture* c, const char* word)
+{
+	char* path = strdup(word);
+	size_t n = strlen(path);
+	while (n > 0 && isspace((unsigned char)path[n - 1]))
+		path[--n] = 0;
+
+	const char* name = strchr(path, '$') != NULL ? var_expand(path) : path;
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		perror(name);
+		last_status = 1;
+	}
+	else {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) { /* 大きさがわかれば、一度に読める分を確保しておく */
+			c->cap = st.st_size + CAPTURE_CHUNK;
+			c->buf = malloc(c->cap);
+		}
+		capture_fd(c, fd);
+		close(fd);
+		last_status = 0;
+	}
+	var_set_status(last_status);
+	free(path);
+}
+
+/*
+** fork_free():
+** 実行計画の start から end の手前までが、シェルの状態を変えない組み込みコマンドと、
+** そのような関数の呼び出しだけでできているかを調べる
+** パイプ・リダイレクト・バックグラウンド・代入・for・関数の定義と、外部コマンドを起動する組み込みコマンドを含むものは対象外
+** (シェル自身のプロセスで実行しても、子プロセスで実行した場合と結果が変わらないもの)
+*/
+static bool fork_free(Plan* plan, int start, int end, int depth)
+{
+	int i;
+	for (i = start; i < end; i++) {
+		PlanOp* op = &plan->ops[i];
+		switch (op->type)
+		{
+		case PLAN_WAIT:
+		case PLAN_SEQ:
+		case PLAN_JUMP:
+		case PLAN_JUMP_IF_FALSE:
+		case PLAN_JUMP_IF_TRUE:
+		case PLAN_TRUE:
+		case PLAN_CASE_WORD:
+		case PLAN_CASE_TEST:
+			break;
+
+		case PLAN_SPAWN: {
+			ASTree* tree = &plan->tree;
+			int nwords = ASTreeArgc(tree, op->node);
+			int j;
+			for (j = 0; j < nwords; j++) {
+				const char* word = ASTreeData(tree, op->node + j);
+				if ((ASTreeType(tree, op->node + j) & NODE_EXPAND) && strstr(word, "$((") != NULL)
+					return false; /* 算術式の中で代入しているかもしれない */
+			}
+
+			const char* name = ASTreeData(tree, op->node);
+			if ((ASTreeType(tree, op->node) & (NODE_EXPAND | NODE_GLOB)) || var_is_assignment(name))
+				return false;
+
+			Function* func = function_lookup(name);
+			if (func != NULL) {
+				if (depth >= FORK_FREE_DEPTH || !fork_free(func->plan, func->start, func->end, depth + 1))
+					return false;
+				break;
+			}
+			int flags = builtin_flags(name);
+			if (flags < 0 || !((flags & BUILTIN_PURE) || ((flags & BUILTIN_RETURN) && depth > 0)))
+				return false;
+			if (flags & BUILTIN_SPAWN) /* 起動したコマンドの出力は、差し替えた stdout を通らない */
+				return false;
+			break;
+		}
+
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+** run_in_shell():
+** 実行計画をシェル自身のプロセスで実行し、stdout に書かれた内容をバッファに取り込む
+*/
+static void run_in_shell(Capture* c, Plan* plan)
+{
+	FILE* saved = stdout;
+	fflush(stdout);
+	stdout = open_memstream(&c->buf, &c->len);
+	execute_plan(plan);
+	fclose(stdout);
+	stdout = saved;
+	c->cap = c->len + 1; /* open_memstream() は終端文字の分も確保している */
+}
+
+/*
+** run_in_child():
+** 実行計画を子プロセスで実行し、その標準出力をパイプから読み込む
+*/
+static void run_in_child(Capture* c, Plan* plan)
+{
+	int fd[2];
+	if (pipe(fd) == -1) {
+		perror("pipe");
+		var_set_status(1);
+		return;
+	}
+
+	fflush(stdout); /* 出力途中のバッファが子プロセスに複製されないようにする */
+	pid_t pid = fork();
+	if (pid == 0) {
+		restore_sigint_in_child();
+		dup2(fd[1], STDOUT_FILENO);
+		close(fd[0]);
+		close(fd[1]);
+		/* run_in_shell() の中から呼ばれた場合、stdout はメモリ上のストリームに差し替えられているので、1 番に戻す */
+		stdout = fdopen(STDOUT_FILENO, "w");
+		int status = execute_plan(plan);
+		fflush(stdout);
+		_exit(status);
+	}
+	close(fd[1]);
+	if (pid < 0) {
+		perror("fork");
+		close(fd[0]);
+		var_set_status(1);
+		return;
+	}
+
+	capture_fd(c, fd[0]);
+	close(fd[0]);
+
+	/* SIGCHLDのハンドラが先に回収してしまった場合は 0 とみなす */
+	int status;
+	pid_t r;
+	while ((r = waitpid(pid, &status, 0)) < 0 && errno == EINTR);
+	if (r < 0)
+		var_set_status(0);
+	else
+		var_set_status(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+}
+
+/*
+** command_subst():
+** コマンドラインを実行して、その標準出力の内容を末尾の改行を取り除いて返す(呼び出し元でfreeする)
+** 出力の長さを *len に入れる
+*/
+char* command_subst(const char* cmdline, size_t* len)
+{
+	Capture c = { NULL, 0, 0 };
+	const char* p = cmdline;
+
+	while (isspace((unsigned char)*p))
+		p++;
+	if (p[0] == '<') { /* '<' とファイル名だけであれば、ファイルを直接読み込む */
+		p++;
+		while (isspace((unsigned char)*p))
+			p++;
+		size_t n = strcspn(p, " \t\n;&|<>()'\"\\`");
+		const char* rest = p + n;
+		while (isspace((unsigned char)*rest))
+			rest++;
+		if (n > 0 && *rest == 0) {
+			read_file(&c, p);
+			return capture_finish(&c, len);
+		}
+	}
+
+	char* line = strdup(cmdline);
+	Plan* plan;
+	if (compile_line(line, &plan) != 0) /* 構文エラー、または閉じていない制御構文 */
+		var_set_status(2);
+	else if (plan == NULL)
+		var_set_status(0);
+	else {
+		if (fork_free(plan, 0, plan->nops, 0))
+			run_in_shell(&c, plan);
+		else
+			run_in_child(&c, plan);
+		plan_release(plan);
+	}
+	free(line);
+
+	last_status = var_status();
+	return capture_finish(&c, len);
+}
+
+/*
+** command_subst_status():
+** 前回の呼び出しから後にコマンド置換を実行していれば、その終了ステータスを *status に入れて true を返す
+** 代入だけのコマンドの終了ステータスに使う。status が NULL なら記録を消すだけ
+*/
+bool command_subst_status(int* status)
+{
+	bool ran = last_status >= 0;
+	if (ran && status != NULL)
+		*status = last_status;
+	last_status = -1;
+	return ran;
+}
@@ -0,0 +1,10 @@
+#ifndef SUBST_H
+#define SUBST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+char* command_subst(const char* cmdline, size_t* len);
+bool command_subst_status(int* status);
+
+#endif
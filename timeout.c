@@ -0,0 +1,225 @@
+#include "timeout.h"
+#include "cmdstats.h"
+#include "var.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+/*
+** timeout [-s signal] [-k duration] [--foreground] [--preserve-status] duration command args ...
+** /usr/bin/timeout を挟むと、コマンドごとにプロセスがひとつ増え、シグナルの中継も入る
+** 組み込みコマンドの timeout は、コマンドを直接起動して、pidfd と timerfd を poll で待つ
+**
+** 時間が過ぎたら、コマンドのプロセスグループ全体にシグナル(既定は TERM)を送る
+** (コマンドは新しいプロセスグループで起動するので、そこから起動されたプロセスにも届く)
+** -k を指定すると、さらにその時間が過ぎても終了しない場合に KILL を送る
+** --foreground は、プロセスグループを作らずコマンド自身にだけ送る(端末から読むコマンド用。孫プロセスには届かない)
+**
+** 時間は秒で、小数と接尾辞 s / m / h / d を使える。0 なら時間を区切らない
+** 終了ステータス(GNU timeout と同じ)
+**   124  時間が過ぎた( --preserve-status ではコマンドの終了ステータス)
+**   137  時間が過ぎて送った KILL ( -s KILL または -k )で終了した
+**   125  timeout 自身の失敗、126 / 127 はコマンドを起動できなかった
+**
+** 組み込みコマンドや関数はシェル自身で実行するので、時間を区切れない
+*/
+
+#define TIMEOUT_EXIT_TIMEDOUT 124
+#define TIMEOUT_EXIT_FAILURE 125
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static const struct
+{
+	const char* name;
+	int sig;
+} signal_names[] = {
+	{ "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+	{ "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+	{ "CONT", SIGCONT }, { "STOP", SIGSTOP }, { NULL, 0 },
+};
+
+/* TERM / SIGTERM / 15 のどれでも受け付ける。不正なら -1 */
+static int parse_signal(const char* s)
+{
+	char* end;
+	long n = strtol(s, &end, 10);
+	int i;
+
+	if (end != s && *end == 0)
+		return n > 0 && n < NSIG ? n : -1;
+	if (strncasecmp(s, "SIG", 3) == 0)
+		s += 3;
+	for (i = 0; signal_names[i].name != NULL; i++)
+		if (strcasecmp(s, signal_names[i].name) == 0)
+			return signal_names[i].sig;
+	return -1;
+}
+
+/* 10 / 0.5 / 2m / 1h などを秒にする。不正なら -1 */
+static double parse_duration(const char* s)
+{
+	char* end;
+	double d = strtod(s, &end);
+
+	if (end == s || d < 0)
+		return -1;
+	switch (*end)
+	{
+	case 0: case 's': break;
+	case 'm': d *= 60; break;
+	case 'h': d *= 60 * 60; break;
+	case 'd': d *= 24 * 60 * 60; break;
+	default: return -1;
+	}
+	if (*end != 0 && end[1] != 0)
+		return -1;
+	return d;
+}
+
+/* timerfd を seconds 後に一度だけ鳴るようにする */
+static void arm(int tfd, double seconds)
+{
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = (time_t)seconds;
+	its.it_value.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1; /* 0 は止めることになるので、すぐに鳴らす */
+	timerfd_settime(tfd, 0, &its, NULL);
+}
+
+/* グループ全体(--foreground ではコマンドだけ)にシグナルを送る。止まっているプロセスにも届くように CONT も送る */
+static void send_signal(pid_t pid, bool group, int sig)
+{
+	pid_t target = group ? -pid : pid;
+	kill(target, sig);
+	if (sig != SIGKILL && sig != SIGCONT)
+		kill(target, SIGCONT);
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: timeout [-s signal] [-k duration] [--foreground] [--preserve-status] duration command args ...\n");
+}
+
+int execute_timeout(CommandInternal* cmdinternal)
+{
+	char** argv = cmdinternal->argv;
+	int argc = cmdinternal->argc;
+	int sig = SIGTERM;
+	double kill_after = 0;
+	bool foreground = false, preserve = false;
+	int c = 1;
+
+	for (; c < argc && argv[c][0] == '-' && argv[c][1] != 0; c++) {
+		if (strcmp(argv[c], "--") == 0) {
+			c++;
+			break;
+		}
+		else if (strcmp(argv[c], "--foreground") == 0)
+			foreground = true;
+		else if (strcmp(argv[c], "--preserve-status") == 0)
+			preserve = true;
+		else if (strcmp(argv[c], "-s") == 0 && c + 1 < argc && (sig = parse_signal(argv[c + 1])) > 0)
+			c++;
+		else if (strcmp(argv[c], "-k") == 0 && c + 1 < argc && (kill_after = parse_duration(argv[c + 1])) >= 0)
+			c++;
+		else {
+			usage();
+			return TIMEOUT_EXIT_FAILURE;
+		}
+	}
+	double duration = c < argc ? parse_duration(argv[c]) : -1;
+	if (duration < 0 || c + 1 >= argc) {
+		usage();
+		return TIMEOUT_EXIT_FAILURE;
+	}
+
+	/* コマンドを起動する。リダイレクトは timeout を実行する前に適用済み */
+	CommandInternal cmd = *cmdinternal;
+	cmd.argv = argv + c + 1;
+	cmd.argc = argc - c - 1;
+	cmd.nredirects = 0;
+	cmd.globbed = false;
+	cmd.exec_in_place = false; /* 時間を区切るので、置き換わらずに待つ */
+	cmd.threads = NULL;
+	cmd.new_pgrp = !foreground;
+	pid_t pid = execute_command_internal(&cmd);
+	if (pid == 0) /* 組み込みコマンドや関数は、実行し終えている */
+		return var_status();
+	if (pid < 0)
+		return 126;
+	if (!foreground)
+		setpgid(pid, pid); /* 子プロセスが setpgid する前に時間が過ぎても、グループに送れるように */
+
+	int pidfd = syscall(SYS_pidfd_open, pid, 0);
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (pidfd == -1 || tfd == -1) {
+		perror("timeout");
+		if (pidfd != -1)
+			close(pidfd);
+		if (tfd != -1)
+			close(tfd);
+		kill(foreground ? pid : -pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		cmdstats_reaped(pid);
+		return TIMEOUT_EXIT_FAILURE;
+	}
+	if (duration > 0)
+		arm(tfd, duration);
+
+	/* コマンドの終了か、時間が過ぎるのを待つ */
+	int fired = 0; /* 0: まだ、1: sig を送った、2: KILL を送った */
+	while (1) {
+		struct pollfd pfds[2] = { { pidfd, POLLIN, 0 }, { tfd, POLLIN, 0 } };
+		if (poll(pfds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfds[0].revents != 0)
+			break;
+		if (pfds[1].revents != 0) {
+			uint64_t expirations;
+			if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) /* 割り込まれた。まだ鳴っていない */
+				continue;
+			if (fired == 0) {
+				send_signal(pid, !foreground, sig);
+				fired = 1;
+				if (kill_after > 0)
+					arm(tfd, kill_after);
+			}
+			else {
+				send_signal(pid, !foreground, SIGKILL);
+				fired = 2;
+			}
+		}
+	}
+	close(pidfd);
+	close(tfd);
+
+	int status;
+	pid_t r;
+	while ((r = waitpid(pid, &status, 0)) == -1 && errno == EINTR);
+	cmdstats_reaped(pid);
+	if (r == -1)
+		return TIMEOUT_EXIT_FAILURE;
+	if (fired != 0 && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL)
+		return 128 + SIGKILL;
+	if (fired && !preserve)
+		return TIMEOUT_EXIT_TIMEDOUT;
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
@@ -0,0 +1,8 @@
+#ifndef TIMEOUT_H
+#define TIMEOUT_H
+
+#include "command.h"
+
+int execute_timeout(CommandInternal* cmdinternal);
+
+#endif
@@ -0,0 +1,546 @@
+#include "var.h"
+#include "arith.h"
+#include "subst.h"
+#include "lexer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <unistd.h>
+
+/*
+** シェル変数
+** 名前と値の組を、チェイン法のハッシュ表で保持する
+** シェル変数に無い名前は、環境変数から探す
+*/
+typedef struct Var
+{
+	char* name;
+	char* value;
+	struct Var* next; /* 同じバケットに入る次の変数 */
+} Var;
+
+static Var** var_table = NULL;
+static unsigned int var_buckets = 0; /* バケットの数(2のべき乗) */
+static unsigned int var_count = 0; /* 登録されている変数の数 */
+
+static int last_status = 0; /* 直前に実行したコマンドの終了ステータス ( $? ) */
+static bool expand_failed = false; /* 展開中に算術式のエラーがあった( var_expand_failed() で消す) */
+static VarArgs args = { 0, NULL }; /* 現在の位置パラメータ */
+
+/* FNV-1a ハッシュ */
+static uint32_t var_hash(const char* s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	return h;
+}
+
+/* 名前の長さを指定して変数を探す。見つからなければNULL */
+static Var* var_find(const char* name, size_t len)
+{
+	if (var_table == NULL)
+		return NULL;
+
+	Var* v = var_table[var_hash(name, len) & (var_buckets - 1)];
+	for (; v != NULL; v = v->next)
+		if (strncmp(v->name, name, len) == 0 && v->name[len] == 0)
+			return v;
+	return NULL;
+}
+
+/* 変数の数がバケットの数の2倍を超えたら、バケットを倍に増やして入れ直す */
+static void var_grow()
+{
+	unsigned int nbuckets = var_buckets ? var_buckets * 2 : 64;
+	Var** table = calloc(nbuckets, sizeof(Var*));
+	unsigned int i;
+
+	for (i = 0; i < var_buckets; i++) {
+		Var* v = var_table[i];
+		while (v != NULL) {
+			Var* next = v->next;
+			uint32_t h = var_hash(v->name, strlen(v->name)) & (nbuckets - 1);
+			v->next = table[h];
+			table[h] = v;
+			v = next;
+		}
+	}
+	free(var_table);
+	var_table = table;
+	var_buckets = nbuckets;
+}
+
+/* シェル変数に値を設定する。無ければ新しく作る */
+void var_set(const char* name, const char* value)
+{
+	size_t len = strlen(name);
+	Var* v = var_find(name, len);
+
+	if (v != NULL) {
+		char* copy = strdup(value); /* valueが自分自身の値を指している場合に備えて、先に複製する */
+		free(v->value);
+		v->value = copy;
+		return;
+	}
+
+	if (var_count + 1 > var_buckets * 2)
+		var_grow();
+
+	v = malloc(sizeof(*v));
+	v->name = strdup(name);
+	v->value = strdup(value);
+	uint32_t h = var_hash(name, len) & (var_buckets - 1);
+	v->next = var_table[h];
+	var_table[h] = v;
+	var_count++;
+}
+
+/* シェル変数を削除する */
+void var_unset(const char* name)
+{
+	if (var_table == NULL)
+		return;
+
+	Var** link = &var_table[var_hash(name, strlen(name)) & (var_buckets - 1)];
+	for (; *link != NULL; link = &(*link)->next) {
+		if (strcmp((*link)->name, name) == 0) {
+			Var* v = *link;
+			*link = v->next;
+			free(v->name);
+			free(v->value);
+			free(v);
+			var_count--;
+			return;
+		}
+	}
+}
+
+/*
+** var_get():
+** 変数の値を返す。シェル変数に無ければ環境変数を探し、どちらにも無ければNULL
+*/
+const char* var_get(const char* name)
+{
+	Var* v = var_find(name, strlen(name));
+	if (v != NULL)
+		return v->value;
+	return getenv(name);
+}
+
+int var_status()
+{
+	return last_status;
+}
+
+void var_set_status(int status)
+{
+	last_status = status;
+}
+
+/*
+** var_push_args():
+** 位置パラメータを argv[0] から argc 個の文字列の複製に入れ替え、それまでの位置パラメータを返す
+** argv は使い回されるバッファを指していることがあるので、複製しておく
+*/
+VarArgs var_push_args(int argc, char** argv)
+{
+	VarArgs saved = args;
+	int i;
+
+	args.argc = argc;
+	args.argv = malloc(sizeof(char*) * (argc + 1));
+	for (i = 0; i < argc; i++)
+		args.argv[i] = strdup(argv[i]);
+	args.argv[argc] = NULL;
+	return saved;
+}
+
+/* 現在の位置パラメータを捨てて、var_push_args() が返したものに戻す */
+void var_pop_args(VarArgs saved)
+{
+	int i;
+	for (i = 0; i < args.argc; i++)
+		free(args.argv[i]);
+	free(args.argv);
+	args = saved;
+}
+
+int var_argc()
+{
+	return args.argc;
+}
+
+/* n 番目( 1 から)の位置パラメータ。無ければNULL */
+const char* var_arg(int n)
+{
+	if (n < 1 || n > args.argc)
+		return NULL;
+	return args.argv[n - 1];
+}
+
+/* 変数名として使える文字列か ( [A-Za-z_][A-Za-z0-9_]* ) */
+bool var_is_name(const char* name)
+{
+	if (!(isalpha((unsigned char)*name) || *name == '_'))
+		return false;
+	for (name++; *name; name++)
+		if (!(isalnum((unsigned char)*name) || *name == '_'))
+			return false;
+	return true;
+}
+
+/* name=value の形の単語か */
+bool var_is_assignment(const char* word)
+{
+	const char* p = word;
+	if (!(isalpha((unsigned char)*p) || *p == '_'))
+		return false;
+	for (p++; *p != '='; p++)
+		if (!(isalnum((unsigned char)*p) || *p == '_'))
+			return false;
+	return true;
+}
+
+/*
+** var_assign():
+** name=value の形の単語であれば、シェル変数に代入して true を返す
+*/
+bool var_assign(const char* word)
+{
+	if (!var_is_assignment(word))
+		return false;
+
+	const char* eq = strchr(word, '=');
+	char* name = strndup(word, eq - word);
+	var_set(name, eq + 1);
+	free(name);
+	return true;
+}
+
+/*
+** 展開結果を置く領域(アリーナ)
+** ブロックを連結リストでつなぎ、末尾のブロックから順に切り出す
+** ブロックは移動しないので、切り出した文字列のポインタは解放されるまで有効
+*/
+typedef struct ExpandBlock
+{
+	struct ExpandBlock* prev; /* ひとつ前のブロック */
+	unsigned long size;
+	unsigned long used;
+	char data[];
+} ExpandBlock;
+
+static ExpandBlock* expand_arena = NULL; /* 現在切り出し中のブロック */
+
+/* アリーナから len バイトを切り出す */
+static char* expand_alloc(unsigned long len)
+{
+	if (expand_arena == NULL || expand_arena->used + len > expand_arena->size) {
+		unsigned long size = len > 4096 ? len : 4096;
+		ExpandBlock* b = malloc(sizeof(*b) + size);
+		b->prev = expand_arena;
+		b->size = size;
+		b->used = 0;
+		expand_arena = b;
+	}
+
+	char* p = expand_arena->data + expand_arena->used;
+	expand_arena->used += len;
+	return p;
+}
+
+/* 現在のアリーナの使用位置を記録する */
+VarMark var_expand_mark()
+{
+	VarMark mark;
+	mark.block = expand_arena;
+	mark.used = expand_arena ? expand_arena->used : 0;
+	return mark;
+}
+
+/* var_expand_mark() で記録した後に展開した文字列を、まとめて捨てる */
+void var_expand_release(VarMark mark)
+{
+	while (expand_arena != NULL && expand_arena != mark.block) {
+		ExpandBlock* prev = expand_arena->prev;
+		free(expand_arena);
+		expand_arena = prev;
+	}
+	if (expand_arena != NULL)
+		expand_arena->used = mark.used;
+}
+
+/*
+** ExpandBuf:
+** 展開途中の文字列を組み立てる作業用バッファ
+** $(( ... )) の中の式を展開するときは var_expand() が入れ子で呼ばれるので、
+** 使用中であれば呼び出しごとに別のバッファを使う
+*/
+typedef struct ExpandBuf
+{
+	char* buf;
+	size_t len;
+	size_t cap;
+} ExpandBuf;
+
+static ExpandBuf expand_work; /* 通常はこれを使い回す */
+static bool expand_busy = false;
+
+static void expand_append(ExpandBuf* b, const char* s, size_t len)
+{
+	if (b->len + len + 1 > b->cap) {
+		while (b->len + len + 1 > b->cap)
+			b->cap = b->cap ? b->cap * 2 : 256;
+		b->buf = realloc(b->buf, b->cap);
+	}
+	memcpy(b->buf + b->len, s, len);
+	b->len += len;
+}
+
+static void expand_number(ExpandBuf* b, long long value)
+{
+	char num[32];
+	expand_append(b, num, snprintf(num, sizeof(num), "%lld", value));
+}
+
+/*
+** expand_arith():
+** "$((" の直後から式を読み取り、計算結果を作業用バッファに追加する
+** 式の中の $変数 は先に展開する。読み取った文字数を返す。"))" で閉じていなければ 0
+*/
+static size_t expand_arith(ExpandBuf* b, const char* p)
+{
+	const char* end = arith_find_end(p);
+	if (end == NULL)
+		return 0;
+
+	char* expr = strndup(p, end - p);
+	int64_t value;
+	if (!arith_eval(strchr(expr, '$') != NULL ? var_expand(expr) : expr, &value))
+		expand_failed = true; /* メッセージは arith_eval() が表示している */
+	free(expr);
+
+	expand_number(b, value);
+	return end + 2 - p;
+}
+
+/*
+** expand_command():
+** コマンド置換のコマンドラインを実行し、出力を作業用バッファに追加する
+*/
+static void expand_command(ExpandBuf* b, const char* cmdline, size_t cmdlen)
+{
+	char* line = strndup(cmdline, cmdlen);
+	size_t len;
+	char* output = command_subst(line, &len);
+	expand_append(b, output, len);
+	free(output);
+	free(line);
+}
+
+/*
+** expand_param():
+** "$" の直後から変数名を読み取り、その値を作業用バッファに追加する
+** 読み取った文字数を返す。変数名になっていなければ 0 を返す("$"はそのまま残す)
+**   $name  ${name}  $?  $$  $1 ... $9  ${10}  $#  $@  $*  $(( 式 ))  $( コマンド )
+** $@ と $* は、位置パラメータを空白でつないだ1つの文字列になる
+*/
+static size_t expand_param(ExpandBuf* b, const char* p)
+{
+	const char* name = p;
+	size_t len = 0, used;
+
+	if (p[0] == '(' && p[1] == '(' && (used = expand_arith(b, p + 2)) > 0)
+		return used + 2;
+	if (p[0] == '(') {
+		if ((used = subst_span(p)) == 0)
+			return 0;
+		expand_command(b, p + 1, used - 2);
+		return used;
+	}
+	if (*p == '?') {
+		expand_number(b, last_status);
+		return 1;
+	}
+	if (*p == '$') {
+		expand_number(b, getpid());
+		return 1;
+	}
+	if (*p == '#') {
+		expand_number(b, args.argc);
+		return 1;
+	}
+	if (*p == '@' || *p == '*') {
+		int i;
+		for (i = 0; i < args.argc; i++) {
+			if (i > 0)
+				expand_append(b, " ", 1);
+			expand_append(b, args.argv[i], strlen(args.argv[i]));
+		}
+		return 1;
+	}
+	if (isdigit((unsigned char)*p)) { /* $1 ... $9 は1文字だけ */
+		const char* value = var_arg(*p - '0');
+		if (value != NULL)
+			expand_append(b, value, strlen(value));
+		return 1;
+	}
+
+	if (*p == '{') { /* ${name} */
+		name = p + 1;
+		while (name[len] != 0 && name[len] != '}')
+			len++;
+		if (name[len] != '}')
+			return 0;
+		used = len + 2;
+	}
+	else {
+		while (isalnum((unsigned char)name[len]) || name[len] == '_')
+			len++;
+		used = len;
+	}
+
+	if (len == 0)
+		return 0;
+
+	if (isdigit((unsigned char)*name)) { /* ${10} */
+		const char* value = var_arg(atoi(name));
+		if (value != NULL)
+			expand_append(b, value, strlen(value));
+		return used;
+	}
+
+	Var* v = var_find(name, len);
+	const char* value = NULL;
+	if (v != NULL)
+		value = v->value;
+	else {
+		char* envname = strndup(name, len);
+		value = getenv(envname);
+		free(envname);
+	}
+
+	if (value != NULL)
+		expand_append(b, value, strlen(value));
+	return used;
+}
+
+/*
+** var_expand_failed():
+** 前回の呼び出しから後の展開で、算術式のエラーがあれば true を返す。記録は消す
+** コマンドの単語の展開に失敗したら、そのコマンドは実行しない( init_command_internal() )
+*/
+bool var_expand_failed()
+{
+	bool failed = expand_failed;
+	expand_failed = false;
+	return failed;
+}
+
+/*
+** expand_word():
+** var_expand() と var_expand_pattern() の本体
+** pattern が true なら、クオートされていた文字( CHAR_QUOTED の次の文字)を '\' でエスケープして写す
+*/
+static char* expand_word(const char* word, bool pattern)
+{
+	ExpandBuf local = { NULL, 0, 0 };
+	ExpandBuf* b = expand_busy ? &local : &expand_work;
+	bool outer = !expand_busy;
+	const char* p = word;
+	static const char specials[] = { '$', '`', CHAR_QUOTED, 0 };
+
+	expand_busy = true;
+	b->len = 0;
+	while (*p) {
+		const char* dollar = strpbrk(p, specials);
+		if (dollar == NULL) {
+			expand_append(b, p, strlen(p));
+			break;
+		}
+
+		expand_append(b, p, dollar - p);
+		if (*dollar == CHAR_QUOTED) { /* クオートされていた文字は、展開せずにそのまま写す */
+			if (dollar[1] == 0)
+				break;
+			if (pattern)
+				expand_append(b, "\\", 1);
+			expand_append(b, dollar + 1, 1);
+			p = dollar + 2;
+			continue;
+		}
+		if (*dollar == '`') { /* 閉じていない '`' は、そのまま文字として扱う */
+			const char* close = strchr(dollar + 1, '`');
+			if (close == NULL) {
+				expand_append(b, dollar, strlen(dollar));
+				break;
+			}
+			expand_command(b, dollar + 1, close - (dollar + 1));
+			p = close + 1;
+			continue;
+		}
+		size_t used = expand_param(b, dollar + 1);
+		if (used == 0) /* 変数名が続かない "$" は、そのまま文字として扱う */
+			expand_append(b, "$", 1);
+		p = dollar + 1 + used;
+	}
+
+	char* result = expand_alloc(b->len + 1);
+	memcpy(result, b->buf, b->len);
+	result[b->len] = 0;
+
+	if (outer)
+		expand_busy = false;
+	else
+		free(local.buf);
+	return result;
+}
+
+/*
+** var_expand():
+** 単語に含まれる $変数 とコマンド置換( $( ... ) と ` ... ` )を値に置き換えた文字列を返す
+** クオートされていた文字( CHAR_QUOTED の印)は展開せず、印を取り除く
+** 結果はアリーナに置かれ、var_expand_release() されるまで有効
+** (分割やワイルドカードの展開は行わない)
+*/
+char* var_expand(const char* word)
+{
+	return expand_word(word, false);
+}
+
+/*
+** var_expand_pattern():
+** var_expand() と同じく展開し、ワイルドカードのパターン( glob() / fnmatch() )にして返す
+** クオートされていた文字は '\' でエスケープするので、ワイルドカードとしては扱われない
+*/
+char* var_expand_pattern(const char* word)
+{
+	return expand_word(word, true);
+}
+
+/*
+** var_glob():
+** var_expand_pattern() で作ったパターンでパス名を展開し、globbuf に加える( flags は glob() と同じ)
+** 一致するものが無ければ、エスケープを取り除いたパターンを1つ加える
+*/
+void var_glob(const char* pattern, int flags, glob_t* globbuf)
+{
+	size_t first = (flags & GLOB_APPEND) ? globbuf->gl_pathc : 0;
+	glob(pattern, flags | GLOB_NOCHECK, NULL, globbuf);
+
+	/* GLOB_NOCHECK で返るパターンは、エスケープがそのまま残っている */
+	if (globbuf->gl_pathc == first + 1 && strcmp(globbuf->gl_pathv[first], pattern) == 0) {
+		char* src = globbuf->gl_pathv[first];
+		char* dest = src;
+		for (; *src; src++) {
+			if (*src == '\\' && src[1] != 0)
+				src++;
+			*dest++ = *src;
+		}
+		*dest = 0;
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef VAR_H
+#define VAR_H
+
+#include <stdbool.h>
+#include <glob.h>
+
+/*
+** VarMark:
+** 展開結果を置く領域(アリーナ)の使用位置
+** var_expand_mark() で記録し、var_expand_release() でそこまでの展開結果をまとめて捨てる
+*/
+typedef struct VarMark
+{
+	void* block;
+	unsigned long used;
+} VarMark;
+
+/*
+** VarArgs:
+** 位置パラメータ( $1 $2 ... )。関数の呼び出しのたびに入れ替え、戻ったら元に戻す
+*/
+typedef struct VarArgs
+{
+	int argc; /* $# */
+	char** argv; /* argv[0] が $1 */
+} VarArgs;
+
+void var_set(const char* name, const char* value);
+const char* var_get(const char* name);
+void var_unset(const char* name);
+
+int var_status();
+void var_set_status(int status);
+
+VarArgs var_push_args(int argc, char** argv);
+void var_pop_args(VarArgs saved);
+int var_argc();
+const char* var_arg(int n);
+
+bool var_is_name(const char* name);
+bool var_is_assignment(const char* word);
+bool var_assign(const char* word);
+
+char* var_expand(const char* word);
+char* var_expand_pattern(const char* word);
+void var_glob(const char* pattern, int flags, glob_t* globbuf);
+VarMark var_expand_mark();
+void var_expand_release(VarMark mark);
+bool var_expand_failed();
+
+#endif
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE /* MSG_CMSG_CLOEXEC */
+#include "zygote.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/*
+** zygote ( MYSH_ZYGOTE=1 )
+** rcファイルや長いスクリプトを読み込んでシェルのメモリが大きくなると、
+** コマンドを起動するたびの fork() でページテーブルの複製に時間がかかるようになる
+** そこで起動の直後(rcファイルを読み込む前)に、まだ小さいシェルを fork して zygote にしておき、
+** 外部コマンドはソケットで zygote に起動を依頼して、zygote の小さなアドレス空間から fork させる
+**
+** zygote は clone(CLONE_PARENT) で起動するので、起動したプロセスは zygote ではなくシェルの子になる
+** 終了ステータスと資源の使用量は、これまで通りシェルが wait4() で回収する(ジョブの管理はそのまま)
+** 依頼には argv・環境変数・リダイレクト・cgroup・CPU の割り当てを詰め、
+** 作業ディレクトリ・標準入出力・パイプのディスクリプタは SCM_RIGHTS で渡す。zygote は起動した pid を返す
+**
+** 次の場合は zygote を使わず、これまで通りシェルが fork する
+**   forkした子プロセス(サブシェルやパイプラインの関数)からの起動: zygote が起動するとシェルの子になってしまう
+**   シェルが 3 番以降のディスクリプタを開いている( exec 3>file や { ... } 3>file の中): zygote はそれを持っていない
+**   zygote が終了していたり、依頼を送れなかった場合
+*/
+
+enum
+{ /* ZygoteRequest.flags */
+	ZYGOTE_ASYNC = (1 << 0), /* バックグラウンド。標準入力を /dev/null にする */
+	ZYGOTE_STDIN_PIPE = (1 << 1), /* パイプのディスクリプタを受け取る */
+	ZYGOTE_STDOUT_PIPE = (1 << 2),
+	ZYGOTE_CGROUP = (1 << 3), /* 文字列の最後が、ジョブの cgroup のディレクトリ */
+	ZYGOTE_PGRP = (1 << 4), /* 新しいプロセスグループにする */
+};
+
+/*
+** ZygoteRequest:
+** 起動の依頼。続けて len バイトの文字列(NUL 区切りの argv・代入・環境変数・リダイレクト先・cgroup)を送る
+** ディスクリプタは 作業ディレクトリ・標準入力・標準出力・標準エラー出力・(パイプの読み込み側)・(書き込み側) の順
+*/
+typedef struct ZygoteRequest
+{
+	uint32_t len;
+	int flags; /* ZYGOTE_* */
+	int argc;
+	int nassigns;
+	int nenv;
+	int nredirects;
+	int redirect_fd[MAX_REDIRECTS];
+	NodeType redirect_type[MAX_REDIRECTS];
+	SchedHint sched;
+} ZygoteRequest;
+
+#define ZYGOTE_MAX_FDS 6
+
+extern char** environ;
+
+static int zygote_fd = -1; /* シェル側のソケット。zygote を使えない場合は -1 */
+static pid_t zygote_pid = 0;
+static pid_t zygote_owner = 0; /* zygote を起動したシェルの pid。forkした子プロセスは zygote を使わない */
+
+/* 依頼の文字列を組み立てる領域(シェル側)と、受け取る領域(zygote 側)。どちらも使い回す */
+static char* strbuf = NULL;
+static size_t strbuf_len = 0;
+static size_t strbuf_size = 0;
+
+static void strbuf_add(const char* str)
+{
+	size_t n = strlen(str) + 1;
+	if (strbuf_len + n > strbuf_size) {
+		while (strbuf_len + n > strbuf_size)
+			strbuf_size = strbuf_size ? strbuf_size * 2 : 4096;
+		strbuf = realloc(strbuf, strbuf_size);
+	}
+	memcpy(strbuf + strbuf_len, str, n);
+	strbuf_len += n;
+}
+
+/* len バイトを書き切る/読み切る。失敗したら false */
+static bool write_full(int fd, const void* buf, size_t len)
+{
+	const char* p = buf;
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool read_full(int fd, void* buf, size_t len)
+{
+	char* p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*
+** recv_request():
+** zygote 側で依頼をひとつ受け取る。文字列は strbuf に入る
+** シェルが終了してソケットが閉じられた場合と、壊れた依頼の場合は false
+*/
+static bool recv_request(int sock, ZygoteRequest* req, int* fds, int* nfds)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { req, sizeof(*req) };
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	ssize_t n;
+	while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+	*nfds = 0;
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+	}
+	if (n <= 0 || !read_full(sock, (char*)req + n, sizeof(*req) - n))
+		return false;
+
+	if (req->len > strbuf_size) {
+		strbuf_size = req->len;
+		strbuf = realloc(strbuf, strbuf_size);
+	}
+	return read_full(sock, strbuf, req->len);
+}
+
+/* 文字列の領域から n 個の文字列を取り出して、NULL で終わる配列にする */
+static char** take_strings(char** p, int n)
+{
+	char** v = malloc(sizeof(char*) * (n + 1));
+	int i;
+	for (i = 0; i < n; i++) {
+		v[i] = *p;
+		*p += strlen(*p) + 1;
+	}
+	v[n] = NULL;
+	return v;
+}
+
+/*
+** spawn():
+** zygote 側で、受け取った依頼のコマンドを clone(CLONE_PARENT) で起動し、pid を返す
+** 子プロセスは作業ディレクトリと標準入出力を切り替えた後、シェルが fork した場合と同じ手順で exec する
+*/
+static pid_t spawn(ZygoteRequest* req, int* fds)
+{
+	char* p = strbuf;
+	char** argv = take_strings(&p, req->argc);
+	char** assigns = take_strings(&p, req->nassigns);
+	char** env = take_strings(&p, req->nenv);
+	Redirect redirects[MAX_REDIRECTS];
+	int i;
+	for (i = 0; i < req->nredirects; i++) {
+		redirects[i].fd = req->redirect_fd[i];
+		redirects[i].type = req->redirect_type[i];
+		redirects[i].target = p;
+		p += strlen(p) + 1;
+	}
+	Job job;
+	memset(&job, 0, sizeof(job));
+	job.cgroup = (req->flags & ZYGOTE_CGROUP) ? p : NULL;
+
+	pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL);
+	if (pid == 0) {
+		if (fchdir(fds[0]) == -1)
+			perror("zygote: fchdir");
+		for (i = 0; i < 3; i++)
+			dup2(fds[i + 1], i);
+		environ = env;
+
+		CommandInternal cmd;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.argc = req->argc;
+		cmd.argv = argv;
+		cmd.assigns = assigns;
+		cmd.nassigns = req->nassigns;
+		cmd.redirects = redirects;
+		cmd.nredirects = req->nredirects;
+		cmd.asynchrnous = (req->flags & ZYGOTE_ASYNC) != 0;
+		cmd.new_pgrp = (req->flags & ZYGOTE_PGRP) != 0;
+		int next = 4;
+		if (req->flags & ZYGOTE_STDIN_PIPE) {
+			cmd.stdin_pipe = true;
+			cmd.pipe_read = fds[next++];
+		}
+		if (req->flags & ZYGOTE_STDOUT_PIPE) {
+			cmd.stdout_pipe = true;
+			cmd.pipe_write = fds[next++];
+		}
+		cmd.job = &job;
+		cmd.sched = &req->sched;
+
+		int stdoutfd = prepare_child(&cmd);
+		exec_child(&cmd, stdoutfd);
+	}
+	if (pid == -1)
+		pid = -errno;
+
+	free(argv);
+	free(assigns);
+	free(env);
+	return pid;
+}
+
+/* zygote のプロセス。シェルがソケットを閉じたら終了する */
+static void zygote_main(int sock)
+{
+	/* シェルの端末やパイプを持ち続けないように、標準入力と標準出力は /dev/null にしておく */
+	int null = open("/dev/null", O_RDWR);
+	if (null != -1) {
+		dup2(null, STDIN_FILENO);
+		dup2(null, STDOUT_FILENO);
+		if (null > STDERR_FILENO)
+			close(null);
+	}
+
+	while (1) {
+		ZygoteRequest req;
+		int fds[ZYGOTE_MAX_FDS];
+		int nfds, i;
+
+		if (!recv_request(sock, &req, fds, &nfds))
+			_exit(0);
+		int expected = 4 + ((req.flags & ZYGOTE_STDIN_PIPE) != 0) + ((req.flags & ZYGOTE_STDOUT_PIPE) != 0);
+		int32_t reply = nfds == expected ? spawn(&req, fds) : -EINVAL;
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		if (!write_full(sock, &reply, sizeof(reply)))
+			_exit(0);
+	}
+}
+
+/*
+** zygote_start():
+** zygote を起動する。シェルのメモリが小さいうちに(起動の直後に)呼び出す
+*/
+bool zygote_start()
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("zygote: socketpair");
+		return false;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		zygote_main(sv[1]);
+	}
+	close(sv[1]);
+	if (pid < 0) {
+		perror("zygote: fork");
+		close(sv[0]);
+		return false;
+	}
+	zygote_fd = sv[0];
+	zygote_pid = pid;
+	zygote_owner = getpid();
+	return true;
+}
+
+/*
+** zygote_stop():
+** zygote を終了させ、以降はシェル自身で fork する
+** zygote が使えなくなったときと、シェルが exec でコマンドに置き換わる前に呼び出す
+*/
+void zygote_stop()
+{
+	if (zygote_fd == -1 || getpid() != zygote_owner)
+		return;
+	close(zygote_fd);
+	zygote_fd = -1;
+	waitpid(zygote_pid, NULL, 0); /* ソケットを閉じたので、zygote はすぐに終了する */
+}
+
+/*
+** zygote_spawn():
+** 外部コマンドの起動を zygote に依頼し、起動したプロセスの pid を返す
+** zygote を使えない場合は -1 を返すので、呼び出し側が自分で fork する
+*/
+pid_t zygote_spawn(CommandInternal* cmdinternal)
+{
+	if (zygote_fd == -1 || getpid() != zygote_owner || shell_has_extra_fds())
+		return -1;
+
+	ZygoteRequest req;
+	int fds[ZYGOTE_MAX_FDS];
+	int nfds = 0, i;
+	memset(&req, 0, sizeof(req));
+
+	strbuf_len = 0;
+	for (i = 0; i < cmdinternal->argc; i++)
+		strbuf_add(cmdinternal->argv[i]);
+	for (i = 0; i < cmdinternal->nassigns; i++)
+		strbuf_add(cmdinternal->assigns[i]);
+	for (i = 0; environ[i] != NULL; i++) /* export で変わっていることがあるので、毎回送る */
+		strbuf_add(environ[i]);
+	req.nenv = i;
+	for (i = 0; i < cmdinternal->nredirects; i++) {
+		req.redirect_fd[i] = cmdinternal->redirects[i].fd;
+		req.redirect_type[i] = cmdinternal->redirects[i].type;
+		strbuf_add(cmdinternal->redirects[i].target);
+	}
+	if (cmdinternal->job != NULL && cmdinternal->job->cgroup != NULL) {
+		req.flags |= ZYGOTE_CGROUP;
+		strbuf_add(cmdinternal->job->cgroup);
+	}
+	req.len = strbuf_len;
+	req.argc = cmdinternal->argc;
+	req.nassigns = cmdinternal->nassigns;
+	req.nredirects = cmdinternal->nredirects;
+	if (cmdinternal->sched != NULL)
+		req.sched = *cmdinternal->sched;
+	if (cmdinternal->asynchrnous)
+		req.flags |= ZYGOTE_ASYNC;
+	if (cmdinternal->new_pgrp)
+		req.flags |= ZYGOTE_PGRP;
+
+	fds[nfds++] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC); /* cd で変わっていることがある */
+	if (fds[0] == -1)
+		return -1;
+	fds[nfds++] = STDIN_FILENO;
+	fds[nfds++] = STDOUT_FILENO;
+	fds[nfds++] = STDERR_FILENO;
+	if (cmdinternal->stdin_pipe) {
+		req.flags |= ZYGOTE_STDIN_PIPE;
+		fds[nfds++] = cmdinternal->pipe_read;
+	}
+	if (cmdinternal->stdout_pipe) {
+		req.flags |= ZYGOTE_STDOUT_PIPE;
+		fds[nfds++] = cmdinternal->pipe_write;
+	}
+
+	union {
+		char buf[CMSG_SPACE(sizeof(fds))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { &req, sizeof(req) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+
+	ssize_t n;
+	while ((n = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+	int err = errno;
+	close(fds[0]);
+	if (n == -1 && err == EBADF) /* 標準入出力のどれかが閉じている。何も送っていないので、自分で fork する */
+		return -1;
+
+	int32_t reply;
+	if (n <= 0 || !write_full(zygote_fd, (char*)&req + n, sizeof(req) - n)
+		|| !write_full(zygote_fd, strbuf, strbuf_len) || !read_full(zygote_fd, &reply, sizeof(reply))) {
+		zygote_stop();
+		return -1;
+	}
+	if (reply < 0) /* clone() に失敗した */
+		return -1;
+	return reply;
+}
@@ -0,0 +1,12 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+#include "command.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+bool zygote_start();
+pid_t zygote_spawn(CommandInternal* cmdinternal);
+void zygote_stop();
+
+#endif